@@ -1,13 +1,14 @@
 #include "Bsp.h"
 #include "util.h"
 #include <algorithm>
-#include <sstream>
 #include "lodepng.h"
 #include "rad.h"
 #include "vis.h"
 #include "remap.h"
-#include "Renderer.h"
+#include "AppSettings.h"
 #include <set>
+#include <unordered_map>
+#include <cfloat>
 
 typedef map< string, vec3 > mapStringToVector;
 
@@ -79,10 +80,12 @@ Bsp::Bsp(std::string fpath)
 
 Bsp::~Bsp()
 {	 
-	for (int i = 0; i < HEADER_LUMPS; i++)
-		if (lumps[i])
-			delete [] lumps[i];
-	delete [] lumps;
+	if (lumps) {
+		for (int i = 0; i < HEADER_LUMPS; i++)
+			free_lump(i);
+		delete [] lumps;
+	}
+	unmapFile((char*)mappedFile, mappedFileSize);
 
 	for (int i = 0; i < ents.size(); i++)
 		delete ents[i];
@@ -570,14 +573,14 @@ bool Bsp::move(vec3 offset, int modelIdx) {
 
 			vec3 ori;
 			if (ents[i]->hasKey("origin")) {
-				ori = parseVector(ents[i]->keyvalues["origin"]);
+				ori = parseVector(ents[i]->getKeyvalue("origin"));
 			}
 			ori += offset;
 
 			ents[i]->setOrAddKeyvalue("origin", ori.toKeyvalueString());
 
 			if (ents[i]->hasKey("spawnorigin")) {
-				vec3 spawnori = parseVector(ents[i]->keyvalues["spawnorigin"]);
+				vec3 spawnori = parseVector(ents[i]->getKeyvalue("spawnorigin"));
 
 				// entity not moved if destination is 0,0,0
 				if (spawnori.x != 0 || spawnori.y != 0 || spawnori.z != 0) {
@@ -1006,18 +1009,38 @@ bool Bsp::does_model_use_shared_structures(int modelIdx) {
 	return false;
 }
 
-LumpState Bsp::duplicate_lumps(int targets) {
+LumpState Bsp::duplicate_lumps(int targets, const LumpState* previous) {
 	LumpState state;
 
 	for (int i = 0; i < HEADER_LUMPS; i++) {
 		if ((targets & (1 << i)) == 0) {
-			state.lumps[i] = NULL;
-			state.lumpLen[i] = 0;
 			continue;
 		}
-		state.lumps[i] = new byte[header.lump[i].nLength];
-		state.lumpLen[i] = header.lump[i].nLength;
-		memcpy(state.lumps[i], lumps[i], header.lump[i].nLength);
+
+		int len = header.lump[i].nLength;
+		int numChunks = (len + LUMP_CHUNK_SIZE - 1) / LUMP_CHUNK_SIZE;
+		bool hasPrevious = previous && previous->hasLump[i];
+
+		state.chunks[i].resize(numChunks);
+		state.lumpLen[i] = len;
+		state.hasLump[i] = true;
+
+		// chunks are compared at the same offset, so edits that insert or remove structures in the middle
+		// of a lump copy everything after that point
+		for (int k = 0; k < numChunks; k++) {
+			int offset = k * LUMP_CHUNK_SIZE;
+			int chunkLen = min(LUMP_CHUNK_SIZE, len - offset);
+
+			if (hasPrevious && k < previous->chunks[i].size()) {
+				const LumpChunk& oldChunk = previous->chunks[i][k];
+				if (oldChunk->size() == chunkLen && memcmp(&(*oldChunk)[0], lumps[i] + offset, chunkLen) == 0) {
+					state.chunks[i][k] = oldChunk;
+					continue;
+				}
+			}
+
+			state.chunks[i][k] = make_shared<vector<byte>>(lumps[i] + offset, lumps[i] + offset + chunkLen);
+		}
 	}
 
 	return state;
@@ -1058,13 +1081,13 @@ int Bsp::delete_embedded_textures() {
 
 void Bsp::replace_lumps(LumpState& state) {
 	for (int i = 0; i < HEADER_LUMPS; i++) {
-		if (state.lumps[i] == NULL) {
+		if (!state.hasLump[i]) {
 			continue;
 		}
 
-		delete[] lumps[i];
+		free_lump(i);
 		lumps[i] = new byte[state.lumpLen[i]];
-		memcpy(lumps[i], state.lumps[i], state.lumpLen[i]);
+		state.copyLump(i, lumps[i]);
 		header.lump[i].nLength = state.lumpLen[i];
 
 		if (i == LUMP_ENTITIES) {
@@ -1263,9 +1286,6 @@ int Bsp::remove_unused_visdata(bool* usedLeaves, BSPLEAF* oldLeaves, int oldLeaf
 }
 
 STRUCTCOUNT Bsp::remove_unused_model_structures() {
-	// marks which structures should not be moved
-	STRUCTUSAGE usedStructures(this);
-
 	bool* usedModels = new bool[modelCount];
 	memset(usedModels, 0, sizeof(bool) * modelCount);
 	usedModels[0] = true; // never delete worldspawn
@@ -1276,18 +1296,37 @@ STRUCTCOUNT Bsp::remove_unused_model_structures() {
 		}
 	}
 
-	// reversed so models can be deleted without shifting the next delete index
- 	for (int i = modelCount-1; i >= 0; i--) { 
+	set<int> unusedModels;
+	for (int i = 0; i < modelCount; i++) {
 		if (!usedModels[i]) {
-			delete_model(i);
-		}
-		else {
-			mark_model_structures(i, &usedStructures, false);
+			unusedModels.insert(i);
 		}
 	}
 
 	delete[] usedModels;
 
+	return delete_models(unusedModels);
+}
+
+STRUCTCOUNT Bsp::delete_models(const set<int>& modelIdxs) {
+	int oldModelCount = modelCount;
+
+	compact_models(modelIdxs);
+
+	// marks which structures should not be moved
+	STRUCTUSAGE usedStructures(this);
+
+	for (int i = 0; i < modelCount; i++) {
+		mark_model_structures(i, &usedStructures, false);
+	}
+
+	STRUCTCOUNT removeCount = remove_unused_structures(usedStructures);
+	removeCount.models = oldModelCount - modelCount;
+
+	return removeCount;
+}
+
+STRUCTCOUNT Bsp::remove_unused_structures(STRUCTUSAGE& usedStructures) {
 	STRUCTREMAP remap(this);
 	STRUCTCOUNT removeCount;
 	memset(&removeCount, 0, sizeof(STRUCTCOUNT));
@@ -1378,6 +1417,181 @@ STRUCTCOUNT Bsp::remove_unused_model_structures() {
 	return removeCount;
 }
 
+STRUCTCOUNT Bsp::weld(float epsilon) {
+	STRUCTCOUNT removeCount;
+	memset(&removeCount, 0, sizeof(STRUCTCOUNT));
+
+	g_progress.update("Welding vertexes", vertCount + surfedgeCount);
+
+	// Kept verts are hashed by grid cell. Cells are twice the size of epsilon, so a vertex within epsilon
+	// of another is either in the same cell or the neighboring cell on the closest side (2^3 cells to check).
+	// With no epsilon, verts are hashed by their exact position instead.
+	double cellSize = epsilon * 2.0;
+	int neighborCount = epsilon > 0 ? 8 : 1;
+
+	vector<int> vertRemap(vertCount);
+	vector<vec3> newVerts;
+	newVerts.reserve(vertCount);
+	unordered_multimap<uint64, int> vertGrid; // cell hash -> new vertex index
+	vertGrid.reserve(vertCount);
+
+	for (int i = 0; i < vertCount; i++) {
+		vec3 v = verts[i];
+		int64 cell[3];
+		bool roundUp[3];
+
+		if (epsilon > 0) {
+			float coords[3] = { v.x, v.y, v.z };
+			for (int k = 0; k < 3; k++) {
+				double c = coords[k] / cellSize;
+				cell[k] = (int64)floor(c);
+				roundUp[k] = c - floor(c) >= 0.5;
+			}
+		}
+
+		int match = -1;
+		for (int n = 0; n < neighborCount; n++) {
+			uint64 hash;
+			if (epsilon > 0) {
+				int64 neighbor[3];
+				for (int k = 0; k < 3; k++) {
+					neighbor[k] = cell[k] + ((n & (1 << k)) ? (roundUp[k] ? 1 : -1) : 0);
+				}
+				hash = hashData(neighbor, sizeof(neighbor));
+			}
+			else {
+				hash = hashData(&v, sizeof(vec3));
+			}
+
+			auto range = vertGrid.equal_range(hash);
+			for (auto it = range.first; it != range.second; ++it) {
+				vec3& other = newVerts[it->second];
+				bool same = epsilon > 0 ? fabs(other.x - v.x) < epsilon && fabs(other.y - v.y) < epsilon
+					&& fabs(other.z - v.z) < epsilon : memcmp(&other, &v, sizeof(vec3)) == 0;
+
+				if (same && (match == -1 || it->second < match)) {
+					match = it->second;
+				}
+			}
+		}
+
+		if (match == -1) {
+			match = newVerts.size();
+			newVerts.push_back(v);
+			vertGrid.insert(make_pair(neighborCount > 1 ? hashData(cell, sizeof(cell)) : hashData(&v, sizeof(vec3)), match));
+		}
+		vertRemap[i] = match;
+
+		g_progress.tick();
+	}
+
+	// Edges are rebuilt from the face windings the way the compiler builds them (hlbsp's GetEdge). A face edge
+	// reuses an edge of another face in the same model only if that face walks it in the opposite direction,
+	// and each edge is shared at most once. Reusing an edge in the same direction, or across models, would
+	// break face windings and the edge ranges of models.
+	vector<BSPEDGE> newEdges;
+	newEdges.reserve(edgeCount);
+	vector<bool> surfedgeDone(surfedgeCount);
+
+	// edge 0 is never referenced by a negative surfedge, so it is kept as-is
+	if (edgeCount > 0) {
+		BSPEDGE edge = edges[0];
+		for (int k = 0; k < 2; k++) {
+			if (edge.iVertex[k] < vertCount)
+				edge.iVertex[k] = vertRemap[edge.iVertex[k]];
+		}
+		newEdges.push_back(edge);
+	}
+
+	unordered_map<uint32_t, int> openEdges; // directed vertex pair -> new edge that can still be shared
+	vector<bool> faceDone(faceCount);
+
+	auto weldSurfedge = [&](int surfedgeIdx) {
+		if (surfedgeDone[surfedgeIdx]) {
+			return;
+		}
+		surfedgeDone[surfedgeIdx] = true;
+		g_progress.tick();
+
+		int32_t edgeIdx = abs(surfedges[surfedgeIdx]);
+		if (edgeIdx == 0 || edgeIdx >= edgeCount) {
+			return;
+		}
+
+		BSPEDGE& edge = edges[edgeIdx];
+		uint16 from = surfedges[surfedgeIdx] < 0 ? edge.iVertex[1] : edge.iVertex[0];
+		uint16 to = surfedges[surfedgeIdx] < 0 ? edge.iVertex[0] : edge.iVertex[1];
+		if (from < vertCount)
+			from = vertRemap[from];
+		if (to < vertCount)
+			to = vertRemap[to];
+
+		auto reversed = openEdges.find(((uint32_t)to << 16) | from);
+		if (reversed != openEdges.end()) {
+			surfedges[surfedgeIdx] = -reversed->second;
+			openEdges.erase(reversed);
+			return;
+		}
+
+		surfedges[surfedgeIdx] = newEdges.size();
+		openEdges[((uint32_t)from << 16) | to] = newEdges.size();
+		newEdges.push_back(BSPEDGE(from, to));
+	};
+
+	auto weldFace = [&](int faceIdx) {
+		if (faceIdx < 0 || faceIdx >= faceCount || faceDone[faceIdx]) {
+			return;
+		}
+		faceDone[faceIdx] = true;
+
+		BSPFACE& face = faces[faceIdx];
+		for (int e = 0; e < face.nEdges; e++) {
+			int surfedgeIdx = face.iFirstEdge + e;
+			if (surfedgeIdx >= 0 && surfedgeIdx < surfedgeCount) {
+				weldSurfedge(surfedgeIdx);
+			}
+		}
+	};
+
+	for (int i = 0; i < modelCount; i++) {
+		openEdges.clear();
+		for (int k = 0; k < models[i].nFaces; k++) {
+			weldFace(models[i].iFirstFace + k);
+		}
+	}
+
+	// faces and surfedges that no model uses don't share edges with anything
+	for (int i = 0; i < faceCount; i++) {
+		if (!faceDone[i]) {
+			openEdges.clear();
+			weldFace(i);
+		}
+	}
+	for (int i = 0; i < surfedgeCount; i++) {
+		if (!surfedgeDone[i]) {
+			openEdges.clear();
+			weldSurfedge(i);
+		}
+	}
+
+
+	removeCount.verts = vertCount - newVerts.size();
+	removeCount.edges = max(0, edgeCount - (int)newEdges.size());
+
+	if (removeCount.verts) {
+		byte* newLump = new byte[newVerts.size() * sizeof(vec3)];
+		memcpy(newLump, newVerts.data(), newVerts.size() * sizeof(vec3));
+		replace_lump(LUMP_VERTICES, newLump, newVerts.size() * sizeof(vec3));
+	}
+	if (edgeCount > 0) { // surfedges now point into the rebuilt edges
+		byte* newLump = new byte[newEdges.size() * sizeof(BSPEDGE)];
+		memcpy(newLump, newEdges.data(), newEdges.size() * sizeof(BSPEDGE));
+		replace_lump(LUMP_EDGES, newLump, newEdges.size() * sizeof(BSPEDGE));
+	}
+
+	return removeCount;
+}
+
 bool Bsp::has_hull2_ents() {
 	// monsters that use hull 2 by default
 	static set<string> largeMonsters{
@@ -1396,17 +1610,17 @@ bool Bsp::has_hull2_ents() {
 	};
 
 	for (int i = 0; i < ents.size(); i++) {
-		string cname = ents[i]->keyvalues["classname"];
-		string tname = ents[i]->keyvalues["targetname"];
+		string cname = ents[i]->getKeyvalue("classname");
+		string tname = ents[i]->getKeyvalue("targetname");
 
 		if (cname.find("monster_") == 0) {
 			vec3 minhull;
 			vec3 maxhull;
 
-			if (!ents[i]->keyvalues["minhullsize"].empty())
-				minhull = Keyvalue("", ents[i]->keyvalues["minhullsize"]).getVector();
-			if (!ents[i]->keyvalues["maxhullsize"].empty())
-				maxhull = Keyvalue("", ents[i]->keyvalues["maxhullsize"]).getVector();
+			if (!ents[i]->getKeyvalue("minhullsize").empty())
+				minhull = Keyvalue("", ents[i]->getKeyvalue("minhullsize")).getVector();
+			if (!ents[i]->getKeyvalue("maxhullsize").empty())
+				maxhull = Keyvalue("", ents[i]->getKeyvalue("maxhullsize")).getVector();
 
 			if (minhull == vec3(0, 0, 0) && maxhull == vec3(0, 0, 0)) {
 				// monster is using its default hull size
@@ -1445,23 +1659,28 @@ STRUCTCOUNT Bsp::delete_unused_hulls(bool noProgress) {
 
 	int deletedHulls = 0;
 
+	set<int> unusedModels;
 	for (int i = 1; i < modelCount; i++) {
-		if (!g_verbose && !noProgress)
-			g_progress.tick();
-
-		vector<Entity*> usageEnts = get_model_ents(i);
-		
-		if (usageEnts.size() == 0) {
+		if (get_model_ents(i).empty()) {
 			debugf("Deleting unused model %d\n", i);
 
 			for (int k = 0; k < MAX_MAP_HULLS; k++)
 				deletedHulls += models[i].iHeadnodes[k] >= 0;
 
-			delete_model(i);
-			//modelCount--; automatically updated when lump is replaced
-			i--;
-			continue;
+			unusedModels.insert(i);
+
+			if (!g_verbose && !noProgress)
+				g_progress.tick();
 		}
+	}
+
+	compact_models(unusedModels);
+
+	for (int i = 1; i < modelCount; i++) {
+		if (!g_verbose && !noProgress)
+			g_progress.tick();
+
+		vector<Entity*> usageEnts = get_model_ents(i);
 
 		set<string> conditionalPointEntTriggers;
 		conditionalPointEntTriggers.insert("trigger_once");
@@ -1508,9 +1727,9 @@ STRUCTCOUNT Bsp::delete_unused_hulls(bool noProgress) {
 		bool needsMonsterHulls = false; // All HULLs
 		bool needsVisibleHull = false; // HULL 0
 		for (int k = 0; k < usageEnts.size(); k++) {
-			string cname = usageEnts[k]->keyvalues["classname"];
-			string tname = usageEnts[k]->keyvalues["targetname"];
-			int spawnflags = atoi(usageEnts[k]->keyvalues["spawnflags"].c_str());
+			string cname = usageEnts[k]->getKeyvalue("classname");
+			string tname = usageEnts[k]->getKeyvalue("targetname");
+			int spawnflags = atoi(usageEnts[k]->getKeyvalue("spawnflags").c_str());
 
 			if (k != 0) {
 				uses += ", ";
@@ -1631,6 +1850,7 @@ STRUCTCOUNT Bsp::delete_unused_hulls(bool noProgress) {
 	}
 
 	STRUCTCOUNT removed = remove_unused_model_structures();
+	removed.models += unusedModels.size();
 
 	update_ent_lump();
 
@@ -1645,10 +1865,10 @@ bool Bsp::is_invisible_solid(Entity* ent) {
 	if (!ent->isBspModel())
 		return false;
 
-	string tname = ent->keyvalues["targetname"];
-	int rendermode = atoi(ent->keyvalues["rendermode"].c_str());
-	int renderamt = atoi(ent->keyvalues["renderamt"].c_str());
-	int renderfx = atoi(ent->keyvalues["renderfx"].c_str());
+	string tname = ent->getKeyvalue("targetname");
+	int rendermode = atoi(ent->getKeyvalue("rendermode").c_str());
+	int renderamt = atoi(ent->getKeyvalue("renderamt").c_str());
+	int renderfx = atoi(ent->getKeyvalue("renderfx").c_str());
 
 	if (rendermode == 0 || renderamt != 0) {
 		return false;
@@ -1668,37 +1888,37 @@ bool Bsp::is_invisible_solid(Entity* ent) {
 	};
 
 	for (int i = 0; i < ents.size(); i++) {
-		string cname = ents[i]->keyvalues["classname"];
+		string cname = ents[i]->getKeyvalue("classname");
 
 		if (cname == "env_render") {
 			return false; // assume it will affect the brush since it can be moved anywhere
 		}
 		else if (cname == "env_render_individual") {
-			if (ents[i]->keyvalues["target"] == tname) {
+			if (ents[i]->getKeyvalue("target") == tname) {
 				return false; // assume it's making the ent visible
 			}
 		}
 		else if (cname == "trigger_changevalue") {
-			if (ents[i]->keyvalues["target"] == tname) {
-				if (renderKeys.find(ents[i]->keyvalues["m_iszValueName"]) != renderKeys.end()) {
+			if (ents[i]->getKeyvalue("target") == tname) {
+				if (renderKeys.find(ents[i]->getKeyvalue("m_iszValueName")) != renderKeys.end()) {
 					return false; // assume it's making the ent visible
 				}
 			}
 		}
 		else if (cname == "trigger_copyvalue") {
-			if (ents[i]->keyvalues["target"] == tname) {
-				if (renderKeys.find(ents[i]->keyvalues["m_iszDstValueName"]) != renderKeys.end()) {
+			if (ents[i]->getKeyvalue("target") == tname) {
+				if (renderKeys.find(ents[i]->getKeyvalue("m_iszDstValueName")) != renderKeys.end()) {
 					return false; // assume it's making the ent visible
 				}
 			}
 		}
 		else if (cname == "trigger_createentity") {
-			if (ents[i]->keyvalues["+model"] == tname || ents[i]->keyvalues["-model"] == ent->keyvalues["model"]) {
+			if (ents[i]->getKeyvalue("+model") == tname || ents[i]->getKeyvalue("-model") == ent->getKeyvalue("model")) {
 				return false; // assume this new ent will be visible at some point
 			}
 		}
 		else if (cname == "trigger_changemodel") {
-			if (ents[i]->keyvalues["model"] == ent->keyvalues["model"]) {
+			if (ents[i]->getKeyvalue("model") == ent->getKeyvalue("model")) {
 				return false; // assume the target is visible
 			}
 		}
@@ -1773,36 +1993,88 @@ void Bsp::get_lightmap_shift(const LIGHTMAP& oldLightmap, const LIGHTMAP& newLig
 }
 
 void Bsp::update_ent_lump(bool stripNodes) {
-	stringstream ent_data;
+	// first pass: measure the lump so it can be written straight into its final buffer.
+	// Entities that haven't changed since the last update are copied from the current lump.
+	vector<bool> skipped(ents.size());
+	int lumpSize = 1; // null terminator required too(?)
 
 	for (int i = 0; i < ents.size(); i++) {
+		Entity* ent = ents[i];
+
 		if (stripNodes) {
-			string cname = ents[i]->keyvalues["classname"];
+			const string& cname = ent->getKeyvalue("classname");
 			if (cname == "info_node" || cname == "info_node_air") {
+				skipped[i] = true;
 				continue;
 			}
 		}
 
-		ent_data << "{\n";
-
-		for (int k = 0; k < ents[i]->keyOrder.size(); k++) {
-			string key = ents[i]->keyOrder[k];
-			ent_data << "\"" << key << "\" \"" << ents[i]->keyvalues[key] << "\"\n";
+		if (entLumpId && ent->lumpId == entLumpId && ent->lumpRevision == ent->revision) {
+			lumpSize += ent->lumpLength;
+		}
+		else {
+			lumpSize += 3; // "{\n" and "}"
+			for (int k = 0; k < ent->getKeyCount(); k++) {
+				lumpSize += ent->getKey(k).size() + ent->getValue(k).size() + 6; // "key" "value"\n
+			}
 		}
 
-		ent_data << "}";
 		if (i < ents.size() - 1) {
-			ent_data << "\n"; // trailing newline crashes sven, and only sven, and only sometimes
+			lumpSize += 1; // trailing newline crashes sven, and only sven, and only sometimes
 		}
 	}
 
-	string str_data = ent_data.str();
+	// second pass: write the lump and remember where each entity went
+	static atomic<uint32_t> nextEntLumpId(1);
+	uint32_t newEntLumpId = nextEntLumpId++;
 
-	byte* newEntData = new byte[str_data.size() + 1];
-	memcpy(newEntData, str_data.c_str(), str_data.size());
-	newEntData[str_data.size()] = 0; // null terminator required too(?)
+	byte* newEntData = new byte[lumpSize];
+	byte* out = newEntData;
 
-	replace_lump(LUMP_ENTITIES, newEntData, str_data.size()+1);	
+	for (int i = 0; i < ents.size(); i++) {
+		if (skipped[i]) {
+			continue;
+		}
+		Entity* ent = ents[i];
+		byte* entStart = out;
+
+		if (entLumpId && ent->lumpId == entLumpId && ent->lumpRevision == ent->revision) {
+			memcpy(out, lumps[LUMP_ENTITIES] + ent->lumpOffset, ent->lumpLength);
+			out += ent->lumpLength;
+		}
+		else {
+			*out++ = '{';
+			*out++ = '\n';
+			for (int k = 0; k < ent->getKeyCount(); k++) {
+				const string& key = ent->getKey(k);
+				const string& value = ent->getValue(k);
+				*out++ = '"';
+				memcpy(out, key.c_str(), key.size());
+				out += key.size();
+				*out++ = '"';
+				*out++ = ' ';
+				*out++ = '"';
+				memcpy(out, value.c_str(), value.size());
+				out += value.size();
+				*out++ = '"';
+				*out++ = '\n';
+			}
+			*out++ = '}';
+		}
+
+		ent->lumpId = newEntLumpId;
+		ent->lumpRevision = ent->revision;
+		ent->lumpOffset = entStart - newEntData;
+		ent->lumpLength = out - entStart;
+
+		if (i < ents.size() - 1) {
+			*out++ = '\n';
+		}
+	}
+	*out = 0;
+
+	replace_lump(LUMP_ENTITIES, newEntData, lumpSize);
+	entLumpId = newEntLumpId;
 }
 
 vec3 Bsp::get_model_center(int modelIdx) {
@@ -1816,6 +2088,20 @@ vec3 Bsp::get_model_center(int modelIdx) {
 	return model.nMins + (model.nMaxs - model.nMins) * 0.5f;
 }
 
+vector<vec3> Bsp::get_face_verts(int faceIdx) {
+	BSPFACE& face = faces[faceIdx];
+	vector<vec3> faceVerts(face.nEdges);
+
+	for (int e = 0; e < face.nEdges; e++) {
+		int32_t edgeIdx = surfedges[face.iFirstEdge + e];
+		BSPEDGE& edge = edges[abs(edgeIdx)];
+		int vertIdx = edgeIdx < 0 ? edge.iVertex[1] : edge.iVertex[0];
+		faceVerts[e] = verts[vertIdx];
+	}
+
+	return faceVerts;
+}
+
 int Bsp::lightmap_count(int faceIdx) {
 	BSPFACE& face = faces[faceIdx];
 
@@ -1835,42 +2121,44 @@ void Bsp::write(string path) {
 		path = path + ".bsp";
 	}
 
-	// calculate lump offsets
+#ifdef WIN32
+	// Windows can't replace a file that's still mapped. Elsewhere, the mapping keeps the old file alive.
+	unmap_file();
+#endif
+
+	// calculate lump offsets (4-byte aligned, so that the lumps can be mapped directly when loaded)
 	int offset = sizeof(BSPHEADER);
 	for (int i = 0; i < HEADER_LUMPS; i++) {
+		offset = (offset + 3) & ~3;
 		header.lump[i].nOffset = offset;
 		offset += header.lump[i].nLength;
 	}
 
-	// Make single backup
-	if (g_settings.backUpMap && fileExists(path) && !fileExists(path + ".bak"))
-	{
-		int len;
-		char* oldfile = loadFile(path, len);
-		ofstream file(path + ".bak", ios::out | ios::binary | ios::trunc);
-		if (!file.is_open()) {
-			logf("Failed to open backup file for writing:\n%s\n", path.c_str());
-			return;
+	// the lumps are written straight from memory, with padding in between
+	static const byte padding[4] = { 0 };
+	vector<pair<const void*, int>> buffers;
+	buffers.push_back(make_pair((const void*)&header, (int)sizeof(BSPHEADER)));
+	offset = sizeof(BSPHEADER);
+	for (int i = 0; i < HEADER_LUMPS; i++) {
+		if (header.lump[i].nOffset > offset) {
+			buffers.push_back(make_pair((const void*)padding, header.lump[i].nOffset - offset));
 		}
-		logf("Writing backup to %s\n", (path + ".bak").c_str());
-
-		file.write(oldfile, len);
-		delete[] oldfile;
+		buffers.push_back(make_pair((const void*)lumps[i], header.lump[i].nLength));
+		offset = header.lump[i].nOffset + header.lump[i].nLength;
 	}
 
-	ofstream file(path, ios::out | ios::binary | ios::trunc);
-	if (!file.is_open()) {
-		logf("Failed to open BSP file for writing:\n%s\n", path.c_str());
-		return;
+	// Make single backup
+	string backupPath;
+	if (g_settings.backUpMap && fileExists(path) && !fileExists(path + ".bak"))
+	{
+		backupPath = path + ".bak";
+		logf("Writing backup to %s\n", backupPath.c_str());
 	}
 
 	logf("Writing %s\n", path.c_str());
 
-	file.write((char*)&header, sizeof(BSPHEADER));
-
-	// write the lumps
-	for (int i = 0; i < HEADER_LUMPS; i++) {
-		file.write((char*)lumps[i], header.lump[i].nLength);
+	if (!writeFileAtomic(path, buffers, backupPath)) {
+		logf("Failed to write BSP file:\n%s\n", path.c_str());
 	}
 }
 
@@ -1878,76 +2166,124 @@ bool Bsp::load_lumps(string fpath)
 {
 	bool valid = true;
 
-	// Read all BSP Data
-	ifstream fin(fpath, ios::binary | ios::ate);
-	int size = fin.tellg();
-	fin.seekg(0, fin.beg);
+	// Map the file instead of reading it. Lumps point directly into the mapping, so only the pages that are
+	// actually used get read from disk. Edits made in-place go to private copies of the pages, and replaced
+	// lumps get their own memory (see replace_lump). This suits short-lived commands. Long-lived users
+	// (the editor) should call unmap_file() after loading.
+	int size = 0;
+	mappedFile = (byte*)mapFile(fpath, size);
+	if (!mappedFile)
+		return false;
+	mappedFileSize = size;
 
 	if (size < sizeof(BSPHEADER) + sizeof(BSPLUMP)*HEADER_LUMPS)
 		return false;
 
-	fin.read((char*)&header.nVersion, sizeof(int));
+	memcpy(&header, mappedFile, sizeof(BSPHEADER));
 #ifndef NDEBUG
 	logf("Bsp version: %d\n", header.nVersion);
-#endif
-	
 	for (int i = 0; i < HEADER_LUMPS; i++)
 	{
-		fin.read((char*)&header.lump[i], sizeof(BSPLUMP));
-#ifndef NDEBUG
 		logf("Read lump id: %d. Len: %d. Offset %d.\n", i,header.lump[i].nLength,header.lump[i].nOffset);
-#endif
 	}
+#endif
 
 	lumps = new byte*[HEADER_LUMPS];
 	memset(lumps, 0, sizeof(byte*)*HEADER_LUMPS);
 	
 	for (int i = 0; i < HEADER_LUMPS; i++)
 	{
-		if (header.lump[i].nLength == 0) {
+		BSPLUMP& lump = header.lump[i];
+
+		if (lump.nLength == 0) {
 			lumps[i] = NULL;
 			continue;
 		}
 
-		fin.seekg(header.lump[i].nOffset);
-		if (fin.eof()) {
+		if (lump.nOffset < 0 || lump.nLength < 0 || (int64_t)lump.nOffset + lump.nLength > size) {
 			logf("FAILED TO READ BSP LUMP %d\n", i);
 			valid = false;
 		}
+		else if (lump.nOffset % 4 != 0) {
+			// lump structs need to be aligned
+			lumps[i] = new byte[lump.nLength];
+			memcpy(lumps[i], mappedFile + lump.nOffset, lump.nLength);
+		}
 		else
 		{
-			lumps[i] = new byte[header.lump[i].nLength];
-			fin.read((char*)lumps[i], header.lump[i].nLength);
+			lumps[i] = mappedFile + lump.nOffset;
 		}
 	}	
-	
-	fin.close();
 
 	return valid;
 }
 
+bool Bsp::is_lump_mapped(int lumpIdx) {
+	return mappedFile && lumps[lumpIdx] >= mappedFile && lumps[lumpIdx] < mappedFile + mappedFileSize;
+}
+
+void Bsp::free_lump(int lumpIdx) {
+	if (!is_lump_mapped(lumpIdx)) {
+		delete[] lumps[lumpIdx];
+	}
+	lumps[lumpIdx] = NULL;
+
+	if (lumpIdx == LUMP_ENTITIES) {
+		entLumpId = 0;
+	}
+}
+
+void Bsp::unmap_file() {
+	if (!mappedFile) {
+		return;
+	}
+
+	for (int i = 0; i < HEADER_LUMPS; i++) {
+		if (is_lump_mapped(i)) {
+			byte* copy = new byte[header.lump[i].nLength];
+			memcpy(copy, lumps[i], header.lump[i].nLength);
+			lumps[i] = copy;
+		}
+	}
+
+	unmapFile((char*)mappedFile, mappedFileSize);
+	mappedFile = NULL;
+	mappedFileSize = 0;
+
+	update_lump_pointers();
+}
+
 void Bsp::load_ents()
 {
 	for (int i = 0; i < ents.size(); i++)
 		delete ents[i];
 	ents.clear();
 
-	bool verbose = true;
-	membuf sbuf((char*)lumps[LUMP_ENTITIES], header.lump[LUMP_ENTITIES].nLength);
-	istream in(&sbuf);
+	// Tokenize the lump in place instead of copying it line by line. Braces and quoted strings can be
+	// anywhere, so ents that open and close on the same line work too. A quoted string can't span lines.
+	const char* data = (const char*)lumps[LUMP_ENTITIES];
+	const char* end = data + header.lump[LUMP_ENTITIES].nLength;
 
-	int lineNum = 0;
+	int lineNum = 1;
 	int lastBracket = -1;
 	Entity* ent = NULL;
 
-	string line = "";
-	while (getline(in, line))
-	{
-		lineNum++;
-		if (line.length() < 1 || line[0] == '\n')
-			continue;
+	Keyvalue k; // reused so the strings keep their capacity between keyvalues
+	bool haveKey = false;
 
-		if (line[0] == '{')
+	for (const char* c = data; c < end && *c != '\0'; c++)
+	{
+		if (*c == '\n')
+		{
+			lineNum++;
+		}
+		else if (*c == '/' && c + 1 < end && c[1] == '/')
+		{
+			// comment until the end of the line
+			while (c + 1 < end && c[1] != '\n' && c[1] != '\0')
+				c++;
+		}
+		else if (*c == '{')
 		{
 			if (lastBracket == 0)
 			{
@@ -1955,12 +2291,13 @@ void Bsp::load_ents()
 				continue;
 			}
 			lastBracket = 0;
+			haveKey = false;
 
 			if (ent != NULL)
 				delete ent;
 			ent = new Entity();
 		}
-		else if (line[0] == '}')
+		else if (*c == '}')
 		{
 			if (lastBracket == 1)
 				logf("%s.bsp ent data (line %d): Unexpected '}'\n", path.c_str(), lineNum);
@@ -1969,35 +2306,56 @@ void Bsp::load_ents()
 			if (ent == NULL)
 				continue;
 
-			if (ent->keyvalues.count("classname"))
+			if (ent->hasKey("classname"))
 				ents.push_back(ent);
-			else
+			else {
 				logf("Found unknown classname entity. Skip it.\n");
+				delete ent;
+			}
 			ent = NULL;
+		}
+		else if (*c == '"')
+		{
+			const char* str = ++c;
+			while (c < end && *c != '"' && *c != '\n' && *c != '\0')
+				c++;
+			int len = c - str;
 
-			// you can end/start an ent on the same line, you know
-			if (line.find("{") != string::npos)
+			if (c >= end || *c != '"')
 			{
-				ent = new Entity();
-				lastBracket = 0;
+				// unterminated string. Drop it along with any key before it, and let the loop see the newline.
+				haveKey = false;
+				c--;
+				continue;
+			}
+
+			if (lastBracket != 0 || ent == NULL)
+				continue;
+
+			if (!haveKey)
+			{
+				k.key.assign(str, len);
+				haveKey = true;
+			}
+			else
+			{
+				k.value.assign(str, len);
+				haveKey = false;
+
+				if (k.key.length() && k.value.length())
+					ent->addKeyvalue(k);
 			}
-		}
-		else if (lastBracket == 0 && ent != NULL) // currently defining an entity
-		{
-			Keyvalue k(line);
-			if (k.key.length() && k.value.length())
-				ent->addKeyvalue(k);
 		}
 	}
 
 	if (ents.size() > 1)
 	{
-		if (ents[0]->keyvalues["classname"] != "worldspawn")
+		if (ents[0]->getKeyvalue("classname") != "worldspawn")
 		{
 			logf("First entity has classname different from 'woldspawn', we do fixup it\n");
 			for (int i = 1; i < ents.size(); i++)
 			{
-				if (ents[i]->keyvalues["classname"] == "worldspawn")
+				if (ents[i]->getKeyvalue("classname") == "worldspawn")
 				{
 					std::swap(ents[0], ents[i]);
 					break;
@@ -2049,11 +2407,10 @@ void Bsp::print_model_stat(STRUCTUSAGE* modelInfo, uint val, uint max, bool isMe
 {
 	string classname = modelInfo->modelIdx == 0 ? "worldspawn" : "???";
 	string targetname = modelInfo->modelIdx == 0 ? "" : "???";
-	for (int k = 0; k < ents.size(); k++) {
-		if (ents[k]->getBspModelIdx() == modelInfo->modelIdx) {
-			targetname = ents[k]->keyvalues["targetname"];
-			classname = ents[k]->keyvalues["classname"];
-		}
+	vector<Entity*> uses = get_model_ents(modelInfo->modelIdx);
+	if (uses.size()) {
+		targetname = uses.back()->getKeyvalue("targetname");
+		classname = uses.back()->getKeyvalue("classname");
 	}
 
 	const float meg = 1024 * 1024;
@@ -2071,8 +2428,8 @@ void Bsp::print_model_stat(STRUCTUSAGE* modelInfo, uint val, uint max, bool isMe
 	logf("\n");
 }
 
-bool sortModelInfos(const STRUCTUSAGE* a, const STRUCTUSAGE* b) {
-	switch (g_sort_mode) {
+bool sortModelInfos(const STRUCTUSAGE* a, const STRUCTUSAGE* b, int sortMode) {
+	switch (sortMode) {
 	case SORT_VERTS:
 		return a->sum.verts > b->sum.verts;
 	case SORT_NODES:
@@ -2242,7 +2599,7 @@ bool Bsp::validate() {
 
 	int worldspawn_count = 0;
 	for (int i = 0; i < ents.size(); i++) {
-		if (ents[i]->keyvalues["classname"] == "worldspawn") {
+		if (ents[i]->getKeyvalue("classname") == "worldspawn") {
 			worldspawn_count++;
 		}
 	}
@@ -2265,8 +2622,10 @@ vector<STRUCTUSAGE*> Bsp::get_sorted_model_infos(int sortMode) {
 		modelStructs[i]->compute_sum();
 	}
 
-	g_sort_mode = sortMode;
-	sort(modelStructs.begin(), modelStructs.end(), sortModelInfos);
+	// the sort mode is passed along instead of read from g_sort_mode, so maps can be sorted on different threads
+	sort(modelStructs.begin(), modelStructs.end(), [sortMode](const STRUCTUSAGE* a, const STRUCTUSAGE* b) {
+		return sortModelInfos(a, b, sortMode);
+	});
 
 	return modelStructs;
 }
@@ -2388,22 +2747,165 @@ void Bsp::print_model_hull(int modelIdx, int hull_number) {
 }
 
 string Bsp::get_model_usage(int modelIdx) {
-	for (int i = 0; i < ents.size(); i++) {
-		if (ents[i]->getBspModelIdx() == modelIdx) {
-			return "\"" + ents[i]->keyvalues["targetname"] + "\" (" + ents[i]->keyvalues["classname"] + ")";
-		}
+	vector<Entity*> uses = get_model_ents(modelIdx);
+	if (uses.size()) {
+		return "\"" + uses[0]->getKeyvalue("targetname") + "\" (" + uses[0]->getKeyvalue("classname") + ")";
 	}
 	return "(unused)";
 }
 
 vector<Entity*> Bsp::get_model_ents(int modelIdx) {
-	vector<Entity*> uses;
-	for (int i = 0; i < ents.size(); i++) {
-		if (ents[i]->getBspModelIdx() == modelIdx) {
-			uses.push_back(ents[i]);
+	update_ent_index();
+
+	if (modelIdx < 0 || modelIdx >= modelEnts.size()) {
+		return vector<Entity*>();
+	}
+	return modelEnts[modelIdx];
+}
+
+vector<Entity*> Bsp::get_targetname_ents(const string& targetname) {
+	update_ent_index();
+
+	auto it = targetnameEnts.find(targetname);
+	return it != targetnameEnts.end() ? it->second : vector<Entity*>();
+}
+
+vector<Entity*> Bsp::get_targeting_ents(const string& targetname) {
+	update_ent_index();
+
+	auto it = targetingEnts.find(targetname);
+	return it != targetingEnts.end() ? it->second : vector<Entity*>();
+}
+
+// removes one occurrence of the entity (order is not kept)
+static void remove_indexed_ent(vector<Entity*>& list, Entity* ent) {
+	for (int i = 0; i < list.size(); i++) {
+		if (list[i] == ent) {
+			list[i] = list.back();
+			list.pop_back();
+			return;
 		}
 	}
-	return uses;
+}
+
+static void remove_indexed_ent(unordered_map<string, vector<Entity*>>& index, const string& name, Entity* ent) {
+	auto it = index.find(name);
+	if (it == index.end()) {
+		return;
+	}
+	remove_indexed_ent(it->second, ent);
+	if (it->second.empty()) {
+		index.erase(it);
+	}
+}
+
+void Bsp::index_ent(IndexedEnt& entry, Entity* ent) {
+	entry.ent = ent;
+	entry.revision = ent->revision;
+	entry.modelIdx = ent->getBspModelIdx();
+	entry.targetname = ent->getKeyvalue("targetname");
+	entry.targets.clear();
+
+	if (entry.modelIdx >= 0) {
+		if (entry.modelIdx >= modelEnts.size()) {
+			modelEnts.resize(entry.modelIdx + 1); // bad reference, but it should still be found
+		}
+		modelEnts[entry.modelIdx].push_back(ent);
+	}
+
+	if (!entry.targetname.empty()) {
+		targetnameEnts[entry.targetname].push_back(ent);
+	}
+
+	vector<string> targets = ent->getTargets();
+	for (int k = 0; k < targets.size(); k++) {
+		if (targets[k].empty()) {
+			continue;
+		}
+		// an entity can target the same name more than once, but it's only listed once
+		if (std::find(entry.targets.begin(), entry.targets.end(), targets[k]) != entry.targets.end()) {
+			continue;
+		}
+		entry.targets.push_back(targets[k]);
+		targetingEnts[targets[k]].push_back(ent);
+	}
+}
+
+void Bsp::unindex_ent(IndexedEnt& entry) {
+	// the entity may have been deleted already, so only the pointer is used
+	if (entry.modelIdx >= 0 && entry.modelIdx < modelEnts.size()) {
+		remove_indexed_ent(modelEnts[entry.modelIdx], entry.ent);
+	}
+	if (!entry.targetname.empty()) {
+		remove_indexed_ent(targetnameEnts, entry.targetname, entry.ent);
+	}
+	for (int k = 0; k < entry.targets.size(); k++) {
+		remove_indexed_ent(targetingEnts, entry.targets[k], entry.ent);
+	}
+}
+
+void Bsp::update_ent_index() {
+	uint32_t version = Entity::keyvalueVersion;
+	if (indexedEntsVersion == version && indexedEnts.size() == ents.size()) {
+		return;
+	}
+
+	if (modelEnts.size() < modelCount) {
+		modelEnts.resize(modelCount);
+	}
+
+	bool samePositions = indexedEnts.size() == ents.size();
+	for (int i = 0; i < ents.size() && samePositions; i++) {
+		samePositions = indexedEnts[i].ent == ents[i];
+	}
+
+	if (samePositions) {
+		// only keyvalues changed
+		for (int i = 0; i < ents.size(); i++) {
+			if (indexedEnts[i].revision != ents[i]->revision) {
+				unindex_ent(indexedEnts[i]);
+				index_ent(indexedEnts[i], ents[i]);
+			}
+		}
+	}
+	else {
+		// entities were added, removed, or moved. Unchanged entities keep their entries. Revisions are
+		// unique across all entities, so a new entity allocated where a deleted one was is still re-indexed.
+		unordered_map<Entity*, int> oldIdx;
+		for (int i = 0; i < indexedEnts.size(); i++) {
+			oldIdx[indexedEnts[i].ent] = i;
+		}
+
+		vector<int> keptIdx(ents.size(), -1);
+		vector<bool> kept(indexedEnts.size(), false);
+		for (int i = 0; i < ents.size(); i++) {
+			auto it = oldIdx.find(ents[i]);
+			if (it != oldIdx.end() && !kept[it->second] && indexedEnts[it->second].revision == ents[i]->revision) {
+				kept[it->second] = true;
+				keptIdx[i] = it->second;
+			}
+		}
+
+		for (int i = 0; i < indexedEnts.size(); i++) {
+			if (!kept[i]) {
+				unindex_ent(indexedEnts[i]);
+			}
+		}
+
+		vector<IndexedEnt> newIndexedEnts(ents.size());
+		for (int i = 0; i < ents.size(); i++) {
+			if (keptIdx[i] != -1) {
+				newIndexedEnts[i] = std::move(indexedEnts[keptIdx[i]]);
+			}
+			else {
+				index_ent(newIndexedEnts[i], ents[i]);
+			}
+		}
+		indexedEnts.swap(newIndexedEnts);
+	}
+
+	// entities changed by other threads while indexing will be caught by the next update
+	indexedEntsVersion = version;
 }
 
 void Bsp::recurse_node(int16_t nodeIdx, int depth) {
@@ -2733,29 +3235,54 @@ void Bsp::delete_hull(int hull_number, int modelIdx, int redirect) {
 	}	
 }
 
-void Bsp::delete_model(int modelIdx) {
-	byte* oldModels = (byte*)models;
+STRUCTCOUNT Bsp::delete_model(int modelIdx) {
+	set<int> modelIdxs;
+	modelIdxs.insert(modelIdx);
+	return delete_models(modelIdxs);
+}
 
-	int newSize = (modelCount - 1) * sizeof(BSPMODEL);
-	byte* newModels = new byte[newSize];
+void Bsp::compact_models(const set<int>& modelIdxs) {
+	vector<int> remap(modelCount); // old model index -> new index, or -1 if deleted
+	int newModelCount = 0;
 
-	memcpy(newModels, oldModels, modelIdx * sizeof(BSPMODEL));
-	memcpy(newModels + modelIdx * sizeof(BSPMODEL), 
-		   oldModels + (modelIdx+1) * sizeof(BSPMODEL), 
-		   (modelCount - (modelIdx+1))*sizeof(BSPMODEL));
+	for (int i = 0; i < modelCount; i++) {
+		remap[i] = modelIdxs.count(i) ? -1 : newModelCount++;
+	}
 
-	replace_lump(LUMP_MODELS, newModels, newSize);
+	if (newModelCount == modelCount) {
+		return;
+	}
 
-	// update model index references
-	for (int i = 0; i < ents.size(); i++) {
-		int entModel = ents[i]->getBspModelIdx();
-		if (entModel == modelIdx) {
-			ents[i]->setOrAddKeyvalue("model", "error.mdl");
+	byte* newModels = new byte[newModelCount * sizeof(BSPMODEL)];
+	for (int i = 0; i < modelCount; i++) {
+		if (remap[i] != -1) {
+			memcpy(newModels + remap[i] * sizeof(BSPMODEL), &models[i], sizeof(BSPMODEL));
 		}
-		else if (entModel > modelIdx) {
-			ents[i]->setOrAddKeyvalue("model", "*" + to_string(entModel - 1));
+	}
+
+	// update model index references. Only entities that use a model are visited, and only those
+	// are re-indexed the next time the index is used.
+	update_ent_index();
+
+	int deleteCount = modelCount - newModelCount;
+
+	for (int i = 0; i < modelEnts.size(); i++) {
+		int newIdx = i < modelCount ? remap[i] : i - deleteCount;
+
+		for (int k = 0; k < modelEnts[i].size(); k++) {
+			Entity* ent = modelEnts[i][k];
+
+			if (newIdx == -1) {
+				ent->setOrAddKeyvalue("model", "error.mdl");
+				continue;
+			}
+			if (newIdx != i) {
+				ent->setOrAddKeyvalue("model", "*" + to_string(newIdx));
+			}
 		}
 	}
+
+	replace_lump(LUMP_MODELS, newModels, newModelCount * sizeof(BSPMODEL));
 }
 
 int Bsp::create_solid(vec3 mins, vec3 maxs, int textureIdx) {
@@ -3862,7 +4389,7 @@ void Bsp::write_csg_outputs(string path) {
 		flipped.fDist = -flipped.fDist;
 		newPlanes[numPlanes + i] = flipped;
 	}
-	delete [] lumps[LUMP_PLANES];
+	free_lump(LUMP_PLANES);
 	lumps[LUMP_PLANES] = (byte*)newPlanes;
 	numPlanes *= 2;
 	header.lump[LUMP_PLANES].nLength = numPlanes * sizeof(BSPPLANE);
@@ -4049,7 +4576,7 @@ void Bsp::update_lump_pointers() {
 }
 
 void Bsp::replace_lump(int lumpIdx, void* newData, int newLength) {
-	delete[] lumps[lumpIdx];
+	free_lump(lumpIdx);
 	lumps[lumpIdx] = (byte*)newData;
 	header.lump[lumpIdx].nLength = newLength;
 	update_lump_pointers();
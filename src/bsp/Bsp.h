@@ -8,22 +8,16 @@
 #include <string.h>
 #include "remap.h"
 #include <set>
+#include <unordered_map>
 #include "bsptypes.h"
 
-struct membuf : std::streambuf
-{
-	membuf(char* begin, int len) {
-		this->setg(begin, begin, begin + len);
-	}
-};
-
 class Bsp
 {
 public:
 	string path;
 	string name;
 	BSPHEADER header = BSPHEADER();
-	byte ** lumps;
+	byte ** lumps = NULL;
 	bool valid;
 
 	BSPPLANE* planes;
@@ -127,8 +121,17 @@ public:
 	// call this after editing ents
 	void update_ent_lump(bool stripNodes=false);
 
+	// entities with the given targetname
+	vector<Entity*> get_targetname_ents(const string& targetname);
+
+	// entities that have the given targetname as one of their targets (see Entity::getTargets)
+	vector<Entity*> get_targeting_ents(const string& targetname);
+
 	vec3 get_model_center(int modelIdx);
 
+	// verts of the face's polygon, in the order of its edges
+	vector<vec3> get_face_verts(int faceIdx);
+
 	// returns the number of lightmaps applied to the face, or 0 if it has no lighting
 	int lightmap_count(int faceIdx);
 
@@ -136,7 +139,17 @@ public:
 
 	// delete structures not used by the map (needed after deleting models/hulls)
 	STRUCTCOUNT remove_unused_model_structures();
-	void delete_model(int modelIdx);
+	STRUCTCOUNT delete_model(int modelIdx);
+
+	// deletes the models and shifts the model keys of entities using the models after them, then deletes
+	// the structures that only the deleted models used. Lumps are rebuilt once no matter how many models
+	// are deleted. Entities using deleted models are changed to use error.mdl.
+	STRUCTCOUNT delete_models(const set<int>& modelIdxs);
+
+	// merges vertexes that are within epsilon of each other on every axis (0 = exact copies only),
+	// then rebuilds the edges so that each edge is shared by at most two faces of the same model, which
+	// walk it in opposite directions. Returns the removed counts.
+	STRUCTCOUNT weld(float epsilon=0);
 
 	// conditionally deletes hulls for entities that aren't using them
 	STRUCTCOUNT delete_unused_hulls(bool noProgress=false);
@@ -166,9 +179,17 @@ public:
 	// Returns -1 on failure, else the new texture index
 	int add_texture(const char* name, byte* data, int width, int height);
 
+	// lumps loaded from a file point into a copy-on-write mapping of it, until they're replaced
 	void replace_lump(int lumpIdx, void* newData, int newLength);
 	void append_lump(int lumpIdx, void* newData, int appendLength);
 
+	// true if the lump points into the mapped BSP file, rather than memory owned by the lump
+	bool is_lump_mapped(int lumpIdx);
+
+	// copies lumps that still point into the mapped BSP file, then unmaps it
+	// (e.g. before overwriting the file, or when the map will be kept open for a long time)
+	void unmap_file();
+
 	bool is_invisible_solid(Entity* ent);
 
 	// replace a model's clipnode hull with a axis-aligned bounding box
@@ -199,8 +220,8 @@ public:
 	// true if the model is sharing planes/clipnodes with other models
 	bool does_model_use_shared_structures(int modelIdx);
 
-	// returns the current lump contents
-	LumpState duplicate_lumps(int targets);
+	// returns the current lump contents. Chunks that are unchanged since the previous snapshot are shared with it.
+	LumpState duplicate_lumps(int targets, const LumpState* previous=NULL);
 
 	void replace_lumps(LumpState& state);
 
@@ -216,10 +237,23 @@ private:
 	int remove_unused_textures(bool* usedTextures, int* remappedIndexes);
 	int remove_unused_structs(int lumpIdx, bool* usedStructs, int* remappedIndexes);
 
+	// deletes every structure not marked as used and remaps the indexes of the rest
+	STRUCTCOUNT remove_unused_structures(STRUCTUSAGE& usedStructures);
+
+	// deletes the models from the models lump without touching their structures
+	void compact_models(const set<int>& modelIdxs);
+
 	void resize_lightmaps(LIGHTMAP* oldLightmaps, LIGHTMAP* newLightmaps);
 
+	// the BSP file that loaded lumps point into (see load_lumps)
+	byte* mappedFile = NULL;
+	int mappedFileSize = 0;
+
 	bool load_lumps(string fname);
 
+	// deletes the lump data, unless it belongs to the mapped BSP file
+	void free_lump(int lumpIdx);
+
 	// lightmaps that are resized due to precision errors should not be stretched to fit the new canvas.
 	// Instead, the texture should be shifted around, depending on which parts of the canvas is "lit" according
 	// to the qrad code. Shifts apply to one or both of the lightmaps, depending on which dimension is bigger.
@@ -234,6 +268,37 @@ private:
 	string get_model_usage(int modelIdx);
 	vector<Entity*> get_model_ents(int modelIdx);
 
+	// what an entity was indexed under, so it can be removed from the index when it changes
+	struct IndexedEnt {
+		Entity* ent;
+		uint32_t revision; // the entity's revision when it was indexed
+		int modelIdx;
+		string targetname;
+		vector<string> targets;
+	};
+
+	// entities using each model index, so models don't need to search every entity for their users.
+	// Entities are listed in no particular order.
+	vector<vector<Entity*>> modelEnts;
+
+	// entities by targetname, and by the names they target
+	unordered_map<string, vector<Entity*>> targetnameEnts;
+	unordered_map<string, vector<Entity*>> targetingEnts;
+
+	// one entry per entity in ents, as of the last update_ent_index
+	vector<IndexedEnt> indexedEnts;
+	uint32_t indexedEntsVersion = 0; // Entity::keyvalueVersion when the index was last updated
+
+	// re-indexes only the entities that were added, removed, or changed since the last update.
+	// Nothing is done if no entity in any map has changed since then.
+	void update_ent_index();
+	void index_ent(IndexedEnt& entry, Entity* ent);
+	void unindex_ent(IndexedEnt& entry);
+
+	// unique id of the entity lump written by update_ent_lump, or 0 if the lump came from anywhere else.
+	// Entities remember the id and their position in the lump, so unchanged entities can be copied from it.
+	uint32_t entLumpId = 0;
+
 	void write_csg_polys(int16_t nodeIdx, FILE* fout, int flipPlaneSkip, bool debug);	
 
 	// marks all structures that this model uses
@@ -2,7 +2,10 @@
 #include <algorithm>
 #include <map>
 #include <set>
+#include <atomic>
 #include "vis.h"
+#include "PlaneIndex.h"
+#include "ContentIndex.h"
 
 BspMerger::BspMerger() {
 
@@ -41,58 +44,66 @@ Bsp* BspMerger::merge(vector<Bsp*> maps, vec3 gap, string output_name, bool nori
 
 	// Merge order matters. 
 	// The bounding box of a merged map is expanded to contain both maps, and bounding boxes cannot overlap.
-	// TODO: Don't merge linearly. Merge gradually bigger chunks to minimize BSP tree depth.
-	//       Not worth it until more than 27 maps are merged together (merge cube bigger than 3x3x3)
+	// Neighboring maps are merged in pairs, then neighboring pairs are merged, and so on. This keeps the
+	// BSP tree balanced and avoids copying the first map's data again for every map that's merged into it.
 
 	logf("\nMerging %d maps:\n", maps.size());
 
-	// merge maps along X axis to form rows of maps
-	int rowId = 0;
+	duplicatePlaneCount = 0;
+	snappedPlaneCount = 0;
 	int mergeCount = 1;
+
+	// merge maps along X axis to form rows of maps
+	vector<vector<MAPBLOCK*>> rows;
+	vector<string> rowNames;
 	for (int z = 0; z < blocks.size(); z++) {
 		for (int y = 0; y < blocks[z].size(); y++) {
-			MAPBLOCK& rowStart = blocks[z][y][0];
+			vector<MAPBLOCK*> row;
 			for (int x = 0; x < blocks[z][y].size(); x++) {
-				MAPBLOCK& block = blocks[z][y][x];
-
-				if (x != 0) {
-					//logf("Merge %d,%d,%d -> %d,%d,%d\n", x, y, z, 0, y, z);
-					string merge_name = ++mergeCount < maps.size() ? "row_" + to_string(rowId) : "result";
-					merge(rowStart, block, merge_name);
-				}
+				row.push_back(&blocks[z][y][x]);
 			}
-			rowId++;
+			rows.push_back(row);
+			rowNames.push_back("row_" + to_string(rowNames.size()));
 		}
 	}
+	bool success = merge_groups(rows, rowNames, mergeCount, maps.size());
 
 	// merge the rows along the Y axis to form layers of maps
-	int colId = 0;
+	vector<vector<MAPBLOCK*>> layers;
+	vector<string> layerNames;
 	for (int z = 0; z < blocks.size(); z++) {
-		MAPBLOCK& colStart = blocks[z][0][0];
+		vector<MAPBLOCK*> layer;
 		for (int y = 0; y < blocks[z].size(); y++) {
-			MAPBLOCK& block = blocks[z][y][0];
-
-			if (y != 0) {
-				//logf("Merge %d,%d,%d -> %d,%d,%d\n", 0, y, z, 0, 0, z);
-				string merge_name = ++mergeCount < maps.size() ? "layer_" + to_string(colId) : "result";
-				merge(colStart, block, merge_name);
-			}
+			layer.push_back(&blocks[z][y][0]);
 		}
-		colId++;
+		layers.push_back(layer);
+		layerNames.push_back("layer_" + to_string(layerNames.size()));
 	}
+	success = success && merge_groups(layers, layerNames, mergeCount, maps.size());
 
 	// merge the layers to form a cube of maps
-	MAPBLOCK& layerStart = blocks[0][0][0];
+	vector<vector<MAPBLOCK*>> cube(1);
 	for (int z = 0; z < blocks.size(); z++) {
-		MAPBLOCK& block = blocks[z][0][0];
+		cube[0].push_back(&blocks[z][0][0]);
+	}
+	success = success && merge_groups(cube, vector<string>(1, "cube"), mergeCount, maps.size());
 
-		if (z != 0) {
-			//logf("Merge %d,%d,%d -> %d,%d,%d\n", 0, 0, z, 0, 0, 0);
-			merge(layerStart, block, "result");
-		}
+	if (!success) {
+		for (int z = 0; z < blocks.size(); z++)
+			for (int y = 0; y < blocks[z].size(); y++)
+				for (int x = 0; x < blocks[z][y].size(); x++)
+					delete blocks[z][y][x].merged;
+		logf("\nFailed to merge the maps.\n");
+		return NULL;
 	}
 
-	Bsp* output = layerStart.map;
+	MAPBLOCK& layerStart = blocks[0][0][0];
+	Bsp* output = layerStart.merged ? layerStart.merged : layerStart.map;
+
+	logf("\nRemoved %d duplicate planes", duplicatePlaneCount);
+	if (snapPlanes)
+		logf(" (%d nearly identical)", snappedPlaneCount);
+	logf("\n");
 
 	if (!noripent) {
 		vector<MAPBLOCK> flattenedBlocks;
@@ -108,13 +119,104 @@ Bsp* BspMerger::merge(vector<Bsp*> maps, vec3 gap, string output_name, bool nori
 	return output;
 }
 
-void BspMerger::merge(MAPBLOCK& dst, MAPBLOCK& src, string resultType) {
+bool BspMerger::merge_groups(vector<vector<MAPBLOCK*>> groups, vector<string> groupNames, int& mergeCount, int totalMaps) {
+	struct MergePair {
+		MAPBLOCK* dst;
+		MAPBLOCK* src;
+		string name;
+	};
+
+	while (true) {
+		// pair up neighbors in each group. The first block of a pair keeps the merged result.
+		vector<MergePair> pairs;
+		for (int g = 0; g < groups.size(); g++) {
+			vector<MAPBLOCK*>& group = groups[g];
+			if (group.size() < 2) {
+				continue;
+			}
+
+			bool isLastPass = group.size() == 2;
+			vector<MAPBLOCK*> merged;
+
+			for (int i = 0; i < group.size(); i += 2) {
+				merged.push_back(group[i]);
+
+				if (i + 1 < group.size()) {
+					MergePair pair;
+					pair.dst = group[i];
+					pair.src = group[i + 1];
+					pair.name = isLastPass ? groupNames[g] : groupNames[g] + "." + to_string(i / 2);
+					if (++mergeCount >= totalMaps) {
+						pair.name = "result";
+					}
+					pairs.push_back(pair);
+				}
+			}
+
+			group = merged;
+		}
+
+		if (pairs.empty()) {
+			break;
+		}
+
+		// pairs don't share any maps, so they can be merged at the same time
+		bool parallel = pairs.size() > 1;
+		bool oldHide = g_progress.hide;
+		g_progress.hide = oldHide || parallel; // progress from multiple merges would be unreadable, and racy
+
+		vector<BspMerger*> workers(pairs.size());
+		for (int i = 0; i < pairs.size(); i++) {
+			workers[i] = new BspMerger();
+			workers[i]->snapPlanes = snapPlanes;
+		}
+
+		vector<char> results(pairs.size());
+		parallelFor(pairs.size(), 1, [&](int start, int end) {
+			for (int i = start; i < end; i++) {
+				results[i] = workers[i]->merge(*pairs[i].dst, *pairs[i].src, pairs[i].name);
+			}
+		});
+
+		g_progress.hide = oldHide;
+
+		bool success = true;
+		for (int i = 0; i < workers.size(); i++) {
+			duplicatePlaneCount += workers[i]->duplicatePlaneCount;
+			snappedPlaneCount += workers[i]->snappedPlaneCount;
+			success = success && results[i];
+			delete workers[i];
+		}
+
+		if (!success) {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+bool BspMerger::merge(MAPBLOCK& dst, MAPBLOCK& src, string resultType) {
 	string thisName = dst.merge_name.size() ? dst.merge_name : dst.map->name;
 	string otherName = src.merge_name.size() ? src.merge_name : src.map->name;
 	dst.merge_name = resultType;
 	logf("    %-8s = %s + %s\n", dst.merge_name.c_str(), thisName.c_str(), otherName.c_str());
 
-	merge(*dst.map, *src.map);
+	Bsp* thisMap = dst.merged ? dst.merged : dst.map;
+	Bsp* otherMap = src.merged ? src.merged : src.map;
+	Bsp* result = merge(*thisMap, *otherMap);
+	if (!result) {
+		return false;
+	}
+
+	// intermediate results aren't needed once they've been merged into something else
+	delete src.merged;
+	src.merged = NULL;
+
+	delete dst.merged;
+	dst.merged = result;
+
+	return true;
 }
 
 vector<vector<vector<MAPBLOCK>>> BspMerger::separate(vector<Bsp*>& maps, vec3 gap) {
@@ -285,14 +387,14 @@ void BspMerger::update_map_series_entity_logic(Bsp* mergedMap, vector<MAPBLOCK>&
 	string startingSkyColor = "0 0 0 0";
 	for (int k = 0; k < mergedMap->ents.size(); k++) {
 		Entity* ent = mergedMap->ents[k];
-		if (ent->keyvalues["classname"] == "worldspawn") {
+		if (ent->getKeyvalue("classname") == "worldspawn") {
 			if (ent->hasKey("skyname")) {
-				startingSky = toLowerCase(ent->keyvalues["skyname"]);
+				startingSky = toLowerCase(ent->getKeyvalue("skyname"));
 			}
 		}
-		if (ent->keyvalues["classname"] == "light_environment") {
+		if (ent->getKeyvalue("classname") == "light_environment") {
 			if (ent->hasKey("_light")) {
-				startingSkyColor = ent->keyvalues["_light"];
+				startingSkyColor = ent->getKeyvalue("_light");
 			}
 		}
 	}
@@ -304,14 +406,14 @@ void BspMerger::update_map_series_entity_logic(Bsp* mergedMap, vector<MAPBLOCK>&
 		string skyColor = "0 0 0 0";
 		for (int k = 0; k < sourceMaps[i].map->ents.size(); k++) {
 			Entity* ent = sourceMaps[i].map->ents[k];
-			if (ent->keyvalues["classname"] == "worldspawn") {
+			if (ent->getKeyvalue("classname") == "worldspawn") {
 				if (ent->hasKey("skyname")) {
-					skyname = toLowerCase(ent->keyvalues["skyname"]);
+					skyname = toLowerCase(ent->getKeyvalue("skyname"));
 				}
 			}
-			if (ent->keyvalues["classname"] == "light_environment") {
+			if (ent->getKeyvalue("classname") == "light_environment") {
 				if (ent->hasKey("_light")) {
-					skyColor = ent->keyvalues["_light"];
+					skyColor = ent->getKeyvalue("_light");
 				}
 			}
 		}
@@ -377,10 +479,10 @@ void BspMerger::update_map_series_entity_logic(Bsp* mergedMap, vector<MAPBLOCK>&
 
 	for (int i = 0; i < originalEntCount; i++) {
 		Entity* ent = mergedMap->ents[i];
-		string cname = ent->keyvalues["classname"];
-		string tname = ent->keyvalues["targetname"];
-		string source_map = ent->keyvalues["$s_bspguy_map_source"];
-		int spawnflags = atoi(ent->keyvalues["spawnflags"].c_str());
+		string cname = ent->getKeyvalue("classname");
+		string tname = ent->getKeyvalue("targetname");
+		string source_map = ent->getKeyvalue("$s_bspguy_map_source");
+		int spawnflags = atoi(ent->getKeyvalue("spawnflags").c_str());
 		bool isInFirstMap = toLowerCase(source_map) == toLowerCase(firstMapName);
 		vec3 origin;
 
@@ -390,7 +492,7 @@ void BspMerger::update_map_series_entity_logic(Bsp* mergedMap, vector<MAPBLOCK>&
 		}
 
 		if (ent->hasKey("origin")) {
-			origin = Keyvalue("origin", ent->keyvalues["origin"]).getVector();
+			origin = Keyvalue("origin", ent->getKeyvalue("origin")).getVector();
 		}
 		if (ent->isBspModel()) {
 			origin = mergedMap->get_model_center(ent->getBspModelIdx());
@@ -399,7 +501,8 @@ void BspMerger::update_map_series_entity_logic(Bsp* mergedMap, vector<MAPBLOCK>&
 		if (noscript && (cname == "info_player_start" || cname == "info_player_coop" || cname == "info_player_dm2")) {
 			// info_player_start ents are ignored if there is any active info_player_deathmatch,
 			// so this may break spawns if there are a mix of spawn types
-			cname = ent->keyvalues["classname"] = "info_player_deathmatch";
+			cname = "info_player_deathmatch";
+			ent->setOrAddKeyvalue("classname", cname);
 		}
 
 		if (noscript && !isInFirstMap) {
@@ -422,13 +525,14 @@ void BspMerger::update_map_series_entity_logic(Bsp* mergedMap, vector<MAPBLOCK>&
 			}
 			if (cname == "trigger_auto") {
 				ent->addKeyvalue("targetname", "bspguy_autos_" + source_map);
-				ent->keyvalues["classname"] = "trigger_relay";
+				ent->setOrAddKeyvalue("classname", "trigger_relay");
 			}
 			if (cname.find("monster_") == 0 && cname.rfind("_dead") != cname.size()-5) {
 				// replace with a squadmaker and spawn when this map section starts
 
 				updated_monsters++;
-				hashmap oldKeys = ent->keyvalues;
+				Entity oldKeys;
+				oldKeys = *ent;
 
 				string spawn_name = "bspguy_npcs_" + source_map;
 
@@ -442,46 +546,46 @@ void BspMerger::update_map_series_entity_logic(Bsp* mergedMap, vector<MAPBLOCK>&
 				// - apache/osprey targets, and any other monster-specific keys
 
 				ent->clearAllKeyvalues();
-				ent->addKeyvalue("origin", oldKeys["origin"]);
-				ent->addKeyvalue("angles", oldKeys["angles"]);
+				ent->addKeyvalue("origin", oldKeys.getKeyvalue("origin"));
+				ent->addKeyvalue("angles", oldKeys.getKeyvalue("angles"));
 				ent->addKeyvalue("targetname", spawn_name);
-				ent->addKeyvalue("netname", oldKeys["targetname"]);
+				ent->addKeyvalue("netname", oldKeys.getKeyvalue("targetname"));
 				//ent->addKeyvalue("target", "bspguy_npc_spawn_" + toLowerCase(source_map));
-				if (oldKeys["rendermode"] != "0") {
-					ent->addKeyvalue("renderfx", oldKeys["renderfx"]);
-					ent->addKeyvalue("rendermode", oldKeys["rendermode"]);
-					ent->addKeyvalue("renderamt", oldKeys["renderamt"]);
-					ent->addKeyvalue("rendercolor", oldKeys["rendercolor"]);
+				if (oldKeys.getKeyvalue("rendermode") != "0") {
+					ent->addKeyvalue("renderfx", oldKeys.getKeyvalue("renderfx"));
+					ent->addKeyvalue("rendermode", oldKeys.getKeyvalue("rendermode"));
+					ent->addKeyvalue("renderamt", oldKeys.getKeyvalue("renderamt"));
+					ent->addKeyvalue("rendercolor", oldKeys.getKeyvalue("rendercolor"));
 					ent->addKeyvalue("change_rendermode", "1");
 				}
-				ent->addKeyvalue("classify", oldKeys["classify"]);
-				ent->addKeyvalue("is_not_revivable", oldKeys["is_not_revivable"]);
-				ent->addKeyvalue("bloodcolor", oldKeys["bloodcolor"]);
-				ent->addKeyvalue("health", oldKeys["health"]);
-				ent->addKeyvalue("minhullsize", oldKeys["minhullsize"]);
-				ent->addKeyvalue("maxhullsize", oldKeys["maxhullsize"]);
-				ent->addKeyvalue("freeroam", oldKeys["freeroam"]);
+				ent->addKeyvalue("classify", oldKeys.getKeyvalue("classify"));
+				ent->addKeyvalue("is_not_revivable", oldKeys.getKeyvalue("is_not_revivable"));
+				ent->addKeyvalue("bloodcolor", oldKeys.getKeyvalue("bloodcolor"));
+				ent->addKeyvalue("health", oldKeys.getKeyvalue("health"));
+				ent->addKeyvalue("minhullsize", oldKeys.getKeyvalue("minhullsize"));
+				ent->addKeyvalue("maxhullsize", oldKeys.getKeyvalue("maxhullsize"));
+				ent->addKeyvalue("freeroam", oldKeys.getKeyvalue("freeroam"));
 				ent->addKeyvalue("monstercount", "1");
 				ent->addKeyvalue("delay", "0");
 				ent->addKeyvalue("m_imaxlivechildren", "1");
 				ent->addKeyvalue("spawn_mode", "2"); // force spawn, never block
 				ent->addKeyvalue("dmg", "0"); // telefrag damage
-				ent->addKeyvalue("trigger_condition", oldKeys["TriggerCondition"]);
-				ent->addKeyvalue("trigger_target", oldKeys["TriggerTarget"]);
-				ent->addKeyvalue("trigger_target", oldKeys["TriggerTarget"]);
+				ent->addKeyvalue("trigger_condition", oldKeys.getKeyvalue("TriggerCondition"));
+				ent->addKeyvalue("trigger_target", oldKeys.getKeyvalue("TriggerTarget"));
+				ent->addKeyvalue("trigger_target", oldKeys.getKeyvalue("TriggerTarget"));
 				ent->addKeyvalue("notsolid", "-1");
 				ent->addKeyvalue("gag", (spawnflags & 2) ? "1" : "0");
-				ent->addKeyvalue("weapons", oldKeys["weapons"]);
-				ent->addKeyvalue("new_body", oldKeys["body"]);
-				ent->addKeyvalue("respawn_as_playerally", oldKeys["is_player_ally"]);
-				ent->addKeyvalue("monstertype", oldKeys["classname"]);
-				ent->addKeyvalue("displayname", oldKeys["displayname"]);
-				ent->addKeyvalue("squadname", oldKeys["netname"]);
-				ent->addKeyvalue("new_model", oldKeys["model"]);
-				ent->addKeyvalue("soundlist", oldKeys["soundlist"]);
-				ent->addKeyvalue("path_name", oldKeys["path_name"]);
-				ent->addKeyvalue("guard_ent", oldKeys["guard_ent"]);
-				ent->addKeyvalue("$s_bspguy_map_source", oldKeys["$s_bspguy_map_source"]);
+				ent->addKeyvalue("weapons", oldKeys.getKeyvalue("weapons"));
+				ent->addKeyvalue("new_body", oldKeys.getKeyvalue("body"));
+				ent->addKeyvalue("respawn_as_playerally", oldKeys.getKeyvalue("is_player_ally"));
+				ent->addKeyvalue("monstertype", oldKeys.getKeyvalue("classname"));
+				ent->addKeyvalue("displayname", oldKeys.getKeyvalue("displayname"));
+				ent->addKeyvalue("squadname", oldKeys.getKeyvalue("netname"));
+				ent->addKeyvalue("new_model", oldKeys.getKeyvalue("model"));
+				ent->addKeyvalue("soundlist", oldKeys.getKeyvalue("soundlist"));
+				ent->addKeyvalue("path_name", oldKeys.getKeyvalue("path_name"));
+				ent->addKeyvalue("guard_ent", oldKeys.getKeyvalue("guard_ent"));
+				ent->addKeyvalue("$s_bspguy_map_source", oldKeys.getKeyvalue("$s_bspguy_map_source"));
 				ent->addKeyvalue("spawnflags", to_string(newFlags));
 				ent->addKeyvalue("classname", "squadmaker");
 				ent->clearEmptyKeyvalues(); // things like the model keyvalue will break the monster if it's set but empty
@@ -499,7 +603,7 @@ void BspMerger::update_map_series_entity_logic(Bsp* mergedMap, vector<MAPBLOCK>&
 		if (cname == "trigger_changelevel") {
 			replaced_changelevels++;
 
-			string map = toLowerCase(ent->keyvalues["map"]);
+			string map = toLowerCase(ent->getKeyvalue("map"));
 			bool isMergedMap = false;
 			for (int i = 0; i < sourceMaps.size(); i++) {
 				if (map == toLowerCase(sourceMaps[i].map->name)) {
@@ -518,9 +622,9 @@ void BspMerger::update_map_series_entity_logic(Bsp* mergedMap, vector<MAPBLOCK>&
 				logf("\nWarning: use-only trigger_changelevel has no targetname\n");
 
 			if (!(spawnflags & 2)) {
-				string model = ent->keyvalues["model"];
+				string model = ent->getKeyvalue("model");
 
-				string oldOrigin = ent->keyvalues["origin"];
+				string oldOrigin = ent->getKeyvalue("origin");
 				ent->clearAllKeyvalues();
 				ent->addKeyvalue("origin", oldOrigin);
 				ent->addKeyvalue("model", model);
@@ -767,28 +871,22 @@ void BspMerger::update_map_series_entity_logic(Bsp* mergedMap, vector<MAPBLOCK>&
 }
 
 int BspMerger::force_unique_ent_names_per_map(Bsp* mergedMap) {
-	mapStringToSet mapEntNames;
+	unordered_map<string, string> nameOwners; // targetname -> the first map that used it
 	mapStringToSet entsToRename;
 
 	for (int i = 0; i < mergedMap->ents.size(); i++) {
 		Entity* ent = mergedMap->ents[i];
-		string tname = ent->keyvalues["targetname"];
-		string source_map = ent->keyvalues["$s_bspguy_map_source"];
+		const string& tname = ent->getKeyvalue("targetname");
+		const string& source_map = ent->getKeyvalue("$s_bspguy_map_source");
 
 		if (tname.empty())
 			continue;
 
-		bool isUnique = true;
-		for (auto it = mapEntNames.begin(); it != mapEntNames.end(); ++it) {
-			if (it->first != source_map && it->second.find(tname) != it->second.end()) {
-				entsToRename[source_map].insert(tname);
-				isUnique = false;
-				break;
-			}
-		}
-
-		if (isUnique)
-			mapEntNames[source_map].insert(tname);
+		auto owner = nameOwners.find(tname);
+		if (owner == nameOwners.end())
+			nameOwners[tname] = source_map;
+		else if (owner->second != source_map)
+			entsToRename[source_map].insert(tname);
 	}
 
 	int renameCount = 0;
@@ -797,126 +895,184 @@ int BspMerger::force_unique_ent_names_per_map(Bsp* mergedMap) {
 
 	g_progress.update("Renaming entities", renameCount);
 
+	struct RENAME {
+		string oldName;
+		string newName;
+		vector<Entity*> ents;
+	};
+	vector<RENAME> renames;
+
+	// Only entities named by or targeting the old name need to be updated. They're all found before renaming
+	// anything, because renames change keyvalues and that would rebuild the map's target index each time.
 	int renameSuffix = 2;
 	for (auto it = entsToRename.begin(); it != entsToRename.end(); ++it) {
 		for (auto it2 = it->second.begin(); it2 != it->second.end(); ++it2) {
-			string oldName = *it2;
-			string newName = oldName + "_" + to_string(renameSuffix++);
+			RENAME rename;
+			rename.oldName = *it2;
+			rename.newName = rename.oldName + "_" + to_string(renameSuffix++);
 
-			//logf << "\nRenaming " << *it2 << " to " << newName << endl;
+			vector<Entity*> named = mergedMap->get_targetname_ents(rename.oldName);
+			vector<Entity*> callers = mergedMap->get_targeting_ents(rename.oldName);
+			named.insert(named.end(), callers.begin(), callers.end());
 
-			for (int i = 0; i < mergedMap->ents.size(); i++) {
-				Entity* ent = mergedMap->ents[i];
-				if (ent->keyvalues["$s_bspguy_map_source"] != it->first)
-					continue;
-
-				ent->renameTargetnameValues(oldName, newName);
+			for (int i = 0; i < named.size(); i++) {
+				if (named[i]->getKeyvalue("$s_bspguy_map_source") == it->first)
+					rename.ents.push_back(named[i]);
 			}
 
-			g_progress.tick();
+			renames.push_back(rename);
 		}
 	}
 
+	for (int i = 0; i < renames.size(); i++) {
+		//logf << "\nRenaming " << renames[i].oldName << " to " << renames[i].newName << endl;
+
+		for (int k = 0; k < renames[i].ents.size(); k++) {
+			renames[i].ents[k]->renameTargetnameValues(renames[i].oldName, renames[i].newName);
+		}
+
+		g_progress.tick();
+	}
+
 	return renameCount;
 }
 
-bool BspMerger::merge(Bsp& mapA, Bsp& mapB) {
-	// TODO: Create a new map and store result there. Don't break mapA.
-
+Bsp* BspMerger::merge(Bsp& mapA, Bsp& mapB) {
 	BSPPLANE separationPlane = separate(mapA, mapB);
 	if (separationPlane.nType == -1) {
 		logf("No separating axis found. The maps overlap and can't be merged.\n");
-		return false;
+		return NULL;
 	}
 
-	thisWorldLeafCount = mapA.models[0].nVisLeafs; // excludes solid leaf 0
-	otherWorldLeafCount = mapB.models[0].nVisLeafs; // excluding solid leaf 0
+	// edges store 16-bit vertex indexes, so more vertexes than that can't be referenced
+	if (mapA.vertCount + mapB.vertCount > MAX_MAP_VERTS) {
+		// pairs can be merged in parallel, so the message is logged in one call
+		const char* advice = weldedInputs ? "The limit is still exceeded after welding the input maps."
+			: "Try merging with -weld.";
+		logf("ERROR: The merged map would have %d vertexes (max %d). %s\n",
+			mapA.vertCount + mapB.vertCount, MAX_MAP_VERTS, advice);
+		return NULL;
+	}
 
 	texRemap.clear();
 	texInfoRemap.clear();
 	planeRemap.clear();
 	leavesRemap.clear();
 	modelLeafRemap.clear();
+	mergedTexOffsets.clear();
+
+	Bsp* output = new Bsp();
+	output->name = mapA.name;
+	output->path = mapA.path;
+	output->header.nVersion = mapA.header.nVersion;
 
 	bool shouldMerge[HEADER_LUMPS] = { false };
 
 	for (int i = 0; i < HEADER_LUMPS; i++) {
+		delete[] output->lumps[i];
+		output->lumps[i] = NULL;
+		output->header.lump[i].nLength = 0;
 
 		if (i == LUMP_VISIBILITY || i == LUMP_LIGHTING) {
+			shouldMerge[i] = true;
 			continue; // always merge
 		}
 
+		Bsp* source = NULL;
+
 		if (!mapA.lumps[i] && !mapB.lumps[i]) {
 			//logf << "Skipping " << g_lump_names[i] << " lump (missing from both maps)\n";
 		}
 		else if (!mapA.lumps[i]) {
 			logf("Replacing %s lump\n", g_lump_names[i]);
-			mapA.header.lump[i].nLength = mapB.header.lump[i].nLength;
-			mapA.lumps[i] = new byte[mapB.header.lump[i].nLength];
-			memcpy(mapA.lumps[i], mapB.lumps[i], mapB.header.lump[i].nLength);
-
-			// process the lump here (TODO: faster to just copy wtv needs copying)
-			switch (i) {
-			case LUMP_ENTITIES:
-				mapA.load_ents(); break;
-			}
+			source = &mapB;
 		}
 		else if (!mapB.lumps[i]) {
 			logf("Keeping %s lump\n", g_lump_names[i]);
+			source = &mapA;
 		}
 		else {
 			//logf << "Merging " << g_lump_names[i] << " lump\n";
 
 			shouldMerge[i] = true;
 		}
+
+		if (source && i != LUMP_ENTITIES) {
+			int len = source->header.lump[i].nLength;
+			output->lumps[i] = new byte[len];
+			output->header.lump[i].nLength = len;
+			memcpy(output->lumps[i], source->lumps[i], len);
+		}
+	}
+
+	// first pass: remap structures and count everything, so that each output lump is allocated only once
+	plan_merge(mapA, mapB, shouldMerge);
+
+	for (int i = 0; i < HEADER_LUMPS; i++) {
+		if (shouldMerge[i] && i != LUMP_ENTITIES && i != LUMP_VISIBILITY) {
+			output->lumps[i] = new byte[mergedLumpSizes[i]];
+			output->header.lump[i].nLength = mergedLumpSizes[i];
+		}
 	}
 
-	// base structures (they don't reference any other structures)
-	if (shouldMerge[LUMP_ENTITIES])
-		merge_ents(mapA, mapB);
+	// second pass: write the merged structures directly into the output lumps
 	if (shouldMerge[LUMP_PLANES])
-		merge_planes(mapA, mapB);
+		merge_planes(mapA, mapB, *output);
 	if (shouldMerge[LUMP_TEXTURES])
-		merge_textures(mapA, mapB);
+		merge_textures(mapA, mapB, *output);
 	if (shouldMerge[LUMP_VERTICES])
-		merge_vertices(mapA, mapB);
+		merge_vertices(mapA, mapB, *output);
 
 	if (shouldMerge[LUMP_EDGES])
-		merge_edges(mapA, mapB); // references verts
+		merge_edges(mapA, mapB, *output); // references verts
 
 	if (shouldMerge[LUMP_SURFEDGES])
-		merge_surfedges(mapA, mapB); // references edges
+		merge_surfedges(mapA, mapB, *output); // references edges
 
 	if (shouldMerge[LUMP_TEXINFO])
-		merge_texinfo(mapA, mapB); // references textures
+		merge_texinfo(mapA, mapB, *output); // references textures
 
 	if (shouldMerge[LUMP_FACES])
-		merge_faces(mapA, mapB); // references planes, surfedges, and texinfo
+		merge_faces(mapA, mapB, *output); // references planes, surfedges, and texinfo
 
 	if (shouldMerge[LUMP_MARKSURFACES])
-		merge_marksurfs(mapA, mapB); // references faces
+		merge_marksurfs(mapA, mapB, *output); // references faces
 
 	if (shouldMerge[LUMP_LEAVES])
-		merge_leaves(mapA, mapB); // references vis data, and marksurfs
+		merge_leaves(mapA, mapB, *output); // references vis data, and marksurfs
 
 	if (shouldMerge[LUMP_NODES]) {
-		create_merge_headnodes(mapA, mapB, separationPlane);
-		merge_nodes(mapA, mapB);
-		merge_clipnodes(mapA, mapB);
+		create_merge_headnodes(mapA, mapB, *output, separationPlane);
+		merge_nodes(mapA, mapB, *output);
+		merge_clipnodes(mapA, mapB, *output);
 	}
 
 	if (shouldMerge[LUMP_MODELS])
-		merge_models(mapA, mapB);
+		merge_models(mapA, mapB, *output);
 
-	merge_lighting(mapA, mapB);
+	merge_lighting(mapA, mapB, *output);
 
 	// doing this last because it takes way longer than anything else, and limit overflows should fail the
 	// merge as soon as possible. // TODO: fail fast if overflow detected in other merges? Kind ni
-	merge_vis(mapA, mapB);
+	merge_vis(mapA, mapB, *output);
+
+	// entities are written last because update_ent_lump also updates the lump pointers of the finished map
+	if (shouldMerge[LUMP_ENTITIES]) {
+		merge_ents(mapA, mapB, *output);
+	}
+	else {
+		Bsp& source = mapA.lumps[LUMP_ENTITIES] ? mapA : mapB;
+		for (int i = 0; i < source.ents.size(); i++) {
+			Entity* copy = new Entity();
+			*copy = *source.ents[i];
+			output->ents.push_back(copy);
+		}
+	}
+	output->update_ent_lump();
 
 	g_progress.clear();
 
-	return true;
+	return output;
 }
 
 BSPPLANE BspMerger::separate(Bsp& mapA, Bsp& mapB) {
@@ -976,35 +1132,203 @@ BSPPLANE BspMerger::separate(Bsp& mapA, Bsp& mapB) {
 	return separationPlane;
 }
 
-void BspMerger::merge_ents(Bsp& mapA, Bsp& mapB)
+void BspMerger::plan_merge(Bsp& mapA, Bsp& mapB, bool* shouldMerge) {
+	memset(mergedLumpSizes, 0, sizeof(mergedLumpSizes));
+
+	thisWorldLeafCount = mapA.models[0].nVisLeafs; // excludes solid leaf 0
+	otherWorldLeafCount = mapB.models[0].nVisLeafs; // excluding solid leaf 0
+	thisLeafCount = mapA.leafCount;
+	otherLeafCount = mapB.leafCount - 1; // the solid leaf is shared with mapA
+	thisFaceCount = mapA.faceCount;
+	otherFaceCount = mapB.faceCount;
+	thisWorldFaceCount = mapA.models[0].nFaces;
+	thisNodeCount = mapA.nodeCount + 1; // includes the new headnode
+	thisClipnodeCount = mapA.clipnodeCount + (MAX_MAP_HULLS - 1); // includes the new headnodes
+	thisSurfEdgeCount = mapA.surfedgeCount;
+	thisMarkSurfCount = mapA.marksurfCount;
+	thisEdgeCount = mapA.edgeCount;
+	thisVertCount = mapA.vertCount;
+
+	// a single full-bright lightmap is used for all faces, if one map has lighting but the other doesn't
+	thisColorCount = mapA.header.lump[LUMP_LIGHTING].nLength / sizeof(COLOR3);
+	otherColorCount = mapB.header.lump[LUMP_LIGHTING].nLength / sizeof(COLOR3);
+	if (thisColorCount == 0 && otherColorCount != 0) {
+		thisColorCount = MAX_SURFACE_EXTENT * MAX_SURFACE_EXTENT;
+	}
+	else if (thisColorCount != 0 && otherColorCount == 0) {
+		otherColorCount = MAX_SURFACE_EXTENT * MAX_SURFACE_EXTENT;
+	}
+
+	if (shouldMerge[LUMP_PLANES])
+		plan_planes(mapA, mapB);
+	if (shouldMerge[LUMP_TEXTURES])
+		plan_textures(mapA, mapB);
+	if (shouldMerge[LUMP_TEXINFO])
+		plan_texinfo(mapA, mapB); // references textures
+
+	mergedLumpSizes[LUMP_VERTICES] = (mapA.vertCount + mapB.vertCount) * sizeof(vec3);
+	mergedLumpSizes[LUMP_EDGES] = (mapA.edgeCount + mapB.edgeCount) * sizeof(BSPEDGE);
+	mergedLumpSizes[LUMP_SURFEDGES] = (mapA.surfedgeCount + mapB.surfedgeCount) * sizeof(int32_t);
+	mergedLumpSizes[LUMP_FACES] = (mapA.faceCount + mapB.faceCount) * sizeof(BSPFACE);
+	mergedLumpSizes[LUMP_MARKSURFACES] = (mapA.marksurfCount + mapB.marksurfCount) * sizeof(uint16);
+	mergedLumpSizes[LUMP_LEAVES] = (thisLeafCount + otherLeafCount) * sizeof(BSPLEAF);
+	mergedLumpSizes[LUMP_NODES] = (thisNodeCount + mapB.nodeCount) * sizeof(BSPNODE);
+	mergedLumpSizes[LUMP_CLIPNODES] = (thisClipnodeCount + mapB.clipnodeCount) * sizeof(BSPCLIPNODE);
+	mergedLumpSizes[LUMP_MODELS] = (mapA.modelCount + mapB.modelCount - 1) * sizeof(BSPMODEL); // one world model
+	mergedLumpSizes[LUMP_LIGHTING] = (thisColorCount + otherColorCount) * sizeof(COLOR3);
+}
+
+void BspMerger::plan_planes(Bsp& mapA, Bsp& mapB) {
+	g_progress.update("Merging planes", mapA.planeCount + mapB.planeCount);
+
+	PlaneIndex planeIndex(snapPlanes);
+
+	for (int i = 0; i < mapA.planeCount; i++) {
+		planeIndex.add(mapA.planes[i], i);
+		g_progress.tick();
+	}
+
+	mergedPlaneCount = mapA.planeCount;
+
+	for (int i = 0; i < mapB.planeCount; i++) {
+		int k = planeIndex.find_exact(mapB.planes[i]);
+
+		if (k == -1) {
+			k = planeIndex.find_similar(mapB.planes[i]);
+			if (k != -1) {
+				snappedPlaneCount++;
+			}
+		}
+
+		planeRemap.push_back(k != -1 ? k : mergedPlaneCount++);
+
+		g_progress.tick();
+	}
+
+	duplicatePlaneCount += (mapA.planeCount + mapB.planeCount) - mergedPlaneCount;
+
+	// +1 for the plane that separates the maps (see create_merge_headnodes)
+	mergedLumpSizes[LUMP_PLANES] = (mergedPlaneCount + 1) * sizeof(BSPPLANE);
+}
+
+void BspMerger::plan_textures(Bsp& mapA, Bsp& mapB) {
+	g_progress.update("Merging textures", mapA.textureCount + mapB.textureCount);
+
+	mergedTexOffsets.reserve(mapA.textureCount + mapB.textureCount);
+	uint mipTexDataSize = 0;
+
+	// textures are identical if the miptex header and all pixel data match
+	ContentIndex texIndex;
+	texIndex.reserve(mapA.textureCount + mapB.textureCount);
+
+	for (int i = 0; i < mapA.textureCount; i++) {
+		int32_t offset = ((int32_t*)mapA.textures)[i + 1];
+
+		if (offset == -1) {
+			mergedTexOffsets.push_back(-1);
+		}
+		else {
+			BSPMIPTEX* tex = (BSPMIPTEX*)(mapA.textures + offset);
+			int sz = getBspTextureSize(tex);
+			texIndex.find_or_add(tex, sz, i);
+
+			mergedTexOffsets.push_back(mipTexDataSize);
+			mipTexDataSize += sz;
+		}
+
+		g_progress.tick();
+	}
+
+	for (int i = 0; i < mapB.textureCount; i++) {
+		int32_t offset = ((int32_t*)mapB.textures)[i + 1];
+
+		if (offset != -1) {
+			BSPMIPTEX* tex = (BSPMIPTEX*)(mapB.textures + offset);
+			int sz = getBspTextureSize(tex);
+
+			int k = texIndex.find_or_add(tex, sz, mergedTexOffsets.size());
+
+			if (k != -1) {
+				texRemap.push_back(k);
+			}
+			else {
+				texRemap.push_back(mergedTexOffsets.size());
+				mergedTexOffsets.push_back(mipTexDataSize);
+				mipTexDataSize += sz;
+			}
+		}
+		else {
+			texRemap.push_back(mergedTexOffsets.size());
+			mergedTexOffsets.push_back(-1);
+		}
+
+		g_progress.tick();
+	}
+
+	mergedTexCount = mergedTexOffsets.size();
+	mergedLumpSizes[LUMP_TEXTURES] = (mergedTexCount + 1) * sizeof(int32_t) + mipTexDataSize;
+}
+
+void BspMerger::plan_texinfo(Bsp& mapA, Bsp& mapB) {
+	g_progress.update("Merging texinfos", mapA.texinfoCount + mapB.texinfoCount);
+
+	ContentIndex texinfoIndex;
+	texinfoIndex.reserve(mapA.texinfoCount + mapB.texinfoCount);
+
+	for (int i = 0; i < mapA.texinfoCount; i++) {
+		texinfoIndex.find_or_add(&mapA.texinfos[i], sizeof(BSPTEXTUREINFO), i);
+		g_progress.tick();
+	}
+
+	mergedTexinfoCount = mapA.texinfoCount;
+
+	// mapB's texinfos are compared after remapping their textures, and have to stay alive for the index
+	vector<BSPTEXTUREINFO> remappedInfos(mapB.texinfos, mapB.texinfos + mapB.texinfoCount);
+
+	for (int i = 0; i < mapB.texinfoCount; i++) {
+		BSPTEXTUREINFO& info = remappedInfos[i];
+		info.iMiptex = texRemap[info.iMiptex];
+
+		int k = texinfoIndex.find_or_add(&info, sizeof(BSPTEXTUREINFO), mergedTexinfoCount);
+
+		texInfoRemap.push_back(k != -1 ? k : mergedTexinfoCount++);
+		g_progress.tick();
+	}
+
+	mergedLumpSizes[LUMP_TEXINFO] = mergedTexinfoCount * sizeof(BSPTEXTUREINFO);
+}
+
+void BspMerger::merge_ents(Bsp& mapA, Bsp& mapB, Bsp& output)
 {
 	g_progress.update("Merging entities", mapA.ents.size() + mapB.ents.size());
 
-	int oldEntCount = mapA.ents.size();
-
 	// update model indexes since this map's models will be appended after the other map's models
-	int otherModelCount = (mapB.header.lump[LUMP_MODELS].nLength / sizeof(BSPMODEL)) - 1;
+	int otherModelCount = mapB.modelCount - 1;
 	for (int i = 0; i < mapA.ents.size(); i++) {
-		if (!mapA.ents[i]->hasKey("model") || mapA.ents[i]->keyvalues["model"][0] != '*') {
+		Entity* copy = new Entity();
+		*copy = *mapA.ents[i];
+		output.ents.push_back(copy);
+
+		if (!copy->hasKey("model") || copy->getKeyvalue("model")[0] != '*') {
 			continue;
 		}
-		string modelIdxStr = mapA.ents[i]->keyvalues["model"].substr(1);
+		string modelIdxStr = copy->getKeyvalue("model").substr(1);
 
 		if (!isNumeric(modelIdxStr)) {
 			continue;
 		}
 
 		int newModelIdx = atoi(modelIdxStr.c_str()) + otherModelCount;
-		mapA.ents[i]->keyvalues["model"] = "*" + to_string(newModelIdx);
+		copy->setOrAddKeyvalue("model", "*" + to_string(newModelIdx));
 
 		g_progress.tick();
 	}
 
 	for (int i = 0; i < mapB.ents.size(); i++) {
-		if (mapB.ents[i]->keyvalues["classname"] == "worldspawn") {
+		if (mapB.ents[i]->getKeyvalue("classname") == "worldspawn") {
 			Entity* otherWorldspawn = mapB.ents[i];
 
-			vector<string> otherWads = splitString(otherWorldspawn->keyvalues["wad"], ";");
+			vector<string> otherWads = splitString(otherWorldspawn->getKeyvalue("wad"), ";");
 
 			// strip paths from wad names
 			for (int j = 0; j < otherWads.size(); j++) {
@@ -1012,15 +1336,15 @@ void BspMerger::merge_ents(Bsp& mapA, Bsp& mapB)
 			}
 
 			Entity* worldspawn = NULL;
-			for (int k = 0; k < mapA.ents.size(); k++) {
-				if (mapA.ents[k]->keyvalues["classname"] == "worldspawn") {
-					worldspawn = mapA.ents[k];
+			for (int k = 0; k < output.ents.size(); k++) {
+				if (output.ents[k]->getKeyvalue("classname") == "worldspawn") {
+					worldspawn = output.ents[k];
 					break;
 				}
 			}
 
 			// merge wad list
-			vector<string> thisWads = splitString(worldspawn->keyvalues["wad"], ";");
+			vector<string> thisWads = splitString(worldspawn->getKeyvalue("wad"), ";");
 
 			// strip paths from wad names
 			for (int j = 0; j < thisWads.size(); j++) {
@@ -1034,231 +1358,106 @@ void BspMerger::merge_ents(Bsp& mapA, Bsp& mapB)
 				}
 			}
 
-			worldspawn->keyvalues["wad"] = "";
+			string wads;
 			for (int j = 0; j < thisWads.size(); j++) {
-				worldspawn->keyvalues["wad"] += thisWads[j] + ";";
+				wads += thisWads[j] + ";";
+			}
+			if (!wads.empty() || worldspawn->hasKey("wad")) {
+				worldspawn->setOrAddKeyvalue("wad", wads);
 			}
 
 			// include prefixed version of the other maps keyvalues
-			for (auto it = otherWorldspawn->keyvalues.begin(); it != otherWorldspawn->keyvalues.end(); it++) {
-				if (it->first == "classname" || it->first == "wad") {
+			for (int k = 0; k < otherWorldspawn->getKeyCount(); k++) {
+				const string& key = otherWorldspawn->getKey(k);
+				if (key == "classname" || key == "wad") {
 					continue;
 				}
 				// TODO: unknown keyvalues crash the game? Try something else.
-				//worldspawn->addKeyvalue(Keyvalue(mapB.name + "_" + it->first, it->second));
+				//worldspawn->addKeyvalue(Keyvalue(mapB.name + "_" + key, otherWorldspawn->getValue(k)));
 			}
 		}
 		else {
 			Entity* copy = new Entity();
-			copy->keyvalues = mapB.ents[i]->keyvalues;
-			copy->keyOrder = mapB.ents[i]->keyOrder;
-			mapA.ents.push_back(copy);
+			*copy = *mapB.ents[i];
+			output.ents.push_back(copy);
 		}
 
 		g_progress.tick();
 	}
-
-	mapA.update_ent_lump();
 }
 
-void BspMerger::merge_planes(Bsp& mapA, Bsp& mapB) {
-	g_progress.update("Merging planes", mapA.planeCount + mapB.planeCount);
+void BspMerger::merge_planes(Bsp& mapA, Bsp& mapB, Bsp& output) {
+	BSPPLANE* newPlanes = (BSPPLANE*)output.lumps[LUMP_PLANES];
 
-	vector<BSPPLANE> mergedPlanes;
-	mergedPlanes.reserve(mapA.planeCount + mapB.planeCount);
+	memcpy(newPlanes, mapA.planes, mapA.planeCount * sizeof(BSPPLANE));
 
-	for (int i = 0; i < mapA.planeCount; i++) {
-		mergedPlanes.push_back(mapA.planes[i]);
-		g_progress.tick();
-	}
 	for (int i = 0; i < mapB.planeCount; i++) {
-		bool isUnique = true;
-		for (int k = 0; k < mapA.planeCount; k++) {
-			if (memcmp(&mapB.planes[i], &mapA.planes[k], sizeof(BSPPLANE)) == 0) {
-				isUnique = false;
-				planeRemap.push_back(k);
-				break;
-			}
+		if (planeRemap[i] >= mapA.planeCount) {
+			newPlanes[planeRemap[i]] = mapB.planes[i];
 		}
-		if (isUnique) {
-			planeRemap.push_back(mergedPlanes.size());
-			mergedPlanes.push_back(mapB.planes[i]);
-		}
-
-		g_progress.tick();
 	}
-
-	int newLen = mergedPlanes.size() * sizeof(BSPPLANE);
-	int duplicates = (mapA.planeCount + mapB.planeCount) - mergedPlanes.size();
-
-	//logf("\nRemoved %d duplicate planes\n", duplicates);
-
-	byte* newPlanes = new byte[newLen];
-	memcpy(newPlanes, &mergedPlanes[0], newLen);
-
-	mapA.replace_lump(LUMP_PLANES, newPlanes, newLen);
 }
 
-void BspMerger::merge_textures(Bsp& mapA, Bsp& mapB) {
-	uint32_t newTexCount = 0;
+void BspMerger::merge_textures(Bsp& mapA, Bsp& mapB, Bsp& output) {
+	byte* newTextureData = output.lumps[LUMP_TEXTURES];
+	uint texHeaderSize = (mergedTexCount + 1) * sizeof(int32_t);
 
-	// temporary buffer for holding miptex + embedded textures (too big but doesn't matter)
-	uint maxMipTexDataSize = mapA.header.lump[LUMP_TEXTURES].nLength + mapB.header.lump[LUMP_TEXTURES].nLength;
-	byte* newMipTexData = new byte[maxMipTexDataSize];
-
-	byte* mipTexWritePtr = newMipTexData;
-
-	// offsets relative to the start of the mipmap data, not the lump
-	uint32_t* mipTexOffsets = new uint32_t[mapA.textureCount + mapB.textureCount];
-
-	g_progress.update("Merging textures", mapA.textureCount + mapB.textureCount);
+	// write texture lump header
+	int32_t* texHeader = (int32_t*)(newTextureData);
+	texHeader[0] = mergedTexCount;
+	for (int i = 0; i < mergedTexCount; i++) {
+		texHeader[i + 1] = (mergedTexOffsets[i] == -1) ? -1 : mergedTexOffsets[i] + texHeaderSize;
+	}
 
-	uint thisMergeSz = (mapA.textureCount + 1) * sizeof(int32_t);
 	for (int i = 0; i < mapA.textureCount; i++) {
 		int32_t offset = ((int32_t*)mapA.textures)[i + 1];
-
-		if (offset == -1) {
-			mipTexOffsets[newTexCount] = -1;
-		}
-		else {
+		if (offset != -1) {
 			BSPMIPTEX* tex = (BSPMIPTEX*)(mapA.textures + offset);
-			int sz = getBspTextureSize(tex);
-			//memset(tex->nOffsets, 0, sizeof(uint32) * 4);
-
-			mipTexOffsets[newTexCount] = (mipTexWritePtr - newMipTexData);
-			memcpy(mipTexWritePtr, tex, sz);
-			mipTexWritePtr += sz;
-			thisMergeSz += sz;
+			memcpy(newTextureData + texHeader[i + 1], tex, getBspTextureSize(tex));
 		}
-		newTexCount++;
-
-		g_progress.tick();
 	}
 
-	uint otherMergeSz = (mapB.textureCount + 1) * sizeof(int32_t);
 	for (int i = 0; i < mapB.textureCount; i++) {
 		int32_t offset = ((int32_t*)mapB.textures)[i + 1];
-		
-		if (offset != -1) {
-			bool isUnique = true;
+		if (offset != -1 && texRemap[i] >= mapA.textureCount) {
 			BSPMIPTEX* tex = (BSPMIPTEX*)(mapB.textures + offset);
-			int sz = getBspTextureSize(tex);
-
-			for (int k = 0; k < mapA.textureCount; k++) {
-				if (mipTexOffsets[k] == -1) {
-					continue;
-				}
-				BSPMIPTEX* thisTex = (BSPMIPTEX*)(newMipTexData + mipTexOffsets[k]);
-				if (memcmp(tex, thisTex, sz) == 0) {
-					isUnique = false;
-					texRemap.push_back(k);
-					break;
-				}
-			}
-
-			if (isUnique) {
-				mipTexOffsets[newTexCount] = (mipTexWritePtr - newMipTexData);
-				texRemap.push_back(newTexCount);
-				memcpy(mipTexWritePtr, tex, sz); // Note: won't work if pixel data isn't immediately after struct
-				mipTexWritePtr += sz;
-				newTexCount++;
-				otherMergeSz += sz;
-			}
+			// Note: won't work if pixel data isn't immediately after struct
+			memcpy(newTextureData + texHeader[texRemap[i] + 1], tex, getBspTextureSize(tex));
 		}
-		else {
-			mipTexOffsets[newTexCount] = -1;
-			texRemap.push_back(newTexCount);
-			newTexCount++;
-		}
-
-		g_progress.tick();
-	}
-
-	int duplicates = newTexCount - (mapA.textureCount + mapB.textureCount);
-
-	uint texHeaderSize = (newTexCount + 1) * sizeof(int32_t);
-	uint newLen = (mipTexWritePtr - newMipTexData) + texHeaderSize;
-	byte* newTextureData = new byte[newLen];
-
-	// write texture lump header
-	uint32_t* texHeader = (uint32_t*)(newTextureData);
-	texHeader[0] = newTexCount;
-	for (int i = 0; i < newTexCount; i++) {
-		texHeader[i + 1] = (mipTexOffsets[i] == -1) ? -1 : mipTexOffsets[i] + texHeaderSize;
 	}
-
-	memcpy(newTextureData + texHeaderSize, newMipTexData, mipTexWritePtr - newMipTexData);
-
-	delete[] mipTexOffsets;
-	mapA.replace_lump(LUMP_TEXTURES, newTextureData, newLen);
 }
 
-void BspMerger::merge_vertices(Bsp& mapA, Bsp& mapB) {
-	thisVertCount = mapA.vertCount;
-	int totalVertCount = thisVertCount + mapB.vertCount;
+void BspMerger::merge_vertices(Bsp& mapA, Bsp& mapB, Bsp& output) {
+	g_progress.update("Merging verticies", 2);
 
-	g_progress.update("Merging verticies", 3);
-	g_progress.tick();
-
-	vec3* newVerts = new vec3[totalVertCount];
+	vec3* newVerts = (vec3*)output.lumps[LUMP_VERTICES];
 	memcpy(newVerts, mapA.verts, thisVertCount * sizeof(vec3));
 	g_progress.tick();
 	memcpy(newVerts + thisVertCount, mapB.verts, mapB.vertCount * sizeof(vec3));
 	g_progress.tick();
-
-	mapA.replace_lump(LUMP_VERTICES, newVerts, totalVertCount * sizeof(vec3));
 }
 
-void BspMerger::merge_texinfo(Bsp& mapA, Bsp& mapB) {
-	g_progress.update("Merging texinfos", mapA.texinfoCount + mapB.texinfoCount);
-
-	vector<BSPTEXTUREINFO> mergedInfo;
-	mergedInfo.reserve(mapA.texinfoCount + mapB.texinfoCount);
+void BspMerger::merge_texinfo(Bsp& mapA, Bsp& mapB, Bsp& output) {
+	BSPTEXTUREINFO* newTexinfos = (BSPTEXTUREINFO*)output.lumps[LUMP_TEXINFO];
 
-	for (int i = 0; i < mapA.texinfoCount; i++) {
-		mergedInfo.push_back(mapA.texinfos[i]);
-		g_progress.tick();
-	}
+	memcpy(newTexinfos, mapA.texinfos, mapA.texinfoCount * sizeof(BSPTEXTUREINFO));
 
 	for (int i = 0; i < mapB.texinfoCount; i++) {
-		BSPTEXTUREINFO info = mapB.texinfos[i];
-		info.iMiptex = texRemap[info.iMiptex];
-
-		bool isUnique = true;
-		for (int k = 0; k < mapA.texinfoCount; k++) {
-			if (memcmp(&info, &mapA.texinfos[k], sizeof(BSPTEXTUREINFO)) == 0) {
-				texInfoRemap.push_back(k);
-				isUnique = false;
-				break;
-			}
-		}
-
-		if (isUnique) {
-			texInfoRemap.push_back(mergedInfo.size());
-			mergedInfo.push_back(info);
+		if (texInfoRemap[i] >= mapA.texinfoCount) {
+			BSPTEXTUREINFO& info = newTexinfos[texInfoRemap[i]];
+			info = mapB.texinfos[i];
+			info.iMiptex = texRemap[info.iMiptex];
 		}
-		g_progress.tick();
 	}
-
-	int newLen = mergedInfo.size() * sizeof(BSPTEXTUREINFO);
-	int duplicates = mergedInfo.size() - (mapA.texinfoCount + mapB.texinfoCount);
-
-	byte* newTexinfoData = new byte[newLen];
-	memcpy(newTexinfoData, &mergedInfo[0], newLen);
-
-	mapA.replace_lump(LUMP_TEXINFO, newTexinfoData, newLen);
 }
 
-void BspMerger::merge_faces(Bsp& mapA, Bsp& mapB) {
-	thisFaceCount = mapA.faceCount;
-	otherFaceCount = mapB.faceCount;
-	thisWorldFaceCount = mapA.models[0].nFaces;
-	int totalFaceCount = thisFaceCount + mapB.faceCount;
+void BspMerger::merge_faces(Bsp& mapA, Bsp& mapB, Bsp& output) {
+	int totalFaceCount = thisFaceCount + otherFaceCount;
 
-	g_progress.update("Merging faces", mapB.faceCount + 1);
+	g_progress.update("Merging faces", otherFaceCount + 1);
 	g_progress.tick();
 
-	BSPFACE* newFaces = new BSPFACE[totalFaceCount];
+	BSPFACE* newFaces = (BSPFACE*)output.lumps[LUMP_FACES];
 
 	// world model faces come first so they can be merged into one group (model.nFaces is used to render models)
 	// assumes world model faces always come first
@@ -1278,49 +1477,42 @@ void BspMerger::merge_faces(Bsp& mapA, Bsp& mapB) {
 	appendOffset += submodelFaceCountB;
 	memcpy(newFaces + appendOffset, mapA.faces + worldFaceCountA, submodelFaceCountA * sizeof(BSPFACE));
 
-	for (int i = 0; i < totalFaceCount; i++) {
-		// only update B's faces
-		if (i < worldFaceCountA || i >= worldFaceCountA + mapB.faceCount)
-			continue;
-
+	// only update B's faces
+	for (int i = worldFaceCountA; i < worldFaceCountA + otherFaceCount; i++) {
 		BSPFACE& face = newFaces[i];
 		face.iPlane = planeRemap[face.iPlane];
 		face.iFirstEdge = face.iFirstEdge + thisSurfEdgeCount;
 		face.iTextureInfo = texInfoRemap[face.iTextureInfo];
 		g_progress.tick();
 	}
-
-	mapA.replace_lump(LUMP_FACES, newFaces, totalFaceCount * sizeof(BSPFACE));
 }
 
-void BspMerger::merge_leaves(Bsp& mapA, Bsp& mapB) {
-	thisLeafCount = mapA.header.lump[LUMP_LEAVES].nLength / sizeof(BSPLEAF);
-	otherLeafCount = mapB.header.lump[LUMP_LEAVES].nLength / sizeof(BSPLEAF);
+void BspMerger::merge_leaves(Bsp& mapA, Bsp& mapB, Bsp& output) {
+	int worldLeafCountA = thisWorldLeafCount + 1; // include solid leaf
 
-	int thisWorldLeafCount = ((BSPMODEL*)mapA.lumps[LUMP_MODELS])->nVisLeafs + 1; // include solid leaf
+	g_progress.update("Merging leaves", thisLeafCount + mapB.leafCount);
 
-	g_progress.update("Merging leaves", thisLeafCount + otherLeafCount);
+	BSPLEAF* newLeaves = (BSPLEAF*)output.lumps[LUMP_LEAVES];
+	int newLeafCount = 0;
 
-	vector<BSPLEAF> mergedLeaves;
-	mergedLeaves.reserve(thisWorldLeafCount + otherLeafCount);
-	modelLeafRemap.reserve(thisWorldLeafCount + otherLeafCount);
+	modelLeafRemap.reserve(thisLeafCount);
+	leavesRemap.reserve(mapB.leafCount);
 
-	for (int i = 0; i < thisWorldLeafCount; i++) {
+	for (int i = 0; i < worldLeafCountA; i++) {
 		modelLeafRemap.push_back(i);
-		mergedLeaves.push_back(mapA.leaves[i]);
+		newLeaves[newLeafCount++] = mapA.leaves[i];
 		g_progress.tick();
 	}
 
-	for (int i = 0; i < otherLeafCount; i++) {
-		BSPLEAF& leaf = mapB.leaves[i];
-		if (leaf.nMarkSurfaces) {
-			leaf.iFirstMarkSurface = leaf.iFirstMarkSurface + thisMarkSurfCount;
-		}
-
+	for (int i = 0; i < mapB.leafCount; i++) {
 		bool isSharedSolidLeaf = i == 0;
 		if (!isSharedSolidLeaf) {
-			leavesRemap.push_back(mergedLeaves.size());
-			mergedLeaves.push_back(leaf);
+			BSPLEAF& leaf = newLeaves[newLeafCount];
+			leaf = mapB.leaves[i];
+			if (leaf.nMarkSurfaces) {
+				leaf.iFirstMarkSurface = leaf.iFirstMarkSurface + thisMarkSurfCount;
+			}
+			leavesRemap.push_back(newLeafCount++);
 		}
 		else {
 			// always exclude the first solid leaf since there can only be one per map, at index 0
@@ -1331,29 +1523,20 @@ void BspMerger::merge_leaves(Bsp& mapA, Bsp& mapB) {
 
 	// append A's submodel leaves after B's world leaves
 	// Order will be: A's world leaves -> B's world leaves -> B's submodel leaves -> A's submodel leaves
-	for (int i = thisWorldLeafCount; i < thisLeafCount; i++) {
-		modelLeafRemap.push_back(mergedLeaves.size());
-		mergedLeaves.push_back(mapA.leaves[i]);
+	for (int i = worldLeafCountA; i < thisLeafCount; i++) {
+		modelLeafRemap.push_back(newLeafCount);
+		newLeaves[newLeafCount++] = mapA.leaves[i];
+		g_progress.tick();
 	}
-
-	otherLeafCount -= 1; // solid leaf removed
-
-	int newLen = mergedLeaves.size() * sizeof(BSPLEAF);
-
-	byte* newLeavesData = new byte[newLen];
-	memcpy(newLeavesData, &mergedLeaves[0], newLen);
-
-	mapA.replace_lump(LUMP_LEAVES, newLeavesData, newLen);
 }
 
-void BspMerger::merge_marksurfs(Bsp& mapA, Bsp& mapB) {
-	thisMarkSurfCount = mapA.marksurfCount;
+void BspMerger::merge_marksurfs(Bsp& mapA, Bsp& mapB, Bsp& output) {
 	int totalSurfCount = thisMarkSurfCount + mapB.marksurfCount;
 
 	g_progress.update("Merging marksurfaces", totalSurfCount + 1);
 	g_progress.tick();
 
-	uint16* newSurfs = new uint16[totalSurfCount];
+	uint16* newSurfs = (uint16*)output.lumps[LUMP_MARKSURFACES];
 	memcpy(newSurfs, mapA.marksurfs, thisMarkSurfCount * sizeof(uint16));
 	memcpy(newSurfs + thisMarkSurfCount, mapB.marksurfs, mapB.marksurfCount * sizeof(uint16));
 
@@ -1370,18 +1553,15 @@ void BspMerger::merge_marksurfs(Bsp& mapA, Bsp& mapB) {
 		mark = mark + thisWorldFaceCount;
 		g_progress.tick();
 	}
-
-	mapA.replace_lump(LUMP_MARKSURFACES, newSurfs, totalSurfCount * sizeof(uint16));
 }
 
-void BspMerger::merge_edges(Bsp& mapA, Bsp& mapB) {
-	thisEdgeCount = mapA.header.lump[LUMP_EDGES].nLength / sizeof(BSPEDGE);
+void BspMerger::merge_edges(Bsp& mapA, Bsp& mapB, Bsp& output) {
 	int totalEdgeCount = thisEdgeCount + mapB.edgeCount;
 
 	g_progress.update("Merging edges", mapB.edgeCount + 1);
 	g_progress.tick();
 
-	BSPEDGE* newEdges = new BSPEDGE[totalEdgeCount];
+	BSPEDGE* newEdges = (BSPEDGE*)output.lumps[LUMP_EDGES];
 	memcpy(newEdges, mapA.edges, thisEdgeCount * sizeof(BSPEDGE));
 	memcpy(newEdges + thisEdgeCount, mapB.edges, mapB.edgeCount * sizeof(BSPEDGE));
 
@@ -1391,18 +1571,15 @@ void BspMerger::merge_edges(Bsp& mapA, Bsp& mapB) {
 		edge.iVertex[1] = edge.iVertex[1] + thisVertCount;
 		g_progress.tick();
 	}
-
-	mapA.replace_lump(LUMP_EDGES, newEdges, totalEdgeCount * sizeof(BSPEDGE));
 }
 
-void BspMerger::merge_surfedges(Bsp& mapA, Bsp& mapB) {
-	thisSurfEdgeCount = mapA.surfedgeCount;
+void BspMerger::merge_surfedges(Bsp& mapA, Bsp& mapB, Bsp& output) {
 	int totalSurfCount = thisSurfEdgeCount + mapB.surfedgeCount;
 
-	g_progress.update("Merging surfedges", mapB.edgeCount + 1);
+	g_progress.update("Merging surfedges", mapB.surfedgeCount + 1);
 	g_progress.tick();
 
-	int32_t* newSurfs = new int32_t[totalSurfCount];
+	int32_t* newSurfs = (int32_t*)output.lumps[LUMP_SURFEDGES];
 	memcpy(newSurfs, mapA.surfedges, thisSurfEdgeCount * sizeof(int32_t));
 	memcpy(newSurfs + thisSurfEdgeCount, mapB.surfedges, mapB.surfedgeCount * sizeof(int32_t));
 
@@ -1411,41 +1588,36 @@ void BspMerger::merge_surfedges(Bsp& mapA, Bsp& mapB) {
 		surfEdge = surfEdge < 0 ? surfEdge - thisEdgeCount : surfEdge + thisEdgeCount;
 		g_progress.tick();
 	}
-
-	mapA.replace_lump(LUMP_SURFEDGES, newSurfs, totalSurfCount * sizeof(int32_t));
 }
 
-void BspMerger::merge_nodes(Bsp& mapA, Bsp& mapB) {
-	thisNodeCount = mapA.nodeCount;
+void BspMerger::merge_nodes(Bsp& mapA, Bsp& mapB, Bsp& output) {
+	g_progress.update("Merging nodes", mapA.nodeCount + mapB.nodeCount);
 
-	g_progress.update("Merging nodes", thisNodeCount + mapB.nodeCount);
+	// the new headnode was already written to index 0 by create_merge_headnodes
+	BSPNODE* newNodes = (BSPNODE*)output.lumps[LUMP_NODES];
 
-	vector<BSPNODE> mergedNodes;
-	mergedNodes.reserve(thisNodeCount + mapB.nodeCount);
+	for (int i = 0; i < mapA.nodeCount; i++) {
+		BSPNODE& node = newNodes[i + 1];
+		node = mapA.nodes[i];
 
-	for (int i = 0; i < thisNodeCount; i++) {
-		BSPNODE node = mapA.nodes[i];
-
-		if (i > 0) { // new headnode should already be correct
-			for (int k = 0; k < 2; k++) {
-				if (node.iChildren[k] >= 0) {
-					node.iChildren[k] += 1; // shifted from new head node
-				}
-				else {
-					node.iChildren[k] = ~((int16_t)modelLeafRemap[~node.iChildren[k]]);
-				}
+		for (int k = 0; k < 2; k++) {
+			if (node.iChildren[k] >= 0) {
+				node.iChildren[k] += 1; // shifted from new head node
+			}
+			else {
+				node.iChildren[k] = ~((int16_t)modelLeafRemap[~node.iChildren[k]]);
 			}
 		}
 		if (node.nFaces && node.firstFace >= thisWorldFaceCount) {
 			node.firstFace += otherFaceCount;
 		}
 
-		mergedNodes.push_back(node);
 		g_progress.tick();
 	}
 
 	for (int i = 0; i < mapB.nodeCount; i++) {
-		BSPNODE node = mapB.nodes[i];
+		BSPNODE& node = newNodes[thisNodeCount + i];
+		node = mapB.nodes[i];
 
 		for (int k = 0; k < 2; k++) {
 			if (node.iChildren[k] >= 0) {
@@ -1460,41 +1632,33 @@ void BspMerger::merge_nodes(Bsp& mapA, Bsp& mapB) {
 			node.firstFace += thisWorldFaceCount;
 		}
 
-		mergedNodes.push_back(node);
 		g_progress.tick();
 	}
-
-	int newLen = mergedNodes.size() * sizeof(BSPNODE);
-
-	byte* newNodeData = new byte[newLen];
-	memcpy(newNodeData, &mergedNodes[0], newLen);
-
-	mapA.replace_lump(LUMP_NODES, newNodeData, newLen);
 }
 
-void BspMerger::merge_clipnodes(Bsp& mapA, Bsp& mapB) {
-	thisClipnodeCount = mapA.clipnodeCount;
+void BspMerger::merge_clipnodes(Bsp& mapA, Bsp& mapB, Bsp& output) {
+	const int NEW_NODE_COUNT = MAX_MAP_HULLS - 1;
 
-	g_progress.update("Merging clipnodes", thisClipnodeCount + mapB.clipnodeCount);
+	g_progress.update("Merging clipnodes", mapA.clipnodeCount + mapB.clipnodeCount);
 
-	vector<BSPCLIPNODE> mergedNodes;
-	mergedNodes.reserve(thisClipnodeCount + mapB.clipnodeCount);
+	// the new headnodes were already written to the start of the lump by create_merge_headnodes
+	BSPCLIPNODE* newNodes = (BSPCLIPNODE*)output.lumps[LUMP_CLIPNODES];
 
-	for (int i = 0; i < thisClipnodeCount; i++) {
-		BSPCLIPNODE node = mapA.clipnodes[i];
-		if (i > 2) { // new headnodes should already be correct
-			for (int k = 0; k < 2; k++) {
-				if (node.iChildren[k] >= 0) {
-					node.iChildren[k] += MAX_MAP_HULLS - 1; // offset from new headnodes being added
-				}
+	for (int i = 0; i < mapA.clipnodeCount; i++) {
+		BSPCLIPNODE& node = newNodes[NEW_NODE_COUNT + i];
+		node = mapA.clipnodes[i];
+
+		for (int k = 0; k < 2; k++) {
+			if (node.iChildren[k] >= 0) {
+				node.iChildren[k] += NEW_NODE_COUNT; // offset from new headnodes being added
 			}
 		}
-		mergedNodes.push_back(node);
 		g_progress.tick();
 	}
 
 	for (int i = 0; i < mapB.clipnodeCount; i++) {
-		BSPCLIPNODE node = mapB.clipnodes[i];
+		BSPCLIPNODE& node = newNodes[thisClipnodeCount + i];
+		node = mapB.clipnodes[i];
 		node.iPlane = planeRemap[node.iPlane];
 
 		for (int k = 0; k < 2; k++) {
@@ -1502,30 +1666,23 @@ void BspMerger::merge_clipnodes(Bsp& mapA, Bsp& mapB) {
 				node.iChildren[k] += thisClipnodeCount;
 			}
 		}
-		mergedNodes.push_back(node);
 		g_progress.tick();
 	}
-
-	int newLen = mergedNodes.size() * sizeof(BSPCLIPNODE);
-
-	byte* newClipnodeData = new byte[newLen];
-	memcpy(newClipnodeData, &mergedNodes[0], newLen);
-
-	mapA.replace_lump(LUMP_CLIPNODES, newClipnodeData, newLen);
 }
 
-void BspMerger::merge_models(Bsp& mapA, Bsp& mapB) {
+void BspMerger::merge_models(Bsp& mapA, Bsp& mapB, Bsp& output) {
 	g_progress.update("Merging models", mapA.modelCount + mapB.modelCount);
 
-	vector<BSPMODEL> mergedModels;
-	mergedModels.reserve(mapA.modelCount + mapB.modelCount);
+	BSPMODEL* newModels = (BSPMODEL*)output.lumps[LUMP_MODELS];
+	int newModelCount = 0;
 
 	// merged world model
-	mergedModels.push_back(mapA.models[0]);
+	newModels[newModelCount++] = mapA.models[0];
 
 	// other map's submodels
 	for (int i = 1; i < mapB.modelCount; i++) {
-		BSPMODEL model = mapB.models[i];
+		BSPMODEL& model = newModels[newModelCount++];
+		model = mapB.models[i];
 		if (model.iHeadnodes[0] >= 0)
 			model.iHeadnodes[0] += thisNodeCount; // already includes new head nodes (merge_nodes comes after create_merge_headnodes)
 		for (int k = 1; k < MAX_MAP_HULLS; k++) {
@@ -1533,13 +1690,13 @@ void BspMerger::merge_models(Bsp& mapA, Bsp& mapB) {
 				model.iHeadnodes[k] += thisClipnodeCount;
 		}
 		model.iFirstFace = model.iFirstFace + thisWorldFaceCount;
-		mergedModels.push_back(model);
 		g_progress.tick();
 	}
 
 	// this map's submodels
 	for (int i = 1; i < mapA.modelCount; i++) {
-		BSPMODEL model = mapA.models[i];
+		BSPMODEL& model = newModels[newModelCount++];
+		model = mapA.models[i];
 		if (model.iHeadnodes[0] >= 0)
 			model.iHeadnodes[0] += 1; // adjust for new head node
 		for (int k = 1; k < MAX_MAP_HULLS; k++) {
@@ -1549,35 +1706,27 @@ void BspMerger::merge_models(Bsp& mapA, Bsp& mapB) {
 		if (model.iFirstFace >= thisWorldFaceCount) {
 			model.iFirstFace += otherFaceCount;
 		}
-		mergedModels.push_back(model);
 		g_progress.tick();
 	}
 
 	// update world head nodes
-	mergedModels[0].iHeadnodes[0] = 0;
-	mergedModels[0].iHeadnodes[1] = 0;
-	mergedModels[0].iHeadnodes[2] = 1;
-	mergedModels[0].iHeadnodes[3] = 2;
-	mergedModels[0].nVisLeafs = mapA.models[0].nVisLeafs + mapB.models[0].nVisLeafs;
-	mergedModels[0].nFaces = mapA.models[0].nFaces + mapB.models[0].nFaces;
+	newModels[0].iHeadnodes[0] = 0;
+	newModels[0].iHeadnodes[1] = 0;
+	newModels[0].iHeadnodes[2] = 1;
+	newModels[0].iHeadnodes[3] = 2;
+	newModels[0].nVisLeafs = mapA.models[0].nVisLeafs + mapB.models[0].nVisLeafs;
+	newModels[0].nFaces = mapA.models[0].nFaces + mapB.models[0].nFaces;
 
 	vec3 amin = mapA.models[0].nMins;
 	vec3 bmin = mapB.models[0].nMins;
 	vec3 amax = mapA.models[0].nMaxs;
 	vec3 bmax = mapB.models[0].nMaxs;
-	mergedModels[0].nMins = { min(amin.x, bmin.x), min(amin.y, bmin.y), min(amin.z, bmin.z) };
-	mergedModels[0].nMaxs = { max(amax.x, bmax.x), max(amax.y, bmax.y), max(amax.z, bmax.z) };
-
-	int newLen = mergedModels.size() * sizeof(BSPMODEL);
-
-	byte* newModelData = new byte[newLen];
-	memcpy(newModelData, &mergedModels[0], newLen);
-
-	mapA.replace_lump(LUMP_MODELS, newModelData, newLen);
+	newModels[0].nMins = { min(amin.x, bmin.x), min(amin.y, bmin.y), min(amin.z, bmin.z) };
+	newModels[0].nMaxs = { max(amax.x, bmax.x), max(amax.y, bmax.y), max(amax.z, bmax.z) };
 }
 
-void BspMerger::merge_vis(Bsp& mapA, Bsp& mapB) {
-	BSPLEAF* allLeaves = mapA.leaves; // combined with mapB's leaves earlier in merge_leaves
+void BspMerger::merge_vis(Bsp& mapA, Bsp& mapB, Bsp& output) {
+	BSPLEAF* allLeaves = (BSPLEAF*)output.lumps[LUMP_LEAVES]; // combined with mapB's leaves earlier in merge_leaves
 
 	int thisVisLeaves = thisLeafCount - 1; // VIS ignores the shared solid leaf 0
 	int otherVisLeaves = otherLeafCount; // already does not include the solid leaf (see merge_leaves)
@@ -1605,90 +1754,79 @@ void BspMerger::merge_vis(Bsp& mapA, Bsp& mapB) {
 		otherWorldLeafCount, otherLeafCount, totalVisLeaves);
 
 	// shift mapB's world leaves after mapA's world leaves
-	for (int i = 0; i < otherWorldLeafCount; i++) {
-		shiftVis(decompressedOtherVis + i * newVisRowSize, newVisRowSize, 0, thisWorldLeafCount);
-		g_progress.tick();
+	std::atomic<int> visOverflow(0);
+	parallelFor(otherWorldLeafCount, VIS_ROWS_PER_JOB, [&](int start, int end) {
+		int overflow = 0;
+		for (int i = start; i < end; i++) {
+			overflow += shiftVis(decompressedOtherVis + i * newVisRowSize, newVisRowSize, 0, thisWorldLeafCount);
+		}
+		visOverflow += overflow;
+		g_progress.tick(end - start);
+	});
+
+	if (visOverflow) {
+		logf("OVERFLOWED %d VIS LEAVES WHILE SHIFTING\n", (int)visOverflow);
 	}
 
 	// recompress the combined vis data
 	byte* compressedVis = new byte[decompressedVisSize];
 	memset(compressedVis, 0, decompressedVisSize);
 	int newVisLen = CompressAll(allLeaves, decompressedVis, compressedVis, totalVisLeaves, mergedWorldLeafCount, decompressedVisSize);
-	int oldLen = mapA.header.lump[LUMP_VISIBILITY].nLength;
-
-	byte* compressedVisResize = new byte[newVisLen];
-	memcpy(compressedVisResize, compressedVis, newVisLen);
 
-	mapA.replace_lump(LUMP_VISIBILITY, compressedVisResize, newVisLen);
+	// the compressed size isn't known until now, so this is the only lump that needs a temporary buffer
+	output.lumps[LUMP_VISIBILITY] = new byte[newVisLen];
+	output.header.lump[LUMP_VISIBILITY].nLength = newVisLen;
+	memcpy(output.lumps[LUMP_VISIBILITY], compressedVis, newVisLen);
 
 	delete[] decompressedVis;
 	delete[] compressedVis;
 }
 
-void BspMerger::merge_lighting(Bsp& mapA, Bsp& mapB) {
-	COLOR3* thisRad = (COLOR3*)mapA.lightdata;
-	COLOR3* otherRad = (COLOR3*)mapB.lightdata;
-	bool freemem = false;
-
-	int thisColorCount = mapA.header.lump[LUMP_LIGHTING].nLength / sizeof(COLOR3);
-	int otherColorCount = mapB.header.lump[LUMP_LIGHTING].nLength / sizeof(COLOR3);
-	int totalColorCount = thisColorCount + otherColorCount;
-	int totalFaceCount = mapA.header.lump[LUMP_FACES].nLength / sizeof(BSPFACE);
+void BspMerger::merge_lighting(Bsp& mapA, Bsp& mapB, Bsp& output) {
+	int thisLightLen = mapA.header.lump[LUMP_LIGHTING].nLength;
+	int otherLightLen = mapB.header.lump[LUMP_LIGHTING].nLength;
+	int totalFaceCount = thisFaceCount + otherFaceCount;
 
-	g_progress.update("Merging lightmaps", 4 + totalFaceCount);
+	g_progress.update("Merging lightmaps", 2 + totalFaceCount);
 
-	// create a single full-bright lightmap to use for all faces, if one map has lighting but the other doesn't
-	if (thisColorCount == 0 && otherColorCount != 0) {
-		thisColorCount = MAX_SURFACE_EXTENT * MAX_SURFACE_EXTENT;
-		totalColorCount += thisColorCount;
-		int sz = thisColorCount * sizeof(COLOR3);
-		mapA.lumps[LUMP_LIGHTING] = new byte[sz];
-		mapA.header.lump[LUMP_LIGHTING].nLength = sz;
-		thisRad = (COLOR3*)mapA.lumps[LUMP_LIGHTING];
+	COLOR3* newRad = (COLOR3*)output.lumps[LUMP_LIGHTING];
+	BSPFACE* newFaces = (BSPFACE*)output.lumps[LUMP_FACES];
 
-		memset(thisRad, 255, sz);
+	// use a full-bright lightmap for the faces of a map without lighting (see plan_merge)
+	if (thisLightLen == 0 && otherLightLen != 0) {
+		memset(newRad, 255, thisColorCount * sizeof(COLOR3));
 
 		for (int i = 0; i < thisWorldFaceCount; i++) {
-			mapA.faces[i].nLightmapOffset = 0;
+			newFaces[i].nLightmapOffset = 0;
 		}
 		for (int i = thisWorldFaceCount + otherFaceCount; i < totalFaceCount; i++) {
-			mapA.faces[i].nLightmapOffset = 0;
+			newFaces[i].nLightmapOffset = 0;
 		}
 	}
-	else if (thisColorCount != 0 && otherColorCount == 0) {
-		otherColorCount = MAX_SURFACE_EXTENT * MAX_SURFACE_EXTENT;
-		totalColorCount += otherColorCount;
-		otherRad = new COLOR3[otherColorCount];
-		freemem = true;
-		memset(otherRad, 255, otherColorCount * sizeof(COLOR3));
+	else {
+		memcpy(newRad, mapA.lightdata, thisColorCount * sizeof(COLOR3));
+	}
+	g_progress.tick();
+
+	if (thisLightLen != 0 && otherLightLen == 0) {
+		memset(newRad + thisColorCount, 255, otherColorCount * sizeof(COLOR3));
 
 		for (int i = thisWorldFaceCount; i < thisWorldFaceCount + otherFaceCount; i++) {
-			mapA.faces[i].nLightmapOffset = 0;
+			newFaces[i].nLightmapOffset = 0;
 		}
 	}
-
-	g_progress.tick();
-	COLOR3* newRad = new COLOR3[totalColorCount];
-	
-	g_progress.tick();
-	memcpy(newRad, thisRad, thisColorCount * sizeof(COLOR3));
-	
-	g_progress.tick();
-	memcpy((byte*)newRad + thisColorCount * sizeof(COLOR3), otherRad, otherColorCount * sizeof(COLOR3));
-	if (freemem)
-	{
-		delete[] otherRad;
+	else {
+		memcpy(newRad + thisColorCount, mapB.lightdata, otherColorCount * sizeof(COLOR3));
 	}
 	g_progress.tick();
-	mapA.replace_lump(LUMP_LIGHTING, newRad, totalColorCount * sizeof(COLOR3));
 
 	for (int i = thisWorldFaceCount; i < thisWorldFaceCount + otherFaceCount; i++) {
-		mapA.faces[i].nLightmapOffset += thisColorCount * sizeof(COLOR3);
+		newFaces[i].nLightmapOffset += thisColorCount * sizeof(COLOR3);
 		g_progress.tick();
 	}
 }
 
-void BspMerger::create_merge_headnodes(Bsp& mapA, Bsp& mapB, BSPPLANE separationPlane) {
+void BspMerger::create_merge_headnodes(Bsp& mapA, Bsp& mapB, Bsp& output, BSPPLANE separationPlane) {
 	BSPMODEL& thisWorld = mapA.models[0];
 	BSPMODEL& otherWorld = mapB.models[0];
 
@@ -1704,15 +1842,9 @@ void BspMerger::create_merge_headnodes(Bsp& mapA, Bsp& mapB, BSPPLANE separation
 
 	//logf("Separating plane: (%.0f, %.0f, %.0f) %.0f\n", separationPlane.vNormal.x, separationPlane.vNormal.y, separationPlane.vNormal.z, separationPlane.fDist);
 
-	// write separating plane
-
-	BSPPLANE* newThisPlanes = new BSPPLANE[mapA.planeCount + 1];
-	memcpy(newThisPlanes, mapA.planes, mapA.planeCount * sizeof(BSPPLANE));
-	newThisPlanes[mapA.planeCount] = separationPlane;
-
-	mapA.replace_lump(LUMP_PLANES, newThisPlanes, (mapA.planeCount + 1) * sizeof(BSPPLANE));
-
-	int separationPlaneIdx = mapA.planeCount-1;
+	// write separating plane (space for it was reserved after the merged planes)
+	int separationPlaneIdx = mergedPlaneCount;
+	((BSPPLANE*)output.lumps[LUMP_PLANES])[separationPlaneIdx] = separationPlane;
 
 
 	// write new head node (visible BSP)
@@ -1732,11 +1864,7 @@ void BspMerger::create_merge_headnodes(Bsp& mapA, Bsp& mapB, BSPPLANE separation
 			headNode.iChildren[1] = temp;
 		}
 
-		BSPNODE* newThisNodes = new BSPNODE[mapA.nodeCount + 1];
-		memcpy(newThisNodes + 1, mapA.nodes, mapA.nodeCount * sizeof(BSPNODE));
-		newThisNodes[0] = headNode;
-
-		mapA.replace_lump(LUMP_NODES, newThisNodes, (mapA.nodeCount + 1) * sizeof(BSPNODE));
+		((BSPNODE*)output.lumps[LUMP_NODES])[0] = headNode;
 	}
 
 
@@ -1744,7 +1872,7 @@ void BspMerger::create_merge_headnodes(Bsp& mapA, Bsp& mapB, BSPPLANE separation
 	{
 		const int NEW_NODE_COUNT = MAX_MAP_HULLS - 1;
 
-		BSPCLIPNODE newHeadNodes[NEW_NODE_COUNT];
+		BSPCLIPNODE* newHeadNodes = (BSPCLIPNODE*)output.lumps[LUMP_CLIPNODES];
 		for (int i = 0; i < NEW_NODE_COUNT; i++) {
 			//logf("HULL %d starts at %d\n", i+1, thisWorld.iHeadnodes[i+1]);
 			newHeadNodes[i] = {
@@ -1769,11 +1897,5 @@ void BspMerger::create_merge_headnodes(Bsp& mapA, Bsp& mapB, BSPPLANE separation
 				newHeadNodes[i].iChildren[1] = temp;
 			}
 		}
-
-		BSPCLIPNODE* newThisNodes = new BSPCLIPNODE[mapA.clipnodeCount + NEW_NODE_COUNT];
-		memcpy(newThisNodes, newHeadNodes, NEW_NODE_COUNT * sizeof(BSPCLIPNODE));
-		memcpy(newThisNodes + NEW_NODE_COUNT, mapA.clipnodes, mapA.clipnodeCount * sizeof(BSPCLIPNODE));
-
-		mapA.replace_lump(LUMP_CLIPNODES, newThisNodes, (mapA.clipnodeCount + NEW_NODE_COUNT) * sizeof(BSPCLIPNODE));
 	}
 }
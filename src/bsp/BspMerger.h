@@ -6,6 +6,7 @@ struct MAPBLOCK
 {
 	vec3 mins, maxs, size, offset;
 	Bsp* map;
+	Bsp* merged = NULL; // result of merging other blocks into this one (owned by the merger)
 	string merge_name;
 
 	bool intersects(MAPBLOCK& other) {
@@ -17,9 +18,16 @@ struct MAPBLOCK
 
 class BspMerger {
 public:
+	// also merge planes that are nearly identical, not just exact copies
+	bool snapPlanes = false;
+
+	// the input maps were welded before merging (-weld), so welding can't free up more vertexes
+	bool weldedInputs = false;
+
 	BspMerger();
 
-	// merges all maps into one
+	// merges all maps into a new map. The input maps are moved but otherwise left as-is.
+	// Returns NULL if any of the maps couldn't be merged.
 	// noripent - don't change any entity logic
 	// noscript - don't add support for the bspguy map script (worse performance + buggy, but simpler)
 	Bsp* merge(vector<Bsp*> maps, vec3 gap, string output_name, bool noripent, bool noscript);
@@ -27,11 +35,21 @@ public:
 private:
 	int merge_ops = 0;
 
+	// deduplication stats for the whole merge
+	int duplicatePlaneCount = 0;
+	int snappedPlaneCount = 0;
+
 	// wrapper around BSP data merging for nicer console output
-	void merge(MAPBLOCK& dst, MAPBLOCK& src, string resultName);
+	// returns false if the blocks couldn't be merged. Both blocks keep their maps in that case.
+	bool merge(MAPBLOCK& dst, MAPBLOCK& src, string resultName);
+
+	// merges each group of neighboring blocks into its first block, as a balanced tree of pairs.
+	// Pairs on the same level of the tree are merged in parallel.
+	// Returns false if any pair failed to merge.
+	bool merge_groups(vector<vector<MAPBLOCK*>> groups, vector<string> groupNames, int& mergeCount, int totalMaps);
 
-	// merge BSP data
-	bool merge(Bsp& mapA, Bsp& mapB);
+	// merge BSP data into a new map without modifying either input. Returns NULL if the maps overlap.
+	Bsp* merge(Bsp& mapA, Bsp& mapB);
 
 	vector<vector<vector<MAPBLOCK>>> separate(vector<Bsp*>& maps, vec3 gap);
 
@@ -47,23 +65,30 @@ private:
 
 	BSPPLANE separate(Bsp& mapA, Bsp& mapB);
 
-	void merge_ents(Bsp& mapA, Bsp& mapB);
-	void merge_planes(Bsp& mapA, Bsp& mapB);
-	void merge_textures(Bsp& mapA, Bsp& mapB);
-	void merge_vertices(Bsp& mapA, Bsp& mapB);
-	void merge_texinfo(Bsp& mapA, Bsp& mapB);
-	void merge_faces(Bsp& mapA, Bsp& mapB);
-	void merge_leaves(Bsp& mapA, Bsp& mapB);
-	void merge_marksurfs(Bsp& mapA, Bsp& mapB);
-	void merge_edges(Bsp& mapA, Bsp& mapB);
-	void merge_surfedges(Bsp& mapA, Bsp& mapB);
-	void merge_nodes(Bsp& mapA, Bsp& mapB);
-	void merge_clipnodes(Bsp& mapA, Bsp& mapB);
-	void merge_models(Bsp& mapA, Bsp& mapB);
-	void merge_vis(Bsp& mapA, Bsp& mapB);
-	void merge_lighting(Bsp& mapA, Bsp& mapB);
-
-	void create_merge_headnodes(Bsp& mapA, Bsp& mapB, BSPPLANE separationPlane);
+	// first pass: remap mapB's structures onto mapA's and calculate the size of each output lump
+	void plan_merge(Bsp& mapA, Bsp& mapB, bool* shouldMerge);
+	void plan_planes(Bsp& mapA, Bsp& mapB);
+	void plan_textures(Bsp& mapA, Bsp& mapB);
+	void plan_texinfo(Bsp& mapA, Bsp& mapB);
+
+	// second pass: fill the output lumps, which are already allocated at their final size
+	void merge_ents(Bsp& mapA, Bsp& mapB, Bsp& output);
+	void merge_planes(Bsp& mapA, Bsp& mapB, Bsp& output);
+	void merge_textures(Bsp& mapA, Bsp& mapB, Bsp& output);
+	void merge_vertices(Bsp& mapA, Bsp& mapB, Bsp& output);
+	void merge_texinfo(Bsp& mapA, Bsp& mapB, Bsp& output);
+	void merge_faces(Bsp& mapA, Bsp& mapB, Bsp& output);
+	void merge_leaves(Bsp& mapA, Bsp& mapB, Bsp& output);
+	void merge_marksurfs(Bsp& mapA, Bsp& mapB, Bsp& output);
+	void merge_edges(Bsp& mapA, Bsp& mapB, Bsp& output);
+	void merge_surfedges(Bsp& mapA, Bsp& mapB, Bsp& output);
+	void merge_nodes(Bsp& mapA, Bsp& mapB, Bsp& output);
+	void merge_clipnodes(Bsp& mapA, Bsp& mapB, Bsp& output);
+	void merge_models(Bsp& mapA, Bsp& mapB, Bsp& output);
+	void merge_vis(Bsp& mapA, Bsp& mapB, Bsp& output);
+	void merge_lighting(Bsp& mapA, Bsp& mapB, Bsp& output);
+
+	void create_merge_headnodes(Bsp& mapA, Bsp& mapB, Bsp& output, BSPPLANE separationPlane);
 
 
 	// remapped structure indexes for mapB when merging
@@ -76,7 +101,7 @@ private:
 	vector<int> modelLeafRemap;
 
 	int thisLeafCount;
-	int otherLeafCount;
+	int otherLeafCount; // excludes solid leaf 0
 	int thisFaceCount;
 	int thisWorldFaceCount;
 	int otherFaceCount;
@@ -88,4 +113,13 @@ private:
 	int thisMarkSurfCount;
 	int thisEdgeCount;
 	int thisVertCount;
+	int thisColorCount; // includes the full-bright lightmap added when only mapB has lighting
+	int otherColorCount;
+
+	// output lump sizes calculated by plan_merge
+	int mergedLumpSizes[HEADER_LUMPS];
+	int mergedPlaneCount;
+	int mergedTexCount;
+	int mergedTexinfoCount;
+	vector<int32_t> mergedTexOffsets; // relative to the start of the miptex data, not the lump
 };
\ No newline at end of file
@@ -0,0 +1,40 @@
+#include "ContentIndex.h"
+#include "util.h"
+#include <string.h>
+
+int ContentIndex::find_or_add(const void* data, int len, int idx) {
+	uint64 hash = hashData(data, len);
+
+	int existing = find(data, len, hash);
+	if (existing != -1) {
+		return existing;
+	}
+
+	Entry entry;
+	entry.data = data;
+	entry.len = len;
+	entry.idx = idx;
+	entries.insert(make_pair(hash, entry));
+
+	return -1;
+}
+
+int ContentIndex::find(const void* data, int len) {
+	return find(data, len, hashData(data, len));
+}
+
+void ContentIndex::reserve(int count) {
+	entries.reserve(count);
+}
+
+int ContentIndex::find(const void* data, int len, uint64 hash) {
+	auto range = entries.equal_range(hash);
+
+	for (auto it = range.first; it != range.second; ++it) {
+		if (it->second.len == len && memcmp(it->second.data, data, len) == 0) {
+			return it->second.idx;
+		}
+	}
+
+	return -1;
+}
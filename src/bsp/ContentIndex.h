@@ -0,0 +1,28 @@
+#pragma once
+#include "bsptypes.h"
+#include <unordered_map>
+
+// Finds byte-identical data (textures, texinfos, etc.) in constant time, by a hash of the content.
+// Only pointers are stored, so the indexed data must outlive the index.
+class ContentIndex {
+public:
+	// returns the index of data identical to the given data. If there is none, the data is added
+	// with the given index and -1 is returned. The first index given for some data is the one that's kept.
+	int find_or_add(const void* data, int len, int idx);
+
+	// returns the index of identical data, or -1 if there is none
+	int find(const void* data, int len);
+
+	void reserve(int count);
+
+private:
+	struct Entry {
+		const void* data;
+		int len;
+		int idx;
+	};
+
+	unordered_multimap<uint64, Entry> entries; // content hash -> data
+
+	int find(const void* data, int len, uint64 hash);
+};
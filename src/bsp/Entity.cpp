@@ -2,9 +2,14 @@
 #include <string>
 #include "util.h"
 #include <algorithm>
+#include <unordered_map>
+#include <unordered_set>
+#include <mutex>
 
 using namespace std;
 
+atomic<uint32_t> Entity::keyvalueVersion(0);
+
 Entity::Entity(void)
 {
 }
@@ -18,101 +23,219 @@ Entity::~Entity(void)
 {
 }
 
+Entity& Entity::operator=(const Entity& other)
+{
+	keys = other.keys;
+	values = other.values;
+	slots = other.slots;
+	invalidateCache();
+	return *this;
+}
+
+void Entity::invalidateCache() {
+	cachedModelIdx = -2;
+	targetsCached = false;
+	revision = ++keyvalueVersion;
+}
+
+// key names are never freed, but there are only as many as there are unique keys in all loaded maps
+static mutex g_entity_key_mutex;
+static unordered_map<string, EntityKey*> g_entity_keys;
+static const string g_empty_value;
+
+static uint32_t hashKeyName(const string& name) {
+	return (uint32_t)hashData(name.c_str(), name.size());
+}
+
+static const EntityKey* internKey(const string& name) {
+	lock_guard<mutex> lock(g_entity_key_mutex);
+
+	auto it = g_entity_keys.find(name);
+	if (it != g_entity_keys.end()) {
+		return it->second;
+	}
+
+	EntityKey* key = new EntityKey();
+	key->name = name;
+	key->hash = hashKeyName(name);
+	g_entity_keys[name] = key;
+	return key;
+}
+
+int Entity::findKey(const string& key) const {
+	if (slots.empty()) {
+		return -1;
+	}
+
+	uint32_t hash = hashKeyName(key);
+	int mask = slots.size() - 1;
+
+	for (int i = hash & mask; slots[i]; i = (i + 1) & mask) {
+		const EntityKey* k = keys[slots[i] - 1];
+		if (k->hash == hash && k->name == key) {
+			return slots[i] - 1;
+		}
+	}
+
+	return -1;
+}
+
+void Entity::appendKeyvalue(const EntityKey* key, const string& value) {
+	keys.push_back(key);
+	values.push_back(value);
+
+	if (keys.size() * 2 > slots.size()) {
+		rebuildSlots();
+		return;
+	}
+
+	int mask = slots.size() - 1;
+	int i = key->hash & mask;
+	while (slots[i]) {
+		i = (i + 1) & mask;
+	}
+	slots[i] = keys.size();
+}
+
+void Entity::rebuildSlots() {
+	if (keys.empty()) {
+		slots.clear();
+		return;
+	}
+
+	int size = 8;
+	while (size < keys.size() * 2) {
+		size *= 2;
+	}
+
+	slots.assign(size, 0);
+	int mask = size - 1;
+
+	for (int k = 0; k < keys.size(); k++) {
+		int i = keys[k]->hash & mask;
+		while (slots[i]) {
+			i = (i + 1) & mask;
+		}
+		slots[i] = k + 1;
+	}
+}
+
 void Entity::addKeyvalue( Keyvalue& k )
 {
-	int dup = 1;
-	if (keyvalues.find(k.key) == keyvalues.end()) {
-		keyvalues[k.key] = k.value;
-		keyOrder.push_back(k.key);
+	if (findKey(k.key) == -1) {
+		appendKeyvalue(internKey(k.key), k.value);
 	}
 	else
 	{
-		while (true)
+		for (int dup = 1; ; dup++)
 		{
 			string newKey = k.key + '#' + to_string((long long)dup);
-			if (keyvalues.find(newKey) == keyvalues.end())
+			if (findKey(newKey) == -1)
 			{
 				//println("wrote dup key " + newKey);
-				keyvalues[newKey] = k.value;
-				keyOrder.push_back(newKey);
+				appendKeyvalue(internKey(newKey), k.value);
 				break;
 			}
-			dup++;
 		}
 	}
 
-	cachedModelIdx = -2;
-	targetsCached = false;
+	invalidateCache();
 }
 
 void Entity::addKeyvalue(const std::string& key, const std::string& value)
 {
-	keyvalues[key] = value;
+	int idx = findKey(key);
+	if (idx != -1) {
+		values[idx] = value;
+	}
+	else {
+		appendKeyvalue(internKey(key), value);
+	}
 
-	keyOrder.push_back(key);
-	cachedModelIdx = -2;
-	targetsCached = false;
+	invalidateCache();
 }
 
 void Entity::setOrAddKeyvalue(const std::string& key, const std::string& value) {
-	cachedModelIdx = -2;
-	targetsCached = false;
-
-	if (hasKey(key)) {
-		keyvalues[key] = value;
-		return;
-	}
 	addKeyvalue(key, value);
 }
 
 void Entity::removeKeyvalue(const std::string& key) {
-	if (!hasKey(key))
+	int idx = findKey(key);
+	if (idx == -1)
 		return;
-	keyOrder.erase(find(keyOrder.begin(), keyOrder.end(), key));
-	keyvalues.erase(key);
-	cachedModelIdx = -2;
-	targetsCached = false;
+	keys.erase(keys.begin() + idx);
+	values.erase(values.begin() + idx);
+	rebuildSlots();
+	invalidateCache();
 }
 
 bool Entity::renameKey(int idx, string newName) {
-	if (idx < 0 || idx >= keyOrder.size() || newName.empty()) {
+	if (idx < 0 || idx >= keys.size() || newName.empty()) {
 		return false;
 	}
-	for (int i = 0; i < keyOrder.size(); i++) {
-		if (keyOrder[i] == newName) {
-			return false;
-		}
+	if (findKey(newName) != -1) {
+		return false;
 	}
 
-	keyvalues[newName] = keyvalues[keyOrder[idx]];
-	keyvalues.erase(keyOrder[idx]);
-	keyOrder[idx] = newName;
-	cachedModelIdx = -2;
-	targetsCached = false;
+	keys[idx] = internKey(newName);
+	rebuildSlots();
+	invalidateCache();
 	return true;
 }
 
+void Entity::swapKeys(int idxA, int idxB) {
+	if (idxA < 0 || idxB < 0 || idxA >= keys.size() || idxB >= keys.size()) {
+		return;
+	}
+
+	std::swap(keys[idxA], keys[idxB]);
+	values[idxA].swap(values[idxB]);
+	rebuildSlots();
+	invalidateCache(); // key order is written to the lump
+}
+
 void Entity::clearAllKeyvalues() {
-	keyOrder.clear();
-	keyvalues.clear();
-	cachedModelIdx = -2;
+	keys.clear();
+	values.clear();
+	slots.clear();
+	invalidateCache();
 }
 
 void Entity::clearEmptyKeyvalues() {
-	vector<string> newKeyOrder;
-	for (int i = 0; i < keyOrder.size(); i++) {
-		if (!keyvalues[keyOrder[i]].empty()) {
-			newKeyOrder.push_back(keyOrder[i]);
+	int newCount = 0;
+	for (int i = 0; i < keys.size(); i++) {
+		if (!values[i].empty()) {
+			keys[newCount] = keys[i];
+			values[newCount].swap(values[i]);
+			newCount++;
 		}
 	}
-	keyOrder = newKeyOrder;
-	cachedModelIdx = -2;
-	targetsCached = false;
+	keys.resize(newCount);
+	values.resize(newCount);
+	rebuildSlots();
+	invalidateCache();
 }
 
-bool Entity::hasKey(const std::string& key)
+const string& Entity::getKeyvalue(const std::string& key) const {
+	int idx = findKey(key);
+	return idx != -1 ? values[idx] : g_empty_value;
+}
+
+int Entity::getKeyCount() const {
+	return keys.size();
+}
+
+const string& Entity::getKey(int idx) const {
+	return keys[idx]->name;
+}
+
+const string& Entity::getValue(int idx) const {
+	return values[idx];
+}
+
+bool Entity::hasKey(const std::string& key) const
 {
-	return keyvalues.find(key) != keyvalues.end() && find(keyOrder.begin(), keyOrder.end(), key) != keyOrder.end();
+	return findKey(key) != -1;
 }
 
 int Entity::getBspModelIdx() {
@@ -120,12 +243,7 @@ int Entity::getBspModelIdx() {
 		return cachedModelIdx;
 	}
 
-	if (!hasKey("model")) {
-		cachedModelIdx = -1;
-		return -1;
-	}
-
-	string model = keyvalues["model"];
+	const string& model = getKeyvalue("model");
 	if (model.size() <= 1 || model[0] != '*') {
 		cachedModelIdx = -1;
 		return -1;
@@ -145,7 +263,7 @@ bool Entity::isBspModel() {
 }
 
 vec3 Entity::getOrigin() {
-	return hasKey("origin") ? parseVector(keyvalues["origin"]) : vec3(0, 0, 0);
+	return hasKey("origin") ? parseVector(getKeyvalue("origin")) : vec3(0, 0, 0);
 }
 
 // TODO: maybe store this in a text file or something
@@ -359,16 +477,16 @@ vector<string> Entity::getTargets() {
 	vector<string> targets;
 
 	for (int i = 1; i < TOTAL_TARGETNAME_KEYS; i++) { // skip targetname
-		const char* key = potential_tergetname_keys[i];
-		if (hasKey(key)) {
-			targets.push_back(keyvalues[key]);
+		int idx = findKey(potential_tergetname_keys[i]);
+		if (idx != -1) {
+			targets.push_back(values[idx]);
 		}
 	}
 
-	if (keyvalues["classname"] == "multi_manager") {
+	if (getKeyvalue("classname") == "multi_manager") {
 		// multi_manager is a special case where the targets are in the key names
-		for (int i = 0; i < keyOrder.size(); i++) {
-			string tname = keyOrder[i];
+		for (int i = 0; i < keys.size(); i++) {
+			string tname = keys[i]->name;
 			size_t hashPos = tname.find("#");
 			string suffix;
 
@@ -403,32 +521,52 @@ bool Entity::hasTarget(string checkTarget) {
 
 void Entity::renameTargetnameValues(string oldTargetname, string newTargetname) {
 	for (int i = 0; i < TOTAL_TARGETNAME_KEYS; i++) {
-		const char* key = potential_tergetname_keys[i];
-		if (keyvalues.find(key) != keyvalues.end() && keyvalues[key] == oldTargetname) {
-			keyvalues[key] = newTargetname;
+		int idx = findKey(potential_tergetname_keys[i]);
+		if (idx != -1 && values[idx] == oldTargetname) {
+			values[idx] = newTargetname;
 		}
 	}
 
-	if (keyvalues["classname"] == "multi_manager") {
+	if (getKeyvalue("classname") == "multi_manager") {
 		// multi_manager is a special case where the targets are in the key names
-		for (int i = 0; i < keyOrder.size(); i++) {
-			string tname = keyOrder[i];
+		vector<string> suffixes(keys.size());
+		vector<bool> renamed(keys.size());
+
+		for (int i = 0; i < keys.size(); i++) {
+			const string& tname = keys[i]->name;
 			size_t hashPos = tname.find("#");
-			string suffix;
 
 			// duplicate targetnames have a #X suffix to differentiate them
 			if (hashPos != string::npos) {
-				tname = keyOrder[i].substr(0, hashPos);
-				suffix = keyOrder[i].substr(hashPos);
+				suffixes[i] = tname.substr(hashPos);
 			}
+			renamed[i] = tname.substr(0, hashPos) == oldTargetname;
+		}
 
-			if (tname == oldTargetname) {
-				string newKey = newTargetname + suffix;
-				keyvalues[newKey] = keyvalues[keyOrder[i]];
-				keyOrder[i] = newKey;
+		unordered_set<string> usedKeys;
+		for (int i = 0; i < keys.size(); i++) {
+			if (!renamed[i]) {
+				usedKeys.insert(keys[i]->name);
 			}
 		}
+
+		for (int i = 0; i < keys.size(); i++) {
+			if (!renamed[i]) {
+				continue;
+			}
+
+			// the manager may already target the new name, so both are kept with a new suffix
+			string newKey = newTargetname + suffixes[i];
+			for (int dup = 1; usedKeys.count(newKey); dup++) {
+				newKey = newTargetname + '#' + to_string((long long)dup);
+			}
+			usedKeys.insert(newKey);
+			keys[i] = internKey(newKey);
+		}
+		rebuildSlots();
 	}
+
+	invalidateCache();
 }
 
 int Entity::getMemoryUsage() {
@@ -437,12 +575,10 @@ int Entity::getMemoryUsage() {
 	for (int i = 0; i < cachedTargets.size(); i++) {
 		size += cachedTargets[i].size();
 	}
-	for (int i = 0; i < keyOrder.size(); i++) {
-		size += keyOrder[i].size();
-	}
-	for (const auto& entry : keyvalues) {
-		size += entry.first.size() + entry.second.size();
+	for (int i = 0; i < values.size(); i++) {
+		size += sizeof(EntityKey*) + sizeof(string) + values[i].size();
 	}
+	size += slots.size() * sizeof(int);
 
 	return size;
 }
\ No newline at end of file
@@ -1,32 +1,65 @@
 #pragma once
 #include "Keyvalue.h"
 #include <map>
+#include <atomic>
 
 typedef std::map< std::string, std::string > hashmap;
 
+// A key name shared by every entity that uses it, so that entities only store a pointer per key
+struct EntityKey
+{
+	std::string name;
+	uint32_t hash;
+};
+
 class Entity
 {
 public:
-	hashmap keyvalues;
-	vector<string> keyOrder;
-
 	int cachedModelIdx = -2; // -2 = not cached
 	vector<string> cachedTargets;
 	bool targetsCached = false;
 
+	// incremented whenever any entity's keyvalues change, so that lookups built from keyvalues
+	// can skip checking for changed entities when nothing changed (see Bsp::update_ent_index)
+	static atomic<uint32_t> keyvalueVersion;
+
+	// the keyvalueVersion after this entity's last keyvalue change (0 = never had keyvalues).
+	// Unique across all entities, so it also tells apart entities that were allocated at the same address.
+	uint32_t revision = 0;
+
+	// where Bsp::update_ent_lump last wrote this entity, so it can be copied from there if it hasn't
+	// changed since then (lumpRevision == revision) and the lump is still the same (see Bsp::entLumpId)
+	uint32_t lumpId = 0;
+	uint32_t lumpRevision = 0;
+	int lumpOffset = 0;
+	int lumpLength = 0;
+
 	Entity(void);
 	Entity(const std::string& classname);
 	~Entity(void);
 
+	Entity& operator=(const Entity& other);
+
+	// adds a keyvalue, or renames the key with a #X suffix if the entity already has it
 	void addKeyvalue(Keyvalue& k);
+	// adds a keyvalue, or sets the value if the entity already has the key
 	void addKeyvalue(const std::string& key, const std::string& value);
 	void removeKeyvalue(const std::string& key);
 	bool renameKey(int idx, string newName);
+	void swapKeys(int idxA, int idxB);
 	void clearAllKeyvalues();
 	void clearEmptyKeyvalues();
 
 	void setOrAddKeyvalue(const std::string& key, const std::string& value);
 
+	// returns an empty string if the entity doesn't have the key (the key is not added)
+	const std::string& getKeyvalue(const std::string& key) const;
+
+	// keys and values in the order they were added
+	int getKeyCount() const;
+	const std::string& getKey(int idx) const;
+	const std::string& getValue(int idx) const;
+
 	// returns -1 for invalid idx
 	int getBspModelIdx();
 
@@ -34,14 +67,35 @@ public:
 
 	vec3 getOrigin();
 
-	bool hasKey(const std::string& key);
+	bool hasKey(const std::string& key) const;
 
 	vector<string> getTargets();
 
 	bool hasTarget(string tname);
 
+	// multi_manager target keys that would end up with the same name as another key get a new #X suffix
 	void renameTargetnameValues(string oldTargetname, string newTargetname);
 
 	int getMemoryUsage(); // aproximate
+
+private:
+	vector<const EntityKey*> keys;
+	vector<string> values; // same order as keys
+
+	// open addressing hash table of (key index + 1) for each key, or 0 for empty slots.
+	// The size is a power of 2 that's at least twice the key count.
+	vector<int> slots;
+
+	// returns -1 if the entity doesn't have the key
+	int findKey(const std::string& key) const;
+
+	// adds the key without checking if it already exists
+	void appendKeyvalue(const EntityKey* key, const std::string& value);
+
+	// rehashes all keys (call this after keys are removed or moved)
+	void rebuildSlots();
+
+	// call this after any keyvalue changes
+	void invalidateCache();
 };
 
@@ -0,0 +1,102 @@
+#include "PlaneIndex.h"
+#include "util.h"
+#include <string.h>
+
+// Cells are twice the size of the epsilon, so a similar plane is either in the same cell or
+// in the neighboring cell on the side that's closest to the plane. That's 2^4 cells to check.
+#define NORMAL_CELL_SIZE (PLANE_NORMAL_EPSILON*2.0)
+#define DIST_CELL_SIZE (PLANE_DIST_EPSILON*2.0)
+
+PlaneIndex::PlaneIndex(bool snap) {
+	this->snap = snap;
+}
+
+void PlaneIndex::add(const BSPPLANE& plane, int idx) {
+	if (find_exact(plane) != -1) {
+		return;
+	}
+
+	Entry entry;
+	entry.plane = plane;
+	entry.idx = idx;
+
+	exact.insert(make_pair(hashData(&plane, sizeof(BSPPLANE)), entry));
+
+	if (snap) {
+		int64 cell[4];
+		bool roundUp[4];
+		get_cell(plane, cell, roundUp);
+		cells.insert(make_pair(hash_cell(cell, plane.nType), entry));
+	}
+}
+
+int PlaneIndex::find_exact(const BSPPLANE& plane) {
+	auto range = exact.equal_range(hashData(&plane, sizeof(BSPPLANE)));
+
+	for (auto it = range.first; it != range.second; ++it) {
+		if (memcmp(&it->second.plane, &plane, sizeof(BSPPLANE)) == 0) {
+			return it->second.idx;
+		}
+	}
+
+	return -1;
+}
+
+int PlaneIndex::find_similar(const BSPPLANE& plane) {
+	if (!snap) {
+		return -1;
+	}
+
+	int64 cell[4];
+	bool roundUp[4];
+	get_cell(plane, cell, roundUp);
+
+	int bestIdx = -1;
+
+	for (int i = 0; i < 16; i++) {
+		int64 neighbor[4];
+		for (int k = 0; k < 4; k++) {
+			neighbor[k] = cell[k];
+			if (i & (1 << k)) {
+				neighbor[k] += roundUp[k] ? 1 : -1;
+			}
+		}
+
+		auto range = cells.equal_range(hash_cell(neighbor, plane.nType));
+
+		for (auto it = range.first; it != range.second; ++it) {
+			const BSPPLANE& other = it->second.plane;
+
+			if (other.nType == plane.nType
+				&& fabs(other.vNormal.x - plane.vNormal.x) < PLANE_NORMAL_EPSILON
+				&& fabs(other.vNormal.y - plane.vNormal.y) < PLANE_NORMAL_EPSILON
+				&& fabs(other.vNormal.z - plane.vNormal.z) < PLANE_NORMAL_EPSILON
+				&& fabs(other.fDist - plane.fDist) < PLANE_DIST_EPSILON) {
+				if (bestIdx == -1 || it->second.idx < bestIdx) {
+					bestIdx = it->second.idx;
+				}
+			}
+		}
+	}
+
+	return bestIdx;
+}
+
+void PlaneIndex::get_cell(const BSPPLANE& plane, int64 cell[4], bool roundUp[4]) {
+	double coords[4] = {
+		plane.vNormal.x / NORMAL_CELL_SIZE,
+		plane.vNormal.y / NORMAL_CELL_SIZE,
+		plane.vNormal.z / NORMAL_CELL_SIZE,
+		plane.fDist / DIST_CELL_SIZE
+	};
+
+	for (int i = 0; i < 4; i++) {
+		double c = floor(coords[i]);
+		cell[i] = (int64)c;
+		roundUp[i] = coords[i] - c >= 0.5;
+	}
+}
+
+uint64 PlaneIndex::hash_cell(int64 cell[4], int32_t type) {
+	return hashData(cell, sizeof(int64) * 4, type);
+}
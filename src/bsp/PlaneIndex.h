@@ -0,0 +1,39 @@
+#pragma once
+#include "bsptypes.h"
+#include <unordered_map>
+
+// max difference between planes that are considered duplicates when snapping is enabled
+#define PLANE_NORMAL_EPSILON 0.00001f
+#define PLANE_DIST_EPSILON 0.01f
+
+// Finds duplicate planes in constant time, for deduplicating planes without comparing every pair.
+// Exact matches are bitwise identical. Snapped matches have the same type and a normal/distance
+// within the epsilons above, like the compiler uses when it looks up planes.
+class PlaneIndex {
+public:
+	PlaneIndex(bool snap=false);
+
+	// index a plane so that it can be found later. Planes already in the index are ignored,
+	// so the first index given for a plane is the one that's returned when searching.
+	void add(const BSPPLANE& plane, int idx);
+
+	// returns the index of a bitwise identical plane, or -1 if there is none
+	int find_exact(const BSPPLANE& plane);
+
+	// returns the index of a nearly identical plane, or -1 if there is none or snapping is disabled
+	int find_similar(const BSPPLANE& plane);
+
+private:
+	struct Entry {
+		BSPPLANE plane;
+		int idx;
+	};
+
+	bool snap;
+
+	unordered_multimap<uint64, Entry> exact; // plane bits hash -> plane
+	unordered_multimap<uint64, Entry> cells; // snapped grid cell hash -> plane
+
+	void get_cell(const BSPPLANE& plane, int64 cell[4], bool roundUp[4]);
+	uint64 hash_cell(int64 cell[4], int32_t type);
+};
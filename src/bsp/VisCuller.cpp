@@ -0,0 +1,167 @@
+#include "VisCuller.h"
+#include "vis.h"
+
+Frustum::Frustum() {
+	planeCount = 0;
+}
+
+Frustum::Frustum(vec3 origin, vec3 forward, vec3 up, float fov, float aspect, float zFar) {
+	this->origin = origin;
+
+	forward = forward.normalize(1.0f);
+	vec3 right = crossProduct(forward, up).normalize(1.0f);
+	up = crossProduct(right, forward).normalize(1.0f);
+
+	// widened a little so that faces at the edges of the screen don't pop in late
+	float tanY = tanf(fov * 0.5f * PI / 180.0f) * 1.05f;
+	float tanX = tanY * aspect;
+
+	normals[0] = forward * tanX + right;
+	normals[1] = forward * tanX - right;
+	normals[2] = forward * tanY - up;
+	normals[3] = forward * tanY + up;
+
+	// at the camera instead of zNear, which is too close to matter. Without it, large boxes behind the camera
+	// could pass the side planes through different corners.
+	normals[4] = forward;
+	planeCount = 5;
+
+	if (zFar > 0) {
+		normals[planeCount++] = forward * -1;
+	}
+
+	for (int i = 0; i < planeCount; i++) {
+		normals[i] = normals[i].normalize(1.0f);
+		dists[i] = dotProduct(normals[i], origin);
+	}
+	if (zFar > 0) {
+		dists[5] -= zFar;
+	}
+}
+
+Frustum Frustum::toLocal(vec3 offset) const {
+	Frustum local = *this;
+	local.origin = origin - offset;
+
+	for (int i = 0; i < planeCount; i++) {
+		local.dists[i] = dists[i] - dotProduct(normals[i], offset);
+	}
+
+	return local;
+}
+
+bool Frustum::isBoxVisible(const vec3& mins, const vec3& maxs) const {
+	for (int i = 0; i < planeCount; i++) {
+		// the corner of the box that is furthest along the plane normal
+		const vec3& n = normals[i];
+		vec3 corner = vec3(n.x >= 0 ? maxs.x : mins.x, n.y >= 0 ? maxs.y : mins.y, n.z >= 0 ? maxs.z : mins.z);
+
+		if (dotProduct(n, corner) < dists[i]) {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+VisCuller::VisCuller(Bsp* map) {
+	this->map = map;
+}
+
+int VisCuller::findLeaf(vec3 pos) const {
+	if (map->modelCount <= 0) {
+		return 0;
+	}
+
+	int nodeIdx = map->models[0].iHeadnodes[0];
+
+	while (nodeIdx >= 0) {
+		if (nodeIdx >= map->nodeCount) {
+			return 0;
+		}
+
+		BSPNODE& node = map->nodes[nodeIdx];
+		if (node.iPlane >= map->planeCount) {
+			return 0;
+		}
+
+		BSPPLANE& plane = map->planes[node.iPlane];
+		float dist = dotProduct(plane.vNormal, pos) - plane.fDist;
+		nodeIdx = node.iChildren[dist > 0 ? 0 : 1];
+	}
+
+	int leafIdx = ~nodeIdx;
+	return leafIdx < map->leafCount ? leafIdx : 0;
+}
+
+void VisCuller::invalidate() {
+	pvsLeaf = -1;
+	pvsValid = false;
+}
+
+bool VisCuller::loadPvs(int leafIdx) {
+	int visLeaves = map->modelCount > 0 ? map->models[0].nVisLeafs : 0;
+	if (leafIdx <= 0 || leafIdx > visLeaves || leafIdx >= map->leafCount) {
+		return false;
+	}
+
+	// leaves without vis data can see everything
+	int visOffset = map->leaves[leafIdx].nVisOffset;
+	if (visOffset < 0 || visOffset >= map->visDataLength) {
+		return false;
+	}
+
+	int rowSize = (visLeaves + 7) / 8;
+	pvs.resize(rowSize);
+	DecompressVis(map->visdata + visOffset, &pvs[0], rowSize, visLeaves);
+
+	return true;
+}
+
+bool VisCuller::getVisibleFaces(const Frustum& frustum, vector<int>& faces) {
+	faces.clear();
+
+	int leafIdx = findLeaf(frustum.origin);
+	if (leafIdx != pvsLeaf) {
+		pvsLeaf = leafIdx;
+		pvsValid = loadPvs(leafIdx);
+	}
+
+	if (!pvsValid) {
+		return false;
+	}
+
+	if (faceVisits.size() != map->faceCount) {
+		faceVisits.clear();
+		faceVisits.resize(map->faceCount, 0);
+		visitCount = 0;
+	}
+	visitCount++;
+
+	int visLeaves = min(map->models[0].nVisLeafs, map->leafCount - 1);
+
+	for (int i = 1; i <= visLeaves; i++) {
+		// the camera leaf isn't always in its own row
+		if (i != leafIdx && !(pvs[(i - 1) >> 3] & (1 << ((i - 1) & 7)))) {
+			continue;
+		}
+
+		BSPLEAF& leaf = map->leaves[i];
+		vec3 mins = vec3(leaf.nMins[0], leaf.nMins[1], leaf.nMins[2]);
+		vec3 maxs = vec3(leaf.nMaxs[0], leaf.nMaxs[1], leaf.nMaxs[2]);
+		if (!frustum.isBoxVisible(mins, maxs)) {
+			continue;
+		}
+
+		int end = min((int)leaf.iFirstMarkSurface + leaf.nMarkSurfaces, map->marksurfCount);
+		for (int k = leaf.iFirstMarkSurface; k < end; k++) {
+			int faceIdx = map->marksurfs[k];
+			if (faceIdx < map->faceCount && faceVisits[faceIdx] != visitCount) {
+				faceVisits[faceIdx] = visitCount;
+				faces.push_back(faceIdx);
+			}
+		}
+	}
+
+	return true;
+}
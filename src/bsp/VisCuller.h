@@ -0,0 +1,51 @@
+#pragma once
+#include "Bsp.h"
+
+#define FRUSTUM_PLANES 6 // left, right, top, bottom, near, far
+
+// View frustum in map coordinates, for skipping things that are off screen
+struct Frustum {
+	vec3 origin;
+	vec3 normals[FRUSTUM_PLANES]; // pointing into the frustum
+	float dists[FRUSTUM_PLANES];
+	int planeCount;
+
+	Frustum();
+
+	// fov is the vertical field of view in degrees. There is no far plane if zFar <= 0.
+	Frustum(vec3 origin, vec3 forward, vec3 up, float fov, float aspect, float zFar);
+
+	// returns the frustum in the coordinates of a map that is drawn at the given offset
+	Frustum toLocal(vec3 offset) const;
+
+	// false if the box is entirely outside the frustum. Boxes near the corners may pass without being visible.
+	bool isBoxVisible(const vec3& mins, const vec3& maxs) const;
+};
+
+// Finds the world faces that can be seen from the camera, using the potentially visible sets (PVS) that VIS
+// compiled into the map, and skipping leaves that are outside the view frustum.
+class VisCuller {
+public:
+	VisCuller(Bsp* map);
+
+	// returns the index of the world leaf that contains the point (0 is the shared solid leaf)
+	int findLeaf(vec3 pos) const;
+
+	// lists the world faces in leaves that are potentially visible from the frustum origin and inside the frustum.
+	// Returns false if the map can't be culled from there (no vis data, or the origin is in solid space or outside
+	// the map), in which case everything should be drawn.
+	bool getVisibleFaces(const Frustum& frustum, vector<int>& faces);
+
+	// forgets the cached PVS row. Call after the leaves or vis data of the map change.
+	void invalidate();
+
+private:
+	Bsp* map;
+	int pvsLeaf = -1; // leaf that the cached row was decompressed for
+	bool pvsValid = false;
+	vector<byte> pvs; // bit i is set if leaf i+1 is potentially visible from pvsLeaf
+	vector<int> faceVisits; // last call that listed each face, so faces in several leaves are listed once
+	int visitCount = 0;
+
+	bool loadPvs(int leafIdx);
+};
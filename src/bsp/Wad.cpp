@@ -11,6 +11,7 @@
 Wad::Wad(void)
 {
 	dirEntries = NULL;
+	numTex = -1;
 }
 
 Wad::Wad( const string& file )
@@ -21,74 +22,118 @@ Wad::Wad( const string& file )
 }
 
 Wad::~Wad(void)
+{
+	close();
+}
+
+void Wad::close()
 {
 	if (dirEntries)
 		delete [] dirEntries;
+	dirEntries = NULL;
+	dirIndex.clear();
+
+	closeFile();
+}
+
+bool Wad::openFile()
+{
+	if (mappedFile)
+		return true;
+	if (!dirEntries)
+		return false;
+
+	int sz = 0;
+	char* data = mapFile(filename, sz);
+	if (!data)
+		return false;
+
+	if (sz != fileSize)
+	{
+		logf("%s changed since it was opened\n", filename.c_str());
+		unmapFile(data, sz);
+		return false;
+	}
+
+	mappedFile = data;
+	mappedFileSize = sz;
+	return true;
+}
+
+void Wad::closeFile()
+{
+	unmapFile(mappedFile, mappedFileSize);
+	mappedFile = NULL;
+	mappedFileSize = 0;
 }
 
 bool Wad::readInfo()
 {
-	string file = filename;
+	close();
 
-	if (!fileExists(file))
+	if (!fileExists(filename))
 	{
 		logf("%s does not exist!\n", filename.c_str());
 		return false;
 	}
 
-	ifstream fin(file, ifstream::in|ios::binary);
-	if (!fin.good())
+	int sz = 0;
+	mappedFile = mapFile(filename, sz);
+	if (!mappedFile)
 		return false;
-
-	uint begin = fin.tellg();
-	fin.seekg (0, ios::end);
-	uint end = fin.tellg();
-	uint sz = end - begin;
-	fin.seekg(0, ios::beg);
+	mappedFileSize = sz;
+	fileSize = sz;
 
 	if (sz < sizeof(WADHEADER))
 	{
-		fin.close();
+		close();
 		return false;
 	}
 
 	//
 	// WAD HEADER
 	//
-	fin.read((char*)&header, sizeof(WADHEADER)); 
+	memcpy(&header, mappedFile, sizeof(WADHEADER));
 
-	if (string(header.szMagic).find("WAD3") != 0)
+	if (strncmp(header.szMagic, "WAD3", 4) != 0)
 	{
-		fin.close();
+		close();
 		return false;
 	}
 
-	if (header.nDirOffset >= sz)
+	if (header.nDirOffset < 0 || header.nDirOffset >= sz)
 	{
-		fin.close();
+		close();
 		return false;
 	}
 
 	//
 	// WAD DIRECTORY ENTRIES
 	//
-	fin.seekg(header.nDirOffset);
 	numTex = header.nDir;
+	if (numTex < 0 || (int64_t)numTex * sizeof(WADDIRENTRY) > sz - header.nDirOffset)
+	{
+		logf("Unexpected end of WAD\n");
+		close();
+		return false;
+	}
 	dirEntries = new WADDIRENTRY[numTex];
+	memcpy(dirEntries, mappedFile + header.nDirOffset, numTex * sizeof(WADDIRENTRY));
 
 	bool usableTextures = false;
+	dirIndex.reserve(numTex);
 	for (int i = 0; i < numTex; i++)
 	{
-		if (fin.eof()) { logf("Unexpected end of WAD\n"); return false; }
-		fin.read((char*)&dirEntries[i], sizeof(WADDIRENTRY)); 
 		if (dirEntries[i].nType == 0x43) usableTextures = true;
+
+		// names are compared case-insensitively. The first entry wins if a name is used twice.
+		string name(dirEntries[i].szName, strnlen(dirEntries[i].szName, MAXTEXTURENAME));
+		dirIndex.emplace(toLowerCase(name), i);
 	}
-	fin.close();
 
 	if (!usableTextures)
 	{
-		delete [] dirEntries;
-		dirEntries = NULL;
+		close();
 		header.nDir = 0;
 		logf("%s contains no regular textures\n", filename.c_str());
 		return false; // we can't use these types of textures (see fonts.wad as an example)
@@ -98,12 +143,15 @@ bool Wad::readInfo()
 	return true;
 }
 
+int Wad::findTexture(const string& name)
+{
+	auto found = dirIndex.find(toLowerCase(name));
+	return found != dirIndex.end() ? found->second : -1;
+}
+
 bool Wad::hasTexture(string name)
 {
-	for (int d = 0; d < header.nDir; d++)
-		if (strcasecmp(name.c_str(), dirEntries[d].szName) == 0)
-			return true;
-	return false;
+	return findTexture(name) != -1;
 }
 
 WADTEX * Wad::readTexture( int dirIndex )
@@ -113,58 +161,40 @@ WADTEX * Wad::readTexture( int dirIndex )
 		logf("invalid wad directory index\n");
 		return NULL;
 	}
-	//if (cache != NULL)
-		//return cache[dirIndex];
-	string name = string(dirEntries[dirIndex].szName);
-	return readTexture(name);
-}
-
-WADTEX * Wad::readTexture( const string& texname )
-{
-	string path = filename;
-	const char * file = (path.c_str());
-
-	ifstream fin(file, ifstream::in|ios::binary);
-	if (!fin.good())
-		return NULL;
 
-	int idx = -1;
-	for (int d = 0; d < header.nDir; d++)
+	if (!mappedFile)
 	{
-		if (strcasecmp(texname.c_str(), dirEntries[d].szName) == 0)
-		{
-			idx = d;
-			break;
-		}
+		logf("Can't read textures from %s while it is closed\n", filename.c_str());
+		return NULL;
 	}
 
-	if (idx < 0)
+	WADDIRENTRY& entry = dirEntries[dirIndex];
+	if (entry.bCompression)
 	{
-		fin.close();
+		logf("OMG texture is compressed. I'm too scared to load it :<\n");
 		return NULL;
 	}
-	if (dirEntries[idx].bCompression)
+
+	if (entry.nFilePos < 0 || (int64_t)entry.nFilePos + sizeof(BSPMIPTEX) > mappedFileSize)
 	{
-		logf("OMG texture is compressed. I'm too scared to load it :<\n");
+		logf("Invalid offset for texture %s in %s\n", entry.szName, filename.c_str());
 		return NULL;
 	}
-	fin.seekg(dirEntries[idx].nFilePos);
 
 	BSPMIPTEX mtex;
-	fin.read((char*)&mtex, sizeof(BSPMIPTEX));
-
-	int w = mtex.nWidth;
-	int h = mtex.nHeight;
-	int sz = w*h;	   // miptex 0
-	int sz2 = sz / 4;  // miptex 1
-	int sz3 = sz2 / 4; // miptex 2
-	int sz4 = sz3 / 4; // miptex 3
-	int szAll = sz + sz2 + sz3 + sz4 + 2 + 256*3 + 2;
-
-	byte * data = new byte[szAll];
-	fin.read((char*)data, szAll);		
-	
-	fin.close();
+	memcpy(&mtex, mappedFile + entry.nFilePos, sizeof(BSPMIPTEX));
+
+	int64_t sz = (int64_t)mtex.nWidth*mtex.nHeight;	   // miptex 0
+	int64_t sz2 = sz / 4;  // miptex 1
+	int64_t sz3 = sz2 / 4; // miptex 2
+	int64_t sz4 = sz3 / 4; // miptex 3
+	int64_t szAll = sz + sz2 + sz3 + sz4 + 2 + 256*3 + 2;
+
+	if (entry.nFilePos + sizeof(BSPMIPTEX) + szAll > mappedFileSize)
+	{
+		logf("Texture %s is truncated in %s\n", entry.szName, filename.c_str());
+		return NULL;
+	}
 
 	WADTEX * tex = new WADTEX;
 	for (int i = 0; i < MAXTEXTURENAME; i++)
@@ -173,10 +203,18 @@ WADTEX * Wad::readTexture( const string& texname )
 		tex->nOffsets[i] = mtex.nOffsets[i];
 	tex->nWidth = mtex.nWidth;
 	tex->nHeight = mtex.nHeight;
-	tex->data = data;
+	tex->data = (byte*)mappedFile + entry.nFilePos + sizeof(BSPMIPTEX);
 
 	return tex;
 }
+
+WADTEX * Wad::readTexture( const string& texname )
+{
+	int idx = findTexture(texname);
+	if (idx < 0)
+		return NULL;
+	return readTexture(idx);
+}
 bool Wad::write(WADTEX** textures, int numTex)
 {
 	return write(filename, textures, numTex);
@@ -184,6 +222,13 @@ bool Wad::write(WADTEX** textures, int numTex)
 
 bool Wad::write( std::string filename, WADTEX ** textures, int numTex )
 {
+	if (mappedFile && filename == this->filename)
+	{
+		// truncating a mapped file invalidates the mapping (and any textures read from it)
+		logf("Can't overwrite %s while it is open\n", filename.c_str());
+		return false;
+	}
+
 	ofstream myFile(filename, ios::out | ios::binary | ios::trunc);
 
 	header.szMagic[0] = 'W';
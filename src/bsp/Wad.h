@@ -1,5 +1,6 @@
 #pragma once
 #include <string>
+#include <unordered_map>
 #include "bsplimits.h"
 #include "bsptypes.h"
 
@@ -86,14 +87,37 @@ public:
 	Wad(void);
 	~Wad(void);
 
+	// maps the wad file and indexes its directory. The file stays mapped for readTexture until closeFile() is
+	// called or the Wad is deleted.
 	bool readInfo();
+
+	// maps the file again after closeFile(), reusing the directory. Fails if the file's size has changed.
+	bool openFile();
+
+	// unmaps the file but keeps the directory, so that an idle Wad doesn't hold on to the whole file.
+	// Textures read from the file are invalid after this.
+	void closeFile();
 	bool hasTexture(std::string name);
 
+	// returns the directory index of the texture (case-insensitive), or -1 if the wad doesn't have it
+	int findTexture(const std::string& name);
+
 	bool write(std::string filename, WADTEX** textures, int numTex);
 	bool write(WADTEX** textures, int numTex);
 
-
+	// the texture data points into the mapped wad file, so it is only valid until the file is closed.
+	// Delete the returned WADTEX, but not its data. Returns NULL if the texture is missing or invalid.
 	WADTEX * readTexture(int dirIndex);
 	WADTEX * readTexture(const std::string& texname);
+
+private:
+	char* mappedFile = NULL;
+	int mappedFileSize = 0;
+	int fileSize = 0; // size when the directory was read
+
+	// lowercase texture name -> directory index
+	std::unordered_map<std::string, int> dirIndex;
+
+	void close();
 };
 
@@ -2,6 +2,56 @@
 #include <math.h>
 #include <string.h>
 
+LumpState::LumpState() {
+	for (int i = 0; i < HEADER_LUMPS; i++) {
+		lumpLen[i] = 0;
+		hasLump[i] = false;
+	}
+}
+
+bool LumpState::sameLump(const LumpState& other, int lumpIdx) const {
+	return hasLump[lumpIdx] && other.hasLump[lumpIdx] && lumpLen[lumpIdx] == other.lumpLen[lumpIdx]
+		&& chunks[lumpIdx] == other.chunks[lumpIdx];
+}
+
+void LumpState::clearLump(int lumpIdx) {
+	chunks[lumpIdx].clear();
+	lumpLen[lumpIdx] = 0;
+	hasLump[lumpIdx] = false;
+}
+
+void LumpState::copyLump(int lumpIdx, byte* dst) const {
+	for (int i = 0; i < chunks[lumpIdx].size(); i++) {
+		const std::vector<byte>& chunk = *chunks[lumpIdx][i];
+		memcpy(dst, &chunk[0], chunk.size());
+		dst += chunk.size();
+	}
+}
+
+int LumpState::updateChunkRefs(std::unordered_map<const void*, int>& chunkRefs, int refDelta) const {
+	int size = sizeof(LumpState);
+
+	for (int i = 0; i < HEADER_LUMPS; i++) {
+		size += chunks[i].size() * sizeof(LumpChunk);
+
+		for (int k = 0; k < chunks[i].size(); k++) {
+			const std::vector<byte>* chunk = chunks[i][k].get();
+			int& refs = chunkRefs[chunk];
+			int oldRefs = refs;
+			refs += refDelta;
+
+			if (oldRefs == 0 || refs == 0) {
+				size += sizeof(std::vector<byte>) + chunk->size();
+			}
+			if (refs == 0) {
+				chunkRefs.erase(chunk);
+			}
+		}
+	}
+
+	return size * refDelta;
+}
+
 BSPEDGE::BSPEDGE() {}
 
 BSPEDGE::BSPEDGE(uint16_t v1, uint16_t v2) { 
@@ -2,6 +2,8 @@
 #include "types.h"
 #include "bsplimits.h"
 #include <vector>
+#include <memory>
+#include <unordered_map>
 
 #define BSP_MODEL_BYTES 64 // size of a BSP model in bytes
 
@@ -107,9 +109,31 @@ struct BSPHEADER
 	BSPLUMP lump[HEADER_LUMPS]; // Stores the directory of lumps
 };
 
+#define LUMP_CHUNK_SIZE (64*1024) // lump snapshots are split into chunks of this many bytes
+
+typedef std::shared_ptr<const std::vector<byte>> LumpChunk;
+
+// Snapshot of some of a map's lumps, for undoing edits. Lumps are stored as reference-counted chunks, and
+// Bsp::duplicate_lumps reuses the chunks of a previous snapshot that didn't change, so snapshots of a large map
+// only cost the chunks that an edit touched. Copying a LumpState copies chunk pointers, not lump data.
 struct LumpState {
-	byte* lumps[HEADER_LUMPS];
+	std::vector<LumpChunk> chunks[HEADER_LUMPS];
 	int lumpLen[HEADER_LUMPS];
+	bool hasLump[HEADER_LUMPS];
+
+	LumpState();
+
+	// true if both states have the lump and share all of its chunks
+	bool sameLump(const LumpState& other, int lumpIdx) const;
+	void clearLump(int lumpIdx);
+
+	// copies the lump into dst, which must have room for lumpLen[lumpIdx] bytes
+	void copyLump(int lumpIdx, byte* dst) const;
+
+	// adds (refDelta = 1) or removes (refDelta = -1) the state's references in chunkRefs and returns the change
+	// in memory usage. Chunk data is only counted while a chunk is referenced, so chunks shared by several
+	// states are counted once.
+	int updateChunkRefs(std::unordered_map<const void*, int>& chunkRefs, int refDelta) const;
 };
 
 struct BSPPLANE {
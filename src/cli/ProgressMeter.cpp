@@ -9,19 +9,35 @@ ProgressMeter::ProgressMeter() {
 }
 
 void ProgressMeter::update(const char* newTitle, int totalProgressTicks) {
+	if (hide) {
+		return;
+	}
+
+	std::lock_guard<std::mutex> lock(state_mutex);
+
 	progress_title = newTitle;
 	progress = 0;
 	progress_total = totalProgressTicks;
-	if (simpleMode && !hide) {
+	if (simpleMode) {
 		logf((string(newTitle) + "\n").c_str());
 	}
 }
 
-void ProgressMeter::tick() {
-	if (progress_title[0] == '\0' || simpleMode || hide) {
+void ProgressMeter::tick(int ticks) {
+	if (simpleMode || hide) {
 		return;
 	}
-	if (progress++ > 0) {
+
+	std::lock_guard<std::mutex> lock(state_mutex);
+
+	if (progress_title[0] == '\0') {
+		return;
+	}
+
+	int oldProgress = progress;
+	progress += ticks;
+
+	if (oldProgress > 0) {
 		auto now = std::chrono::system_clock::now();
 		std::chrono::duration<double> delta = now - last_progress;
 		if (delta.count() < 0.016) {
@@ -40,6 +56,9 @@ void ProgressMeter::clear() {
 	if (simpleMode || hide) {
 		return;
 	}
+
+	std::lock_guard<std::mutex> lock(state_mutex);
+
 	// 50 chars
 	for (int i = 0; i < 6; i++) logf("\b\b\b\b\b\b\b\b\b\b");
 	for (int i = 0; i < 6; i++) logf("          ");
@@ -1,10 +1,14 @@
 #pragma once
 #include <chrono>
 #include <ctime>
+#include <mutex>
 
 class ProgressMeter {
 public:
 	bool simpleMode = false;
+
+	// while hidden, the meter ignores every call. Set this before starting jobs that run at the same time
+	// and would otherwise fight over the title, and only change it while those jobs aren't running.
 	bool hide = false;
 
 	ProgressMeter();
@@ -13,7 +17,7 @@ public:
 	void update(const char* newTitle, int totalProgressTicks);
 
 	// increment progress counter and print current status
-	void tick();
+	void tick(int ticks=1);
 
 	// backspace the progress meter until the line is blank
 	void clear();
@@ -24,4 +28,5 @@ private:
 	const char* last_progress_title;
 	int progress;
 	int progress_total;
+	std::mutex state_mutex; // all methods are safe to call from worker threads
 };
\ No newline at end of file
@@ -0,0 +1,48 @@
+#pragma once
+#include <string>
+#include <vector>
+
+// Editor settings, saved to bspguy.cfg. Kept out of Renderer.h so that code which only reads a setting
+// doesn't need the GL headers. load() and save() are defined in Renderer.cpp.
+struct AppSettings {
+	int windowWidth;
+	int windowHeight;
+	int windowX;
+	int windowY;
+	int maximized;
+	int fontSize;
+	std::string gamedir;
+	std::string workingdir;
+	bool valid;
+	int undoLevels;
+	bool verboseLogs;
+	int textureCacheSize; // MB of decoded WAD textures to keep (see TextureCache)
+	int lightmapAtlasSize; // limited by the GPU's max texture size when maps are loaded
+
+	bool debug_open;
+	bool keyvalue_open;
+	bool transform_open;
+	bool log_open;
+	bool settings_open;
+	bool limits_open;
+	bool entreport_open;
+	int settings_tab;
+
+	float fov;
+	float zfar;
+	float moveSpeed;
+	float rotSpeed;
+	int render_flags;
+	bool vsync;
+	bool show_transform_axes;
+	bool backUpMap;
+
+	std::vector<std::string> fgdPaths;
+	std::vector<std::string> resPaths;
+
+	void loadDefault();
+	void load();
+	void save();
+};
+
+extern AppSettings g_settings;
@@ -4,8 +4,11 @@
 #include "rad.h"
 #include "lodepng.h"
 #include <algorithm>
+#include <map>
 #include "Renderer.h"
 #include "Clipper.h"
+#include "TextureCache.h"
+#include "VisCuller.h"
 
 #include "icons/missing.h"
 
@@ -20,6 +23,11 @@ BspRenderer::BspRenderer(Bsp* map, ShaderProgram* bspShader, ShaderProgram* full
 	renderEnts = NULL;
 	renderModels = NULL;
 	faceMaths = NULL;
+	visCuller = new VisCuller(map);
+
+	GLint maxTextureSize = 0;
+	glGetIntegerv(GL_MAX_TEXTURE_SIZE, &maxTextureSize);
+	lightmapAtlasSize = min(max(g_settings.lightmapAtlasSize, LIGHTMAP_ATLAS_MIN_SIZE), (int)maxTextureSize);
 
 	whiteTex = new Texture(1, 1);
 	greyTex = new Texture(1, 1);
@@ -72,9 +80,18 @@ BspRenderer::BspRenderer(Bsp* map, ShaderProgram* bspShader, ShaderProgram* full
 
 	colorShaderMultId = glGetUniformLocation(colorShader->ID, "colorMult");
 
+	// entity origins are read from the texture unit after the lightmaps
+	ShaderProgram* batchShaders[2] = { bspShader, fullBrightBspShader };
+	for (int i = 0; i < 2; i++) {
+		batchShaders[i]->bind();
+		glUniform1i(glGetUniformLocation(batchShaders[i]->ID, "sEntityOffsets"), MAXLIGHTMAPS + 1);
+		entOffsetsEnabledIds[i] = glGetUniformLocation(batchShaders[i]->ID, "entityOffsetsEnabled");
+		entOffsetsSizeIds[i] = glGetUniformLocation(batchShaders[i]->ID, "entityOffsetsSize");
+	}
+
 	numRenderClipnodes = map->modelCount;
 	lightmapFuture = async(launch::async, &BspRenderer::loadLightmaps, this);
-	texturesFuture = async(launch::async, &BspRenderer::loadTextures, this);
+	reloadTextures();
 	clipnodesFuture = async(launch::async, &BspRenderer::loadClipnodes, this);
 
 	// cache ent targets so first selection doesn't lag
@@ -84,11 +101,11 @@ BspRenderer::BspRenderer(Bsp* map, ShaderProgram* bspShader, ShaderProgram* full
 }
 
 void BspRenderer::loadTextures() {
-	vector<Wad*> wads;
+	vector<TextureCache::CachedWad*> wads;
 	vector<string> wadNames;
 	for (int i = 0; i < map->ents.size(); i++) {
-		if (map->ents[i]->keyvalues["classname"] == "worldspawn") {
-			wadNames = splitString(map->ents[i]->keyvalues["wad"], ";");
+		if (map->ents[i]->getKeyvalue("classname") == "worldspawn") {
+			wadNames = splitString(map->ents[i]->getKeyvalue("wad"), ";");
 
 			for (int k = 0; k < wadNames.size(); k++) {
 				wadNames[k] = basename(wadNames[k]);
@@ -124,86 +141,74 @@ void BspRenderer::loadTextures() {
 		}
 
 		logf("Loading WAD %s\n", path.c_str());
-		Wad* wad = new Wad(path);
-		wad->readInfo();
-		wads.push_back(wad);
+		TextureCache::CachedWad* wad = g_texture_cache.openWad(path);
+		if (wad)
+			wads.push_back(wad);
 	}
 
-	int wadTexCount = 0;
-	int missingCount = 0;
-	int embedCount = 0;
-
-	glTexturesSwap = new Texture * [map->textureCount];
-	for (int i = 0; i < map->textureCount; i++) {
-		int32_t texOffset = ((int32_t*)map->textures)[i + 1];
-		if (texOffset == -1) {
-			glTexturesSwap[i] = missingTex;
-			continue;
-		}
-		BSPMIPTEX& tex = *((BSPMIPTEX*)(map->textures + texOffset));
-
-		COLOR3* palette;
-		byte* src;
-		WADTEX* wadTex = NULL;
-
-		int lastMipSize = (tex.nWidth / 8) * (tex.nHeight / 8);
+	atomic<int> wadTexCount(0);
+	atomic<int> missingCount(0);
+	atomic<int> embedCount(0);
 
-		if (tex.nOffsets[0] <= 0) {
-
-			bool foundInWad = false;
-			for (int k = 0; k < wads.size(); k++) {
-				if (wads[k]->hasTexture(tex.szName)) {
-					foundInWad = true;
+	// each texture is decoded separately, and published as soon as it's done so that
+	// delayLoadData can upload it while the rest are still decoding
+	parallelFor(numSwapTextures, 1, [&](int start, int end) {
+		for (int i = start; i < end; i++) {
+			int32_t texOffset = ((int32_t*)map->textures)[i + 1];
+			if (texOffset == -1) {
+				glTexturesSwap[i] = missingTex;
+				continue;
+			}
+			BSPMIPTEX& tex = *((BSPMIPTEX*)(map->textures + texOffset));
 
-					wadTex = wads[k]->readTexture(tex.szName);
-					palette = (COLOR3*)(wadTex->data + wadTex->nOffsets[3] + lastMipSize + 2 - 40);
-					src = wadTex->data;
+			if (tex.nOffsets[0] <= 0) {
+				// WAD textures are decoded once and shared with other maps (see TextureCache)
+				Texture* wadTex = NULL;
+				for (int k = 0; k < wads.size() && !wadTex; k++) {
+					wadTex = g_texture_cache.acquire(wads[k], tex.szName);
+				}
 
+				if (wadTex) {
+					glTexturesSwap[i] = wadTex;
 					wadTexCount++;
-					break;
+				}
+				else {
+					glTexturesSwap[i] = missingTex;
+					missingCount++;
+					continue;
 				}
 			}
+			else {
+				int lastMipSize = (tex.nWidth / 8) * (tex.nHeight / 8);
+				COLOR3* palette = (COLOR3*)(map->textures + texOffset + tex.nOffsets[3] + lastMipSize + 2);
+				byte* src = map->textures + texOffset + tex.nOffsets[0];
+				embedCount++;
 
-			if (!foundInWad) {
-				glTexturesSwap[i] = missingTex;
-				missingCount++;
-				continue;
-			}
-		}
-		else {
-			palette = (COLOR3*)(map->textures + texOffset + tex.nOffsets[3] + lastMipSize + 2);
-			src = map->textures + texOffset + tex.nOffsets[0];
-			embedCount++;
-		}
+				int sz = tex.nWidth * tex.nHeight;
+				COLOR3* imageData = new COLOR3[sz];
 
-		COLOR3* imageData = new COLOR3[tex.nWidth * tex.nHeight];
+				for (int k = 0; k < sz; k++) {
+					imageData[k] = palette[src[k]];
+				}
 
-		int sz = tex.nWidth * tex.nHeight;
-		
-		for (int k = 0; k < sz; k++) {
-			imageData[k] = palette[src[k]];
-		}
+				glTexturesSwap[i] = new Texture(tex.nWidth, tex.nHeight, imageData);
+			}
 
-		if (wadTex) {
-			delete[] wadTex->data;
-			delete wadTex;
+			lock_guard<mutex> lock(decodedTexturesMutex);
+			decodedTextures.push_back(i);
 		}
-
-		// map->textures + texOffset + tex.nOffsets[0]
-
-		glTexturesSwap[i] = new Texture(tex.nWidth, tex.nHeight, imageData);
-	}
+	});
 
 	for (int i = 0; i < wads.size(); i++) {
-		delete wads[i];
+		g_texture_cache.closeWad(wads[i]);
 	}
 
 	if (wadTexCount)
-		debugf("Loaded %d wad textures\n", wadTexCount);
+		debugf("Loaded %d wad textures\n", wadTexCount.load());
 	if (embedCount)
-		debugf("Loaded %d embedded textures\n", embedCount);
+		debugf("Loaded %d embedded textures\n", embedCount.load());
 	if (missingCount)
-		debugf("%d missing textures\n", missingCount);
+		debugf("%d missing textures\n", missingCount.load());
 }
 
 void BspRenderer::reload() {
@@ -218,6 +223,22 @@ void BspRenderer::reload() {
 
 void BspRenderer::reloadTextures() {
 	texturesLoaded = false;
+	if (texturesFuture.valid()) {
+		texturesFuture.wait(); // only one load may publish decoded textures at a time
+	}
+
+	// a previous load that hasn't replaced glTextures yet still holds its textures and WAD cache references
+	deleteTexturesSwap();
+
+	{
+		lock_guard<mutex> lock(decodedTexturesMutex);
+		decodedTextures.clear();
+	}
+
+	// allocated here so that uploadDecodedTextures never sees the array change
+	numSwapTextures = map->textureCount;
+	glTexturesSwap = new Texture * [numSwapTextures]();
+
 	texturesFuture = async(launch::async, &BspRenderer::loadTextures, this);
 }
 
@@ -260,23 +281,23 @@ void BspRenderer::updateModelShaders() {
 			model.renderGroups[k].wireframeBuffer->setShader(activeShader, true);
 		}
 	}
+
+	// the batches don't keep their vertexes in CPU memory, so they're rebuilt instead of uploaded again
+	entityBatchesDirty = true;
 }
 
 void BspRenderer::loadLightmaps() {
-	vector<LightmapNode*> atlases;
-	vector<Texture*> atlasTextures;
-	atlases.push_back(new LightmapNode(0, 0, LIGHTMAP_ATLAS_SIZE, LIGHTMAP_ATLAS_SIZE));
-	atlasTextures.push_back(new Texture(LIGHTMAP_ATLAS_SIZE, LIGHTMAP_ATLAS_SIZE));
-	memset(atlasTextures[0]->data, 0, LIGHTMAP_ATLAS_SIZE * LIGHTMAP_ATLAS_SIZE * sizeof(COLOR3));
-
 	numRenderLightmapInfos = map->faceCount;
 	lightmaps = new LightmapInfo[map->faceCount];
 	memset(lightmaps, 0, map->faceCount * sizeof(LightmapInfo));
 
 	debugf("Calculating lightmaps\n");
 
-	int lightmapCount = 0;
-	int atlasId = 0;
+	// every style of every face is packed at once, so that the packer can place the biggest lightmaps first
+	vector<LightmapPacker::Rect> rects;
+	vector<int> rectFaces;
+	vector<int> rectStyles;
+
 	for (int i = 0; i < map->faceCount; i++) {
 		BSPFACE& face = map->faces[i];
 		BSPTEXTUREINFO& texinfo = map->texinfos[face.iTextureInfo];
@@ -305,54 +326,69 @@ void BspRenderer::loadLightmaps() {
 			if (face.nStyles[s] == 255)
 				continue;
 
-			// TODO: Try fitting in earlier atlases before using the latest one
-			if (!atlases[atlasId]->insert(info.w, info.h, info.x[s], info.y[s])) {
-				atlases.push_back(new LightmapNode(0, 0, LIGHTMAP_ATLAS_SIZE, LIGHTMAP_ATLAS_SIZE));
-				atlasTextures.push_back(new Texture(LIGHTMAP_ATLAS_SIZE, LIGHTMAP_ATLAS_SIZE));
-				atlasId++;
-				memset(atlasTextures[atlasId]->data, 0, LIGHTMAP_ATLAS_SIZE * LIGHTMAP_ATLAS_SIZE * sizeof(COLOR3));
+			LightmapPacker::Rect rect;
+			rect.w = info.w;
+			rect.h = info.h;
+			rects.push_back(rect);
+			rectFaces.push_back(i);
+			rectStyles.push_back(s);
+		}
+	}
 
-				if (!atlases[atlasId]->insert(info.w, info.h, info.x[s], info.y[s])) {
-					logf("Lightmap too big for atlas size!\n");
-					continue;
-				}
-			}
+	LightmapPacker packer(lightmapAtlasSize);
+	if (!packer.pack(rects)) {
+		logf("Lightmap too big for atlas size!\n");
+	}
 
-			lightmapCount++;
-
-			info.atlasId[s] = atlasId;
-
-			// copy lightmap data into atlas
-			int lightmapSz = info.w * info.h * sizeof(COLOR3);
-			int offset = face.nLightmapOffset + s * lightmapSz;
-			COLOR3* lightSrc = (COLOR3*)(map->lightdata + offset);
-			COLOR3* lightDst = (COLOR3*)(atlasTextures[atlasId]->data);
-			for (int y = 0; y < info.h; y++) {
-				for (int x = 0; x < info.w; x++) {
-					int src = y * info.w + x;
-					int dst = (info.y[s] + y) * LIGHTMAP_ATLAS_SIZE + info.x[s] + x;
-					if (offset + src*sizeof(COLOR3) < map->lightDataLength) {
-						lightDst[dst] = lightSrc[src];
-					}
-					else {
-						bool checkers = x % 2 == 0 != y % 2 == 0;
-						lightDst[dst] = { (byte)(checkers ? 255 : 0), 0, (byte)(checkers ? 255 : 0) };
-					}
+	// faces without lightmaps still refer to the first atlas
+	int atlasCount = max(1, packer.getAtlasCount());
+	glLightmapTextures = new Texture * [atlasCount];
+	for (int i = 0; i < atlasCount; i++) {
+		glLightmapTextures[i] = new Texture(lightmapAtlasSize, lightmapAtlasSize);
+		memset(glLightmapTextures[i]->data, 0, lightmapAtlasSize * lightmapAtlasSize * sizeof(COLOR3));
+	}
+
+	int lightmapCount = 0;
+	for (int i = 0; i < rects.size(); i++) {
+		LightmapPacker::Rect& rect = rects[i];
+		if (rect.atlas == -1) {
+			continue;
+		}
+
+		BSPFACE& face = map->faces[rectFaces[i]];
+		LightmapInfo& info = lightmaps[rectFaces[i]];
+		int s = rectStyles[i];
+
+		info.atlasId[s] = rect.atlas;
+		info.x[s] = rect.x;
+		info.y[s] = rect.y;
+		lightmapCount++;
+
+		// copy lightmap data into atlas
+		int lightmapSz = info.w * info.h * sizeof(COLOR3);
+		int offset = face.nLightmapOffset + s * lightmapSz;
+		COLOR3* lightSrc = (COLOR3*)(map->lightdata + offset);
+		COLOR3* lightDst = (COLOR3*)(glLightmapTextures[rect.atlas]->data);
+		for (int y = 0; y < info.h; y++) {
+			for (int x = 0; x < info.w; x++) {
+				int src = y * info.w + x;
+				int dst = (info.y[s] + y) * lightmapAtlasSize + info.x[s] + x;
+				if (offset + src*sizeof(COLOR3) < map->lightDataLength) {
+					lightDst[dst] = lightSrc[src];
+				}
+				else {
+					bool checkers = x % 2 == 0 != y % 2 == 0;
+					lightDst[dst] = { (byte)(checkers ? 255 : 0), 0, (byte)(checkers ? 255 : 0) };
 				}
 			}
 		}
 	}
 
-	glLightmapTextures = new Texture * [atlasTextures.size()];
-	for (int i = 0; i < atlasTextures.size(); i++) {
-		delete atlases[i];
-		glLightmapTextures[i] = atlasTextures[i];
-	}
-
-	numLightmapAtlases = atlasTextures.size();
+	numLightmapAtlases = atlasCount;
 
-	//lodepng_encode24_file("atlas.png", atlasTextures[0]->data, LIGHTMAP_ATLAS_SIZE, LIGHTMAP_ATLAS_SIZE);
-	debugf("Fit %d lightmaps into %d atlases\n", lightmapCount, atlasId + 1);
+	//lodepng_encode24_file("atlas.png", glLightmapTextures[0]->data, lightmapAtlasSize, lightmapAtlasSize);
+	debugf("Fit %d lightmaps into %d %dx%d atlases (%.0f%% used)\n", lightmapCount, atlasCount,
+		lightmapAtlasSize, lightmapAtlasSize, packer.getUtilization() * 100.0f);
 }
 
 void BspRenderer::updateLightmapInfos() {
@@ -378,7 +414,11 @@ void BspRenderer::updateLightmapInfos() {
 }
 
 void BspRenderer::preRenderFaces() {
+	deleteEntityBatches();
 	deleteRenderFaces();
+	visCuller->invalidate();
+	worldCulled = false;
+	entityBatchesDirty = true;
 
 	genRenderFaces(numRenderModels);
 
@@ -468,7 +508,7 @@ void BspRenderer::deleteRenderFaces() {
 void BspRenderer::deleteTextures() {
 	if (glTextures != NULL) {
 		for (int i = 0; i < numLoadedTextures; i++) {
-			if (glTextures[i] != missingTex)
+			if (glTextures[i] != missingTex && !g_texture_cache.release(glTextures[i]))
 				delete glTextures[i];
 		}
 		delete[] glTextures;
@@ -477,6 +517,20 @@ void BspRenderer::deleteTextures() {
 	glTextures = NULL;
 }
 
+void BspRenderer::deleteTexturesSwap() {
+	if (glTexturesSwap != NULL) {
+		for (int i = 0; i < numSwapTextures; i++) {
+			Texture* tex = glTexturesSwap[i];
+			if (tex && tex != missingTex && !g_texture_cache.release(tex))
+				delete tex;
+		}
+		delete[] glTexturesSwap;
+	}
+
+	glTexturesSwap = NULL;
+	numSwapTextures = 0;
+}
+
 void BspRenderer::deleteLightmapTextures() {
 	if (glLightmapTextures != NULL) {
 		for (int i = 0; i < numLightmapAtlases; i++) {
@@ -501,9 +555,11 @@ int BspRenderer::refreshModel(int modelIdx, bool refreshClipnodes) {
 	BSPMODEL& model = map->models[modelIdx];
 	RenderModel* renderModel = &renderModels[modelIdx];
 
+	unbatchModel(modelIdx, false);
 	deleteRenderModel(renderModel);
 	
 	renderModel->renderFaces = new RenderFace[model.nFaces];
+	renderModel->renderFaceCount = model.nFaces;
 
 	vector<RenderGroup> renderGroups;
 	vector<vector<lightmapVert>> renderGroupVerts;
@@ -539,8 +595,8 @@ int BspRenderer::refreshModel(int modelIdx, bool refreshClipnodes) {
 		float lw = 0;
 		float lh = 0;
 		if (lightmapsGenerated) {
-			lw = (float)lmap->w / (float)LIGHTMAP_ATLAS_SIZE;
-			lh = (float)lmap->h / (float)LIGHTMAP_ATLAS_SIZE;
+			lw = (float)lmap->w / (float)lightmapAtlasSize;
+			lh = (float)lmap->h / (float)lightmapAtlasSize;
 		}
 
 		bool isSpecial = texinfo.nFlags & TEX_SPECIAL;
@@ -586,7 +642,7 @@ int BspRenderer::refreshModel(int modelIdx, bool refreshClipnodes) {
 				float uu = (fLightMapU / (float)lmap->w) * lw;
 				float vv = (fLightMapV / (float)lmap->h) * lh;
 
-				float pixelStep = 1.0f / (float)LIGHTMAP_ATLAS_SIZE;
+				float pixelStep = 1.0f / (float)lightmapAtlasSize;
 
 				for (int s = 0; s < MAXLIGHTMAPS; s++) {
 					verts[e].luv[s][0] = uu + lmap->x[s] * pixelStep;
@@ -675,6 +731,8 @@ int BspRenderer::refreshModel(int modelIdx, bool refreshClipnodes) {
 		renderModel->renderFaces[i].group = groupIdx;
 		renderModel->renderFaces[i].vertOffset = renderGroupVerts[groupIdx].size();
 		renderModel->renderFaces[i].vertCount = vertCount;
+		renderModel->renderFaces[i].wireframeVertOffset = renderGroupWireframeVerts[groupIdx].size();
+		renderModel->renderFaces[i].wireframeVertCount = wireframeVertCount;
 
 		renderGroupVerts[groupIdx].insert(renderGroupVerts[groupIdx].end(), verts, verts + vertCount);
 		renderGroupWireframeVerts[groupIdx].insert(renderGroupWireframeVerts[groupIdx].end(), wireframeVerts, wireframeVerts + wireframeVertCount);
@@ -722,6 +780,21 @@ int BspRenderer::refreshModel(int modelIdx, bool refreshClipnodes) {
 		refreshFace(model.iFirstFace + i);
 	}
 
+	if (modelIdx < faceBvhs.size() && faceBvhs[modelIdx].isBuilt()) {
+		Bvh& bvh = faceBvhs[modelIdx];
+		if (bvh.getItemCount() == model.nFaces) {
+			// faces were moved or reshaped, so the tree only needs new bounds
+			for (int i = 0; i < model.nFaces; i++) {
+				FaceMath& faceMath = faceMaths[model.iFirstFace + i];
+				bvh.setItemBounds(i, faceMath.mins, faceMath.maxs);
+			}
+			bvh.refit();
+		}
+		else {
+			bvh.clear();
+		}
+	}
+
 	if (refreshClipnodes)
 		generateClipnodeBuffer(modelIdx);
 
@@ -830,33 +903,10 @@ void BspRenderer::generateClipnodeBuffer(int modelIdx) {
 				// calculations for face picking
 				{
 					FaceMath faceMath;
-					faceMath.normal = mesh.faces[i].normal;
-					faceMath.fdist = getDistAlongAxis(mesh.faces[i].normal, faceVerts[0]);
-
-					vec3 v0 = faceVerts[0];
-					vec3 v1;
-					bool found = false;
-					for (int i = 1; i < faceVerts.size(); i++) {
-						if (faceVerts[i] != v0) {
-							v1 = faceVerts[i];
-							found = true;
-							break;
-						}
-					}
-					if (!found) {
+					float fdist = getDistAlongAxis(mesh.faces[i].normal, faceVerts[0]);
+					if (!faceMath.init(mesh.faces[i].normal, fdist, faceVerts)) {
 						logf("Failed to find non-duplicate vert for clipnode face\n");
 					}
-
-					vec3 plane_z = mesh.faces[i].normal;
-					vec3 plane_x = (v1 - v0).normalize();
-					vec3 plane_y = crossProduct(plane_z, plane_x).normalize();
-					faceMath.worldToLocal = worldToLocalTransform(plane_x, plane_y, plane_z);
-
-					faceMath.localVerts = vector<vec2>(faceVerts.size());
-					for (int k = 0; k < faceVerts.size(); k++) {
-						faceMath.localVerts[k] = (faceMath.worldToLocal * vec4(faceVerts[k], 1)).xy();
-					}
-
 					faceMaths.push_back(faceMath);
 				}
 
@@ -912,6 +962,7 @@ void BspRenderer::generateClipnodeBuffer(int modelIdx) {
 		renderClip->wireframeClipnodeBuffer[i]->ownData = true;
 
 		renderClip->faceMaths[i] = faceMaths;
+		renderClip->faceMathBvh[i].clear();
 	}
 }
 
@@ -936,6 +987,7 @@ void BspRenderer::preRenderEnts() {
 		delete pointEnts;
 	}
 	renderEnts = new RenderEnt[map->ents.size()];
+	entityBatchesDirty = true;
 
 	numPointEnts = 0;
 	for (int i = 1; i < map->ents.size(); i++) {
@@ -1010,9 +1062,10 @@ void BspRenderer::refreshEnt(int entIdx) {
 	renderEnts[entIdx].modelMat.loadIdentity();
 	renderEnts[entIdx].offset = vec3(0, 0, 0);
 	renderEnts[entIdx].pointEntCube = pointEntRenderer->getEntCube(ent);
+	entOffsetsDirty = true;
 
 	if (ent->hasKey("origin")) {
-		vec3 origin = parseVector(ent->keyvalues["origin"]);
+		vec3 origin = parseVector(ent->getKeyvalue("origin"));
 		renderEnts[entIdx].modelMat.translate(origin.x, origin.z, -origin.y);
 		renderEnts[entIdx].offset = origin;
 	}
@@ -1023,6 +1076,7 @@ void BspRenderer::calcFaceMaths() {
 
 	numFaceMaths = map->faceCount;
 	faceMaths = new FaceMath[map->faceCount];
+	faceBvhs.clear(); // rebuilt on the next pick
 
 	vec3 world_x = vec3(1, 0, 0);
 	vec3 world_y = vec3(0, 1, 0);
@@ -1034,43 +1088,12 @@ void BspRenderer::calcFaceMaths() {
 }
 
 void BspRenderer::refreshFace(int faceIdx) {
-	const vec3 world_x = vec3(1, 0, 0);
-	const vec3 world_y = vec3(0, 1, 0);
-	const vec3 world_z = vec3(0, 0, 1);
-
-	FaceMath& faceMath = faceMaths[faceIdx];
 	BSPFACE& face = map->faces[faceIdx];
 	BSPPLANE& plane = map->planes[face.iPlane];
 	vec3 planeNormal = face.nPlaneSide ? plane.vNormal * -1 : plane.vNormal;
 	float fDist = face.nPlaneSide ? -plane.fDist : plane.fDist;
 
-	faceMath.normal = planeNormal;
-	faceMath.fdist = fDist;
-	
-	vector<vec3> allVerts(face.nEdges);
-	vec3 v1;
-	for (int e = 0; e < face.nEdges; e++) {
-		int32_t edgeIdx = map->surfedges[face.iFirstEdge + e];
-		BSPEDGE& edge = map->edges[abs(edgeIdx)];
-		int vertIdx = edgeIdx < 0 ? edge.iVertex[1] : edge.iVertex[0];
-		allVerts[e] = map->verts[vertIdx];
-
-		// 2 verts can share the same position on a face, so need to find one that isn't shared (aomdc_1intro)
-		if (e > 0 && allVerts[e] != allVerts[0]) {
-			v1 = allVerts[e];
-		}
-	}
-
-	vec3 plane_x = (v1 - allVerts[0]).normalize(1.0f);
-	vec3 plane_y = crossProduct(planeNormal, plane_x).normalize(1.0f);
-	vec3 plane_z = planeNormal;
-
-	faceMath.worldToLocal = worldToLocalTransform(plane_x, plane_y, plane_z);
-
-	faceMath.localVerts = vector<vec2>(allVerts.size());
-	for (int i = 0; i < allVerts.size(); i++) {
-		faceMath.localVerts[i] = (faceMath.worldToLocal * vec4(allVerts[i], 1)).xy();
-	}
+	faceMaths[faceIdx].init(planeNormal, fDist, map->get_face_verts(faceIdx));
 }
 
 BspRenderer::~BspRenderer() {
@@ -1089,8 +1112,14 @@ BspRenderer::~BspRenderer() {
 	if (pointEnts != NULL) {
 		delete pointEnts;
 	}
+	delete visCuller;
+	deleteEntityBatches();
+	if (entOffsetTexId) {
+		glDeleteTextures(1, &entOffsetTexId);
+	}
 
 	deleteTextures();
+	deleteTexturesSwap();
 	deleteLightmapTextures();
 	deleteRenderFaces();
 	deleteRenderClipnodes();
@@ -1120,20 +1149,27 @@ void BspRenderer::delayLoadData() {
 
 		lightmapsUploaded = true;
 	}
-	else if (!texturesLoaded && texturesFuture.wait_for(chrono::milliseconds(0)) == future_status::ready) {
-		deleteTextures();
-		
-		glTextures = glTexturesSwap;
+	else if (!texturesLoaded) {
+		// checked before uploading, so that no texture is published after the last batch
+		bool decodeFinished = texturesFuture.wait_for(chrono::milliseconds(0)) == future_status::ready;
 
-		for (int i = 0; i < map->textureCount; i++) {
-			if (!glTextures[i]->uploaded)
-				glTextures[i]->upload(GL_RGB);
-		}
-		numLoadedTextures = map->textureCount;
+		if (uploadDecodedTextures() && decodeFinished) {
+			deleteTextures();
 
-		texturesLoaded = true;
+			glTextures = glTexturesSwap;
+			numLoadedTextures = numSwapTextures;
+			glTexturesSwap = NULL;
+			numSwapTextures = 0;
 
-		preRenderFaces();
+			for (int i = 0; i < numLoadedTextures; i++) {
+				if (!glTextures[i]->uploaded)
+					glTextures[i]->upload(GL_RGB);
+			}
+
+			texturesLoaded = true;
+
+			preRenderFaces();
+		}
 	}
 
 	if (!clipnodesLoaded && clipnodesFuture.wait_for(chrono::milliseconds(0)) == future_status::ready) {
@@ -1153,6 +1189,31 @@ void BspRenderer::delayLoadData() {
 	}
 }
 
+bool BspRenderer::uploadDecodedTextures() {
+	auto start = chrono::steady_clock::now();
+
+	while (true) {
+		int idx;
+		{
+			lock_guard<mutex> lock(decodedTexturesMutex);
+			if (decodedTextures.empty()) {
+				return true;
+			}
+			idx = decodedTextures.back();
+			decodedTextures.pop_back();
+		}
+
+		// shared WAD textures may have been uploaded by another map already
+		if (!glTexturesSwap[idx]->uploaded)
+			glTexturesSwap[idx]->upload(GL_RGB);
+
+		if (chrono::steady_clock::now() - start > chrono::milliseconds(TEXTURE_UPLOAD_MS)) {
+			lock_guard<mutex> lock(decodedTexturesMutex);
+			return decodedTextures.empty();
+		}
+	}
+}
+
 bool BspRenderer::isFinishedLoading() {
 	return lightmapsUploaded && texturesLoaded && clipnodesLoaded;
 }
@@ -1160,10 +1221,12 @@ bool BspRenderer::isFinishedLoading() {
 void BspRenderer::highlightFace(int faceIdx, bool highlight) {
 	RenderFace* rface;
 	RenderGroup* rgroup;
-	if (!getRenderPointers(faceIdx, &rface, &rgroup)) {
+	int modelIdx;
+	if (!getRenderPointers(faceIdx, &rface, &rgroup, &modelIdx)) {
 		logf("Bad face index\n");
 		return;
 	}
+	unbatchModel(modelIdx);
 
 	float r, g, b;
 	r = g = b = 1.0f;
@@ -1187,10 +1250,12 @@ void BspRenderer::highlightFace(int faceIdx, bool highlight) {
 void BspRenderer::updateFaceUVs(int faceIdx) {
 	RenderFace* rface;
 	RenderGroup* rgroup;
-	if (!getRenderPointers(faceIdx, &rface, &rgroup)) {
+	int modelIdx;
+	if (!getRenderPointers(faceIdx, &rface, &rgroup, &modelIdx)) {
 		logf("Bad face index\n");
 		return;
 	}
+	unbatchModel(modelIdx);
 
 	BSPFACE& face = map->faces[faceIdx];
 	BSPTEXTUREINFO& texinfo = map->texinfos[face.iTextureInfo];
@@ -1213,16 +1278,19 @@ void BspRenderer::updateFaceUVs(int faceIdx) {
 	rgroup->buffer->upload();
 }
 
-bool BspRenderer::getRenderPointers(int faceIdx, RenderFace** renderFace, RenderGroup** renderGroup) {
-	int modelIdx = map->get_model_from_face(faceIdx);
+bool BspRenderer::getRenderPointers(int faceIdx, RenderFace** renderFace, RenderGroup** renderGroup, int* modelIdx) {
+	int faceModelIdx = map->get_model_from_face(faceIdx);
 
-	if (modelIdx == -1) {
+	if (faceModelIdx == -1) {
 		return false;
 	}
 
-	int relativeFaceIdx = faceIdx - map->models[modelIdx].iFirstFace;
-	*renderFace = &renderModels[modelIdx].renderFaces[relativeFaceIdx];
-	*renderGroup = &renderModels[modelIdx].renderGroups[(*renderFace)->group];
+	int relativeFaceIdx = faceIdx - map->models[faceModelIdx].iFirstFace;
+	*renderFace = &renderModels[faceModelIdx].renderFaces[relativeFaceIdx];
+	*renderGroup = &renderModels[faceModelIdx].renderGroups[(*renderFace)->group];
+	if (modelIdx) {
+		*modelIdx = faceModelIdx;
+	}
 
 	return true;
 }
@@ -1233,12 +1301,28 @@ uint BspRenderer::getFaceTextureId(int faceIdx) {
 	return glTextures[texinfo.iMiptex]->id;
 }
 
-void BspRenderer::render(int highlightEnt, bool highlightAlwaysOnTop, int clipnodeHull) {
+void BspRenderer::render(int highlightEnt, bool highlightAlwaysOnTop, int clipnodeHull, const Frustum& frustum) {
 	BSPMODEL& world = map->models[0];
 	mapOffset = map->ents.size() ? map->ents[0]->getOrigin() : vec3();
 	vec3 renderOffset = mapOffset.flip();
 
+	Frustum localFrustum = frustum.toLocal(mapOffset);
+	updateWorldDrawRanges(localFrustum);
+
 	ShaderProgram* activeShader = (g_render_flags & RENDER_LIGHTMAPS) ? bspShader : fullBrightBspShader;
+	int shaderIdx = (g_render_flags & RENDER_LIGHTMAPS) ? 0 : 1;
+
+	// batching needs the entity offsets in the shader, otherwise every entity is drawn with its own call
+	bool batching = numRenderModels > 0 && entOffsetsEnabledIds[shaderIdx] != -1 && entOffsetsSizeIds[shaderIdx] != -1;
+	if (batching) {
+		if (entityBatchesDirty) {
+			buildEntityBatches();
+		}
+		if (entOffsetsDirty) {
+			updateEntityOffsets();
+		}
+	}
+	updateEntityBatchRanges(highlightEnt, localFrustum);
 
 	activeShader->bind();
 	activeShader->modelMat->loadIdentity();
@@ -1268,8 +1352,15 @@ void BspRenderer::render(int highlightEnt, bool highlightAlwaysOnTop, int clipno
 
 		drawModel(0, drawTransparentFaces, false, false);
 
+		if (batching) {
+			drawEntityBatches(drawTransparentFaces);
+		}
+
 		for (int i = 0, sz = map->ents.size(); i < sz; i++) {
 			if (renderEnts[i].modelIdx >= 0 && renderEnts[i].modelIdx < map->modelCount) {
+				if (!entVisible[i] || (batching && i != highlightEnt && isEntBatched(i))) {
+					continue;
+				}
 				activeShader->pushMatrix(MAT_MODEL);
 				*activeShader->modelMat = renderEnts[i].modelMat;
 				activeShader->modelMat->translate(renderOffset.x, renderOffset.y, renderOffset.z);
@@ -1300,6 +1391,9 @@ void BspRenderer::render(int highlightEnt, bool highlightAlwaysOnTop, int clipno
 					if (clipnodeHull == -1 && renderModels[renderEnts[i].modelIdx].groupCount > 0) {
 						continue; // skip rendering for models that have faces, if in auto mode
 					}
+					if (!entVisible[i]) {
+						continue;
+					}
 					colorShader->pushMatrix(MAT_MODEL);
 					*colorShader->modelMat = renderEnts[i].modelMat;
 					colorShader->modelMat->translate(renderOffset.x, renderOffset.y, renderOffset.z);
@@ -1344,6 +1438,359 @@ void BspRenderer::render(int highlightEnt, bool highlightAlwaysOnTop, int clipno
 	delayLoadData();
 }
 
+void BspRenderer::updateWorldDrawRanges(const Frustum& frustum) {
+	worldCulled = false;
+
+	if (!(g_render_flags & RENDER_VIS_CULLING) || numRenderModels <= 0 || !visCuller->getVisibleFaces(frustum, visibleFaces)) {
+		return;
+	}
+
+	RenderModel& world = renderModels[0];
+	int firstFace = map->models[0].iFirstFace;
+
+	worldDrawRanges.resize(world.groupCount);
+	for (int i = 0; i < world.groupCount; i++) {
+		DrawRanges& ranges = worldDrawRanges[i];
+		ranges.starts.clear();
+		ranges.counts.clear();
+		ranges.wireframeStarts.clear();
+		ranges.wireframeCounts.clear();
+	}
+
+	// faces were added to their groups in order, so sorting them lets neighboring faces share a range
+	sort(visibleFaces.begin(), visibleFaces.end());
+
+	for (int i = 0; i < visibleFaces.size(); i++) {
+		int faceIdx = visibleFaces[i] - firstFace;
+		if (faceIdx < 0 || faceIdx >= world.renderFaceCount) {
+			continue;
+		}
+
+		RenderFace& face = world.renderFaces[faceIdx];
+		DrawRanges& ranges = worldDrawRanges[face.group];
+
+		if (!ranges.starts.empty() && ranges.starts.back() + ranges.counts.back() == face.vertOffset) {
+			ranges.counts.back() += face.vertCount;
+			ranges.wireframeCounts.back() += face.wireframeVertCount;
+		}
+		else {
+			ranges.starts.push_back(face.vertOffset);
+			ranges.counts.push_back(face.vertCount);
+			ranges.wireframeStarts.push_back(face.wireframeVertOffset);
+			ranges.wireframeCounts.push_back(face.wireframeVertCount);
+		}
+	}
+
+	worldCulled = true;
+}
+
+bool BspRenderer::isEntVisible(int entIdx, const Frustum& frustum) {
+	RenderEnt& ent = renderEnts[entIdx];
+	BSPMODEL& model = map->models[ent.modelIdx];
+
+	return frustum.isBoxVisible(model.nMins + ent.offset, model.nMaxs + ent.offset);
+}
+
+// render groups with the same texture, lightmap atlases and transparency are drawn in the same batch
+struct EntityBatchKey {
+	Texture* texture;
+	Texture* lightmapAtlas[MAXLIGHTMAPS];
+	bool transparent;
+
+	EntityBatchKey(const RenderGroup& rgroup) {
+		texture = rgroup.texture;
+		transparent = rgroup.transparent;
+		for (int s = 0; s < MAXLIGHTMAPS; s++) {
+			lightmapAtlas[s] = rgroup.lightmapAtlas[s];
+		}
+	}
+
+	bool operator<(const EntityBatchKey& other) const {
+		std::less<Texture*> less;
+		if (texture != other.texture)
+			return less(texture, other.texture);
+		for (int s = 0; s < MAXLIGHTMAPS; s++) {
+			if (lightmapAtlas[s] != other.lightmapAtlas[s])
+				return less(lightmapAtlas[s], other.lightmapAtlas[s]);
+		}
+		return transparent < other.transparent;
+	}
+};
+
+void BspRenderer::buildEntityBatches() {
+	vector<bool> wasBatched = batchedModels;
+	deleteEntityBatches();
+	entityBatchesDirty = false;
+	entOffsetsDirty = true;
+
+	int entCount = map->ents.size();
+	batchedEntModels.assign(entCount, -1);
+	batchedModels.assign(numRenderModels, false);
+
+	vector<vector<entityVert>> batchVerts;
+	vector<vector<entityVert>> batchWireframeVerts;
+	std::map<EntityBatchKey, int> batchIndexes;
+
+	// skip worldspawn
+	for (int i = 1; i < entCount; i++) {
+		int modelIdx = renderEnts[i].modelIdx;
+		if (modelIdx <= 0 || modelIdx >= numRenderModels) {
+			continue;
+		}
+		RenderModel& model = renderModels[modelIdx];
+		batchedEntModels[i] = modelIdx;
+		batchedModels[modelIdx] = true;
+
+		for (int k = 0; k < model.groupCount; k++) {
+			RenderGroup& rgroup = model.renderGroups[k];
+			if (rgroup.vertCount == 0) {
+				continue;
+			}
+
+			auto inserted = batchIndexes.insert(make_pair(EntityBatchKey(rgroup), (int)entityBatches.size()));
+			int batchIdx = inserted.first->second;
+
+			if (inserted.second) {
+				EntityBatch newBatch = EntityBatch();
+				newBatch.texture = rgroup.texture;
+				newBatch.transparent = rgroup.transparent;
+				for (int s = 0; s < MAXLIGHTMAPS; s++) {
+					newBatch.lightmapAtlas[s] = rgroup.lightmapAtlas[s];
+				}
+				entityBatches.push_back(newBatch);
+				batchVerts.push_back(vector<entityVert>());
+				batchWireframeVerts.push_back(vector<entityVert>());
+			}
+
+			EntityBatch& batch = entityBatches[batchIdx];
+			vector<entityVert>& verts = batchVerts[batchIdx];
+			vector<entityVert>& wireframeVerts = batchWireframeVerts[batchIdx];
+
+			batch.ents.push_back(i);
+			batch.starts.push_back(verts.size());
+			batch.counts.push_back(rgroup.vertCount);
+			batch.wireframeStarts.push_back(wireframeVerts.size());
+			batch.wireframeCounts.push_back(rgroup.wireframeVertCount);
+
+			entityVert vert;
+			vert.entIdx = i;
+			for (int v = 0; v < rgroup.vertCount; v++) {
+				vert.vert = rgroup.verts[v];
+				verts.push_back(vert);
+			}
+			for (int v = 0; v < rgroup.wireframeVertCount; v++) {
+				vert.vert = rgroup.wireframeVerts[v];
+				wireframeVerts.push_back(vert);
+			}
+		}
+	}
+
+	ShaderProgram* activeShader = (g_render_flags & RENDER_LIGHTMAPS) ? bspShader : fullBrightBspShader;
+
+	for (int i = 0; i < entityBatches.size(); i++) {
+		EntityBatch& batch = entityBatches[i];
+
+		batch.vertCount = batchVerts[i].size();
+		batch.wireframeVertCount = batchWireframeVerts[i].size();
+
+		VertexBuffer* buffers[2];
+		for (int k = 0; k < 2; k++) {
+			buffers[k] = new VertexBuffer(activeShader, 0);
+			buffers[k]->addAttribute(TEX_2F, "vTex");
+			buffers[k]->addAttribute(3, GL_FLOAT, 0, "vLightmapTex0");
+			buffers[k]->addAttribute(3, GL_FLOAT, 0, "vLightmapTex1");
+			buffers[k]->addAttribute(3, GL_FLOAT, 0, "vLightmapTex2");
+			buffers[k]->addAttribute(3, GL_FLOAT, 0, "vLightmapTex3");
+			buffers[k]->addAttribute(4, GL_FLOAT, 0, "vColor");
+			buffers[k]->addAttribute(POS_3F, "vPosition");
+			buffers[k]->addAttribute(1, GL_FLOAT, 0, "vEntity");
+		}
+		batch.buffer = buffers[0];
+		batch.buffer->setData(batch.vertCount ? &batchVerts[i][0] : NULL, batch.vertCount);
+		batch.wireframeBuffer = buffers[1];
+		batch.wireframeBuffer->setData(batch.wireframeVertCount ? &batchWireframeVerts[i][0] : NULL, batch.wireframeVertCount);
+
+		batch.buffer->bindAttributes(true);
+		batch.wireframeBuffer->bindAttributes(true);
+		batch.buffer->upload();
+		batch.wireframeBuffer->upload();
+
+		// the vertexes are freed below. Only the vertex counts are needed to draw from the GPU copy.
+		batch.buffer->setData(NULL, batch.vertCount);
+		batch.wireframeBuffer->setData(NULL, batch.wireframeVertCount);
+	}
+
+	// batched models are drawn from the batches, so their own GPU buffers aren't needed until they're unbatched.
+	// If they're drawn unbatched anyway (e.g. when highlighted), they're drawn from their CPU copies.
+	for (int i = 0; i < numRenderModels; i++) {
+		bool batchedBefore = i < wasBatched.size() && wasBatched[i];
+		if (batchedModels[i] != batchedBefore) {
+			uploadModelBuffers(i, !batchedModels[i]);
+		}
+	}
+}
+
+void BspRenderer::deleteEntityBatches() {
+	for (int i = 0; i < entityBatches.size(); i++) {
+		EntityBatch& batch = entityBatches[i];
+		delete batch.buffer;
+		delete batch.wireframeBuffer;
+	}
+	entityBatches.clear();
+	batchedEntModels.clear();
+	batchedModels.clear();
+}
+
+void BspRenderer::unbatchModel(int modelIdx, bool reupload) {
+	if (modelIdx < 0 || modelIdx >= batchedModels.size() || !batchedModels[modelIdx]) {
+		return;
+	}
+
+	batchedModels[modelIdx] = false;
+	if (reupload) {
+		uploadModelBuffers(modelIdx, true);
+	}
+}
+
+void BspRenderer::uploadModelBuffers(int modelIdx, bool upload) {
+	if (modelIdx < 0 || modelIdx >= numRenderModels) {
+		return;
+	}
+
+	RenderModel& model = renderModels[modelIdx];
+	for (int k = 0; k < model.groupCount; k++) {
+		model.renderGroups[k].buffer->deleteBuffer();
+		model.renderGroups[k].wireframeBuffer->deleteBuffer();
+		if (upload) {
+			model.renderGroups[k].buffer->upload();
+			model.renderGroups[k].wireframeBuffer->upload();
+		}
+	}
+}
+
+bool BspRenderer::isEntBatched(int entIdx) {
+	if (entIdx < 0 || entIdx >= batchedEntModels.size() || batchedEntModels[entIdx] < 0) {
+		return false;
+	}
+	int modelIdx = batchedEntModels[entIdx];
+	return modelIdx == renderEnts[entIdx].modelIdx && batchedModels[modelIdx];
+}
+
+void BspRenderer::updateEntityOffsets() {
+	int entCount = map->ents.size();
+	int height = max(1, (entCount + ENT_OFFSET_TEX_WIDTH - 1) / ENT_OFFSET_TEX_WIDTH);
+
+	vector<float> offsets(ENT_OFFSET_TEX_WIDTH * height * 3, 0.0f);
+	for (int i = 0; i < entCount; i++) {
+		vec3 offset = renderEnts[i].offset.flip();
+		offsets[i * 3 + 0] = offset.x;
+		offsets[i * 3 + 1] = offset.y;
+		offsets[i * 3 + 2] = offset.z;
+	}
+
+	glActiveTexture(GL_TEXTURE1 + MAXLIGHTMAPS);
+	if (!entOffsetTexId) {
+		glGenTextures(1, &entOffsetTexId);
+		glBindTexture(GL_TEXTURE_2D, entOffsetTexId);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+	}
+	else {
+		glBindTexture(GL_TEXTURE_2D, entOffsetTexId);
+	}
+
+	if (height != entOffsetTexHeight) {
+		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB32F, ENT_OFFSET_TEX_WIDTH, height, 0, GL_RGB, GL_FLOAT, &offsets[0]);
+		entOffsetTexHeight = height;
+	}
+	else {
+		glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, ENT_OFFSET_TEX_WIDTH, height, GL_RGB, GL_FLOAT, &offsets[0]);
+	}
+	glActiveTexture(GL_TEXTURE0);
+
+	entOffsetsDirty = false;
+}
+
+void BspRenderer::updateEntityBatchRanges(int highlightEnt, const Frustum& frustum) {
+	bool culling = g_render_flags & RENDER_VIS_CULLING;
+
+	entVisible.resize(map->ents.size());
+	for (int i = 0; i < entVisible.size(); i++) {
+		int modelIdx = renderEnts[i].modelIdx;
+		entVisible[i] = !culling || (modelIdx >= 0 && modelIdx < map->modelCount && isEntVisible(i, frustum));
+	}
+
+	for (int i = 0; i < entityBatches.size(); i++) {
+		EntityBatch& batch = entityBatches[i];
+		DrawRanges& ranges = batch.visible;
+		ranges.starts.clear();
+		ranges.counts.clear();
+		ranges.wireframeStarts.clear();
+		ranges.wireframeCounts.clear();
+
+		for (int k = 0; k < batch.ents.size(); k++) {
+			int entIdx = batch.ents[k];
+
+			// the highlighted entity and edited models are drawn separately
+			if (entIdx == highlightEnt || !entVisible[entIdx] || !isEntBatched(entIdx)) {
+				continue;
+			}
+
+			if (!ranges.starts.empty() && ranges.starts.back() + ranges.counts.back() == batch.starts[k]) {
+				ranges.counts.back() += batch.counts[k];
+				ranges.wireframeCounts.back() += batch.wireframeCounts[k];
+			}
+			else {
+				ranges.starts.push_back(batch.starts[k]);
+				ranges.counts.push_back(batch.counts[k]);
+				ranges.wireframeStarts.push_back(batch.wireframeStarts[k]);
+				ranges.wireframeCounts.push_back(batch.wireframeCounts[k]);
+			}
+		}
+	}
+}
+
+void BspRenderer::drawEntityBatches(bool transparent) {
+	int shaderIdx = (g_render_flags & RENDER_LIGHTMAPS) ? 0 : 1;
+
+	glActiveTexture(GL_TEXTURE1 + MAXLIGHTMAPS);
+	glBindTexture(GL_TEXTURE_2D, entOffsetTexId);
+	glUniform1f(entOffsetsEnabledIds[shaderIdx], 1.0f);
+	glUniform2f(entOffsetsSizeIds[shaderIdx], ENT_OFFSET_TEX_WIDTH, entOffsetTexHeight);
+
+	for (int i = 0; i < entityBatches.size(); i++) {
+		EntityBatch& batch = entityBatches[i];
+		DrawRanges& ranges = batch.visible;
+
+		if (batch.transparent != transparent || ranges.starts.empty()) {
+			continue;
+		}
+		if (batch.transparent && !(g_render_flags & RENDER_SPECIAL_ENTS)) {
+			continue;
+		}
+		if (!batch.transparent && !(g_render_flags & RENDER_ENTS)) {
+			continue;
+		}
+
+		if (g_render_flags & RENDER_WIREFRAME) {
+			glActiveTexture(GL_TEXTURE0);
+			blueTex->bind();
+			glActiveTexture(GL_TEXTURE1);
+			whiteTex->bind();
+
+			batch.wireframeBuffer->drawRanges(GL_LINES, &ranges.wireframeStarts[0], &ranges.wireframeCounts[0], ranges.starts.size());
+		}
+
+		bindGroupTextures(batch.texture, batch.lightmapAtlas, false);
+
+		batch.buffer->drawRanges(GL_TRIANGLES, &ranges.starts[0], &ranges.counts[0], ranges.starts.size());
+	}
+
+	glUniform1f(entOffsetsEnabledIds[shaderIdx], 0.0f);
+}
+
 void BspRenderer::drawModel(int modelIdx, bool transparent, bool highlight, bool edgesOnly) {
 
 	if (edgesOnly) {
@@ -1380,6 +1827,11 @@ void BspRenderer::drawModel(int modelIdx, bool transparent, bool highlight, bool
 		else if (modelIdx != 0 && !(g_render_flags & RENDER_ENTS)) {
 			continue;
 		}
+
+		DrawRanges* ranges = (modelIdx == 0 && worldCulled) ? &worldDrawRanges[i] : NULL;
+		if (ranges && ranges->starts.empty()) {
+			continue;
+		}
 		
 		if (highlight || (g_render_flags & RENDER_WIREFRAME)) {
 			glActiveTexture(GL_TEXTURE0);
@@ -1394,49 +1846,63 @@ void BspRenderer::drawModel(int modelIdx, bool transparent, bool highlight, bool
 			glActiveTexture(GL_TEXTURE1);
 			whiteTex->bind();
 
-			rgroup.wireframeBuffer->draw(GL_LINES);
+			if (ranges) {
+				rgroup.wireframeBuffer->drawRanges(GL_LINES, &ranges->wireframeStarts[0], &ranges->wireframeCounts[0], ranges->starts.size());
+			}
+			else {
+				rgroup.wireframeBuffer->draw(GL_LINES);
+			}
 		}
 
 
-		glActiveTexture(GL_TEXTURE0);
-		if (texturesLoaded && g_render_flags & RENDER_TEXTURES) {
-			rgroup.texture->bind();
+		bindGroupTextures(rgroup.texture, rgroup.lightmapAtlas, highlight);
+
+		if (ranges) {
+			rgroup.buffer->drawRanges(GL_TRIANGLES, &ranges->starts[0], &ranges->counts[0], ranges->starts.size());
 		}
 		else {
-			whiteTex->bind();
+			rgroup.buffer->draw(GL_TRIANGLES);
 		}
+	}
+}
 
-		if (g_render_flags & RENDER_LIGHTMAPS) {
-			for (int s = 0; s < MAXLIGHTMAPS; s++) {
-				glActiveTexture(GL_TEXTURE1 + s);
+void BspRenderer::bindGroupTextures(Texture* texture, Texture** lightmapAtlas, bool highlight) {
+	glActiveTexture(GL_TEXTURE0);
+	if (texturesLoaded && g_render_flags & RENDER_TEXTURES) {
+		texture->bind();
+	}
+	else {
+		whiteTex->bind();
+	}
+
+	if (g_render_flags & RENDER_LIGHTMAPS) {
+		for (int s = 0; s < MAXLIGHTMAPS; s++) {
+			glActiveTexture(GL_TEXTURE1 + s);
 
 
-				if (highlight) {
-					redTex->bind();
-				}
-				else if (lightmapsUploaded) {
-					if (showLightFlag != -1)
+			if (highlight) {
+				redTex->bind();
+			}
+			else if (lightmapsUploaded) {
+				if (showLightFlag != -1)
+				{
+					if (showLightFlag == s)
 					{
-						if (showLightFlag == s)
-						{
-							blackTex->bind();
-							continue;
-						}
+						blackTex->bind();
+						continue;
 					}
-					rgroup.lightmapAtlas[s]->bind();
+				}
+				lightmapAtlas[s]->bind();
+			}
+			else {
+				if (s == 0) {
+					greyTex->bind();
 				}
 				else {
-					if (s == 0) {
-						greyTex->bind();
-					}
-					else {
-						blackTex->bind();
-					}
+					blackTex->bind();
 				}
 			}
 		}
-
-		rgroup.buffer->draw(GL_TRIANGLES);
 	}
 }
 
@@ -1567,25 +2033,23 @@ bool BspRenderer::pickModelPoly(vec3 start, vec3 dir, vec3 offset, int modelIdx,
 	bool foundBetterPick = false;
 	bool skipSpecial = !(g_render_flags & RENDER_SPECIAL);
 
-	for (int k = 0; k < model.nFaces; k++) {
+	getFaceBvh(modelIdx).trace(start, dir, pickInfo.bestDist, [&](int k, float& bestDist) {
 		FaceMath& faceMath = faceMaths[model.iFirstFace + k];
 		BSPFACE& face = map->faces[model.iFirstFace + k];
-		
+
 		if (skipSpecial && modelIdx == 0) {
 			BSPTEXTUREINFO& info = map->texinfos[face.iTextureInfo];
 			if (info.nFlags & TEX_SPECIAL) {
-				continue;
+				return;
 			}
 		}
 
-		float t = pickInfo.bestDist;
-		if (pickFaceMath(start, dir, faceMath, t)) {
+		if (pickFaceMath(start, dir, faceMath, bestDist)) {
 			foundBetterPick = true;
 			pickInfo.valid = true;
-			pickInfo.bestDist = t;
 			pickInfo.faceIdx = model.iFirstFace + k;
 		}
-	}
+	});
 
 	bool selectWorldClips = modelIdx == 0 && (g_render_flags & RENDER_WORLD_CLIPNODES) && hullIdx != -1;
 	bool selectEntClips = modelIdx > 0 && (g_render_flags & RENDER_ENT_CLIPNODES);
@@ -1596,45 +2060,57 @@ bool BspRenderer::pickModelPoly(vec3 start, vec3 dir, vec3 offset, int modelIdx,
 	}
 
 	if (clipnodesLoaded && (selectWorldClips || selectEntClips) && hullIdx != -1) {
-		for (int i = 0; i < renderClipnodes[modelIdx].faceMaths[hullIdx].size(); i++) {
-			FaceMath& faceMath = renderClipnodes[modelIdx].faceMaths[hullIdx][i];
+		vector<FaceMath>& clipFaceMaths = renderClipnodes[modelIdx].faceMaths[hullIdx];
+		Bvh& clipBvh = renderClipnodes[modelIdx].faceMathBvh[hullIdx];
+
+		if (!clipBvh.isBuilt()) {
+			vector<vec3> mins(clipFaceMaths.size());
+			vector<vec3> maxs(clipFaceMaths.size());
+			for (int i = 0; i < clipFaceMaths.size(); i++) {
+				mins[i] = clipFaceMaths[i].mins;
+				maxs[i] = clipFaceMaths[i].maxs;
+			}
+			clipBvh.build(mins, maxs);
+		}
 
-			float t = pickInfo.bestDist;
-			if (pickFaceMath(start, dir, faceMath, t)) {
+		clipBvh.trace(start, dir, pickInfo.bestDist, [&](int i, float& bestDist) {
+			if (pickFaceMath(start, dir, clipFaceMaths[i], bestDist)) {
 				foundBetterPick = true;
 				pickInfo.valid = true;
-				pickInfo.bestDist = t;
 				pickInfo.faceIdx = -1;
 			}
-		}
+		});
 	}
 
 	return foundBetterPick;
 }
 
-bool BspRenderer::pickFaceMath(vec3 start, vec3 dir, FaceMath& faceMath, float& bestDist) {
-	float dot = dotProduct(dir, faceMath.normal);
-	if (dot >= 0) {
-		return false; // don't select backfaces or parallel faces
+Bvh& BspRenderer::getFaceBvh(int modelIdx) {
+	if (faceBvhs.size() < map->modelCount) {
+		faceBvhs.resize(map->modelCount);
 	}
 
-	float t = dotProduct((faceMath.normal * faceMath.fdist) - start, faceMath.normal) / dot;
-	if (t < 0 || t >= bestDist) {
-		return false; // intersection behind camera, or not a better pick
+	Bvh& bvh = faceBvhs[modelIdx];
+	if (!bvh.isBuilt()) {
+		BSPMODEL& model = map->models[modelIdx];
+		vector<vec3> mins(model.nFaces);
+		vector<vec3> maxs(model.nFaces);
+		for (int i = 0; i < model.nFaces; i++) {
+			mins[i] = faceMaths[model.iFirstFace + i].mins;
+			maxs[i] = faceMaths[model.iFirstFace + i].maxs;
+		}
+		bvh.build(mins, maxs);
 	}
 
-	// transform intersection point to the plane's coordinate system
-	vec3 intersection = start + dir * t;
-	vec2 localRayPoint = (faceMath.worldToLocal * vec4(intersection, 1)).xy();
+	return bvh;
+}
 
-	// check if point is inside the polygon using the plane's 2D coordinate system
-	if (!pointInsidePolygon(faceMath.localVerts, localRayPoint)) {
+bool BspRenderer::pickFaceMath(vec3 start, vec3 dir, FaceMath& faceMath, float& bestDist) {
+	if (!faceMath.pick(start, dir, bestDist)) {
 		return false;
 	}
 
-	bestDist = t;
-	g_app->debugVec0 = intersection;
-
+	g_app->debugVec0 = start + dir * bestDist;
 	return true;
 }
 
@@ -4,12 +4,22 @@
 #include <GLFW/glfw3.h>
 #include "Texture.h"
 #include "ShaderProgram.h"
-#include "LightmapNode.h"
+#include "LightmapPacker.h"
 #include "VertexBuffer.h"
 #include "primitives.h"
 #include "PointEntRenderer.h"
+#include "Bvh.h"
+#include "VisCuller.h"
+#include "FaceMath.h"
 
-#define LIGHTMAP_ATLAS_SIZE 512
+// smallest allowed lightmap atlas. Atlases can be as big as the GPU allows (see AppSettings::lightmapAtlasSize).
+#define LIGHTMAP_ATLAS_MIN_SIZE 128
+
+// time spent uploading decoded textures per frame while a map is loading
+#define TEXTURE_UPLOAD_MS 4
+
+// width of the texture that holds the origins of batched entities
+#define ENT_OFFSET_TEX_WIDTH 256
 
 enum RenderFlags {
 	RENDER_TEXTURES = 1,
@@ -22,7 +32,8 @@ enum RenderFlags {
 	RENDER_ORIGIN = 128,
 	RENDER_WORLD_CLIPNODES = 256,
 	RENDER_ENT_CLIPNODES = 512,
-	RENDER_ENT_CONNECTIONS = 1024
+	RENDER_ENT_CONNECTIONS = 1024,
+	RENDER_VIS_CULLING = 2048
 };
 
 struct LightmapInfo {
@@ -37,13 +48,6 @@ struct LightmapInfo {
 	float midPolyU, midPolyV;
 };
 
-struct FaceMath {
-	mat4x4 worldToLocal; // transforms world coordiantes to this face's plane's coordinate system
-	vec3 normal;
-	float fdist;
-	vector<vec2> localVerts;
-};
-
 struct RenderEnt {
 	mat4x4 modelMat; // model matrix for rendering
 	vec3 offset; // vertex transformations for picking
@@ -67,6 +71,43 @@ struct RenderFace {
 	int group;
 	int vertOffset;
 	int vertCount;
+	int wireframeVertOffset;
+	int wireframeVertCount;
+};
+
+// vertex ranges of a render group that are drawn this frame
+struct DrawRanges {
+	vector<int> starts;
+	vector<int> counts;
+	vector<int> wireframeStarts;
+	vector<int> wireframeCounts;
+};
+
+struct entityVert {
+	lightmapVert vert;
+	float entIdx; // the shader moves the vertex by this entity's origin
+};
+
+// Render groups of all solid entities that share the same textures, merged into one buffer so that they can be
+// drawn with a single call instead of one call and one matrix upload per entity. The merged vertexes are only kept
+// in GPU memory, and the models in the batch free their own GPU buffers until they're unbatched.
+struct EntityBatch {
+	int vertCount;
+	int wireframeVertCount;
+	Texture* texture;
+	Texture* lightmapAtlas[MAXLIGHTMAPS];
+	VertexBuffer* buffer;
+	VertexBuffer* wireframeBuffer;
+	bool transparent;
+
+	// entity and vertex ranges of each render group in the batch
+	vector<int> ents;
+	vector<int> starts;
+	vector<int> counts;
+	vector<int> wireframeStarts;
+	vector<int> wireframeCounts;
+
+	DrawRanges visible; // groups drawn this frame
 };
 
 struct RenderModel {
@@ -80,6 +121,7 @@ struct RenderClipnodes {
 	VertexBuffer* clipnodeBuffer[MAX_MAP_HULLS];
 	VertexBuffer* wireframeClipnodeBuffer[MAX_MAP_HULLS];
 	vector<FaceMath> faceMaths[MAX_MAP_HULLS];
+	Bvh faceMathBvh[MAX_MAP_HULLS]; // built on the first pick
 };
 
 struct PickInfo {
@@ -103,7 +145,8 @@ public:
 	BspRenderer(Bsp* map, ShaderProgram* bspShader, ShaderProgram* fullBrightBspShader, ShaderProgram* colorShader, PointEntRenderer* fgd);
 	~BspRenderer();
 
-	void render(int highlightEnt, bool highlightAlwaysOnTop, int clipnodeHull);
+	// frustum is the camera's view, used to skip models that are off screen when RENDER_VIS_CULLING is set
+	void render(int highlightEnt, bool highlightAlwaysOnTop, int clipnodeHull, const Frustum& frustum);
 
 	void drawModel(int modelIdx, bool transparent, bool highlight, bool edgesOnly);
 	void drawModelClipnodes(int modelIdx, bool highlight, int hullIdx);
@@ -152,12 +195,37 @@ private:
 	RenderModel* renderModels = NULL;
 	RenderClipnodes* renderClipnodes = NULL;
 	FaceMath* faceMaths = NULL;
+
+	// picking BVHs over the faces of each model, built on the first pick (see getFaceBvh)
+	vector<Bvh> faceBvhs;
+
+	VisCuller* visCuller = NULL;
+	bool worldCulled = false; // draw only worldDrawRanges of the world model this frame
+	vector<int> visibleFaces;
+	vector<DrawRanges> worldDrawRanges; // per render group of the world model
+
+	vector<EntityBatch> entityBatches;
+	vector<int> batchedEntModels; // model of each entity when the batches were built, or -1 if it wasn't batched
+	vector<bool> batchedModels; // models drawn from the batches, which have no GPU buffers of their own
+	vector<bool> entVisible; // entities that pass frustum culling this frame
+	bool entityBatchesDirty = true;
+	bool entOffsetsDirty = true;
+	uint entOffsetTexId = 0;
+	int entOffsetTexHeight = 0;
+	int entOffsetsEnabledIds[2]; // uniform locations in bspShader and fullBrightBspShader
+	int entOffsetsSizeIds[2];
 	VertexBuffer* pointEnts = NULL;
 
-	// textures loaded in a separate thread
-	Texture** glTexturesSwap;
+	// textures loaded in a separate thread, until they replace glTextures (see delayLoadData)
+	Texture** glTexturesSwap = NULL;
+	int numSwapTextures = 0;
+
+	// indexes of textures in glTexturesSwap that finished decoding and may need uploading
+	vector<int> decodedTextures;
+	mutex decodedTexturesMutex;
 
 	int numLightmapAtlases;
+	int lightmapAtlasSize; // width and height of the lightmap atlases
 	int numRenderModels;
 	int numRenderClipnodes;
 	int numRenderLightmapInfos;
@@ -196,9 +264,33 @@ private:
 	void deleteRenderClipnodes();
 	void deleteRenderFaces();
 	void deleteTextures();
+	void deleteTexturesSwap();
 	void deleteLightmapTextures();
 	void deleteFaceMaths();
+	Bvh& getFaceBvh(int modelIdx);
 	void delayLoadData();
-	bool getRenderPointers(int faceIdx, RenderFace** renderFace, RenderGroup** renderGroup);
+
+	// uploads decoded textures until TEXTURE_UPLOAD_MS is used up. Returns true if none are left waiting.
+	bool uploadDecodedTextures();
+	bool getRenderPointers(int faceIdx, RenderFace** renderFace, RenderGroup** renderGroup, int* modelIdx=NULL);
+	void bindGroupTextures(Texture* texture, Texture** lightmapAtlas, bool highlight);
+
+	// merges the render groups of solid entities into batches. Models that change later are drawn unbatched
+	// until the batches are rebuilt by preRenderFaces or preRenderEnts.
+	void buildEntityBatches();
+	void deleteEntityBatches();
+
+	// draw the model on its own again. Its GPU buffers are uploaded again unless reupload is false
+	// (when the caller is about to replace them anyway).
+	void unbatchModel(int modelIdx, bool reupload=true);
+	void uploadModelBuffers(int modelIdx, bool upload);
+	bool isEntBatched(int entIdx);
+	void updateEntityOffsets();
+	void updateEntityBatchRanges(int highlightEnt, const Frustum& frustum);
+	void drawEntityBatches(bool transparent);
+
+	// finds the world faces that are visible from the camera and merges them into draw ranges
+	void updateWorldDrawRanges(const Frustum& frustum);
+	bool isEntVisible(int entIdx, const Frustum& frustum);
 	int getBestClipnodeHull(int modelIdx);
 };
\ No newline at end of file
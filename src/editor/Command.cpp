@@ -198,14 +198,6 @@ DuplicateBspModelCommand::DuplicateBspModelCommand(string desc, PickInfo& pickIn
 	this->entIdx = pickInfo.entIdx;
 	this->initialized = false;
 	this->allowedDuringLoad = false;
-	memset(&oldLumps, 0, sizeof(LumpState));
-}
-
-DuplicateBspModelCommand::~DuplicateBspModelCommand() {
-	for (int i = 0; i < HEADER_LUMPS; i++) {
-		if (oldLumps.lumps[i])
-			delete[] oldLumps.lumps[i];
-	}
 }
 
 void DuplicateBspModelCommand::execute() {
@@ -215,7 +207,7 @@ void DuplicateBspModelCommand::execute() {
 
 	if (!initialized) {
 		int dupLumps = CLIPNODES | EDGES | FACES | NODES | PLANES | SURFEDGES | TEXINFO | VERTICES | LIGHTING | MODELS;
-		oldLumps = map->duplicate_lumps(dupLumps);
+		oldLumps = map->duplicate_lumps(dupLumps, &g_app->undoLumpState);
 		initialized = true;
 	}
 
@@ -268,13 +260,11 @@ void DuplicateBspModelCommand::undo() {
 }
 
 int DuplicateBspModelCommand::memoryUsage() {
-	int size = sizeof(DuplicateBspModelCommand);
-
-	for (int i = 0; i < HEADER_LUMPS; i++) {
-		size += oldLumps.lumpLen[i];
-	}
+	return sizeof(DuplicateBspModelCommand);
+}
 
-	return size;
+void DuplicateBspModelCommand::getLumpStates(vector<const LumpState*>& states) {
+	states.push_back(&oldLumps);
 }
 
 
@@ -286,14 +276,9 @@ CreateBspModelCommand::CreateBspModelCommand(string desc, int mapIdx, Entity* en
 	*this->entData = *entData;
 	this->size = size;
 	this->initialized = false;
-	memset(&oldLumps, 0, sizeof(LumpState));
 }
 
 CreateBspModelCommand::~CreateBspModelCommand() {
-	for (int i = 0; i < HEADER_LUMPS; i++) {
-		if (oldLumps.lumps[i])
-			delete[] oldLumps.lumps[i];
-	}
 	if (entData != nullptr)
 	{
 		delete entData;
@@ -312,7 +297,7 @@ void CreateBspModelCommand::execute() {
 		if (aaatriggerIdx == -1) {
 			dupLumps |= TEXTURES;
 		}
-		oldLumps = map->duplicate_lumps(dupLumps);
+		oldLumps = map->duplicate_lumps(dupLumps, &g_app->undoLumpState);
 	}
 
 	// add the aaatrigger texture if it doesn't already exist
@@ -355,13 +340,11 @@ void CreateBspModelCommand::undo() {
 }
 
 int CreateBspModelCommand::memoryUsage() {
-	int size = sizeof(DuplicateBspModelCommand);
-
-	for (int i = 0; i < HEADER_LUMPS; i++) {
-		size += oldLumps.lumpLen[i];
-	}
+	return sizeof(CreateBspModelCommand) + entData->getMemoryUsage();
+}
 
-	return size;
+void CreateBspModelCommand::getLumpStates(vector<const LumpState*>& states) {
+	states.push_back(&oldLumps);
 }
 
 int CreateBspModelCommand::getDefaultTextureIdx() {
@@ -409,15 +392,6 @@ EditBspModelCommand::EditBspModelCommand(string desc, PickInfo& pickInfo, LumpSt
 	this->newOrigin = pickInfo.ent->getOrigin();
 }
 
-EditBspModelCommand::~EditBspModelCommand() {
-	for (int i = 0; i < HEADER_LUMPS; i++) {
-		if (oldLumps.lumps[i])
-			delete[] oldLumps.lumps[i];
-		if (newLumps.lumps[i])
-			delete[] newLumps.lumps[i];
-	}
-}
-
 void EditBspModelCommand::execute() {
 	Bsp* map = getBsp();
 	BspRenderer* renderer = getBspRenderer();
@@ -449,7 +423,7 @@ void EditBspModelCommand::refresh() {
 	renderer->refreshModel(modelIdx);
 	renderer->refreshEnt(entIdx);
 	g_app->gui->refresh();
-	g_app->saveLumpState(map, 0xffffff, true);
+	g_app->saveLumpState(map, 0xffffff);
 	g_app->updateEntityState(ent);
 
 	if (g_app->pickInfo.entIdx == entIdx) {
@@ -458,13 +432,12 @@ void EditBspModelCommand::refresh() {
 }
 
 int EditBspModelCommand::memoryUsage() {
-	int size = sizeof(DuplicateBspModelCommand);
-
-	for (int i = 0; i < HEADER_LUMPS; i++) {
-		size += oldLumps.lumpLen[i] + newLumps.lumpLen[i];
-	}
+	return sizeof(EditBspModelCommand);
+}
 
-	return size;
+void EditBspModelCommand::getLumpStates(vector<const LumpState*>& states) {
+	states.push_back(&oldLumps);
+	states.push_back(&newLumps);
 }
 
 
@@ -477,13 +450,6 @@ CleanMapCommand::CleanMapCommand(string desc, int mapIdx, LumpState oldLumps) :
 	this->allowedDuringLoad = false;
 }
 
-CleanMapCommand::~CleanMapCommand() {
-	for (int i = 0; i < HEADER_LUMPS; i++) {
-		if (oldLumps.lumps[i])
-			delete[] oldLumps.lumps[i];
-	}
-}
-
 void CleanMapCommand::execute() {
 	Bsp* map = getBsp();
 	BspRenderer* renderer = getBspRenderer();
@@ -509,17 +475,15 @@ void CleanMapCommand::refresh() {
 	renderer->reload();
 	g_app->deselectObject();
 	g_app->gui->refresh();
-	g_app->saveLumpState(map, 0xffffffff, true);
+	g_app->saveLumpState(map, 0xffffffff);
 }
 
 int CleanMapCommand::memoryUsage() {
-	int size = sizeof(CleanMapCommand);
-
-	for (int i = 0; i < HEADER_LUMPS; i++) {
-		size += oldLumps.lumpLen[i];
-	}
+	return sizeof(CleanMapCommand);
+}
 
-	return size;
+void CleanMapCommand::getLumpStates(vector<const LumpState*>& states) {
+	states.push_back(&oldLumps);
 }
 
 
@@ -532,13 +496,6 @@ OptimizeMapCommand::OptimizeMapCommand(string desc, int mapIdx, LumpState oldLum
 	this->allowedDuringLoad = false;
 }
 
-OptimizeMapCommand::~OptimizeMapCommand() {
-	for (int i = 0; i < HEADER_LUMPS; i++) {
-		if (oldLumps.lumps[i])
-			delete[] oldLumps.lumps[i];
-	}
-}
-
 void OptimizeMapCommand::execute() {
 	Bsp* map = getBsp();
 	BspRenderer* renderer = getBspRenderer();
@@ -572,15 +529,13 @@ void OptimizeMapCommand::refresh() {
 	renderer->reload();
 	g_app->deselectObject();
 	g_app->gui->refresh();
-	g_app->saveLumpState(map, 0xffffffff, true);
+	g_app->saveLumpState(map, 0xffffffff);
 }
 
 int OptimizeMapCommand::memoryUsage() {
-	int size = sizeof(OptimizeMapCommand);
-
-	for (int i = 0; i < HEADER_LUMPS; i++) {
-		size += oldLumps.lumpLen[i];
-	}
+	return sizeof(OptimizeMapCommand);
+}
 
-	return size;
+void OptimizeMapCommand::getLumpStates(vector<const LumpState*>& states) {
+	states.push_back(&oldLumps);
 }
\ No newline at end of file
@@ -17,6 +17,10 @@ public:
 	virtual void execute() = 0;
 	virtual void undo() = 0;
 	virtual int memoryUsage() = 0;
+
+	// lump snapshots held by the command. These share chunks with each other, so they aren't included in
+	// memoryUsage() and are counted by the renderer instead.
+	virtual void getLumpStates(vector<const LumpState*>& states) {}
 	
 	BspRenderer* getBspRenderer();
 	Bsp* getBsp();
@@ -78,11 +82,11 @@ public:
 	bool initialized = false;
 
 	DuplicateBspModelCommand(string desc, PickInfo& pickInfo);
-	~DuplicateBspModelCommand();
 
 	void execute();
 	void undo();
 	int memoryUsage();
+	void getLumpStates(vector<const LumpState*>& states);
 };
 
 
@@ -99,6 +103,7 @@ public:
 	void execute();
 	void undo();
 	int memoryUsage();
+	void getLumpStates(vector<const LumpState*>& states);
 
 private:
 	int getDefaultTextureIdx();
@@ -116,12 +121,12 @@ public:
 	LumpState newLumps = LumpState();
 
 	EditBspModelCommand(string desc, PickInfo& pickInfo, LumpState oldLumps, LumpState newLumps, vec3 oldOrigin);
-	~EditBspModelCommand();
 
 	void execute();
 	void undo();
 	void refresh();
 	int memoryUsage();
+	void getLumpStates(vector<const LumpState*>& states);
 };
 
 
@@ -130,12 +135,12 @@ public:
 	LumpState oldLumps = LumpState();
 
 	CleanMapCommand(string desc, int mapIdx, LumpState oldLumps);
-	~CleanMapCommand();
 
 	void execute();
 	void undo();
 	void refresh();
 	int memoryUsage();
+	void getLumpStates(vector<const LumpState*>& states);
 };
 
 
@@ -144,10 +149,10 @@ public:
 	LumpState oldLumps = LumpState();
 
 	OptimizeMapCommand(string desc, int mapIdx, LumpState oldLumps);
-	~OptimizeMapCommand();
 
 	void execute();
 	void undo();
 	void refresh();
 	int memoryUsage();
+	void getLumpStates(vector<const LumpState*>& states);
 };
@@ -0,0 +1,58 @@
+#include "FaceMath.h"
+#include "util.h"
+#include <cfloat>
+
+bool FaceMath::init(const vec3& normal, float fdist, const vector<vec3>& verts) {
+	this->normal = normal;
+	this->fdist = fdist;
+
+	// 2 verts can share the same position on a face, so need to find one that isn't shared (aomdc_1intro)
+	vec3 v1;
+	bool found = false;
+	for (int i = 1; i < verts.size(); i++) {
+		if (verts[i] != verts[0]) {
+			v1 = verts[i];
+			found = true;
+			break;
+		}
+	}
+
+	vec3 plane_x = (v1 - verts[0]).normalize(1.0f);
+	vec3 plane_y = crossProduct(normal, plane_x).normalize(1.0f);
+	vec3 plane_z = normal;
+	worldToLocal = worldToLocalTransform(plane_x, plane_y, plane_z);
+
+	localVerts = vector<vec2>(verts.size());
+	mins = vec3(FLT_MAX, FLT_MAX, FLT_MAX);
+	maxs = vec3(-FLT_MAX, -FLT_MAX, -FLT_MAX);
+	for (int i = 0; i < verts.size(); i++) {
+		localVerts[i] = (worldToLocal * vec4(verts[i], 1)).xy();
+		expandBoundingBox(verts[i], mins, maxs);
+	}
+
+	return found;
+}
+
+bool FaceMath::pick(const vec3& start, const vec3& dir, float& bestDist) const {
+	float dot = dotProduct(dir, normal);
+	if (dot >= 0) {
+		return false; // don't select backfaces or parallel faces
+	}
+
+	float t = dotProduct((normal * fdist) - start, normal) / dot;
+	if (t < 0 || t >= bestDist) {
+		return false; // intersection behind camera, or not a better pick
+	}
+
+	// transform intersection point to the plane's coordinate system
+	vec3 intersection = start + dir * t;
+	vec2 localRayPoint = (worldToLocal * vec4(intersection, 1)).xy();
+
+	// check if point is inside the polygon using the plane's 2D coordinate system
+	if (!pointInsidePolygon(localVerts, localRayPoint)) {
+		return false;
+	}
+
+	bestDist = t;
+	return true;
+}
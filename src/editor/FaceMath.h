@@ -0,0 +1,21 @@
+#pragma once
+#include "vectors.h"
+#include "mat4x4.h"
+#include <vector>
+
+// A polygon in its plane's coordinate system, for picking faces with a ray. Doesn't use GL.
+struct FaceMath {
+	mat4x4 worldToLocal; // transforms world coordiantes to this face's plane's coordinate system
+	vec3 normal;
+	float fdist;
+	std::vector<vec2> localVerts;
+	vec3 mins, maxs; // bounding box of the face, for the picking BVHs
+
+	// calculates the plane's coordinate system and the bounding box of the polygon.
+	// Returns false if all of the verts are in the same place.
+	bool init(const vec3& normal, float fdist, const std::vector<vec3>& verts);
+
+	// returns true and sets bestDist to the distance along the ray if the ray hits the front of the polygon
+	// before bestDist
+	bool pick(const vec3& start, const vec3& dir, float& bestDist) const;
+};
@@ -4,6 +4,8 @@
 #include "VertexBuffer.h"
 #include "shaders.h"
 #include "Renderer.h"
+#include "TextureCache.h"
+#include "FrameStats.h"
 #include <lodepng.h>
 #include <algorithm>
 
@@ -526,6 +528,8 @@ void ImportWad(Bsp* map, Renderer* app)
 		for (int i = 0; i < tmpWad->numTex; i++)
 		{
 			WADTEX* wadTex = tmpWad->readTexture(i);
+			if (!wadTex)
+				continue;
 			int lastMipSize = (wadTex->nWidth / 8) * (wadTex->nHeight / 8);
 
 			COLOR3* palette = (COLOR3*)(wadTex->data + wadTex->nOffsets[3] + lastMipSize + 2 - 40);
@@ -591,10 +595,10 @@ void Gui::drawMenuBar() {
 					map->delete_embedded_textures();
 					if (map->ents.size())
 					{
-						std::string wadstr = map->ents[0]->keyvalues["wad"];
+						std::string wadstr = map->ents[0]->getKeyvalue("wad");
 						if (wadstr.find(map->name + ".wad" + ";") == std::string::npos)
 						{
-							map->ents[0]->keyvalues["wad"] += map->name + ".wad" + ";";
+							map->ents[0]->setOrAddKeyvalue("wad", wadstr + map->name + ".wad" + ";");
 						}
 					}
 				}
@@ -794,14 +798,14 @@ void Gui::drawMenuBar() {
 
 		if (ImGui::MenuItem("Clean", 0, false, !app->isLoading && mapSelected)) {
 			CleanMapCommand* command = new CleanMapCommand("Clean " + map->name, app->pickInfo.mapIdx, app->undoLumpState);
-			g_app->saveLumpState(map, 0xffffffff, false);
+			g_app->saveLumpState(map, 0xffffffff);
 			command->execute();
 			app->pushUndoCommand(command);
 		}
 
 		if (ImGui::MenuItem("Optimize", 0, false, !app->isLoading && mapSelected)) {
 			OptimizeMapCommand* command = new OptimizeMapCommand("Optimize " + map->name, app->pickInfo.mapIdx, app->undoLumpState);
-			g_app->saveLumpState(map, 0xffffffff, false);
+			g_app->saveLumpState(map, 0xffffffff);
 			command->execute();
 			app->pushUndoCommand(command);
 		}
@@ -1149,6 +1153,14 @@ void Gui::drawDebugWidget() {
 			ImGui::Text("Angles: %d %d %d", (int)app->cameraAngles.x, (int)app->cameraAngles.y, (int)app->cameraAngles.z);
 		}
 
+		if (ImGui::CollapsingHeader("Rendering", ImGuiTreeNodeFlags_DefaultOpen))
+		{
+			ImGui::Text("Draw calls: %d", g_last_frame_stats.drawCalls);
+			ImGui::Text("Texture binds: %d", g_last_frame_stats.textureBinds);
+			ImGui::Text("Shader binds: %d", g_last_frame_stats.shaderBinds);
+			ImGui::Text("Matrix updates: %d", g_last_frame_stats.matrixUpdates);
+		}
+
 		if (app->pickInfo.valid) {
 			Bsp* map = app->pickInfo.map;
 			Entity* ent = app->pickInfo.ent;
@@ -1274,7 +1286,7 @@ void Gui::drawKeyvalueEditor() {
 			Entity* ent = app->pickInfo.ent;
 			BSPMODEL& model = map->models[app->pickInfo.modelIdx];
 			BSPFACE& face = map->faces[app->pickInfo.faceIdx];
-			string cname = ent->keyvalues["classname"];
+			string cname = ent->getKeyvalue("classname");
 			FgdClass* fgdClass = app->fgd->getFgdClass(cname);
 
 			ImGui::PushFont(largeFont);
@@ -1369,7 +1381,7 @@ void Gui::drawKeyvalueEditor() {
 }
 
 void Gui::drawKeyvalueEditor_SmartEditTab(Entity* ent) {
-	string cname = ent->keyvalues["classname"];
+	string cname = ent->getKeyvalue("classname");
 	FgdClass* fgdClass = app->fgd->getFgdClass(cname);
 	ImGuiStyle& style = ImGui::GetStyle();
 
@@ -1406,7 +1418,7 @@ void Gui::drawKeyvalueEditor_SmartEditTab(Entity* ent) {
 			if (key == "spawnflags") {
 				continue;
 			}
-			string value = ent->keyvalues[key];
+			string value = ent->getKeyvalue(key);
 			string niceName = keyvalue.description;
 
 			if (value.empty() && keyvalue.defaultValue.length()) {
@@ -1518,8 +1530,8 @@ void Gui::drawKeyvalueEditor_SmartEditTab(Entity* ent) {
 void Gui::drawKeyvalueEditor_FlagsTab(Entity* ent) {
 	ImGui::BeginChild("FlagsWindow");
 
-	uint spawnflags = strtoul(ent->keyvalues["spawnflags"].c_str(), NULL, 10);
-	FgdClass* fgdClass = app->fgd->getFgdClass(ent->keyvalues["classname"]);
+	uint spawnflags = strtoul(ent->getKeyvalue("spawnflags").c_str(), NULL, 10);
+	FgdClass* fgdClass = app->fgd->getFgdClass(ent->getKeyvalue("classname"));
 
 	ImGui::Columns(2, "keyvalcols", true);
 
@@ -1605,13 +1617,13 @@ void Gui::drawKeyvalueEditor_RawEditTab(Entity* ent) {
 			InputData* inputData = (InputData*)data->UserData;
 			Entity* ent = inputData->entRef;
 
-			string key = ent->keyOrder[inputData->idx];
+			string key = ent->getKey(inputData->idx);
 			if (key != data->Buf) {
 				ent->renameKey(inputData->idx, data->Buf);
 				inputData->bspRenderer->refreshEnt(inputData->entIdx);
 				if (key == "model" || string(data->Buf) == "model") {
 					inputData->bspRenderer->preRenderEnts();
-					g_app->saveLumpState(inputData->bspRenderer->map, 0xffffffff, false);
+					g_app->saveLumpState(inputData->bspRenderer->map, 0xffffffff);
 				}
 				g_app->updateEntConnections();
 			}
@@ -1622,14 +1634,14 @@ void Gui::drawKeyvalueEditor_RawEditTab(Entity* ent) {
 		static int keyValueChanged(ImGuiInputTextCallbackData* data) {
 			InputData* inputData = (InputData*)data->UserData;
 			Entity* ent = inputData->entRef;
-			string key = ent->keyOrder[inputData->idx];
+			string key = ent->getKey(inputData->idx);
 
-			if (ent->keyvalues[key] != data->Buf) {
+			if (ent->getValue(inputData->idx) != data->Buf) {
 				ent->setOrAddKeyvalue(key, data->Buf);
 				inputData->bspRenderer->refreshEnt(inputData->entIdx);
 				if (key == "model") {
 					inputData->bspRenderer->preRenderEnts();
-					g_app->saveLumpState(inputData->bspRenderer->map, 0xffffffff, false);
+					g_app->saveLumpState(inputData->bspRenderer->map, 0xffffffff);
 				}
 				g_app->updateEntConnections();
 			}
@@ -1671,7 +1683,7 @@ void Gui::drawKeyvalueEditor_RawEditTab(Entity* ent) {
 	bool keyDragging = false;
 
 	float startY = 0;
-	for (int i = 0; i < ent->keyOrder.size() && i < MAX_KEYS_PER_ENT; i++) {
+	for (int i = 0; i < ent->getKeyCount() && i < MAX_KEYS_PER_ENT; i++) {
 		const char* item = dragIds[i];
 
 		{
@@ -1697,14 +1709,12 @@ void Gui::drawKeyvalueEditor_RawEditTab(Entity* ent) {
 			if (ImGui::IsItemActive() && !ImGui::IsItemHovered())
 			{
 				int n_next = (ImGui::GetMousePos().y - startY) / (ImGui::GetItemRectSize().y + style.FramePadding.y * 2);
-				if (n_next >= 0 && n_next < ent->keyOrder.size() && n_next < MAX_KEYS_PER_ENT)
+				if (n_next >= 0 && n_next < ent->getKeyCount() && n_next < MAX_KEYS_PER_ENT)
 				{
 					dragIds[i] = dragIds[n_next];
 					dragIds[n_next] = item;
 
-					string temp = ent->keyOrder[i];
-					ent->keyOrder[i] = ent->keyOrder[n_next];
-					ent->keyOrder[n_next] = temp;
+					ent->swapKeys(i, n_next);
 
 					// fix false-positive error highlight
 					ignoreErrors = 2;
@@ -1716,8 +1726,8 @@ void Gui::drawKeyvalueEditor_RawEditTab(Entity* ent) {
 			ImGui::NextColumn();
 		}
 
-		string key = ent->keyOrder[i];
-		string value = ent->keyvalues[key];
+		string key = ent->getKey(i);
+		string value = ent->getValue(i);
 
 		{
 			bool invalidKey = ignoreErrors == 0 && lastPickCount == app->pickCount && key != keyNames[i];
@@ -1914,7 +1924,7 @@ void Gui::drawTransformWidget() {
 					z = fz = last_fz = activeAxes.origin.z;
 				}
 				else {
-					vec3 ori = ent->hasKey("origin") ? parseVector(ent->keyvalues["origin"]) : vec3();
+					vec3 ori = ent->hasKey("origin") ? parseVector(ent->getKeyvalue("origin")) : vec3();
 					if (app->originSelected) {
 						ori = app->transformedOrigin;
 					}
@@ -2340,6 +2350,21 @@ void Gui::drawSettings() {
 				shouldReloadFonts = true;
 			}
 			ImGui::DragInt("Undo Levels", &app->undoLevels, 0.05f, 0, 64);
+			if (ImGui::DragInt("Texture Cache", &g_settings.textureCacheSize, 1.0f, 0, 4096, "%d MB")) {
+				g_texture_cache.setMemoryLimit((uint64_t)g_settings.textureCacheSize * 1024 * 1024);
+			}
+			if (ImGui::IsItemHovered() && g.HoveredIdTimer > g_tooltip_delay) {
+				ImGui::BeginTooltip();
+				ImGui::TextUnformatted("Memory for WAD textures that open maps are no longer using.\n\nThey are kept so that opening or reloading maps which use the same WADs is faster.");
+				ImGui::EndTooltip();
+			}
+			ImGui::DragInt("Lightmap Atlas", &g_settings.lightmapAtlasSize, 4.0f, LIGHTMAP_ATLAS_MIN_SIZE, 8192, "%d pixels");
+			if (ImGui::IsItemHovered() && g.HoveredIdTimer > g_tooltip_delay) {
+				ImGui::BeginTooltip();
+				ImGui::TextUnformatted("Size of the textures that lightmaps are packed into. Bigger atlases render faster because fewer textures are switched, "
+					"but are limited to the max texture size of the GPU.\n\nApplies to maps opened after changing it.");
+				ImGui::EndTooltip();
+			}
 			ImGui::Checkbox("Verbose Logging", &g_verbose);
 			ImGui::Checkbox("Make map backup", &g_settings.backUpMap);
 			if (ImGui::IsItemHovered() && g.HoveredIdTimer > g_tooltip_delay) {
@@ -2414,6 +2439,7 @@ void Gui::drawSettings() {
 			bool renderWorldClipnodes = g_render_flags & RENDER_WORLD_CLIPNODES;
 			bool renderEntClipnodes = g_render_flags & RENDER_ENT_CLIPNODES;
 			bool renderEntConnections = g_render_flags & RENDER_ENT_CONNECTIONS;
+			bool renderVisCulling = g_render_flags & RENDER_VIS_CULLING;
 
 			ImGui::Text("Render Flags:");
 
@@ -2439,6 +2465,16 @@ void Gui::drawSettings() {
 					app->updateEntConnections();
 				}
 			}
+			if (ImGui::Checkbox("Vis Culling", &renderVisCulling)) {
+				g_render_flags ^= RENDER_VIS_CULLING;
+			}
+			if (ImGui::IsItemHovered() && g.HoveredIdTimer > g_tooltip_delay) {
+				ImGui::BeginTooltip();
+				ImGui::TextUnformatted("Only draw world faces that the map's VIS data says can be seen from the camera,\n"
+					"and skip solid entities that are off screen.\n\n"
+					"Faces are drawn normally while the camera is outside of the map or if the map has no VIS data.");
+				ImGui::EndTooltip();
+			}
 
 			ImGui::NextColumn();
 
@@ -2869,7 +2905,7 @@ void Gui::drawEntityReport() {
 				visibleEnts.clear();
 				for (int i = 1; i < map->ents.size(); i++) {
 					Entity* ent = map->ents[i];
-					string cname = ent->keyvalues["classname"];
+					string cname = ent->getKeyvalue("classname");
 
 					bool visible = true;
 
@@ -2884,12 +2920,12 @@ void Gui::drawEntityReport() {
 							string searchKey = trimSpaces(toLowerCase(keyFilter[k]));
 
 							bool foundKey = false;
-							string actualKey;
-							for (int c = 0; c < ent->keyOrder.size(); c++) {
-								string key = toLowerCase(ent->keyOrder[c]);
+							string actualValue;
+							for (int c = 0; c < ent->getKeyCount(); c++) {
+								string key = toLowerCase(ent->getKey(c));
 								if (key == searchKey || (partialMatches && key.find(searchKey) != string::npos)) {
 									foundKey = true;
-									actualKey = key;
+									actualValue = ent->getValue(c);
 									break;
 								}
 							}
@@ -2900,8 +2936,8 @@ void Gui::drawEntityReport() {
 
 							string searchValue = trimSpaces(toLowerCase(valueFilter[k]));
 							if (!searchValue.empty()) {
-								if ((partialMatches && ent->keyvalues[actualKey].find(searchValue) == string::npos) ||
-									(!partialMatches && ent->keyvalues[actualKey] != searchValue)) {
+								if ((partialMatches && actualValue.find(searchValue) == string::npos) ||
+									(!partialMatches && actualValue != searchValue)) {
 									visible = false;
 									break;
 								}
@@ -2910,8 +2946,8 @@ void Gui::drawEntityReport() {
 						else if (strlen(valueFilter[k]) > 0) {
 							string searchValue = trimSpaces(toLowerCase(valueFilter[k]));
 							bool foundMatch = false;
-							for (int c = 0; c < ent->keyOrder.size(); c++) {
-								string val = toLowerCase(ent->keyvalues[ent->keyOrder[c]]);
+							for (int c = 0; c < ent->getKeyCount(); c++) {
+								string val = toLowerCase(ent->getValue(c));
 								if (val == searchValue || (partialMatches && val.find(searchValue) != string::npos)) {
 									foundMatch = true;
 									break;
@@ -2945,7 +2981,7 @@ void Gui::drawEntityReport() {
 					int i = line;
 					int entIdx = visibleEnts[i];
 					Entity* ent = map->ents[entIdx];
-					string cname = ent->keyvalues["classname"];
+					string cname = ent->getKeyvalue("classname");
 
 					if (ImGui::Selectable((cname + "##ent" + to_string(i)).c_str(), selectedItems[i], ImGuiSelectableFlags_AllowDoubleClick)) {
 						if (expected_key_mod_flags & ImGuiKeyModFlags_Ctrl) {
@@ -3037,7 +3073,7 @@ void Gui::drawEntityReport() {
 
 					for (int i = 1; i < map->ents.size(); i++) {
 						Entity* ent = map->ents[i];
-						string cname = ent->keyvalues["classname"];
+						string cname = ent->getKeyvalue("classname");
 
 						if (uniqueClasses.find(cname) == uniqueClasses.end()) {
 							usedClasses.push_back(cname);
@@ -3862,8 +3898,8 @@ ModelInfo Gui::calcModelStat(Bsp* map, STRUCTUSAGE* modelInfo, uint val, uint ma
 	string targetname = modelInfo->modelIdx == 0 ? "" : "???";
 	for (int k = 0; k < map->ents.size(); k++) {
 		if (map->ents[k]->getBspModelIdx() == modelInfo->modelIdx) {
-			targetname = map->ents[k]->keyvalues["targetname"];
-			classname = map->ents[k]->keyvalues["classname"];
+			targetname = map->ents[k]->getKeyvalue("targetname");
+			classname = map->ents[k]->getKeyvalue("classname");
 			stat.entIdx = k;
 		}
 	}
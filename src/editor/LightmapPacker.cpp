@@ -0,0 +1,125 @@
+#include "LightmapPacker.h"
+#include "util.h"
+#include <algorithm>
+
+LightmapPacker::LightmapPacker(int atlasSize) {
+	this->atlasSize = atlasSize;
+}
+
+bool LightmapPacker::pack(vector<Rect>& rects) {
+	vector<int> order(rects.size());
+	for (int i = 0; i < order.size(); i++) {
+		order[i] = i;
+	}
+	stable_sort(order.begin(), order.end(), [&](int a, int b) {
+		if (rects[a].h != rects[b].h) {
+			return rects[a].h > rects[b].h;
+		}
+		return rects[a].w > rects[b].w;
+	});
+
+	bool allFit = true;
+
+	for (int i = 0; i < order.size(); i++) {
+		Rect& rect = rects[order[i]];
+		rect.atlas = -1;
+
+		if (rect.w <= 0 || rect.h <= 0 || rect.w > atlasSize || rect.h > atlasSize) {
+			allFit = false;
+			continue;
+		}
+
+		int bestAtlas = -1;
+		int bestSeg = -1;
+		int bestY = 0;
+		int bestTop = atlasSize + 1;
+
+		for (int a = 0; a < skylines.size() && bestTop > rect.h; a++) {
+			vector<Segment>& skyline = skylines[a];
+
+			for (int s = 0; s < skyline.size(); s++) {
+				int y = fitHeight(skyline, s, rect.w, rect.h);
+				if (y != -1 && y + rect.h < bestTop) {
+					bestAtlas = a;
+					bestSeg = s;
+					bestY = y;
+					bestTop = y + rect.h;
+				}
+			}
+		}
+
+		if (bestAtlas == -1) {
+			Segment empty = { 0, 0, atlasSize };
+			skylines.push_back(vector<Segment>(1, empty));
+			bestAtlas = skylines.size() - 1;
+			bestSeg = 0;
+			bestY = 0;
+		}
+
+		rect.atlas = bestAtlas;
+		rect.x = skylines[bestAtlas][bestSeg].x;
+		rect.y = bestY;
+		place(skylines[bestAtlas], bestSeg, bestY, rect.w, rect.h);
+		usedArea += (int64_t)rect.w * rect.h;
+	}
+
+	return allFit;
+}
+
+float LightmapPacker::getUtilization() const {
+	if (skylines.empty()) {
+		return 0;
+	}
+	return (double)usedArea / ((double)skylines.size() * atlasSize * atlasSize);
+}
+
+int LightmapPacker::fitHeight(const vector<Segment>& skyline, int segIdx, int w, int h) const {
+	if (skyline[segIdx].x + w > atlasSize) {
+		return -1;
+	}
+
+	// the rect rests on the highest segment below it. Segments span the whole atlas width,
+	// so the ones it covers can't run out.
+	int y = 0;
+	int widthLeft = w;
+	for (int i = segIdx; widthLeft > 0; i++) {
+		y = max(y, skyline[i].y);
+		if (y + h > atlasSize) {
+			return -1;
+		}
+		widthLeft -= skyline[i].w;
+	}
+
+	return y;
+}
+
+void LightmapPacker::place(vector<Segment>& skyline, int segIdx, int y, int w, int h) {
+	Segment top = { skyline[segIdx].x, y + h, w };
+	skyline.insert(skyline.begin() + segIdx, top);
+
+	// cut the segments that are now covered by the rect
+	int right = top.x + top.w;
+	for (int i = segIdx + 1; i < skyline.size(); ) {
+		if (skyline[i].x >= right) {
+			break;
+		}
+		int overlap = right - skyline[i].x;
+		skyline[i].x += overlap;
+		skyline[i].w -= overlap;
+		if (skyline[i].w > 0) {
+			break;
+		}
+		skyline.erase(skyline.begin() + i);
+	}
+
+	// merge neighbors at the same height so the next searches have fewer segments to try
+	for (int i = 0; i + 1 < skyline.size(); ) {
+		if (skyline[i].y == skyline[i + 1].y) {
+			skyline[i].w += skyline[i + 1].w;
+			skyline.erase(skyline.begin() + i + 1);
+		}
+		else {
+			i++;
+		}
+	}
+}
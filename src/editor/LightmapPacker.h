@@ -0,0 +1,44 @@
+#pragma once
+#include <vector>
+#include <stdint.h>
+
+// Packs lightmaps into square atlases. Every atlas keeps a skyline of its filled area (the top edge of the
+// lightmaps placed so far, as a list of horizontal segments). Each lightmap goes to the atlas and position
+// where its top edge ends up lowest, so gaps in older atlases are filled before a new atlas is opened.
+// Doesn't use GL, only positions are calculated.
+class LightmapPacker
+{
+public:
+	struct Rect {
+		int w, h;
+		int atlas; // set by pack(), or -1 if the rect didn't fit
+		int x, y;
+	};
+
+	LightmapPacker(int atlasSize);
+
+	// assigns an atlas and position to every rect. Tall rects are placed first because that packs tighter,
+	// but the order of the vector is kept. Returns false if a rect is empty or bigger than an atlas.
+	bool pack(std::vector<Rect>& rects);
+
+	int getAtlasSize() const { return atlasSize; }
+	int getAtlasCount() const { return (int)skylines.size(); }
+
+	// fraction of the atlas area covered by rects, from 0 to 1
+	float getUtilization() const;
+
+private:
+	struct Segment {
+		int x, y, w;
+	};
+
+	int atlasSize;
+	std::vector<std::vector<Segment>> skylines; // segments of each atlas, ordered by x
+	int64_t usedArea = 0;
+
+	// returns the y a rect would be placed at if its left edge starts at the segment, or -1 if it doesn't fit
+	int fitHeight(const std::vector<Segment>& skyline, int segIdx, int w, int h) const;
+
+	// raises the skyline under a rect placed at the segment
+	void place(std::vector<Segment>& skyline, int segIdx, int y, int w, int h);
+};
@@ -18,7 +18,7 @@ PointEntRenderer::~PointEntRenderer() {
 }
 
 EntCube* PointEntRenderer::getEntCube(Entity* ent) {
-	string cname = ent->keyvalues["classname"];
+	string cname = ent->getKeyvalue("classname");
 
 	if (cubeMap.find(cname) != cubeMap.end()) {
 		return cubeMap[cname];
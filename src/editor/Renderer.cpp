@@ -4,6 +4,8 @@
 #include "VertexBuffer.h"
 #include "shaders.h"
 #include "Gui.h"
+#include "TextureCache.h"
+#include "FrameStats.h"
 #include <algorithm>
 #include <map>
 
@@ -72,6 +74,8 @@ void AppSettings::loadDefault()
 	valid = false;
 	undoLevels = 64;
 	verboseLogs = false;
+	textureCacheSize = 256;
+	lightmapAtlasSize = 1024;
 
 	debug_open = false;
 	keyvalue_open = false;
@@ -139,6 +143,8 @@ void AppSettings::load() {
 			else if (key == "render_flags") { g_settings.render_flags = atoi(val.c_str()); }
 			else if (key == "font_size") { g_settings.fontSize = atoi(val.c_str()); }
 			else if (key == "undo_levels") { g_settings.undoLevels = atoi(val.c_str()); }
+			else if (key == "texture_cache_mb") { g_settings.textureCacheSize = atoi(val.c_str()); }
+			else if (key == "lightmap_atlas_size") { g_settings.lightmapAtlasSize = atoi(val.c_str()); }
 			else if (key == "gamedir") { g_settings.gamedir = val; }
 			else if (key == "workingdir") { g_settings.workingdir = val; }
 			else if (key == "fgd") { fgdPaths.push_back(val);  }
@@ -233,6 +239,8 @@ void AppSettings::save() {
 	file << "render_flags=" << g_settings.render_flags << endl;
 	file << "font_size=" << g_settings.fontSize << endl;
 	file << "undo_levels=" << g_settings.undoLevels << endl;
+	file << "texture_cache_mb=" << g_settings.textureCacheSize << endl;
+	file << "lightmap_atlas_size=" << g_settings.lightmapAtlasSize << endl;
 	file << "savebackup=" << g_settings.backUpMap << endl;
 }
 
@@ -294,11 +302,20 @@ Renderer::Renderer() {
 
 	gui = new Gui(this);
 
-	bspShader = new ShaderProgram(g_shader_multitexture_vertex, g_shader_multitexture_fragment);
+	// batched solid entities read their origins from a texture in the vertex shader. Without vertex shader
+	// textures the offsets are compiled out, and BspRenderer draws each entity with its own matrix instead.
+	GLint vertexTextureUnits = 0;
+	glGetIntegerv(GL_MAX_VERTEX_TEXTURE_IMAGE_UNITS, &vertexTextureUnits);
+	string bspShaderDefines = vertexTextureUnits > 0 ? "#define ENTITY_OFFSETS\n" : "";
+	if (vertexTextureUnits <= 0) {
+		logf("Vertex shader textures are not supported. Solid entities will not be batched.\n");
+	}
+
+	bspShader = new ShaderProgram((bspShaderDefines + g_shader_multitexture_vertex).c_str(), g_shader_multitexture_fragment);
 	bspShader->setMatrixes(&model, &view, &projection, &modelView, &modelViewProjection);
 	bspShader->setMatrixNames(NULL, "modelViewProjection");
 
-	fullBrightBspShader = new ShaderProgram(g_shader_fullbright_vertex, g_shader_fullbright_fragment);
+	fullBrightBspShader = new ShaderProgram((bspShaderDefines + g_shader_fullbright_vertex).c_str(), g_shader_fullbright_fragment);
 	fullBrightBspShader->setMatrixes(&model, &view, &projection, &modelView, &modelViewProjection);
 	fullBrightBspShader->setMatrixNames(NULL, "modelViewProjection");
 
@@ -329,8 +346,6 @@ Renderer::Renderer() {
 	reloading = true;
 	fgdFuture = async(launch::async, &Renderer::loadFgds, this);
 
-	memset(&undoLumpState, 0, sizeof(LumpState));
-
 	//cameraOrigin = vec3(51, 427, 234);
 	//cameraAngles = vec3(41, 0, -170);
 }
@@ -401,6 +416,9 @@ void Renderer::renderLoop() {
 		}
 		glfwPollEvents();
 
+		g_last_frame_stats = g_frame_stats;
+		g_frame_stats = FrameStats();
+
 		float frameDelta = glfwGetTime() - lastFrameTime;
 		frameTimeScale = 0.05f / frameDelta;
 		float fps = 1.0f / frameDelta;
@@ -423,13 +441,18 @@ void Renderer::renderLoop() {
 
 		drawEntConnections();
 
+		vec3 forward, right, up;
+		makeVectors(cameraAngles, forward, right, up);
+		float aspect = windowHeight > 0 ? (float)windowWidth / (float)windowHeight : 1.0f;
+		Frustum frustum = Frustum(cameraOrigin, forward, up, fov, aspect, zFar);
+
 		isLoading = reloading;
 		for (int i = 0; i < mapRenderers.size(); i++) {
 			int highlightEnt = -1;
 			if (pickInfo.valid && pickInfo.mapIdx == i && pickMode == PICK_OBJECT) {
 				highlightEnt = pickInfo.entIdx;
 			}
-			mapRenderers[i]->render(highlightEnt, transformTarget == TRANSFORM_VERTEX, clipnodeRenderHull);
+			mapRenderers[i]->render(highlightEnt, transformTarget == TRANSFORM_VERTEX, clipnodeRenderHull, frustum);
 
 			if (!mapRenderers[i]->isFinishedLoading()) {
 				isLoading = true;
@@ -499,8 +522,6 @@ void Renderer::renderLoop() {
 			}
 		}
 
-		vec3 forward, right, up;
-		makeVectors(cameraAngles, forward, right, up);
 		//logf("DRAW %.1f %.1f %.1f -> %.1f %.1f %.1f\n", pickStart.x, pickStart.y, pickStart.z, pickDir.x, pickDir.y, pickDir.z);
 
 		if (!g_app->hideGui)
@@ -613,6 +634,7 @@ void Renderer::loadSettings() {
 	undoLevels = g_settings.undoLevels;
 	rotationSpeed = g_settings.rotSpeed;
 	moveSpeed = g_settings.moveSpeed;
+	g_texture_cache.setMemoryLimit((uint64_t)g_settings.textureCacheSize * 1024 * 1024);
 
 	gui->shouldReloadFonts = true;
 
@@ -1558,6 +1580,9 @@ void Renderer::setupView() {
 }
 
 void Renderer::addMap(Bsp* map) {
+	// maps stay open in the editor for a long time, so don't keep the file mapped (and locked on Windows)
+	map->unmap_file();
+
 	BspRenderer* mapRenderer = new BspRenderer(map, bspShader, fullBrightBspShader, colorShader, pointEntRenderer);
 
 	mapRenderers.push_back(mapRenderer);
@@ -1663,7 +1688,7 @@ void Renderer::drawNodes(Bsp* map, int iNode, int& currentPlane, int activePlane
 }
 
 vec3 Renderer::getEntOrigin(Bsp* map, Entity* ent) {
-	vec3 origin = ent->hasKey("origin") ? parseVector(ent->keyvalues["origin"]) : vec3(0, 0, 0);
+	vec3 origin = ent->hasKey("origin") ? parseVector(ent->getKeyvalue("origin")) : vec3(0, 0, 0);
 	return origin + getEntOffset(map, ent);
 }
 
@@ -1706,7 +1731,7 @@ void Renderer::updateDragAxes() {
 
 			scaleAxes.origin = modelOrigin;
 			if (ent->hasKey("origin")) {
-				scaleAxes.origin += parseVector(ent->keyvalues["origin"]);
+				scaleAxes.origin += parseVector(ent->getKeyvalue("origin"));
 			}
 		}
 	}
@@ -2000,18 +2025,28 @@ void Renderer::updateEntConnections() {
 		vector<Entity*> callerAndTarget; // both a target and a caller
 		string thisName;
 		if (pickInfo.ent->hasKey("targetname")) {
-			thisName = pickInfo.ent->keyvalues["targetname"];
+			thisName = pickInfo.ent->getKeyvalue("targetname");
+		}
+
+		// only the entities that share a name with the picked entity are checked
+		set<Entity*> linkedEnts;
+		for (int i = 0; i < targetNames.size(); i++) {
+			vector<Entity*> named = map->get_targetname_ents(targetNames[i]);
+			linkedEnts.insert(named.begin(), named.end());
+		}
+		if (thisName.length()) {
+			vector<Entity*> named = map->get_targeting_ents(thisName);
+			linkedEnts.insert(named.begin(), named.end());
 		}
 
-		for (int k = 0; k < map->ents.size(); k++) {
-			Entity* ent = map->ents[k];
+		linkedEnts.erase(pickInfo.ent);
+
+		for (auto it = linkedEnts.begin(); it != linkedEnts.end(); ++it) {
+			Entity* ent = *it;
 
-			if (k == pickInfo.entIdx)
-				continue;
-			
 			bool isTarget = false;
 			if (ent->hasKey("targetname")) {
-				string tname = ent->keyvalues["targetname"];
+				string tname = ent->getKeyvalue("targetname");
 				for (int i = 0; i < targetNames.size(); i++) {
 					if (tname == targetNames[i]) {
 						isTarget = true;
@@ -2738,7 +2773,7 @@ void Renderer::selectEnt(Bsp* map, int entIdx) {
 	updateEntConnections();
 	updateEntityState(pickInfo.ent);
 	if (pickInfo.ent->isBspModel())
-		saveLumpState(pickInfo.map, 0xffffffff, true);
+		saveLumpState(pickInfo.map, 0xffffffff);
 	pickCount++; // force transform window update
 }
 
@@ -2783,15 +2818,14 @@ void Renderer::updateEntityState(Entity* ent) {
 	undoEntOrigin = ent->getOrigin();
 }
 
-void Renderer::saveLumpState(Bsp* map, int targetLumps, bool deleteOldState) {
-	if (deleteOldState) {
-		for (int i = 0; i < HEADER_LUMPS; i++) {
-			if (undoLumpState.lumps[i])
-				delete[] undoLumpState.lumps[i];
-		}
-	}
+void Renderer::saveLumpState(Bsp* map, int targetLumps) {
+	// chunks still referenced by undo commands stay alive after the old state is replaced
+	LumpState newState = map->duplicate_lumps(targetLumps, &undoLumpState);
 
-	undoLumpState = map->duplicate_lumps(targetLumps);
+	// the new state is counted before the old one is dropped, so the chunks they share stay counted
+	undoMemoryUsage += newState.updateChunkRefs(undoChunkRefs, 1);
+	undoMemoryUsage += undoLumpState.updateChunkRefs(undoChunkRefs, -1);
+	undoLumpState = newState;
 }
 
 void Renderer::pushEntityUndoState(string actionDesc) {
@@ -2801,17 +2835,17 @@ void Renderer::pushEntityUndoState(string actionDesc) {
 	}
 
 	bool anythingToUndo = true;
-	if (undoEntityState->keyOrder.size() == pickInfo.ent->keyOrder.size()) {
+	if (undoEntityState->getKeyCount() == pickInfo.ent->getKeyCount()) {
 		bool keyvaluesDifferent = false;
-		for (int i = 0; i < undoEntityState->keyOrder.size(); i++) {
-			string oldKey = undoEntityState->keyOrder[i];
-			string newKey = pickInfo.ent->keyOrder[i];
+		for (int i = 0; i < undoEntityState->getKeyCount(); i++) {
+			const string& oldKey = undoEntityState->getKey(i);
+			const string& newKey = pickInfo.ent->getKey(i);
 			if (oldKey != newKey) {
 				keyvaluesDifferent = true;
 				break;
 			}
-			string oldVal = undoEntityState->keyvalues[oldKey];
-			string newVal = pickInfo.ent->keyvalues[oldKey];
+			const string& oldVal = undoEntityState->getValue(i);
+			const string& newVal = pickInfo.ent->getValue(i);
 			if (oldVal != newVal) {
 				keyvaluesDifferent = true;
 				break;
@@ -2834,14 +2868,16 @@ void Renderer::pushModelUndoState(string actionDesc, int targetLumps) {
 		return;
 	}
 	
-	LumpState newLumps = pickInfo.map->duplicate_lumps(targetLumps);
+	// unchanged chunks are shared with the last saved state, so comparing the chunk lists finds the edited lumps
+	LumpState oldLumps = undoLumpState;
+	LumpState newLumps = pickInfo.map->duplicate_lumps(targetLumps, &undoLumpState);
 
 	bool differences[HEADER_LUMPS] = { false };
 
 	bool anyDifference = false;
 	for (int i = 0; i < HEADER_LUMPS; i++) {
-		if (newLumps.lumps[i] && undoLumpState.lumps[i]) {
-			if (newLumps.lumpLen[i] != undoLumpState.lumpLen[i] || memcmp(newLumps.lumps[i], undoLumpState.lumps[i], newLumps.lumpLen[i]) != 0) {
+		if (newLumps.hasLump[i] && oldLumps.hasLump[i]) {
+			if (!newLumps.sameLump(oldLumps, i)) {
 				anyDifference = true;
 				differences[i] = true;
 			}
@@ -2853,19 +2889,17 @@ void Renderer::pushModelUndoState(string actionDesc, int targetLumps) {
 		return;
 	}
 
-	// delete lumps that have no differences to save space
+	// drop lumps that have no differences, so the command only references the edited lumps
 	for (int i = 0; i < HEADER_LUMPS; i++) {
 		if (!differences[i]) {
-			delete[] undoLumpState.lumps[i];
-			delete[] newLumps.lumps[i];
-			undoLumpState.lumps[i] = newLumps.lumps[i] = NULL;
-			undoLumpState.lumpLen[i] = newLumps.lumpLen[i] = 0;
+			oldLumps.clearLump(i);
+			newLumps.clearLump(i);
 		}
 	}
 
-	EditBspModelCommand* editCommand = new EditBspModelCommand(actionDesc, pickInfo, undoLumpState, newLumps, undoEntOrigin);
+	EditBspModelCommand* editCommand = new EditBspModelCommand(actionDesc, pickInfo, oldLumps, newLumps, undoEntOrigin);
 	pushUndoCommand(editCommand);
-	saveLumpState(pickInfo.map, 0xffffffff, false);
+	saveLumpState(pickInfo.map, 0xffffffff);
 
 	// entity origin edits also update the ent origin (TODO: this breaks when moving + scaling something)
 	updateEntityState(pickInfo.ent);
@@ -2873,14 +2907,14 @@ void Renderer::pushModelUndoState(string actionDesc, int targetLumps) {
 
 void Renderer::pushUndoCommand(Command* cmd) {
 	undoHistory.push_back(cmd);
+	updateUndoMemoryUsage(cmd, 1);
 	clearRedoCommands();
 
 	while (!undoHistory.empty() && undoHistory.size() > undoLevels) {
+		updateUndoMemoryUsage(undoHistory[0], -1);
 		delete undoHistory[0];
 		undoHistory.erase(undoHistory.begin());
 	}
-
-	calcUndoMemoryUsage();
 }
 
 void Renderer::undo() {
@@ -2917,29 +2951,29 @@ void Renderer::redo() {
 
 void Renderer::clearUndoCommands() {
 	for (int i = 0; i < undoHistory.size(); i++) {
+		updateUndoMemoryUsage(undoHistory[i], -1);
 		delete undoHistory[i];
 	}
 
 	undoHistory.clear();
-	calcUndoMemoryUsage();
 }
 
 void Renderer::clearRedoCommands() {
 	for (int i = 0; i < redoHistory.size(); i++) {
+		updateUndoMemoryUsage(redoHistory[i], -1);
 		delete redoHistory[i];
 	}
 
 	redoHistory.clear();
-	calcUndoMemoryUsage();
 }
 
-void Renderer::calcUndoMemoryUsage() {
-	undoMemoryUsage = (undoHistory.size() + redoHistory.size()) * sizeof(Command*);
+void Renderer::updateUndoMemoryUsage(Command* cmd, int refDelta) {
+	// commands don't change their snapshots after they're pushed, so removing one undoes exactly what adding it did
+	undoMemoryUsage += ((int)sizeof(Command*) + cmd->memoryUsage()) * refDelta;
 
-	for (int i = 0; i < undoHistory.size(); i++) {
-		undoMemoryUsage += undoHistory[i]->memoryUsage();
-	}
-	for (int i = 0; i < redoHistory.size(); i++) {
-		undoMemoryUsage += redoHistory[i]->memoryUsage();
+	vector<const LumpState*> lumpStates;
+	cmd->getLumpStates(lumpStates);
+	for (int i = 0; i < lumpStates.size(); i++) {
+		undoMemoryUsage += lumpStates[i]->updateChunkRefs(undoChunkRefs, refDelta);
 	}
 }
@@ -10,6 +10,7 @@
 #include <thread>
 #include <future>
 #include "Command.h"
+#include "AppSettings.h"
 
 class Gui;
 
@@ -41,48 +42,8 @@ struct TransformAxes {
 	int numAxes;
 };
 
-struct AppSettings {
-	int windowWidth;
-	int windowHeight;
-	int windowX;
-	int windowY;
-	int maximized;
-	int fontSize;
-	string gamedir;
-	string workingdir;
-	bool valid;
-	int undoLevels;
-	bool verboseLogs;
-
-	bool debug_open;
-	bool keyvalue_open;
-	bool transform_open;
-	bool log_open;
-	bool settings_open;
-	bool limits_open;
-	bool entreport_open;
-	int settings_tab;
-
-	float fov;
-	float zfar;
-	float moveSpeed;
-	float rotSpeed;
-	int render_flags;
-	bool vsync;
-	bool show_transform_axes;
-	bool backUpMap;
-
-	vector<string> fgdPaths;
-	vector<string> resPaths;
-
-	void loadDefault();
-	void load();
-	void save();
-};
-
 class Renderer;
 
-extern AppSettings g_settings;
 extern Renderer* g_app;
 
 class Renderer {
@@ -229,7 +190,8 @@ private:
 	int clipnodeRenderHull = -1;
 
 	int undoLevels = 64;
-	int undoMemoryUsage = 0; // approximate space used by undo+redo history
+	int undoMemoryUsage = sizeof(LumpState); // approximate space used by undo+redo history and undoLumpState
+	unordered_map<const void*, int> undoChunkRefs; // references to each lump chunk counted in undoMemoryUsage
 	vector<Command*> undoHistory;
 	vector<Command*> redoHistory;
 	Entity* undoEntityState = NULL;
@@ -302,10 +264,10 @@ private:
 	void redo();
 	void clearUndoCommands();
 	void clearRedoCommands();
-	void calcUndoMemoryUsage();
+	void updateUndoMemoryUsage(Command* cmd, int refDelta);
 
 	void updateEntityState(Entity* ent);
-	void saveLumpState(Bsp* map, int targetLumps, bool deleteOldState);
+	void saveLumpState(Bsp* map, int targetLumps);
 
 	void loadFgds();
 };
\ No newline at end of file
@@ -0,0 +1,173 @@
+#include "TextureCache.h"
+#include <sys/types.h>
+#include <sys/stat.h>
+
+TextureCache g_texture_cache;
+
+TextureCache::~TextureCache() {
+	for (auto it = wads.begin(); it != wads.end(); ++it) {
+		delete it->second->wad;
+		delete it->second;
+	}
+}
+
+TextureCache::CachedWad* TextureCache::openWad(const string& path) {
+	struct stat info;
+	if (stat(path.c_str(), &info) != 0) {
+		return NULL;
+	}
+
+	lock_guard<mutex> guard(lock);
+
+	auto found = wads.find(path);
+	if (found != wads.end()) {
+		CachedWad* cached = found->second;
+		// idle wads are unmapped, so the first user maps the file again
+		if (cached->mtime == info.st_mtime && cached->size == info.st_size && cached->wad->openFile()) {
+			cached->users++;
+			return cached;
+		}
+
+		// textures decoded from the old file are keyed by its id, so they are never found again
+		// and get evicted like any other unused texture
+		wads.erase(found);
+		cached->stale = true;
+		if (cached->users == 0) {
+			delete cached->wad;
+			delete cached;
+		}
+	}
+
+	Wad* wad = new Wad(path);
+	if (!wad->readInfo()) {
+		delete wad;
+		return NULL;
+	}
+
+	CachedWad* cached = new CachedWad();
+	cached->path = path;
+	cached->mtime = info.st_mtime;
+	cached->size = info.st_size;
+	cached->id = nextWadId++;
+	cached->wad = wad;
+	cached->users = 1;
+	cached->stale = false;
+	wads[path] = cached;
+
+	return cached;
+}
+
+void TextureCache::closeWad(CachedWad* wad) {
+	lock_guard<mutex> guard(lock);
+
+	wad->users--;
+	if (wad->users > 0) {
+		return;
+	}
+
+	if (wad->stale) {
+		delete wad->wad;
+		delete wad;
+	}
+	else {
+		// the directory is kept, so reopening is cheap, but no map needs the file until textures are reloaded
+		wad->wad->closeFile();
+	}
+}
+
+Texture* TextureCache::acquire(CachedWad* wad, const string& texName) {
+	string key = to_string(wad->id) + "/" + toLowerCase(texName);
+
+	{
+		lock_guard<mutex> guard(lock);
+		auto found = textures.find(key);
+		if (found != textures.end()) {
+			return addRef(found->second);
+		}
+	}
+
+	// decode without holding the lock, so other maps can load textures meanwhile
+	WADTEX* wadTex = wad->wad->readTexture(texName);
+	if (!wadTex) {
+		return NULL;
+	}
+
+	int lastMipSize = (wadTex->nWidth / 8) * (wadTex->nHeight / 8);
+	COLOR3* palette = (COLOR3*)(wadTex->data + wadTex->nOffsets[3] + lastMipSize + 2 - 40);
+	byte* src = wadTex->data;
+
+	int sz = wadTex->nWidth * wadTex->nHeight;
+	COLOR3* imageData = new COLOR3[sz];
+	for (int k = 0; k < sz; k++) {
+		imageData[k] = palette[src[k]];
+	}
+
+	Texture* tex = new Texture(wadTex->nWidth, wadTex->nHeight, imageData);
+	delete wadTex;
+
+	lock_guard<mutex> guard(lock);
+
+	auto found = textures.find(key);
+	if (found != textures.end()) {
+		// another map decoded it first. Ours was never uploaded, so it's safe to delete off the GL thread.
+		delete tex;
+		return addRef(found->second);
+	}
+
+	CachedTexture* entry = new CachedTexture();
+	entry->tex = tex;
+	entry->key = key;
+	entry->bytes = (uint64_t)sz * sizeof(COLOR3);
+	entry->refs = 1;
+	textures[key] = entry;
+	textureEntries[tex] = entry;
+	totalBytes += entry->bytes;
+
+	return tex;
+}
+
+bool TextureCache::release(Texture* tex) {
+	lock_guard<mutex> guard(lock);
+
+	auto found = textureEntries.find(tex);
+	if (found == textureEntries.end()) {
+		return false;
+	}
+
+	CachedTexture* entry = found->second;
+	if (--entry->refs == 0) {
+		unused.push_front(entry);
+		entry->unusedPos = unused.begin();
+		evict();
+	}
+
+	return true;
+}
+
+void TextureCache::setMemoryLimit(uint64_t bytes) {
+	lock_guard<mutex> guard(lock);
+
+	memoryLimit = bytes;
+	evict();
+}
+
+Texture* TextureCache::addRef(CachedTexture* entry) {
+	if (entry->refs++ == 0) {
+		unused.erase(entry->unusedPos);
+	}
+	return entry->tex;
+}
+
+void TextureCache::evict() {
+	while (totalBytes > memoryLimit && !unused.empty()) {
+		CachedTexture* entry = unused.back();
+		unused.pop_back();
+
+		textures.erase(entry->key);
+		textureEntries.erase(entry->tex);
+		totalBytes -= entry->bytes;
+
+		delete entry->tex;
+		delete entry;
+	}
+}
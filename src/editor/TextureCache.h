@@ -0,0 +1,72 @@
+#pragma once
+#include "util.h"
+#include "Wad.h"
+#include "Texture.h"
+#include <list>
+#include <mutex>
+#include <unordered_map>
+
+// WAD textures decoded to RGB and shared by every BspRenderer, so opening several maps that use the same WADs,
+// or reloading them, doesn't read and decode the same textures again. WAD directories are kept in memory and are
+// read again when their file changes. WAD files are only mapped while a map is loading textures from them.
+// Textures that no map uses anymore stay cached until the memory limit is reached, then the least recently used
+// ones are deleted.
+class TextureCache
+{
+public:
+	struct CachedWad {
+		string path;
+		time_t mtime;
+		int64_t size;
+		uint id; // textures are keyed by this id, so textures from an older version of the file are never found
+		Wad* wad;
+		int users;
+		bool stale; // the file changed, so the wad is deleted once its last user closes it
+	};
+
+	// closes the wads. Cached textures are left to the OS, since the GL context is gone by the time this runs at exit.
+	~TextureCache();
+
+	// opens the wad, or reuses it if it's already open and its file hasn't changed. Returns NULL on failure.
+	// Pass the wad to closeWad when done loading textures from it. Thread-safe.
+	CachedWad* openWad(const string& path);
+	void closeWad(CachedWad* wad);
+
+	// returns the texture from the wad decoded to RGB, or NULL if the wad doesn't have it. The texture may be
+	// shared with other maps and is valid until it's passed to release(). Thread-safe.
+	Texture* acquire(CachedWad* wad, const string& texName);
+
+	// returns false if the texture didn't come from the cache (the caller still owns it).
+	// Call from the GL thread, because textures evicted from the cache are deleted.
+	bool release(Texture* tex);
+
+	// limit for the decoded size of all cached textures. Textures that are in use are never evicted, so the
+	// cache can grow past the limit while they are. Call from the GL thread.
+	void setMemoryLimit(uint64_t bytes);
+
+private:
+	struct CachedTexture {
+		Texture* tex;
+		string key;
+		uint64_t bytes;
+		int refs;
+		list<CachedTexture*>::iterator unusedPos; // position in the unused list when refs is 0
+	};
+
+	mutex lock;
+	unordered_map<string, CachedWad*> wads; // by path
+	unordered_map<string, CachedTexture*> textures; // by wad id and lowercase texture name
+	unordered_map<Texture*, CachedTexture*> textureEntries;
+	list<CachedTexture*> unused; // textures that no map uses, most recently used first
+	uint64_t totalBytes = 0;
+	uint64_t memoryLimit = 256 * 1024 * 1024;
+	uint nextWadId = 1;
+
+	// adds a reference to the texture. Call with the lock held.
+	Texture* addRef(CachedTexture* entry);
+
+	// deletes unused textures until the cache fits the memory limit. Call with the lock held.
+	void evict();
+};
+
+extern TextureCache g_texture_cache;
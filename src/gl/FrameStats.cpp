@@ -0,0 +1,4 @@
+#include "FrameStats.h"
+
+FrameStats g_frame_stats;
+FrameStats g_last_frame_stats;
@@ -0,0 +1,12 @@
+#pragma once
+
+// GL work done to render a frame, for finding out what makes rendering slow
+struct FrameStats {
+	int drawCalls = 0;
+	int textureBinds = 0;
+	int shaderBinds = 0; // only counts actual program switches
+	int matrixUpdates = 0; // model/view/projection uploads
+};
+
+extern FrameStats g_frame_stats; // counts for the frame being rendered
+extern FrameStats g_last_frame_stats; // counts for the last finished frame
@@ -1,5 +1,6 @@
 #include <GL/glew.h>
 #include "ShaderProgram.h"
+#include "FrameStats.h"
 #include "util.h"
 #include <string.h>
 
@@ -52,6 +53,7 @@ void ShaderProgram::bind()
 	{
 		g_active_shader_program = ID;
 		glUseProgram(ID);
+		g_frame_stats.shaderBinds++;
 		updateMatrixes();
 	}
 }
@@ -81,6 +83,8 @@ void ShaderProgram::updateMatrixes()
 		glUniformMatrix4fv(modelViewID, 1, false, (float*)modelViewMat);
 	if (modelViewProjID != -1)
 		glUniformMatrix4fv(modelViewProjID, 1, false, (float*)modelViewProjMat);
+
+	g_frame_stats.matrixUpdates++;
 }
 
 void ShaderProgram::setMatrixNames( const char * modelViewMat, const char * modelViewProjMat )
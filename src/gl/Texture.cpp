@@ -1,6 +1,7 @@
 #include <GL/glew.h>
 #include "Wad.h"
 #include "Texture.h"
+#include "FrameStats.h"
 #include "lodepng.h"
 #include "util.h"
 
@@ -71,4 +72,5 @@ void Texture::upload(int format, bool lightmap)
 void Texture::bind()
 {
 	glBindTexture(GL_TEXTURE_2D, id);
+	g_frame_stats.textureBinds++;
 }
@@ -1,5 +1,6 @@
 #include <GL/glew.h>
 #include "VertexBuffer.h"
+#include "FrameStats.h"
 #include "util.h"
 #include <string.h>
 
@@ -195,7 +196,7 @@ void VertexBuffer::deleteBuffer() {
 	vboId = -1;
 }
 
-void VertexBuffer::drawRange( int primitive, int start, int end )
+void VertexBuffer::enableAttributes()
 {
 	shaderProgram->bind();
 	bindAttributes();
@@ -218,16 +219,10 @@ void VertexBuffer::drawRange( int primitive, int start, int end )
 			glVertexAttribPointer(a.handle, a.numValues, a.valueType, a.normalized != 0, elementSize, ptr);
 		}
 	}
+}
 
-	if (start < 0 || start > numVerts)
-		logf("Invalid start index: %d\n", start);
-	else if (end > numVerts || end < 0)
-		logf("Invalid end index: %d\n", end);
-	else if (end - start <= 0)
-		logf("Invalid draw range: %d -> %d\n", start, end);
-	else
-		glDrawArrays(primitive, start, end-start);
-
+void VertexBuffer::disableAttributes()
+{
 	if (vboId != -1) {
 		glBindBuffer(GL_ARRAY_BUFFER, 0);
 	}
@@ -241,6 +236,35 @@ void VertexBuffer::drawRange( int primitive, int start, int end )
 	}
 }
 
+void VertexBuffer::drawRange( int primitive, int start, int end )
+{
+	enableAttributes();
+
+	if (start < 0 || start > numVerts)
+		logf("Invalid start index: %d\n", start);
+	else if (end > numVerts || end < 0)
+		logf("Invalid end index: %d\n", end);
+	else if (end - start <= 0)
+		logf("Invalid draw range: %d -> %d\n", start, end);
+	else {
+		glDrawArrays(primitive, start, end-start);
+		g_frame_stats.drawCalls++;
+	}
+
+	disableAttributes();
+}
+
+void VertexBuffer::drawRanges( int primitive, const int* starts, const int* counts, int rangeCount )
+{
+	if (rangeCount <= 0)
+		return;
+
+	enableAttributes();
+	glMultiDrawArrays(primitive, starts, counts, rangeCount);
+	g_frame_stats.drawCalls++;
+	disableAttributes();
+}
+
 void VertexBuffer::draw( int primitive )
 {
 	drawRange(primitive, 0, numVerts);
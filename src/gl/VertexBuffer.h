@@ -70,6 +70,9 @@ public:
 	void drawRange(int primitive, int start, int end);
 	void draw(int primitive);
 
+	// draws several vertex ranges with a single call
+	void drawRanges(int primitive, const int* starts, const int* counts, int rangeCount);
+
 	void addAttribute(int numValues, int valueType, int normalized, const char* varName);
 	void addAttribute(int type, const char* varName);
 	void bindAttributes(bool hideErrors = false); // find handles for all vertex attributes (call from main thread only)
@@ -81,5 +84,8 @@ private:
 
 	// add attributes according to the attribute flags
 	void addAttributes(int attFlags);
+
+	void enableAttributes();
+	void disableAttributes();
 };
 
@@ -76,6 +76,15 @@ const char* g_shader_multitexture_vertex =
 "attribute vec3 vLightmapTex3;\n"
 "attribute vec4 vColor;\n"
 
+// entity origins for batched solid entities (see BspRenderer::drawEntityBatches).
+// Only defined if the driver supports textures in vertex shaders (see Renderer::Renderer).
+"#ifdef ENTITY_OFFSETS\n"
+"attribute float vEntity;\n"
+"uniform sampler2D sEntityOffsets;\n"
+"uniform vec2 entityOffsetsSize;\n"
+"uniform float entityOffsetsEnabled;\n"
+"#endif\n"
+
 // fragment variables
 "varying vec2 fTex;\n"
 "varying vec3 fLightmapTex0;\n"
@@ -86,7 +95,14 @@ const char* g_shader_multitexture_vertex =
 
 "void main()\n"
 "{\n"
-"	gl_Position = modelViewProjection * vec4(vPosition, 1);\n"
+"	vec3 pos = vPosition;\n"
+"#ifdef ENTITY_OFFSETS\n"
+"	if (entityOffsetsEnabled > 0.0) {\n"
+"		vec2 texel = vec2(mod(vEntity, entityOffsetsSize.x), floor(vEntity / entityOffsetsSize.x)) + 0.5;\n"
+"		pos += texture2DLod(sEntityOffsets, texel / entityOffsetsSize, 0.0).xyz;\n"
+"	}\n"
+"#endif\n"
+"	gl_Position = modelViewProjection * vec4(pos, 1);\n"
 "	fTex = vTex;\n"
 "	fLightmapTex0 = vLightmapTex0;\n"
 "	fLightmapTex1 = vLightmapTex1;\n"
@@ -131,13 +147,29 @@ const char* g_shader_fullbright_vertex =
 "attribute vec2 vTex;\n"
 "attribute vec4 vColor;\n"
 
+// entity origins for batched solid entities (see BspRenderer::drawEntityBatches).
+// Only defined if the driver supports textures in vertex shaders (see Renderer::Renderer).
+"#ifdef ENTITY_OFFSETS\n"
+"attribute float vEntity;\n"
+"uniform sampler2D sEntityOffsets;\n"
+"uniform vec2 entityOffsetsSize;\n"
+"uniform float entityOffsetsEnabled;\n"
+"#endif\n"
+
 // fragment variables
 "varying vec2 fTex;\n"
 "varying vec4 fColor;\n"
 
 "void main()\n"
 "{\n"
-"	gl_Position = modelViewProjection * vec4(vPosition, 1);\n"
+"	vec3 pos = vPosition;\n"
+"#ifdef ENTITY_OFFSETS\n"
+"	if (entityOffsetsEnabled > 0.0) {\n"
+"		vec2 texel = vec2(mod(vEntity, entityOffsetsSize.x), floor(vEntity / entityOffsetsSize.x)) + 0.5;\n"
+"		pos += texture2DLod(sEntityOffsets, texel / entityOffsetsSize, 0.0).xyz;\n"
+"	}\n"
+"#endif\n"
+"	gl_Position = modelViewProjection * vec4(pos, 1);\n"
 "	fTex = vTex;\n"
 "	fColor = vColor;\n"
 "}\n";
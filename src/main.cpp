@@ -221,6 +221,14 @@ int merge_maps(CommandLine& cli) {
 			maps[i]->delete_unused_hulls().print_delete_stats(2);
 		}
 
+		// weld before merging, while vertex indexes still fit in the 16-bit edges
+		if (cli.hasOption("-weld")) {
+			logf("    Welding vertexes and edges...\n");
+			STRUCTCOUNT welded = maps[i]->weld();
+			g_progress.clear();
+			welded.print_delete_stats(2);
+		}
+
 		logf("\n");
 	}
 	
@@ -229,25 +237,253 @@ int merge_maps(CommandLine& cli) {
 	string output_name = cli.hasOption("-o") ? cli.getOption("-o") : cli.bspfile;
 
 	BspMerger merger;
+	merger.snapPlanes = cli.hasOption("-snapplanes");
+	merger.weldedInputs = cli.hasOption("-weld");
 	Bsp* result = merger.merge(maps, gap, output_name, cli.hasOption("-noripent"), cli.hasOption("-noscript"));
 
+	// the result doesn't reference the input maps, which may still be mapped from the output file
+	for (int i = 0; i < maps.size(); i++) {
+		if (maps[i] != result) {
+			delete maps[i];
+		}
+	}
+
+	if (!result) {
+		return 1;
+	}
+
+	if (cli.hasOption("-weld")) {
+		// vertexes shared by neighboring maps
+		logf("\nWelding vertexes and edges:\n");
+		STRUCTCOUNT removed = result->weld();
+		g_progress.clear();
+		removed.print_delete_stats(1);
+	}
+
 	logf("\n");
 	if (result->isValid()) result->write(output_name);
 	logf("\n");
 	result->print_info(false, 0, 0);
 
-	for (int i = 0; i < maps.size(); i++) {
-		delete maps[i];
-	}
+	delete result;
 
 	return 0;
 }
 
-int print_info(CommandLine& cli) {
-	Bsp* map = new Bsp(cli.bspfile);
-	if (!map->valid)
+#define INFO_STAT_COUNT 15
+
+static const char* g_info_stat_names[INFO_STAT_COUNT] = {
+	"models", "planes", "vertexes", "nodes", "texinfos", "faces", "clipnodes", "leaves",
+	"marksurfaces", "surfedges", "edges", "textures", "lightdata", "visdata", "entities"
+};
+
+static const int g_info_stat_max[INFO_STAT_COUNT] = {
+	MAX_MAP_MODELS, MAX_MAP_PLANES, MAX_MAP_VERTS, MAX_MAP_NODES, MAX_MAP_TEXINFOS, MAX_MAP_FACES,
+	MAX_MAP_CLIPNODES, MAX_MAP_LEAVES, MAX_MAP_MARKSURFS, MAX_MAP_SURFEDGES, MAX_MAP_EDGES,
+	MAX_MAP_TEXTURES, MAX_MAP_LIGHTDATA, MAX_MAP_VISDATA, MAX_MAP_ENTS
+};
+
+static const char* g_sort_mode_names[] = { "vertexes", "nodes", "clipnodes", "faces" };
+
+string escape_json(const string& s) {
+	string out;
+	for (int i = 0; i < s.size(); i++) {
+		unsigned char c = s[i];
+		if (c == '"' || c == '\\') {
+			out += '\\';
+			out += c;
+		}
+		else if (c < 0x20) {
+			char hex[8];
+			snprintf(hex, 8, "\\u%04x", c);
+			out += hex;
+		}
+		else {
+			out += c;
+		}
+	}
+	return "\"" + out + "\"";
+}
+
+string escape_csv(const string& s) {
+	if (s.find_first_of(",\"\r\n") == string::npos) {
+		return s;
+	}
+	string out = s;
+	replaceAll(out, "\"", "\"\"");
+	return "\"" + out + "\"";
+}
+
+// one JSON object or CSV line describing the map's limits and the models using the most of the sort limit
+string get_info_row(const string& path, bool json, int topCount, int sortMode) {
+	Bsp* map = new Bsp(path);
+	string row;
+
+	if (!map->valid) {
+		if (json) {
+			row = "{\"file\":" + escape_json(path) + ",\"error\":\"failed to load\"}\n";
+		}
+		else {
+			row = escape_csv(path) + ",failed to load\n";
+		}
+		delete map;
+		return row;
+	}
+
+	int vals[INFO_STAT_COUNT] = {
+		map->modelCount, map->planeCount, map->vertCount, map->nodeCount, map->texinfoCount, map->faceCount,
+		map->clipnodeCount, map->leafCount, map->marksurfCount, map->surfedgeCount, map->edgeCount,
+		map->textureCount, map->lightDataLength, map->visDataLength, (int)map->ents.size()
+	};
+
+	if (json) {
+		row = "{\"file\":" + escape_json(path) + ",\"limits\":{";
+		for (int i = 0; i < INFO_STAT_COUNT; i++) {
+			row += string(i ? "," : "") + "\"" + g_info_stat_names[i] + "\":{\"count\":" + to_string(vals[i]) +
+				",\"max\":" + to_string(g_info_stat_max[i]) + "}";
+		}
+		row += string("},\"top_") + g_sort_mode_names[sortMode] + "\":[";
+	}
+	else {
+		row = escape_csv(path) + ",";
+		for (int i = 0; i < INFO_STAT_COUNT; i++) {
+			row += "," + to_string(vals[i]);
+		}
+		row += ",";
+	}
+
+	// same as print_info, model stats aren't available while BSP limits are exceeded
+	if (topCount > 0 && map->isValid()) {
+		vector<Entity*> modelEnts(map->modelCount);
+		for (int i = 0; i < map->ents.size(); i++) {
+			int modelIdx = map->ents[i]->getBspModelIdx();
+			if (modelIdx >= 0 && modelIdx < map->modelCount)
+				modelEnts[modelIdx] = map->ents[i];
+		}
+
+		vector<STRUCTUSAGE*> modelStructs = map->get_sorted_model_infos(sortMode);
+		string topModels;
+
+		for (int i = 0; i < modelStructs.size(); i++) {
+			STRUCTUSAGE* info = modelStructs[i];
+			int val = 0;
+			switch (sortMode) {
+			case SORT_VERTS:		val = info->sum.verts; break;
+			case SORT_NODES:		val = info->sum.nodes; break;
+			case SORT_CLIPNODES:	val = info->sum.clipnodes; break;
+			case SORT_FACES:		val = info->sum.faces; break;
+			}
+
+			if (i < topCount && val > 0) {
+				Entity* ent = modelEnts[info->modelIdx];
+				string classname = info->modelIdx == 0 ? "worldspawn" : ent ? ent->getKeyvalue("classname") : "";
+				string targetname = ent && info->modelIdx != 0 ? ent->getKeyvalue("targetname") : "";
+
+				if (json) {
+					topModels += string(topModels.empty() ? "" : ",") + "{\"model\":" + to_string(info->modelIdx) +
+						",\"classname\":" + escape_json(classname) + ",\"targetname\":" + escape_json(targetname) +
+						",\"count\":" + to_string(val) + "}";
+				}
+				else {
+					topModels += string(topModels.empty() ? "" : ";") + "*" + to_string(info->modelIdx) + ":" +
+						classname + ":" + targetname + ":" + to_string(val);
+				}
+			}
+
+			delete info;
+		}
+
+		row += json ? topModels : escape_csv(topModels);
+	}
+
+	row += json ? "]}\n" : "\n";
+
+	delete map;
+	return row;
+}
+
+// writes a row for each map in a directory or matching a wildcard pattern. Maps are loaded on all cores
+// but only one per thread at a time, and rows are written in file order as soon as they're ready.
+int print_info_batch(const string& target, bool json, int topCount, int sortMode, const string& outPath) {
+	vector<string> files;
+
+	string dir = target;
+	string pattern = "*";
+
+	if (!dirExists(target)) {
+		size_t lastSlash = target.find_last_of("/\\");
+		dir = lastSlash == string::npos ? "." : target.substr(0, lastSlash + 1);
+		pattern = lastSlash == string::npos ? target : target.substr(lastSlash + 1);
+	}
+
+	vector<string> dirFiles = getDirFiles(dir);
+	for (int i = 0; i < dirFiles.size(); i++) {
+		string name = basename(dirFiles[i]);
+		if (wildcardMatch(name, pattern) && wildcardMatch(name, "*.bsp"))
+			files.push_back(dirFiles[i]);
+	}
+
+	if (files.empty()) {
+		logf("ERROR: no maps found in %s\n", target.c_str());
 		return 1;
+	}
+
+	FILE* out = stdout;
+	if (!outPath.empty()) {
+		out = fopen(outPath.c_str(), "wb");
+		if (!out) {
+			logf("ERROR: failed to open %s for writing\n", outPath.c_str());
+			return 1;
+		}
+	}
+	else {
+		g_progress.hide = true; // don't mix progress text with the rows
+	}
+
+	if (!json) {
+		// maximums are part of the column names so that rows only hold counts
+		string header = "file,error";
+		for (int i = 0; i < INFO_STAT_COUNT; i++) {
+			header += string(",") + g_info_stat_names[i] + "/" + to_string(g_info_stat_max[i]);
+		}
+		header += ",top_" + string(g_sort_mode_names[sortMode]) + "\n";
+		fwrite(header.c_str(), 1, header.size(), out);
+	}
+
+	g_progress.update("Scanning maps", files.size());
+
+	vector<string> rows(files.size());
+	vector<bool> rowReady(files.size());
+	int nextRow = 0;
+	mutex rowMutex;
 
+	parallelFor(files.size(), 1, [&](int start, int end) {
+		for (int i = start; i < end; i++) {
+			string row = get_info_row(files[i], json, topCount, sortMode);
+
+			lock_guard<mutex> lock(rowMutex);
+			rows[i].swap(row);
+			rowReady[i] = true;
+
+			for (; nextRow < files.size() && rowReady[nextRow]; nextRow++) {
+				fwrite(rows[nextRow].c_str(), 1, rows[nextRow].size(), out);
+				string().swap(rows[nextRow]);
+			}
+			g_progress.tick();
+		}
+	});
+
+	g_progress.clear();
+
+	if (out != stdout) {
+		fclose(out);
+		logf("Wrote %d rows to %s\n", (int)files.size(), outPath.c_str());
+	}
+
+	return 0;
+}
+
+int print_info(CommandLine& cli) {
 	bool limitMode = false;
 	int listLength = 10;
 	int sortMode = SORT_CLIPNODES;
@@ -273,10 +509,39 @@ int print_info(CommandLine& cli) {
 			return 0;
 		}
 	}
+	if (cli.hasOption("-top")) {
+		listLength = cli.getOptionInt("-top");
+	}
 	if (cli.hasOption("-all")) {
 		listLength = 32768; // should be more than enough
 	}
 
+	bool batchMode = dirExists(cli.bspfile) || cli.bspfile.find_first_of("*?") != string::npos;
+
+	if (batchMode || cli.hasOption("-format")) {
+		string format = cli.hasOption("-format") ? toLowerCase(cli.getOption("-format")) : "json";
+		if (format != "json" && format != "csv") {
+			logf("ERROR: invalid format: %s\n", format.c_str());
+			return 1;
+		}
+		string outPath = cli.hasOption("-o") ? cli.getOption("-o") : "";
+
+		if (batchMode) {
+			return print_info_batch(cli.bspfile, format == "json", listLength, sortMode, outPath);
+		}
+		
+		string row = get_info_row(cli.bspfile, format == "json", listLength, sortMode);
+		if (outPath.empty()) {
+			fwrite(row.c_str(), 1, row.size(), stdout);
+			return 0;
+		}
+		return writeFile(outPath, row.c_str(), row.size()) ? 0 : 1;
+	}
+
+	Bsp* map = new Bsp(cli.bspfile);
+	if (!map->valid)
+		return 1;
+
 	map->print_info(limitMode, listLength, sortMode);
 
 	delete map;
@@ -446,6 +711,39 @@ int simplify(CommandLine& cli) {
 	return 0;
 }
 
+// parses a list of indexes like "1,4,10-20" into a set. Returns false if the list is malformed or any
+// index is outside of [minIdx, maxIdx].
+bool parse_index_list(const string& list, int minIdx, int maxIdx, set<int>& indexes) {
+	vector<string> parts = splitString(list, ",");
+	if (parts.empty()) {
+		return false;
+	}
+
+	for (int i = 0; i < parts.size(); i++) {
+		string part = trimSpaces(parts[i]);
+		size_t dash = part.find('-', 1);
+		string first = trimSpaces(part.substr(0, dash));
+		string last = dash == string::npos ? first : trimSpaces(part.substr(dash + 1));
+
+		if (!isNumeric(first) || !isNumeric(last)) {
+			return false;
+		}
+
+		int start = atoi(first.c_str());
+		int end = atoi(last.c_str());
+
+		if (start > end || start < minIdx || end > maxIdx) {
+			return false;
+		}
+
+		for (int k = start; k <= end; k++) {
+			indexes.insert(k);
+		}
+	}
+
+	return true;
+}
+
 int deleteCmd(CommandLine& cli) {
 	Bsp* map = new Bsp(cli.bspfile);
 	if (!map->valid)
@@ -454,12 +752,16 @@ int deleteCmd(CommandLine& cli) {
 	remove_unused_data(map);
 
 	if (cli.hasOption("-model")) {
-		int modelIdx = cli.getOptionInt("-model");
+		set<int> modelIdxs;
+		if (!parse_index_list(cli.getOption("-model"), 1, map->modelCount - 1, modelIdxs)) {
+			logf("ERROR: model numbers must be 1 - %d, separated by commas (ranges like 3-7 are allowed)\n", map->modelCount - 1);
+			delete map;
+			return 1;
+		}
 
-		logf("Deleting model %d:\n", modelIdx);
-		map->delete_model(modelIdx);
+		logf("Deleting %d model(s):\n", (int)modelIdxs.size());
+		STRUCTCOUNT removed = map->delete_models(modelIdxs);
 		map->update_ent_lump();
-		STRUCTCOUNT removed = map->remove_unused_model_structures();
 
 		if (!removed.allZero())
 			removed.print_delete_stats(1);
@@ -506,6 +808,43 @@ int transform(CommandLine& cli) {
 	return 0;
 }
 
+int weld(CommandLine& cli) {
+	Bsp* map = new Bsp(cli.bspfile);
+	if (!map->valid)
+		return 1;
+
+	float epsilon = 0;
+
+	if (cli.hasOption("-epsilon")) {
+		epsilon = atof(cli.getOption("-epsilon").c_str());
+
+		if (epsilon < 0) {
+			logf("ERROR: epsilon can't be negative\n");
+			return 1;
+		}
+	}
+
+	logf("Welding vertexes and edges:\n");
+
+	STRUCTCOUNT removed = map->weld(epsilon);
+	g_progress.clear();
+
+	if (!removed.allZero())
+		removed.print_delete_stats(1);
+	else
+		logf("    No duplicate vertexes or edges found.\n");
+	logf("\n");
+
+	if (map->isValid()) map->write(cli.hasOption("-o") ? cli.getOption("-o") : map->path);
+	logf("\n");
+
+	map->print_info(false, 0, 0);
+
+	delete map;
+
+	return 0;
+}
+
 int unembed(CommandLine& cli) {
 	Bsp* map = new Bsp(cli.bspfile);
 	if (!map->valid)
@@ -546,6 +885,10 @@ void print_help(string command) {
 			"                 entities, and some ents might not spawn properly. The benefit\n"
 			"                 to this flag is that you don't have deal with script setup.\n"
 			"  -gap \"X,Y,Z\" : Amount of extra space to add between each map\n"
+			"  -weld        : Merge identical vertexes and edges in each map before merging,\n"
+			"                 and again in the merged map.\n"
+			"  -snapplanes  : Also merge planes that are nearly identical, not just exact\n"
+			"                 copies. This saves planes at the cost of tiny precision errors.\n"
 			"  -v           : Verbose console output.\n"
 			);
 	}
@@ -553,13 +896,23 @@ void print_help(string command) {
 		logf(
 			"info - Show BSP data summary\n\n"
 
-			"Usage:   bspguy info <mapname> [options]\n"
+			"Usage:   bspguy info <mapname|directory|pattern> [options]\n"
 			"Example: bspguy info svencoop1.bsp -limit clipnodes -all\n"
+			"Example: bspguy info \"maps/sc_*.bsp\" -format csv -o report.csv\n"
+
+			"\nGiving a directory or a pattern with * and ? wildcards scans every matching\n"
+			"map on all CPU cores and writes one row per map.\n"
 
 			"\n[Options]\n"
 			"  -limit <name> : List the models contributing most to the named limit.\n"
 			"                  <name> can be one of: [clipnodes, nodes, faces, vertexes]\n"
+			"  -top #        : Number of models to list (default 10).\n"
 			"  -all          : Show the full list of models when using -limit.\n"
+			"  -format <fmt> : Write machine-readable rows instead of tables. <fmt> can be\n"
+			"                  json (one object per line) or csv. Default for batch scans is json.\n"
+			"                  Rows include every limit and the top models for -limit (clipnodes\n"
+			"                  by default).\n"
+			"  -o <file>     : Write the rows to a file instead of the console.\n"
 			);
 	}
 	else if (command == "noclip") {
@@ -604,11 +957,12 @@ void print_help(string command) {
 			"delete - Delete BSP models.\n\n"
 
 			"Usage:   bspguy delete <mapname> [options]\n"
-			"Example: bspguy delete svencoop1.bsp -model 3\n"
+			"Example: bspguy delete svencoop1.bsp -model 3,5,10-20\n"
 
 			"\n[Options]\n"
-			"  -model #  : Model to delete. Entities that reference the deleted\n"
-			"              model will be updated to use error.mdl instead.\n"
+			"  -model #  : Model(s) to delete, as a comma-separated list of numbers\n"
+			"              and ranges. Entities that reference a deleted model\n"
+			"              will be updated to use error.mdl instead.\n"
 			"  -o <file> : Output file. By default, <mapname> is overwritten.\n"
 			);
 	}
@@ -624,6 +978,20 @@ void print_help(string command) {
 			"  -o <file>     : Output file. By default, <mapname> is overwritten.\n"
 			);
 	}
+	else if (command == "weld") {
+		logf(
+			"weld - Merges duplicate vertexes and edges\n\n"
+
+			"Usage:   bspguy weld <mapname> [options]\n"
+			"Example: bspguy weld merged.bsp -epsilon 0.01\n"
+
+			"\n[Options]\n"
+			"  -epsilon # : Max distance on each axis for vertexes to be merged. By default,\n"
+			"               only vertexes at the exact same position are merged. Keep this\n"
+			"               small. Moving vertexes can change the size of lightmaps.\n"
+			"  -o <file>  : Output file. By default, <mapname> is overwritten.\n"
+			);
+	}
 	else if (command == "unembed") {
 	logf(
 		"unembed - Deletes embedded texture data, so that they reference WADs instead.\n\n"
@@ -646,6 +1014,7 @@ void print_help(string command) {
 			"  simplify  : Simplify BSP models\n"
 			"  transform : Apply 3D transformations to the BSP\n"
 			"  unembed   : Deletes embedded texture data\n"
+			"  weld      : Merges duplicate vertexes and edges\n"
 
 			"\nRun 'bspguy <command> help' to read about a specific command.\n"
 			"\nTo launch the 3D editor. Drag and drop a .bsp file onto the executable,\n"
@@ -709,6 +1078,9 @@ int main(int argc, char* argv[])
 		else if (cli.command == "unembed") {
 			return unembed(cli);
 		}
+		else if (cli.command == "weld") {
+			return weld(cli);
+		}
 		else {
 			logf("unrecognized command: %d\n", cli.command.c_str());
 		}
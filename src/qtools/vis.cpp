@@ -1,5 +1,6 @@
 #include "vis.h"
 #include "Bsp.h"
+#include <unordered_map>
 
 bool g_debug_shift = false;
 
@@ -25,113 +26,109 @@ void printVisRow(byte* vis, int len, int offsetLeaf, int mask) {
 	logf("\n");
 }
 
-bool shiftVis(byte* vis, int len, int offsetLeaf, int shift) {
-	if (shift == 0)
-		return false;
+// mask for the bits in a row word that come before the given bit index
+static uint64 bitsBefore(int wordIdx, int bitIdx) {
+	int bitsInWord = bitIdx - wordIdx * 64;
+	if (bitsInWord <= 0)
+		return 0;
+	if (bitsInWord >= 64)
+		return ~(uint64)0;
+	return ((uint64)1 << bitsInWord) - 1;
+}
+
+static int countBits(uint64 v) {
+	v = v - ((v >> 1) & 0x5555555555555555ULL);
+	v = (v & 0x3333333333333333ULL) + ((v >> 2) & 0x3333333333333333ULL);
+	v = (v + (v >> 4)) & 0x0f0f0f0f0f0f0f0fULL;
+	return (v * 0x0101010101010101ULL) >> 56;
+}
 
-	byte bitsPerStep = 8;
-	byte offsetBit = offsetLeaf % bitsPerStep;
-	byte mask = 0; // part of the byte that shouldn't be shifted
-	for (int i = 0; i < offsetBit; i++) {
-		mask |= 1 << i;
+// count bits set in the range [startBit, endBit)
+static int countBits(uint64* words, int startBit, int endBit) {
+	int count = 0;
+	for (int w = startBit / 64; w * 64 < endBit; w++) {
+		count += countBits(words[w] & ~bitsBefore(w, startBit) & bitsBefore(w, endBit));
 	}
+	return count;
+}
+
+int shiftVis(byte* vis, int len, int offsetLeaf, int shift) {
+	if (shift == 0)
+		return 0;
 
-	int byteShifts = abs(shift) / 8;
-	int bitShifts = abs(shift) % 8;
+	// The row is shifted 64 leaves at a time. Leaf N is bit N%8 of byte N/8, so a little-endian
+	// word load puts 64 consecutive leaves in a word, in order.
+	const int maxWords = MAX_MAP_LEAVES / 64 + 1;
+	int wordCount = (len + 7) / 8;
+	int totalBits = len * 8;
 
-	// shift until offsetLeaf isn't sharing a byte with the leaves that come before it
-	// then we can do a much faster memcpy on the section that needs to be shifted
-	if ((offsetLeaf % 8) + bitShifts < 8 && byteShifts > 0) {
-		byteShifts -= 1;
-		bitShifts += 8;
+	if (wordCount > maxWords || offsetLeaf < 0 || offsetLeaf >= totalBits) {
+		logf("Invalid VIS shift (offset %d, row length %d)\n", offsetLeaf, len);
+		return 0;
 	}
 
-	if (shift < 0) {
-		// TODO: memcpy for negative shifts
-		bitShifts += byteShifts * 8;
-		byteShifts = 0;
-	}
+	byte mask = bitsBefore(0, offsetLeaf % 8); // part of the offset byte that shouldn't be shifted
 
 	if (g_debug_shift) {
 		logf("\nSHIFT\n");
+		logf(" 0 = ");
+		printVisRow(vis, len, offsetLeaf, mask);
 	}
 
-	int overflow = 0;
-	for (int k = 0; k < bitShifts; k++) {
-
-		if (g_debug_shift) {
-			logf("%2d = ", k);
-			printVisRow(vis, len, offsetLeaf, mask);
-		}
-
-		if (shift > 0) {
-			bool carry = 0;
-			for (int i = 0; i < len; i++) {
-				uint oldCarry = carry;
-				carry = (vis[i] & 0x80) != 0;
-
-				if (offsetBit != 0 && i * bitsPerStep < offsetLeaf && i * bitsPerStep + bitsPerStep > offsetLeaf) {
-					vis[i] = (vis[i] & mask) | ((vis[i] & ~mask) << 1);
-				}
-				else if (i >= offsetLeaf / bitsPerStep) {
-					vis[i] = (vis[i] << 1) + oldCarry;
-				}
-				else {
-					carry = 0;
-				}
-			}
-
-			if (carry) {
-				overflow++;
-			}
-		}
-		else {
-			bool carry = 0;
-			for (int i = len-1; i >= 0; i--) {
-				uint oldCarry = carry;
-				carry = (vis[i] & 0x01) != 0;
-
-				if (offsetBit != 0 && i * bitsPerStep < offsetLeaf && i * bitsPerStep + bitsPerStep > offsetLeaf) {
-					vis[i] = (vis[i] & mask) | ((vis[i] >> 1) & ~mask) | (oldCarry << 7);
-				}
-				else if (i >= offsetLeaf / bitsPerStep) {
-					vis[i] = (vis[i] >> 1) + (oldCarry << 7);
-				}
-				else {
-					carry = 0;
-				}
-			}
-
-			if (carry) {
-				overflow++;
-			}
-		}
+	// copy of the row with the leaves that aren't shifted cleared
+	uint64 src[maxWords];
+	src[wordCount - 1] = 0;
+	memcpy(src, vis, len);
+	for (int w = 0; w < wordCount && w * 64 < offsetLeaf; w++) {
+		src[w] &= ~bitsBefore(w, offsetLeaf);
+	}
 
-		if (g_debug_shift && k == bitShifts-1) {
-			logf("%2d = ", k+1);
-			printVisRow(vis, len, offsetLeaf, mask);
-		}
+	// leaves shifted past the end of the row (or before offsetLeaf) are lost
+	int absShift = abs(shift);
+	int overflow;
+	if (shift > 0) {
+		overflow = countBits(src, max(offsetLeaf, totalBits - absShift), totalBits);
+	}
+	else {
+		overflow = countBits(src, offsetLeaf, min(offsetLeaf + absShift, totalBits));
 	}
-	if (overflow)
-		logf("OVERFLOWED %d VIS LEAVES WHILE SHIFTING\n", overflow);
 
+	int wordShift = absShift / 64;
+	int bitShift = absShift % 64;
 
-	if (byteShifts > 0) {
-		// TODO: detect overflows here too
-		static byte temp[MAX_MAP_LEAVES / 8];
+	for (int w = offsetLeaf / 64; w < wordCount; w++) {
+		uint64 shifted = 0;
 
+		// funnel shift the neighboring source words into this one
 		if (shift > 0) {
-			int startByte = (offsetLeaf + bitShifts) / 8;
-			int moveSize = len - (startByte + byteShifts);
-
-			memcpy(temp, (byte*)vis + startByte, moveSize);
-			memset((byte*)vis + startByte, 0, byteShifts);
-			memcpy((byte*)vis + startByte + byteShifts, temp, moveSize);
+			int hi = w - wordShift;
+			int lo = hi - 1;
+			if (hi >= 0)
+				shifted = src[hi] << bitShift;
+			if (lo >= 0 && bitShift)
+				shifted |= src[lo] >> (64 - bitShift);
 		}
 		else {
-			// TODO LOL
+			int lo = w + wordShift;
+			int hi = lo + 1;
+			if (lo < wordCount)
+				shifted = src[lo] >> bitShift;
+			if (hi < wordCount && bitShift)
+				shifted |= src[hi] << (64 - bitShift);
 		}
-		
+
+		int byteCount = min(8, len - w * 8);
+		uint64 old = 0;
+		memcpy(&old, vis + w * 8, byteCount);
+
+		uint64 keep = bitsBefore(w, offsetLeaf);
+		uint64 result = (old & keep) | (shifted & ~keep);
+		memcpy(vis + w * 8, &result, byteCount);
+	}
+
+	if (g_debug_shift) {
+		logf("%2d = ", absShift);
+		printVisRow(vis, len, offsetLeaf, mask);
 	}
 
 	return overflow;
@@ -144,10 +141,8 @@ bool shiftVis(byte* vis, int len, int offsetLeaf, int shift) {
 void decompress_vis_lump(BSPLEAF* leafLump, byte* visLump, byte* output,
 	int iterationLeaves, int visDataLeafCount, int newNumLeaves)
 {
-	byte* dest;
 	uint oldVisRowSize = ((visDataLeafCount + 63) & ~63) >> 3;
 	uint newVisRowSize = ((newNumLeaves + 63) & ~63) >> 3;
-	int len = 0;
 
 	// calculate which bits of an uncompressed visibility row are used/unused
 	byte lastChunkMask = 0;
@@ -156,12 +151,17 @@ void decompress_vis_lump(BSPLEAF* leafLump, byte* visLump, byte* output,
 		lastChunkMask = lastChunkMask | (1 << k);
 	}
 
-	for (int i = 0; i < iterationLeaves; i++)
-	{
-		g_progress.tick();
-		dest = output + i * newVisRowSize;
-		if (lastUsedIdx >= 0)
+	if (lastUsedIdx < 0) {
+		logf("Overflow decompressing VIS lump!");
+		return;
+	}
+
+	// each row only depends on its own compressed data, so rows are decompressed in parallel
+	parallelFor(iterationLeaves, VIS_ROWS_PER_JOB, [&](int start, int end) {
+		for (int i = start; i < end; i++)
 		{
+			byte* dest = output + i * newVisRowSize;
+
 			if (leafLump[i + 1].nVisOffset < 0) {
 				memset(dest, 255, lastUsedIdx);
 				dest[lastUsedIdx] |= lastChunkMask;
@@ -176,15 +176,11 @@ void decompress_vis_lump(BSPLEAF* leafLump, byte* visLump, byte* output,
 			if (lastUsedIdx < newVisRowSize) {
 				dest[lastUsedIdx] &= lastChunkMask;
 				int sz = newVisRowSize - (lastUsedIdx + 1);
-				int last = lastUsedIdx + 1 + sz;
 				memset(dest + lastUsedIdx + 1, 0, sz);
 			}
 		}
-		else {
-			logf("Overflow decompressing VIS lump!");
-			return;
-		}
-	}
+		g_progress.tick(end - start);
+	});
 }
 
 //
@@ -281,57 +277,87 @@ int CompressVis(const byte* const src, const unsigned int src_length, byte* dest
 
 int CompressAll(BSPLEAF* leafs, byte* uncompressed, byte* output, int numLeaves, int iterLeaves, int bufferSize)
 {
-	int x = 0;
-	byte* dest;
-	byte* src;
-	byte compressed[MAX_MAP_LEAVES / 8];
 	uint g_bitbytes = ((numLeaves + 63) & ~63) >> 3;
 
-	byte* vismap_p = output;
+	vector<uint64> rowHashes(iterLeaves);
+	parallelFor(iterLeaves, VIS_ROWS_PER_JOB, [&](int start, int end) {
+		for (int i = start; i < end; i++) {
+			rowHashes[i] = hashData(uncompressed + i * g_bitbytes, g_bitbytes);
+		}
+	});
 
+	// find rows with identical contents, so that they can share compressed data.
+	// Rows are hashed first so that only rows with matching hashes need to be compared.
 	int* sharedRows = new int[iterLeaves];
+	unordered_multimap<uint64, int> uniqueRows; // row hash -> first row with that content
+	uniqueRows.reserve(iterLeaves);
+
 	for (int i = 0; i < iterLeaves; i++) {
 		byte* src = uncompressed + i * g_bitbytes;
 
 		sharedRows[i] = i;
-		for (int k = 0; k < i; k++) {
-			if (sharedRows[k] != k) {
-				continue; // already compared in an earlier row
-			}
-			byte* previous = uncompressed + k * g_bitbytes;
+		auto range = uniqueRows.equal_range(rowHashes[i]);
+		for (auto it = range.first; it != range.second; ++it) {
+			byte* previous = uncompressed + it->second * g_bitbytes;
 			if (memcmp(src, previous, g_bitbytes) == 0) {
-				sharedRows[i] = k;
+				sharedRows[i] = it->second;
 				break;
 			}
 		}
+
+		if (sharedRows[i] == i) {
+			uniqueRows.insert(make_pair(rowHashes[i], i));
+		}
 		g_progress.tick();
 	}
 
-	for (int i = 0; i < iterLeaves; i++)
-	{
-		if (sharedRows[i] != i) {
-			leafs[i + 1].nVisOffset = leafs[sharedRows[i] + 1].nVisOffset;
-			continue;
-		}
+	// Compress the unique rows in parallel. Each job appends to its own buffer, and the buffers are
+	// joined in row order afterwards, so the output is the same as compressing the rows one by one.
+	int jobCount = (iterLeaves + VIS_ROWS_PER_JOB - 1) / VIS_ROWS_PER_JOB;
+	vector<vector<byte>> jobOutput(jobCount);
+	vector<int> compressedLen(iterLeaves);
 
-		memset(&compressed, 0, sizeof(compressed));
+	parallelFor(iterLeaves, VIS_ROWS_PER_JOB, [&](int start, int end) {
+		vector<byte>& jobData = jobOutput[start / VIS_ROWS_PER_JOB];
+		byte compressed[MAX_MAP_LEAVES / 8];
 
-		src = uncompressed + i * g_bitbytes;
+		for (int i = start; i < end; i++) {
+			compressedLen[i] = 0;
+			if (sharedRows[i] != i) {
+				continue;
+			}
 
-		// Compress all leafs into global compression buffer
-		x = CompressVis(src, g_bitbytes, compressed, sizeof(compressed));
+			// Compress all leafs into global compression buffer
+			int x = CompressVis(uncompressed + i * g_bitbytes, g_bitbytes, compressed, sizeof(compressed));
+			jobData.insert(jobData.end(), compressed, compressed + x);
+			compressedLen[i] = x;
+		}
+	});
 
-		dest = vismap_p;
-		vismap_p += x;
+	byte* vismap_p = output;
+	for (int i = 0; i < jobCount; i++) {
+		int len = jobOutput[i].size();
 
-		if (vismap_p > output + bufferSize)
+		if (vismap_p + len > output + bufferSize)
 		{
 			logf("Vismap expansion overflow\n");
+			len = (output + bufferSize) - vismap_p;
 		}
 
-		leafs[i + 1].nVisOffset = dest - output;            // leaf 0 is a common solid
+		memcpy(vismap_p, jobOutput[i].data(), len);
+		vismap_p += len;
+	}
+
+	int offset = 0;
+	for (int i = 0; i < iterLeaves; i++)
+	{
+		if (sharedRows[i] != i) {
+			leafs[i + 1].nVisOffset = leafs[sharedRows[i] + 1].nVisOffset;
+			continue;
+		}
 
-		memcpy(dest, compressed, x);
+		leafs[i + 1].nVisOffset = offset; // leaf 0 is a common solid
+		offset += compressedLen[i];
 	}
 
 	delete[] sharedRows;
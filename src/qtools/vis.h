@@ -2,7 +2,12 @@
 
 struct BSPLEAF;
 
-bool shiftVis(byte* vis, int len, int offsetLeaf, int shift);
+// number of vis rows processed by a worker thread at a time
+#define VIS_ROWS_PER_JOB 256
+
+// shifts the leaves from offsetLeaf onward by the given number of leaves (negative = towards leaf 0).
+// Returns the number of visible leaves lost off the end of the row, or dropped below offsetLeaf.
+int shiftVis(byte* vis, int len, int offsetLeaf, int shift);
 
 // decompress the given vis data into arrays of bits where each bit indicates if a leaf is visible or not
 // iterationLeaves = number of leaves to decompress vis for
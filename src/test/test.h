@@ -0,0 +1,22 @@
+#pragma once
+#include "util.h"
+
+// Minimal checks for the unit tests. A failed check is logged and fails the run, but the test keeps going so
+// that one run reports every failure.
+#define CHECK(cond) check((cond), #cond, __FILE__, __LINE__)
+
+bool check(bool passed, const char* expr, const char* file, int line);
+
+// runs one test and logs whether all of its checks passed
+void run_test(const char* name, void (*test)());
+
+// test suites, one per source file
+void test_culling();
+void test_lightmap_packer();
+void test_entities();
+void test_picking();
+void test_vis();
+
+// benchmarks, which are only run when asked for on the command line (see test_main.cpp)
+int bench_pick(const char* mapPath, int rayCount);
+int bench_vis(int leafCount);
@@ -0,0 +1,161 @@
+#include "test.h"
+#include "Bsp.h"
+#include "VisCuller.h"
+#include <algorithm>
+
+template<class T>
+static void set_lump(Bsp* map, int lumpIdx, const vector<T>& data) {
+	int len = data.size() * sizeof(T);
+	byte* copy = new byte[len];
+	if (len) {
+		memcpy(copy, &data[0], len);
+	}
+	map->replace_lump(lumpIdx, copy, len);
+}
+
+static BSPLEAF make_leaf(int minX, int maxX, int face, int visOffset) {
+	BSPLEAF leaf;
+	memset(&leaf, 0, sizeof(BSPLEAF));
+	leaf.nContents = CONTENTS_EMPTY;
+	leaf.nVisOffset = visOffset;
+	leaf.nMins[0] = minX;
+	leaf.nMaxs[0] = maxX;
+	leaf.nMins[1] = leaf.nMins[2] = -100;
+	leaf.nMaxs[1] = leaf.nMaxs[2] = 100;
+	leaf.iFirstMarkSurface = face;
+	leaf.nMarkSurfaces = 1;
+	return leaf;
+}
+
+// A corridor along the x axis, split into three leaves at x=0 and x=100, with one face in each leaf:
+//   leaf 1: -100 < x < 0      sees leaf 2
+//   leaf 2:    0 < x < 100    sees leaves 1 and 3
+//   leaf 3:  100 < x < 200    sees leaf 2
+static Bsp* create_corridor_map(bool withVis) {
+	Bsp* map = new Bsp();
+
+	vector<BSPPLANE> planes(2);
+	for (int i = 0; i < 2; i++) {
+		planes[i].vNormal = vec3(1, 0, 0);
+		planes[i].fDist = i * 100;
+		planes[i].nType = PLANE_X;
+	}
+
+	vector<BSPNODE> nodes(2);
+	memset(&nodes[0], 0, nodes.size() * sizeof(BSPNODE));
+	nodes[0].iPlane = 0;
+	nodes[0].iChildren[0] = 1;  // front: x > 0
+	nodes[0].iChildren[1] = ~1; // back: leaf 1
+	nodes[1].iPlane = 1;
+	nodes[1].iChildren[0] = ~3;
+	nodes[1].iChildren[1] = ~2;
+
+	// one byte per row, since there are less than 8 leaves, and a non-zero byte is never compressed
+	vector<byte> visdata = { 0x02, 0x05, 0x02 };
+
+	vector<BSPLEAF> leaves(4);
+	memset(&leaves[0], 0, sizeof(BSPLEAF));
+	leaves[0].nContents = CONTENTS_SOLID;
+	leaves[0].nVisOffset = -1;
+	leaves[1] = make_leaf(-100, 0, 0, withVis ? 0 : -1);
+	leaves[2] = make_leaf(0, 100, 1, withVis ? 1 : -1);
+	leaves[3] = make_leaf(100, 200, 2, withVis ? 2 : -1);
+
+	vector<uint16_t> marksurfs = { 0, 1, 2 };
+
+	vector<BSPFACE> faces(3);
+	memset(&faces[0], 0, faces.size() * sizeof(BSPFACE));
+
+	vector<BSPMODEL> models(1);
+	memset(&models[0], 0, sizeof(BSPMODEL));
+	models[0].nMins = vec3(-100, -100, -100);
+	models[0].nMaxs = vec3(200, 100, 100);
+	models[0].nVisLeafs = 3;
+	models[0].nFaces = 3;
+
+	set_lump(map, LUMP_PLANES, planes);
+	set_lump(map, LUMP_NODES, nodes);
+	set_lump(map, LUMP_LEAVES, leaves);
+	set_lump(map, LUMP_MARKSURFACES, marksurfs);
+	set_lump(map, LUMP_FACES, faces);
+	set_lump(map, LUMP_MODELS, models);
+	set_lump(map, LUMP_VISIBILITY, withVis ? visdata : vector<byte>());
+
+	return map;
+}
+
+static vector<int> visible_faces(VisCuller& culler, vec3 origin, vec3 forward, bool* culled) {
+	Frustum frustum(origin, forward, vec3(0, 0, 1), 90, 1.0f, 0);
+	vector<int> faces;
+	*culled = culler.getVisibleFaces(frustum, faces);
+	sort(faces.begin(), faces.end());
+	return faces;
+}
+
+static void test_find_leaf() {
+	Bsp* map = create_corridor_map(true);
+	VisCuller culler(map);
+
+	CHECK(culler.findLeaf(vec3(-50, 0, 0)) == 1);
+	CHECK(culler.findLeaf(vec3(50, 0, 0)) == 2);
+	CHECK(culler.findLeaf(vec3(150, 20, -20)) == 3);
+	CHECK(culler.findLeaf(vec3(0, 0, 0)) == 1); // points on a plane are behind it
+
+	delete map;
+}
+
+static void test_pvs_faces() {
+	Bsp* map = create_corridor_map(true);
+	VisCuller culler(map);
+	bool culled;
+
+	// leaf 3 isn't in leaf 1's PVS
+	vector<int> faces = visible_faces(culler, vec3(-50, 0, 0), vec3(1, 0, 0), &culled);
+	CHECK(culled);
+	CHECK(faces == vector<int>({ 0, 1 }));
+
+	// leaf 1 is in leaf 2's PVS, but it's behind the camera
+	faces = visible_faces(culler, vec3(50, 0, 0), vec3(1, 0, 0), &culled);
+	CHECK(culled);
+	CHECK(faces == vector<int>({ 1, 2 }));
+
+	faces = visible_faces(culler, vec3(50, 0, 0), vec3(-1, 0, 0), &culled);
+	CHECK(culled);
+	CHECK(faces == vector<int>({ 0, 1 }));
+
+	delete map;
+}
+
+static void test_no_vis_fallback() {
+	Bsp* map = create_corridor_map(false);
+	VisCuller culler(map);
+	bool culled;
+
+	// without vis data, nothing is culled and the caller draws everything
+	vector<int> faces = visible_faces(culler, vec3(-50, 0, 0), vec3(1, 0, 0), &culled);
+	CHECK(!culled);
+	CHECK(faces.empty());
+
+	delete map;
+}
+
+static void test_frustum_rejection() {
+	Frustum frustum(vec3(0, 0, 0), vec3(1, 0, 0), vec3(0, 0, 1), 90, 1.0f, 1000);
+
+	CHECK(frustum.isBoxVisible(vec3(100, -10, -10), vec3(120, 10, 10)));
+	CHECK(!frustum.isBoxVisible(vec3(-120, -10, -10), vec3(-100, 10, 10))); // behind the camera
+	CHECK(!frustum.isBoxVisible(vec3(2000, -10, -10), vec3(2020, 10, 10))); // past the far plane
+	CHECK(!frustum.isBoxVisible(vec3(100, 500, -10), vec3(120, 520, 10))); // off to the side
+	CHECK(frustum.isBoxVisible(vec3(-10, -10, -10), vec3(10, 10, 10))); // contains the camera
+
+	// the same box, in a map that is drawn moved back behind the camera
+	Frustum local = frustum.toLocal(vec3(-200, 0, 0));
+	CHECK(!local.isBoxVisible(vec3(100, -10, -10), vec3(120, 10, 10)));
+}
+
+void test_culling() {
+	run_test("VisCuller::findLeaf", test_find_leaf);
+	run_test("VisCuller PVS faces", test_pvs_faces);
+	run_test("VisCuller without vis data", test_no_vis_fallback);
+	run_test("Frustum rejection", test_frustum_rejection);
+}
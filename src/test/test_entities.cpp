@@ -0,0 +1,111 @@
+#include "test.h"
+#include "Bsp.h"
+#include <algorithm>
+
+static Entity* create_ent(const string& classname, const string& targetname, const string& target) {
+	Entity* ent = new Entity(classname);
+	if (!targetname.empty()) {
+		ent->addKeyvalue("targetname", targetname);
+	}
+	if (!target.empty()) {
+		ent->addKeyvalue("target", target);
+	}
+	return ent;
+}
+
+static bool has_ent(const vector<Entity*>& list, Entity* ent) {
+	return std::find(list.begin(), list.end(), ent) != list.end();
+}
+
+static void test_index_keyvalue_changes() {
+	Bsp map;
+	Entity* button = create_ent("func_button", "", "door1");
+	Entity* door = create_ent("func_door", "door1", "");
+	map.ents.push_back(button);
+	map.ents.push_back(door);
+
+	CHECK(map.get_targetname_ents("door1").size() == 1 && has_ent(map.get_targetname_ents("door1"), door));
+	CHECK(map.get_targeting_ents("door1").size() == 1 && has_ent(map.get_targeting_ents("door1"), button));
+
+	door->setOrAddKeyvalue("targetname", "door2");
+	CHECK(map.get_targetname_ents("door1").empty());
+	CHECK(has_ent(map.get_targetname_ents("door2"), door));
+
+	button->setOrAddKeyvalue("target", "door2");
+	CHECK(map.get_targeting_ents("door1").empty());
+	CHECK(map.get_targeting_ents("door2").size() == 1);
+
+	// changes to another map's entities don't affect this one
+	Bsp other;
+	other.ents.push_back(create_ent("func_door", "door2", ""));
+	CHECK(other.get_targetname_ents("door2").size() == 1);
+	CHECK(map.get_targetname_ents("door2").size() == 1);
+}
+
+static void test_index_added_removed_ents() {
+	Bsp map;
+	Entity* a = create_ent("info_target", "a", "");
+	Entity* b = create_ent("info_target", "b", "");
+	Entity* c = create_ent("trigger_relay", "c", "a");
+	map.ents.push_back(a);
+	map.ents.push_back(b);
+	map.ents.push_back(c);
+	CHECK(map.get_targetname_ents("b").size() == 1);
+
+	// removed from the middle, so the entities after it move
+	map.ents.erase(map.ents.begin() + 1);
+	delete b;
+	CHECK(map.get_targetname_ents("b").empty());
+	CHECK(has_ent(map.get_targetname_ents("a"), a));
+	CHECK(has_ent(map.get_targeting_ents("a"), c));
+
+	// inserted at the start, with a name another entity already has
+	Entity* a2 = create_ent("info_target", "a", "c");
+	map.ents.insert(map.ents.begin(), a2);
+	CHECK(map.get_targetname_ents("a").size() == 2);
+	CHECK(has_ent(map.get_targeting_ents("c"), a2));
+
+	// an entity targeting the same name twice is listed once
+	c->addKeyvalue("killtarget", "a");
+	CHECK(map.get_targeting_ents("a").size() == 1);
+
+	map.ents.pop_back();
+	delete c;
+	CHECK(map.get_targeting_ents("a").empty());
+	CHECK(map.get_targetname_ents("c").empty());
+}
+
+static void test_rename_multi_manager_targets() {
+	Entity mm("multi_manager");
+	mm.addKeyvalue("targetname", "mm");
+	mm.addKeyvalue("door1", "0.5");
+	mm.addKeyvalue("door2", "1");
+	mm.addKeyvalue("door1#1", "2");
+	mm.addKeyvalue("door2#1", "3");
+
+	mm.renameTargetnameValues("door1", "door2");
+
+	// no keys are lost or merged, and every target fires at its old delay
+	CHECK(mm.getKeyCount() == 6);
+	for (int i = 0; i < mm.getKeyCount(); i++) {
+		for (int k = i + 1; k < mm.getKeyCount(); k++) {
+			CHECK(mm.getKey(i) != mm.getKey(k));
+		}
+	}
+	CHECK(mm.getKeyvalue("door2") == "1");
+	CHECK(mm.getKeyvalue("door2#1") == "3");
+	CHECK(mm.getKey(2) == "door2#2" && mm.getValue(2) == "0.5");
+	CHECK(mm.getKey(4) == "door2#3" && mm.getValue(4) == "2");
+	CHECK(!mm.hasTarget("door1"));
+
+	// keys that don't collide keep their suffix
+	mm.renameTargetnameValues("door2", "door3");
+	CHECK(mm.getKeyvalue("door3") == "1");
+	CHECK(mm.getKeyvalue("door3#2") == "0.5");
+}
+
+void test_entities() {
+	run_test("Entity index keyvalue changes", test_index_keyvalue_changes);
+	run_test("Entity index added and removed entities", test_index_added_removed_ents);
+	run_test("multi_manager target rename collisions", test_rename_multi_manager_targets);
+}
@@ -0,0 +1,102 @@
+#include "test.h"
+#include "LightmapPacker.h"
+
+static LightmapPacker::Rect make_rect(int w, int h) {
+	LightmapPacker::Rect rect;
+	rect.w = w;
+	rect.h = h;
+	rect.atlas = rect.x = rect.y = -1;
+	return rect;
+}
+
+static bool overlaps(const LightmapPacker::Rect& a, const LightmapPacker::Rect& b) {
+	return a.atlas == b.atlas && a.x < b.x + b.w && b.x < a.x + a.w && a.y < b.y + b.h && b.y < a.y + a.h;
+}
+
+// checks that every packed rect is inside its atlas and doesn't overlap another rect
+static void check_placement(const vector<LightmapPacker::Rect>& rects, int atlasSize) {
+	for (int i = 0; i < rects.size(); i++) {
+		const LightmapPacker::Rect& rect = rects[i];
+		if (rect.atlas == -1) {
+			continue;
+		}
+		CHECK(rect.x >= 0 && rect.y >= 0 && rect.x + rect.w <= atlasSize && rect.y + rect.h <= atlasSize);
+
+		for (int k = i + 1; k < rects.size(); k++) {
+			if (!CHECK(!overlaps(rect, rects[k]))) {
+				return;
+			}
+		}
+	}
+}
+
+static void test_no_overlap() {
+	// lightmap sizes like the ones in real maps: mostly small, some long and thin
+	vector<LightmapPacker::Rect> rects;
+	uint seed = 12345;
+	for (int i = 0; i < 2000; i++) {
+		seed = seed * 1103515245 + 12345;
+		int w = 1 + (seed >> 16) % 17;
+		seed = seed * 1103515245 + 12345;
+		int h = 1 + (seed >> 16) % 17;
+		rects.push_back(make_rect(i % 50 == 0 ? 64 : w, h));
+	}
+
+	LightmapPacker packer(128);
+	CHECK(packer.pack(rects));
+	for (int i = 0; i < rects.size(); i++) {
+		CHECK(rects[i].atlas >= 0 && rects[i].atlas < packer.getAtlasCount());
+	}
+	check_placement(rects, 128);
+	CHECK(packer.getUtilization() > 0.5f && packer.getUtilization() <= 1.0f);
+}
+
+static void test_oversize_rejected() {
+	vector<LightmapPacker::Rect> rects;
+	rects.push_back(make_rect(16, 16));
+	rects.push_back(make_rect(65, 8)); // wider than the atlas
+	rects.push_back(make_rect(8, 65)); // taller than the atlas
+	rects.push_back(make_rect(0, 8));
+	rects.push_back(make_rect(64, 64)); // exactly fits
+
+	LightmapPacker packer(64);
+	CHECK(!packer.pack(rects));
+	CHECK(rects[0].atlas != -1);
+	CHECK(rects[1].atlas == -1);
+	CHECK(rects[2].atlas == -1);
+	CHECK(rects[3].atlas == -1);
+	CHECK(rects[4].atlas != -1);
+	CHECK(rects[0].atlas != rects[4].atlas);
+	check_placement(rects, 64);
+}
+
+static void test_atlas_rollover() {
+	// four 32x32 rects fill a 64x64 atlas, so the fifth needs a new one
+	vector<LightmapPacker::Rect> rects;
+	for (int i = 0; i < 5; i++) {
+		rects.push_back(make_rect(32, 32));
+	}
+
+	LightmapPacker packer(64);
+	CHECK(packer.pack(rects));
+	CHECK(packer.getAtlasCount() == 2);
+
+	int inFirst = 0;
+	for (int i = 0; i < rects.size(); i++) {
+		inFirst += rects[i].atlas == 0;
+	}
+	CHECK(inFirst == 4);
+	check_placement(rects, 64);
+
+	// a small rect packed later fills a gap in the second atlas instead of opening a third
+	vector<LightmapPacker::Rect> more(1, make_rect(16, 16));
+	CHECK(packer.pack(more));
+	CHECK(more[0].atlas == 1);
+	CHECK(packer.getAtlasCount() == 2);
+}
+
+void test_lightmap_packer() {
+	run_test("LightmapPacker no overlap", test_no_overlap);
+	run_test("LightmapPacker rejects oversize lightmaps", test_oversize_rejected);
+	run_test("LightmapPacker opens a new atlas when full", test_atlas_rollover);
+}
@@ -0,0 +1,54 @@
+#include "test.h"
+#include "AppSettings.h"
+
+// globals that main.cpp and Renderer.cpp define for the application
+AppSettings g_settings;
+const char* g_version_string = "bspguy tests";
+bool g_verbose = false;
+
+static int g_failed_checks = 0;
+static int g_failed_tests = 0;
+static int g_test_count = 0;
+
+bool check(bool passed, const char* expr, const char* file, int line) {
+	if (!passed) {
+		logf("    %s:%d: CHECK(%s) failed\n", file, line, expr);
+		g_failed_checks++;
+	}
+	return passed;
+}
+
+void run_test(const char* name, void (*test)()) {
+	int failedBefore = g_failed_checks;
+	test();
+
+	bool passed = g_failed_checks == failedBefore;
+	logf("%s %s\n", passed ? "PASS" : "FAIL", name);
+	g_failed_tests += !passed;
+	g_test_count++;
+}
+
+// Unit tests for the code that doesn't need a window or an OpenGL context.
+// Returns non-zero if any test failed, so that ctest reports it.
+//
+// Benchmarks on real maps:
+//     bspguy_test bench_pick <map.bsp> [ray count]
+// Benchmarks on synthetic data:
+//     bspguy_test bench_vis [leaves per map]
+int main(int argc, char* argv[]) {
+	if (argc > 2 && string(argv[1]) == "bench_pick") {
+		return bench_pick(argv[2], argc > 3 ? atoi(argv[3]) : 10000);
+	}
+	if (argc > 1 && string(argv[1]) == "bench_vis") {
+		return bench_vis(argc > 2 ? atoi(argv[2]) : 8000);
+	}
+
+	test_culling();
+	test_lightmap_packer();
+	test_entities();
+	test_picking();
+	test_vis();
+
+	logf("\n%d of %d tests passed\n", g_test_count - g_failed_tests, g_test_count);
+	return g_failed_tests ? 1 : 0;
+}
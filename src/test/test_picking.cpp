@@ -0,0 +1,238 @@
+#include "test.h"
+#include "Bsp.h"
+#include "Bvh.h"
+#include "FaceMath.h"
+#include <chrono>
+#include <cfloat>
+
+using namespace std::chrono;
+
+// simple LCG, so that runs are repeatable
+static float random_float(uint& seed, float min, float max) {
+	seed = seed * 1103515245 + 12345;
+	return min + ((seed >> 8) & 0xffff) / 65535.0f * (max - min);
+}
+
+static vec3 random_vec(uint& seed, vec3 mins, vec3 maxs) {
+	float x = random_float(seed, mins.x, maxs.x);
+	float y = random_float(seed, mins.y, maxs.y);
+	float z = random_float(seed, mins.z, maxs.z);
+	return vec3(x, y, z);
+}
+
+static vec3 random_dir(uint& seed) {
+	while (true) {
+		vec3 dir = random_vec(seed, vec3(-1, -1, -1), vec3(1, 1, 1));
+		float len = dir.length();
+		if (len > 0.1f && len <= 1.0f) {
+			return dir * (1.0f / len);
+		}
+	}
+}
+
+static void build_bvh(Bvh& bvh, const vector<FaceMath>& faceMaths, int first, int count) {
+	vector<vec3> mins(count);
+	vector<vec3> maxs(count);
+	for (int i = 0; i < count; i++) {
+		mins[i] = faceMaths[first + i].mins;
+		maxs[i] = faceMaths[first + i].maxs;
+	}
+	bvh.build(mins, maxs);
+}
+
+// returns the distance to the closest face the ray hits, testing every face
+static float pick_linear(const vector<FaceMath>& faceMaths, int first, int count, vec3 start, vec3 dir,
+	float bestDist, int& bestFace) {
+	for (int i = first; i < first + count; i++) {
+		if (faceMaths[i].pick(start, dir, bestDist)) {
+			bestFace = i;
+		}
+	}
+	return bestDist;
+}
+
+static float pick_bvh(const vector<FaceMath>& faceMaths, const Bvh& bvh, int first, vec3 start, vec3 dir,
+	float bestDist, int& bestFace) {
+	bvh.trace(start, dir, bestDist, [&](int i, float& bestDist) {
+		if (faceMaths[first + i].pick(start, dir, bestDist)) {
+			bestFace = first + i;
+		}
+	});
+	return bestDist;
+}
+
+static void test_face_pick() {
+	// a square in the z=10 plane, facing up
+	vector<vec3> verts;
+	verts.push_back(vec3(0, 0, 10));
+	verts.push_back(vec3(0, 0, 10)); // duplicate verts are allowed
+	verts.push_back(vec3(100, 0, 10));
+	verts.push_back(vec3(100, 100, 10));
+	verts.push_back(vec3(0, 100, 10));
+
+	FaceMath face;
+	CHECK(face.init(vec3(0, 0, 1), 10, verts));
+	CHECK(face.mins == vec3(0, 0, 10) && face.maxs == vec3(100, 100, 10));
+
+	float dist = FLT_MAX;
+	CHECK(face.pick(vec3(50, 50, 110), vec3(0, 0, -1), dist));
+	CHECK(fabs(dist - 100) < 0.01f);
+
+	dist = FLT_MAX;
+	CHECK(!face.pick(vec3(150, 50, 110), vec3(0, 0, -1), dist)); // misses the square
+	CHECK(!face.pick(vec3(50, 50, -90), vec3(0, 0, 1), dist)); // hits the back
+	CHECK(!face.pick(vec3(50, 50, 0), vec3(0, 0, -1), dist)); // behind the ray
+
+	dist = 50;
+	CHECK(!face.pick(vec3(50, 50, 110), vec3(0, 0, -1), dist)); // not closer than the best pick so far
+	CHECK(dist == 50);
+
+	vector<vec3> point(3, vec3(1, 2, 3));
+	CHECK(!face.init(vec3(0, 0, 1), 3, point));
+}
+
+static void test_bvh_pick_matches_linear() {
+	// random triangles, some of them large so that they overlap many others
+	uint seed = 54321;
+	vector<FaceMath> faceMaths;
+	while (faceMaths.size() < 2000) {
+		vec3 center = random_vec(seed, vec3(-1000, -1000, -1000), vec3(1000, 1000, 1000));
+		float size = faceMaths.size() % 100 == 0 ? 800 : 40;
+
+		vector<vec3> verts(3);
+		for (int k = 0; k < 3; k++) {
+			verts[k] = center + random_vec(seed, vec3(-size, -size, -size), vec3(size, size, size));
+		}
+		vec3 normal = crossProduct(verts[1] - verts[0], verts[2] - verts[0]);
+		if (normal.length() < 1.0f) {
+			continue;
+		}
+		normal = normal.normalize();
+
+		FaceMath face;
+		face.init(normal, dotProduct(normal, verts[0]), verts);
+		faceMaths.push_back(face);
+	}
+
+	Bvh bvh;
+	build_bvh(bvh, faceMaths, 0, faceMaths.size());
+
+	int hits = 0;
+	for (int i = 0; i < 2000; i++) {
+		vec3 start = random_vec(seed, vec3(-1200, -1200, -1200), vec3(1200, 1200, 1200));
+		vec3 dir = random_dir(seed);
+
+		int linearFace = -1, bvhFace = -1;
+		float linearDist = pick_linear(faceMaths, 0, faceMaths.size(), start, dir, FLT_MAX, linearFace);
+		float bvhDist = pick_bvh(faceMaths, bvh, 0, start, dir, FLT_MAX, bvhFace);
+
+		if (!CHECK(linearDist == bvhDist)) {
+			break;
+		}
+		hits += linearFace != -1;
+	}
+	CHECK(hits > 100); // the test is useless if most rays miss everything
+}
+
+void test_picking() {
+	run_test("FaceMath picking", test_face_pick);
+	run_test("Bvh picks the same faces as a linear search", test_bvh_pick_matches_linear);
+}
+
+// picks every ray against the faces of models 0 to modelCount-1, and logs the time taken with and without BVHs.
+// Returns the number of rays that the BVHs picked differently.
+static int bench_models(Bsp& map, const vector<FaceMath>& faceMaths, const vector<Bvh>& bvhs, int modelCount,
+	const vector<vec3>& starts, const vector<vec3>& dirs) {
+	int rayCount = starts.size();
+
+	int faceCount = 0;
+	for (int m = 0; m < modelCount; m++) {
+		faceCount += map.models[m].nFaces;
+	}
+
+	vector<float> linearDists(rayCount);
+	auto linearStart = high_resolution_clock::now();
+	for (int i = 0; i < rayCount; i++) {
+		float bestDist = FLT_MAX;
+		int bestFace = -1;
+		for (int m = 0; m < modelCount; m++) {
+			BSPMODEL& model = map.models[m];
+			bestDist = pick_linear(faceMaths, model.iFirstFace, model.nFaces, starts[i], dirs[i], bestDist, bestFace);
+		}
+		linearDists[i] = bestDist;
+	}
+	double linearMs = duration<double, std::milli>(high_resolution_clock::now() - linearStart).count();
+
+	vector<float> bvhDists(rayCount);
+	auto bvhStart = high_resolution_clock::now();
+	for (int i = 0; i < rayCount; i++) {
+		float bestDist = FLT_MAX;
+		int bestFace = -1;
+		for (int m = 0; m < modelCount; m++) {
+			bestDist = pick_bvh(faceMaths, bvhs[m], map.models[m].iFirstFace, starts[i], dirs[i], bestDist, bestFace);
+		}
+		bvhDists[i] = bestDist;
+	}
+	double bvhMs = duration<double, std::milli>(high_resolution_clock::now() - bvhStart).count();
+
+	int mismatches = 0;
+	int hits = 0;
+	for (int i = 0; i < rayCount; i++) {
+		mismatches += linearDists[i] != bvhDists[i];
+		hits += linearDists[i] != FLT_MAX;
+	}
+
+	logf("%d models, %d faces, %d of %d rays hit\n", modelCount, faceCount, hits, rayCount);
+	logf("    linear: %8.4f ms per ray\n", linearMs / rayCount);
+	logf("    BVH:    %8.4f ms per ray\n", bvhMs / rayCount);
+	logf("    speedup: %.1fx\n", bvhMs > 0 ? linearMs / bvhMs : 0.0);
+
+	if (mismatches) {
+		logf("ERROR: %d rays picked a different face with the BVHs\n", mismatches);
+	}
+	return mismatches;
+}
+
+int bench_pick(const char* mapPath, int rayCount) {
+	Bsp map(mapPath);
+	if (!map.valid) {
+		logf("Failed to load %s\n", mapPath);
+		return 1;
+	}
+
+	// face math for every face, like BspRenderer::refreshFace
+	vector<FaceMath> faceMaths(map.faceCount);
+	for (int i = 0; i < map.faceCount; i++) {
+		BSPFACE& face = map.faces[i];
+		BSPPLANE& plane = map.planes[face.iPlane];
+		vec3 normal = face.nPlaneSide ? plane.vNormal * -1 : plane.vNormal;
+		float fdist = face.nPlaneSide ? -plane.fDist : plane.fDist;
+		faceMaths[i].init(normal, fdist, map.get_face_verts(i));
+	}
+
+	// one tree per model, like BspRenderer::getFaceBvh
+	auto buildStart = high_resolution_clock::now();
+	vector<Bvh> bvhs(map.modelCount);
+	for (int i = 0; i < map.modelCount; i++) {
+		build_bvh(bvhs[i], faceMaths, map.models[i].iFirstFace, map.models[i].nFaces);
+	}
+	double buildMs = duration<double, std::milli>(high_resolution_clock::now() - buildStart).count();
+
+	uint seed = 12345;
+	vector<vec3> starts(rayCount);
+	vector<vec3> dirs(rayCount);
+	for (int i = 0; i < rayCount; i++) {
+		starts[i] = random_vec(seed, map.models[0].nMins, map.models[0].nMaxs);
+		dirs[i] = random_dir(seed);
+	}
+
+	logf("\nPicking random rays in %s (BVHs built in %.2f ms)\n\n", map.name.c_str(), buildMs);
+
+	// the world alone shows how picking scales with face count. Entities add a tree per model.
+	logf("World: ");
+	int mismatches = bench_models(map, faceMaths, bvhs, 1, starts, dirs);
+	logf("World and entities: ");
+	mismatches += bench_models(map, faceMaths, bvhs, map.modelCount, starts, dirs);
+
+	return mismatches ? 1 : 0;
+}
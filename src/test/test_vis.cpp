@@ -0,0 +1,296 @@
+#include "test.h"
+#include "vis.h"
+#include <string.h>
+#include <chrono>
+
+using namespace std::chrono;
+
+// simple LCG, so that runs are repeatable
+static uint random_int(uint& seed, uint max) {
+	seed = seed * 1103515245 + 12345;
+	return ((seed >> 8) & 0xffffff) % max;
+}
+
+// The bit-by-bit loop that shiftVis used before it shifted whole words, kept as a reference. Every step
+// moves the leaves from offsetLeaf onward by one leaf. Returns the number of visible leaves lost.
+static int shift_vis_reference(byte* vis, int len, int offsetLeaf, int shift) {
+	byte offsetBit = offsetLeaf % 8;
+	byte mask = 0; // part of the byte that shouldn't be shifted
+	for (int i = 0; i < offsetBit; i++) {
+		mask |= 1 << i;
+	}
+
+	int overflow = 0;
+	for (int k = 0; k < abs(shift); k++) {
+		if (shift > 0) {
+			bool carry = 0;
+			for (int i = 0; i < len; i++) {
+				uint oldCarry = carry;
+				carry = (vis[i] & 0x80) != 0;
+
+				if (offsetBit != 0 && i * 8 < offsetLeaf && i * 8 + 8 > offsetLeaf) {
+					vis[i] = (vis[i] & mask) | ((vis[i] & ~mask) << 1);
+				}
+				else if (i >= offsetLeaf / 8) {
+					vis[i] = (vis[i] << 1) + oldCarry;
+				}
+				else {
+					carry = 0;
+				}
+			}
+
+			overflow += carry; // the last leaf was shifted off the end of the row
+		}
+		else {
+			// the leaf at offsetLeaf is shifted into the leaves that don't move
+			overflow += (vis[offsetLeaf / 8] >> offsetBit) & 1;
+
+			bool carry = 0;
+			for (int i = len - 1; i >= 0; i--) {
+				uint oldCarry = carry;
+				carry = (vis[i] & 0x01) != 0;
+
+				if (offsetBit != 0 && i * 8 < offsetLeaf && i * 8 + 8 > offsetLeaf) {
+					vis[i] = (vis[i] & mask) | ((vis[i] >> 1) & ~mask) | (oldCarry << 7);
+				}
+				else if (i >= offsetLeaf / 8) {
+					vis[i] = (vis[i] >> 1) + (oldCarry << 7);
+				}
+				else {
+					carry = 0;
+				}
+			}
+		}
+	}
+
+	return overflow;
+}
+
+static void check_shift(const vector<byte>& row, int offsetLeaf, int shift) {
+	vector<byte> expected = row;
+	vector<byte> actual = row;
+	int expectedOverflow = shift_vis_reference(&expected[0], row.size(), offsetLeaf, shift);
+	int actualOverflow = shiftVis(&actual[0], row.size(), offsetLeaf, shift);
+
+	bool sameRow = CHECK(expected == actual);
+	bool sameOverflow = CHECK(expectedOverflow == actualOverflow);
+	if (!sameRow || !sameOverflow) {
+		logf("    row length %d, offset %d, shift %d, overflow %d (expected %d)\n",
+			(int)row.size(), offsetLeaf, shift, actualOverflow, expectedOverflow);
+	}
+}
+
+static void test_shift_matches_reference() {
+	uint seed = 1234;
+
+	for (int i = 0; i < 2000; i++) {
+		// rows are usually a multiple of 8 bytes, but shiftVis accepts any length
+		int len = 1 + random_int(seed, 40);
+		vector<byte> row(len);
+
+		// mostly sparse rows, so that some shifts don't overflow
+		bool sparse = random_int(seed, 2);
+		for (int k = 0; k < len; k++) {
+			row[k] = sparse ? (1 << random_int(seed, 8)) & random_int(seed, 256) & random_int(seed, 256)
+				: random_int(seed, 256);
+		}
+
+		int offsetLeaf = random_int(seed, len * 8);
+		int maxShift = len * 8 + 16; // includes shifts that move every leaf off the row
+		int shift = 1 + random_int(seed, maxShift);
+		if (random_int(seed, 2)) {
+			shift = -shift;
+		}
+
+		check_shift(row, offsetLeaf, shift);
+	}
+}
+
+static void test_shift_overflow_counts() {
+	// 3 bytes = 24 leaves, with leaves 2, 10 and 22 visible
+	vector<byte> row(3, 0);
+	row[0] = 1 << 2;
+	row[1] = 1 << 2;
+	row[2] = 1 << 6;
+
+	vector<byte> shifted = row;
+	CHECK(shiftVis(&shifted[0], 3, 0, 0) == 0);
+	CHECK(shifted == row);
+
+	// leaf 22 moves past leaf 23
+	shifted = row;
+	CHECK(shiftVis(&shifted[0], 3, 0, 2) == 1);
+	CHECK(shifted[0] == 1 << 4 && shifted[1] == 1 << 4 && shifted[2] == 0);
+
+	// leaves 2 and 10 stay in place because they're before the offset
+	shifted = row;
+	CHECK(shiftVis(&shifted[0], 3, 11, 8) == 1);
+	CHECK(shifted == vector<byte>({ 1 << 2, 1 << 2, 0 }));
+
+	// leaves 10 and 22 are dropped below the offset
+	shifted = row;
+	CHECK(shiftVis(&shifted[0], 3, 3, -20) == 2);
+	CHECK(shifted == vector<byte>({ 1 << 2, 0, 0 }));
+
+	// the whole row is shifted out
+	shifted = row;
+	CHECK(shiftVis(&shifted[0], 3, 0, 100) == 3);
+	CHECK(shifted == vector<byte>(3, 0));
+}
+
+// The linear search that CompressAll used before it hashed rows, kept as a reference. Each row is compared
+// with every earlier unique row.
+static int compress_all_linear(BSPLEAF* leafs, byte* uncompressed, byte* output, int numLeaves, int iterLeaves,
+	int bufferSize) {
+	uint rowSize = ((numLeaves + 63) & ~63) >> 3;
+	byte compressed[MAX_MAP_LEAVES / 8];
+	byte* vismap_p = output;
+
+	vector<int> sharedRows(iterLeaves);
+	for (int i = 0; i < iterLeaves; i++) {
+		byte* src = uncompressed + i * rowSize;
+
+		sharedRows[i] = i;
+		for (int k = 0; k < i; k++) {
+			if (sharedRows[k] != k) {
+				continue; // already compared in an earlier row
+			}
+			if (memcmp(src, uncompressed + k * rowSize, rowSize) == 0) {
+				sharedRows[i] = k;
+				break;
+			}
+		}
+	}
+
+	for (int i = 0; i < iterLeaves; i++) {
+		if (sharedRows[i] != i) {
+			leafs[i + 1].nVisOffset = leafs[sharedRows[i] + 1].nVisOffset;
+			continue;
+		}
+
+		int x = CompressVis(uncompressed + i * rowSize, rowSize, compressed, sizeof(compressed));
+		if (vismap_p + x > output + bufferSize) {
+			logf("Vismap expansion overflow\n");
+			return vismap_p - output;
+		}
+
+		leafs[i + 1].nVisOffset = vismap_p - output; // leaf 0 is a common solid
+		memcpy(vismap_p, compressed, x);
+		vismap_p += x;
+	}
+
+	return vismap_p - output;
+}
+
+// Vis data for a synthetic map where leaves are laid out in a line and each leaf sees its neighbors, like
+// a long corridor. About a quarter of the rows are copies of an earlier row, so they share compressed data.
+// Returns the compressed lump and fills leaves (which includes the solid leaf 0).
+static vector<byte> create_vis_lump(uint& seed, int leafCount, vector<BSPLEAF>& leaves) {
+	int rowSize = ((leafCount + 63) & ~63) >> 3;
+	vector<byte> rows(leafCount * rowSize, 0);
+
+	for (int i = 0; i < leafCount; i++) {
+		byte* row = &rows[i * rowSize];
+
+		if (i > 0 && random_int(seed, 4) == 0) {
+			int copyIdx = i - 1 - random_int(seed, min(i, 16));
+			memcpy(row, &rows[copyIdx * rowSize], rowSize);
+			continue;
+		}
+
+		int range = 8 + random_int(seed, 64);
+		for (int k = max(0, i - range); k < min(leafCount, i + range); k++) {
+			if (random_int(seed, 4)) {
+				row[k / 8] |= 1 << (k % 8);
+			}
+		}
+	}
+
+	leaves.resize(leafCount + 1);
+	memset(&leaves[0], 0, leaves.size() * sizeof(BSPLEAF));
+	leaves[0].nContents = CONTENTS_SOLID;
+	leaves[0].nVisOffset = -1;
+
+	vector<byte> lump;
+	byte compressed[MAX_MAP_LEAVES / 8];
+	for (int i = 0; i < leafCount; i++) {
+		int len = CompressVis(&rows[i * rowSize], (leafCount + 7) / 8, compressed, sizeof(compressed));
+		leaves[i + 1].nContents = CONTENTS_EMPTY;
+		leaves[i + 1].nVisOffset = lump.size();
+		lump.insert(lump.end(), compressed, compressed + len);
+	}
+
+	return lump;
+}
+
+int bench_vis(int leafCount) {
+	if (leafCount < 1 || leafCount * 2 > MAX_MAP_LEAVES) {
+		logf("Leaf count must be between 1 and %d\n", MAX_MAP_LEAVES / 2);
+		return 1;
+	}
+
+	g_progress.hide = true;
+
+	uint seed = 12345;
+	vector<BSPLEAF> leavesA, leavesB;
+	vector<byte> visA = create_vis_lump(seed, leafCount, leavesA);
+	vector<byte> visB = create_vis_lump(seed, leafCount, leavesB);
+
+	// the same steps as BspMerger::merge_vis, for two maps that only have world leaves
+	auto mergeStart = high_resolution_clock::now();
+	int totalLeaves = leafCount * 2;
+	int rowSize = ((totalLeaves + 63) & ~63) >> 3;
+	vector<byte> decompressed(totalLeaves * rowSize, 0);
+	byte* decompressedB = &decompressed[leafCount * rowSize];
+
+	decompress_vis_lump(&leavesA[0], &visA[0], &decompressed[0], leafCount, leafCount, totalLeaves);
+	decompress_vis_lump(&leavesB[0], &visB[0], decompressedB, leafCount, leafCount, totalLeaves);
+
+	int overflow = 0;
+	for (int i = 0; i < leafCount; i++) {
+		overflow += shiftVis(decompressedB + i * rowSize, rowSize, 0, leafCount);
+	}
+	double mergeMs = duration<double, std::milli>(high_resolution_clock::now() - mergeStart).count();
+
+	vector<BSPLEAF> hashedLeaves(totalLeaves + 1);
+	vector<byte> hashedVis(decompressed.size());
+	auto hashedStart = high_resolution_clock::now();
+	int hashedLen = CompressAll(&hashedLeaves[0], &decompressed[0], &hashedVis[0], totalLeaves, totalLeaves,
+		hashedVis.size());
+	double hashedMs = duration<double, std::milli>(high_resolution_clock::now() - hashedStart).count();
+
+	vector<BSPLEAF> linearLeaves(totalLeaves + 1);
+	vector<byte> linearVis(decompressed.size());
+	auto linearStart = high_resolution_clock::now();
+	int linearLen = compress_all_linear(&linearLeaves[0], &decompressed[0], &linearVis[0], totalLeaves, totalLeaves,
+		linearVis.size());
+	double linearMs = duration<double, std::milli>(high_resolution_clock::now() - linearStart).count();
+
+	int uniqueRows = 0;
+	bool sameOffsets = true;
+	for (int i = 1; i <= totalLeaves; i++) {
+		sameOffsets = sameOffsets && hashedLeaves[i].nVisOffset == linearLeaves[i].nVisOffset;
+		uniqueRows += i == 1 || hashedLeaves[i].nVisOffset > hashedLeaves[i - 1].nVisOffset;
+	}
+	bool sameData = hashedLen == linearLen && memcmp(&hashedVis[0], &linearVis[0], hashedLen) == 0;
+
+	logf("\nMerging the vis data of two maps with %d leaves each\n\n", leafCount);
+	logf("%d rows, %d unique, %d bytes compressed\n", totalLeaves, uniqueRows, hashedLen);
+	logf("    decompress + shift:  %10.2f ms\n", mergeMs);
+	logf("    linear row search:   %10.2f ms\n", linearMs);
+	logf("    hashed row search:   %10.2f ms\n", hashedMs);
+	logf("    speedup: %.1fx\n", hashedMs > 0 ? linearMs / hashedMs : 0.0);
+
+	if (overflow) {
+		logf("ERROR: %d leaves overflowed while shifting\n", overflow);
+	}
+	if (!sameOffsets || !sameData) {
+		logf("ERROR: hashed and linear row searches compressed the rows differently\n");
+	}
+	return overflow || !sameOffsets || !sameData ? 1 : 0;
+}
+
+void test_vis() {
+	run_test("shiftVis matches the bit-by-bit shift", test_shift_matches_reference);
+	run_test("shiftVis overflow counts", test_shift_overflow_counts);
+}
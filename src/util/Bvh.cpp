@@ -0,0 +1,189 @@
+#include "Bvh.h"
+#include "util.h"
+#include <algorithm>
+#include <cfloat>
+
+#define BVH_LEAF_ITEMS 4
+#define BVH_MAX_DEPTH 64
+
+void Bvh::build(const vector<vec3>& mins, const vector<vec3>& maxs) {
+	clear();
+
+	int count = mins.size();
+	itemMins.resize(count);
+	itemMaxs.resize(count);
+	items.resize(count);
+
+	vector<vec3> centers(count);
+	for (int i = 0; i < count; i++) {
+		itemMins[i] = mins[i] - EPSILON;
+		itemMaxs[i] = maxs[i] + EPSILON;
+		centers[i] = (mins[i] + maxs[i]) * 0.5f;
+		items[i] = i;
+	}
+
+	if (count > 0) {
+		nodes.reserve((count / BVH_LEAF_ITEMS + 1) * 2);
+		nodes.push_back(Node());
+		buildNode(0, 0, count, centers);
+	}
+
+	built = true;
+}
+
+void Bvh::clear() {
+	nodes.clear();
+	items.clear();
+	itemMins.clear();
+	itemMaxs.clear();
+	built = false;
+}
+
+void Bvh::buildNode(int nodeIdx, int start, int end, const vector<vec3>& centers) {
+	// the median split halves the items each level, so the depth stays far below BVH_MAX_DEPTH
+	if (end - start <= BVH_LEAF_ITEMS) {
+		nodes[nodeIdx].first = start;
+		nodes[nodeIdx].count = end - start;
+		updateNodeBounds(nodes[nodeIdx]);
+		return;
+	}
+
+	// split at the median item along the axis where the item centers are spread the most
+	vec3 centerMins = vec3(FLT_MAX, FLT_MAX, FLT_MAX);
+	vec3 centerMaxs = vec3(-FLT_MAX, -FLT_MAX, -FLT_MAX);
+	for (int i = start; i < end; i++) {
+		expandBoundingBox(centers[items[i]], centerMins, centerMaxs);
+	}
+
+	vec3 size = centerMaxs - centerMins;
+	int axis = 0;
+	if (size.y > size.x) axis = 1;
+	if (size.z > (axis == 0 ? size.x : size.y)) axis = 2;
+
+	int mid = (start + end) / 2;
+	nth_element(items.begin() + start, items.begin() + mid, items.begin() + end, [&](int a, int b) {
+		return ((float*)&centers[a])[axis] < ((float*)&centers[b])[axis];
+	});
+
+	int firstChild = nodes.size();
+	nodes.push_back(Node());
+	nodes.push_back(Node());
+	nodes[nodeIdx].first = firstChild;
+	nodes[nodeIdx].count = 0;
+
+	buildNode(firstChild, start, mid, centers);
+	buildNode(firstChild + 1, mid, end, centers);
+
+	Node& node = nodes[nodeIdx];
+	node.mins = nodes[firstChild].mins;
+	node.maxs = nodes[firstChild].maxs;
+	expandBoundingBox(nodes[firstChild + 1].mins, node.mins, node.maxs);
+	expandBoundingBox(nodes[firstChild + 1].maxs, node.mins, node.maxs);
+}
+
+void Bvh::updateNodeBounds(Node& node) {
+	if (node.count > 0) {
+		node.mins = vec3(FLT_MAX, FLT_MAX, FLT_MAX);
+		node.maxs = vec3(-FLT_MAX, -FLT_MAX, -FLT_MAX);
+		for (int i = node.first; i < node.first + node.count; i++) {
+			expandBoundingBox(itemMins[items[i]], node.mins, node.maxs);
+			expandBoundingBox(itemMaxs[items[i]], node.mins, node.maxs);
+		}
+	}
+	else {
+		Node& a = nodes[node.first];
+		Node& b = nodes[node.first + 1];
+		node.mins = a.mins;
+		node.maxs = a.maxs;
+		expandBoundingBox(b.mins, node.mins, node.maxs);
+		expandBoundingBox(b.maxs, node.mins, node.maxs);
+	}
+}
+
+void Bvh::setItemBounds(int item, const vec3& mins, const vec3& maxs) {
+	itemMins[item] = mins - EPSILON;
+	itemMaxs[item] = maxs + EPSILON;
+}
+
+void Bvh::refit() {
+	// children are stored after their parents, so walking backwards updates children first
+	for (int i = (int)nodes.size() - 1; i >= 0; i--) {
+		updateNodeBounds(nodes[i]);
+	}
+}
+
+// returns the distance along the ray where it enters the box, or FLT_MAX if it misses the box
+static float rayBoxDist(const vec3& start, const vec3& invDir, const vec3& mins, const vec3& maxs) {
+	float tx1 = (mins.x - start.x) * invDir.x;
+	float tx2 = (maxs.x - start.x) * invDir.x;
+	float ty1 = (mins.y - start.y) * invDir.y;
+	float ty2 = (maxs.y - start.y) * invDir.y;
+	float tz1 = (mins.z - start.z) * invDir.z;
+	float tz2 = (maxs.z - start.z) * invDir.z;
+
+	float tEnter = max(max(min(tx1, tx2), min(ty1, ty2)), min(tz1, tz2));
+	float tExit = min(min(max(tx1, tx2), max(ty1, ty2)), max(tz1, tz2));
+
+	if (tExit < 0 || tEnter > tExit) {
+		return FLT_MAX;
+	}
+	return tEnter;
+}
+
+void Bvh::trace(const vec3& start, const vec3& dir, float& maxDist, const function<void(int item, float& maxDist)>& hit) const {
+	if (nodes.empty()) {
+		return;
+	}
+
+	// a huge value instead of infinity for axes the ray is parallel to, so that 0*inf can't produce NaNs
+	vec3 invDir;
+	invDir.x = dir.x != 0 ? 1.0f / dir.x : 1e30f;
+	invDir.y = dir.y != 0 ? 1.0f / dir.y : 1e30f;
+	invDir.z = dir.z != 0 ? 1.0f / dir.z : 1e30f;
+
+	// nodes to visit, with the distance where the ray enters them
+	int stack[BVH_MAX_DEPTH];
+	float stackDist[BVH_MAX_DEPTH];
+	int stackSize = 0;
+
+	stack[0] = 0;
+	stackDist[0] = rayBoxDist(start, invDir, nodes[0].mins, nodes[0].maxs);
+	stackSize++;
+
+	while (stackSize > 0) {
+		stackSize--;
+		if (stackDist[stackSize] >= maxDist) {
+			continue; // a closer hit was found since the node was pushed
+		}
+		const Node& node = nodes[stack[stackSize]];
+
+		if (node.count > 0) {
+			for (int i = node.first; i < node.first + node.count; i++) {
+				int item = items[i];
+				if (rayBoxDist(start, invDir, itemMins[item], itemMaxs[item]) < maxDist) {
+					hit(item, maxDist);
+				}
+			}
+			continue;
+		}
+
+		int nearChild = node.first;
+		int farChild = node.first + 1;
+		float nearDist = rayBoxDist(start, invDir, nodes[nearChild].mins, nodes[nearChild].maxs);
+		float farDist = rayBoxDist(start, invDir, nodes[farChild].mins, nodes[farChild].maxs);
+		if (farDist < nearDist) {
+			swap(nearChild, farChild);
+			swap(nearDist, farDist);
+		}
+
+		// the far child is pushed first so that the near one is visited first
+		if (farDist < maxDist) {
+			stack[stackSize] = farChild;
+			stackDist[stackSize++] = farDist;
+		}
+		if (nearDist < maxDist) {
+			stack[stackSize] = nearChild;
+			stackDist[stackSize++] = nearDist;
+		}
+	}
+}
@@ -0,0 +1,43 @@
+#pragma once
+#include "vectors.h"
+#include <vector>
+#include <functional>
+
+// Bounding volume hierarchy over axis-aligned boxes, for finding the items a ray hits without testing all of them.
+// Item boxes are padded by EPSILON, so rays that graze the edge of an item still reach it.
+class Bvh
+{
+public:
+	// builds the tree over the items' bounding boxes. Items are identified by their index in the arrays.
+	void build(const std::vector<vec3>& itemMins, const std::vector<vec3>& itemMaxs);
+	void clear();
+	bool isBuilt() const { return built; }
+	int getItemCount() const { return (int)itemMins.size(); }
+
+	// changes the bounding box of an item. Call refit() after changing items to update the tree.
+	void setItemBounds(int item, const vec3& mins, const vec3& maxs);
+
+	// recomputes the node boxes from the item boxes, keeping the tree structure. This is much faster than a
+	// rebuild, but tracing slows down if items move far away from the items they were grouped with.
+	void refit();
+
+	// calls hit for every item whose box the ray enters before maxDist, visiting nearer nodes first.
+	// hit should lower maxDist when it finds a closer hit, so that nodes behind the hit are skipped.
+	void trace(const vec3& start, const vec3& dir, float& maxDist, const std::function<void(int item, float& maxDist)>& hit) const;
+
+private:
+	struct Node {
+		vec3 mins, maxs;
+		int first; // index of the first child (the second follows it), or of the first leaf item in items
+		int count; // number of items in a leaf, or 0 for inner nodes
+	};
+
+	std::vector<Node> nodes; // children are always stored after their parents
+	std::vector<int> items; // item indexes, grouped by leaf
+	std::vector<vec3> itemMins;
+	std::vector<vec3> itemMaxs;
+	bool built = false;
+
+	void buildNode(int nodeIdx, int start, int end, const std::vector<vec3>& centers);
+	void updateNodeBounds(Node& node);
+};
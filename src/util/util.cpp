@@ -8,13 +8,23 @@
 #include "Wad.h"
 #include <stdarg.h>
 #include <cfloat>
+#include <climits>
+#include <atomic>
 #ifdef WIN32
 #include <Windows.h>
 #include <Shlobj.h>
 #else 
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <fcntl.h>
 #include <unistd.h>
+#include <errno.h>
+#endif
+
+#ifndef IOV_MAX
+#define IOV_MAX 1024
 #endif
 
 #ifdef WIN32
@@ -110,6 +120,156 @@ bool writeFile(const string& fileName, const char* data, int len)
 	return true;
 }
 
+char* mapFile(const string& fileName, int& length)
+{
+#ifdef WIN32
+	HANDLE file = CreateFileA(fileName.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (file == INVALID_HANDLE_VALUE)
+		return NULL;
+
+	LARGE_INTEGER size;
+	if (!GetFileSizeEx(file, &size) || size.QuadPart == 0 || size.QuadPart > INT_MAX) {
+		CloseHandle(file);
+		return NULL;
+	}
+
+	HANDLE mapping = CreateFileMappingA(file, NULL, PAGE_WRITECOPY, 0, 0, NULL);
+	CloseHandle(file);
+	if (mapping == NULL)
+		return NULL;
+
+	char* data = (char*)MapViewOfFile(mapping, FILE_MAP_COPY, 0, 0, 0);
+	CloseHandle(mapping); // the view keeps the mapping alive
+	if (data == NULL)
+		return NULL;
+
+	length = (int)size.QuadPart;
+	return data;
+#else
+	int fd = open(fileName.c_str(), O_RDONLY);
+	if (fd == -1)
+		return NULL;
+
+	struct stat sb;
+	if (fstat(fd, &sb) != 0 || sb.st_size == 0 || sb.st_size > INT_MAX) {
+		close(fd);
+		return NULL;
+	}
+
+	void* data = mmap(NULL, sb.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+	close(fd); // the mapping keeps the file open
+	if (data == MAP_FAILED)
+		return NULL;
+
+	length = (int)sb.st_size;
+	return (char*)data;
+#endif
+}
+
+void unmapFile(char* data, int length)
+{
+	if (!data)
+		return;
+#ifdef WIN32
+	UnmapViewOfFile(data);
+#else
+	munmap(data, length);
+#endif
+}
+
+bool writeFileAtomic(const string& fileName, const vector<pair<const void*, int>>& buffers, const string& backupPath)
+{
+	string tempName = fileName + ".tmp";
+	bool ok = true;
+
+#ifdef WIN32
+	HANDLE file = CreateFileA(tempName.c_str(), GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (file == INVALID_HANDLE_VALUE)
+		return false;
+
+	for (int i = 0; i < buffers.size() && ok; i++) {
+		DWORD written = 0;
+		if (buffers[i].second > 0)
+			ok = WriteFile(file, buffers[i].first, buffers[i].second, &written, NULL) && written == (DWORD)buffers[i].second;
+	}
+	ok = ok && FlushFileBuffers(file);
+	CloseHandle(file);
+
+	if (!ok) {
+		DeleteFileA(tempName.c_str());
+		return false;
+	}
+
+	if (!backupPath.empty() && fileExists(fileName)) {
+		if (!CreateHardLinkA(backupPath.c_str(), fileName.c_str(), NULL))
+			MoveFileA(fileName.c_str(), backupPath.c_str());
+	}
+
+	if (!MoveFileExA(tempName.c_str(), fileName.c_str(), MOVEFILE_REPLACE_EXISTING)) {
+		DeleteFileA(tempName.c_str());
+		return false;
+	}
+#else
+	int fd = open(tempName.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	if (fd == -1)
+		return false;
+
+	// the temp file replaces the original, so it needs the original's permissions
+	struct stat oldStat;
+	if (stat(fileName.c_str(), &oldStat) == 0) {
+		ok = fchmod(fd, oldStat.st_mode & 07777) == 0;
+	}
+
+	vector<iovec> iov;
+	for (int i = 0; i < buffers.size(); i++) {
+		if (buffers[i].second > 0) {
+			iovec vec = { (void*)buffers[i].first, (size_t)buffers[i].second };
+			iov.push_back(vec);
+		}
+	}
+
+	// writev can stop early, so skip whatever was written and continue from there
+	int next = 0;
+	while (ok && next < iov.size()) {
+		ssize_t written = writev(fd, &iov[next], min((int)iov.size() - next, IOV_MAX));
+		if (written < 0) {
+			ok = errno == EINTR;
+			continue;
+		}
+		while (written > 0) {
+			if (written >= iov[next].iov_len) {
+				written -= iov[next].iov_len;
+				next++;
+			}
+			else {
+				iov[next].iov_base = (char*)iov[next].iov_base + written;
+				iov[next].iov_len -= written;
+				written = 0;
+			}
+		}
+	}
+	ok = ok && fsync(fd) == 0;
+	ok = close(fd) == 0 && ok;
+
+	if (!ok) {
+		unlink(tempName.c_str());
+		return false;
+	}
+
+	if (!backupPath.empty() && fileExists(fileName)) {
+		if (link(fileName.c_str(), backupPath.c_str()) != 0)
+			rename(fileName.c_str(), backupPath.c_str());
+	}
+
+	if (rename(tempName.c_str(), fileName.c_str()) != 0) {
+		unlink(tempName.c_str());
+		return false;
+	}
+#endif
+
+	return true;
+}
+
 bool removeFile(const string& fileName)
 {
 #ifdef USE_FILESYSTEM
@@ -218,6 +378,78 @@ int getBspTextureSize(BSPMIPTEX* bspTexture) {
 	return sz;
 }
 
+uint64 hashData(const void* data, int len, uint64 seed) {
+	const uint64 m = 0xc6a4a7935bd1e995ULL;
+	const int r = 47;
+
+	uint64 h = seed ^ (len * m);
+
+	const byte* bytes = (const byte*)data;
+	const byte* end = bytes + (len & ~7);
+
+	for (; bytes != end; bytes += 8) {
+		uint64 k;
+		memcpy(&k, bytes, 8); // unaligned read
+
+		k *= m;
+		k ^= k >> r;
+		k *= m;
+
+		h ^= k;
+		h *= m;
+	}
+
+	switch (len & 7) {
+	case 7: h ^= uint64(bytes[6]) << 48;
+	case 6: h ^= uint64(bytes[5]) << 40;
+	case 5: h ^= uint64(bytes[4]) << 32;
+	case 4: h ^= uint64(bytes[3]) << 24;
+	case 3: h ^= uint64(bytes[2]) << 16;
+	case 2: h ^= uint64(bytes[1]) << 8;
+	case 1: h ^= uint64(bytes[0]);
+		h *= m;
+	}
+
+	h ^= h >> r;
+	h *= m;
+	h ^= h >> r;
+
+	return h;
+}
+
+void parallelFor(int count, int chunkSize, const function<void(int, int)>& func) {
+	if (count <= 0) {
+		return;
+	}
+
+	int chunkCount = (count + chunkSize - 1) / chunkSize;
+	int threadCount = min((int)thread::hardware_concurrency(), chunkCount);
+
+	if (threadCount <= 1) {
+		func(0, count);
+		return;
+	}
+
+	atomic<int> nextChunk(0);
+
+	auto worker = [&]() {
+		for (int chunk = nextChunk++; chunk < chunkCount; chunk = nextChunk++) {
+			int start = chunk * chunkSize;
+			func(start, min(start + chunkSize, count));
+		}
+	};
+
+	vector<future<void>> workers;
+	for (int i = 1; i < threadCount; i++) {
+		workers.push_back(async(launch::async, worker));
+	}
+	worker(); // this thread works too instead of idling
+
+	for (int i = 0; i < workers.size(); i++) {
+		workers[i].wait();
+	}
+}
+
 float clamp(float val, float min, float max) {
 	if (val > max) {
 		return max;
@@ -670,14 +902,14 @@ vector<vec3> getSortedPlanarVerts(vector<vec3>& verts) {
 	return outVerts;
 }
 
-bool pointInsidePolygon(vector<vec2>& poly, vec2 p) {
+bool pointInsidePolygon(const vector<vec2>& poly, vec2 p) {
 	// https://stackoverflow.com/a/34689268
 	bool inside = true;
 	float lastd = 0;
 	for (int i = 0; i < poly.size(); i++)
 	{
-		vec2& v1 = poly[i];
-		vec2& v2 = poly[(i + 1) % poly.size()];
+		const vec2& v1 = poly[i];
+		const vec2& v2 = poly[(i + 1) % poly.size()];
 
 		if (v1.x == p.x && v1.y == p.y) {
 			break; // on edge = inside
@@ -816,6 +1048,51 @@ void removeDir(const string& dirName)
 #endif
 }
 
+vector<string> getDirFiles(const string& dirName)
+{
+	vector<string> files;
+#ifdef USE_FILESYSTEM
+	std::error_code e;
+	for (fs::directory_iterator it(dirName, e), end; !e && it != end; it.increment(e)) {
+		if (!fs::is_directory(it->status()))
+			files.push_back(it->path().string());
+	}
+#endif
+	sort(files.begin(), files.end());
+	return files;
+}
+
+bool wildcardMatch(const string& str, const string& pattern) {
+	int s = 0;
+	int p = 0;
+	int starP = -1; // pattern index after the last '*'
+	int starS = 0; // where the last '*' started matching in str
+
+	while (s < str.size()) {
+		if (p < pattern.size() && (pattern[p] == '?' || tolower(pattern[p]) == tolower(str[s]))) {
+			s++;
+			p++;
+		}
+		else if (p < pattern.size() && pattern[p] == '*') {
+			starP = ++p;
+			starS = s;
+		}
+		else if (starP != -1) {
+			// let the last '*' swallow one more char and try again
+			p = starP;
+			s = ++starS;
+		}
+		else {
+			return false;
+		}
+	}
+
+	while (p < pattern.size() && pattern[p] == '*')
+		p++;
+
+	return p == pattern.size();
+}
+
 
 void replaceAll(std::string& str, const std::string& from, const std::string& to) {
 	if (from.empty())
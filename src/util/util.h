@@ -8,6 +8,7 @@
 #include <cmath>
 #include <thread>
 #include <future>
+#include <functional>
 #include "ProgressMeter.h"
 #include "bsptypes.h"
 
@@ -42,6 +43,17 @@ char* loadFile(const string& fileName, int& length);
 
 bool writeFile(const string& fileName, const char * data, int len);
 
+// Maps a file into memory with copy-on-write pages, so writes to the memory never reach the file.
+// Returns NULL on failure. Release the memory with unmapFile.
+char* mapFile(const string& fileName, int& length);
+
+void unmapFile(char* data, int length);
+
+// Writes the buffers to a temporary file in one go, then renames it to fileName, so the file is never left
+// half-written. If backupPath is not empty, an existing file is kept there (hard-linked when possible).
+// Except on Windows, the new file keeps the permissions of the file it replaces.
+bool writeFileAtomic(const string& fileName, const vector<pair<const void*, int>>& buffers, const string& backupPath);
+
 bool removeFile(const string& fileName);
 
 std::streampos fileSize(const string& filePath);
@@ -64,12 +76,25 @@ bool createDir(const string& dirName);
 
 void removeDir(const string& dirName);
 
+// returns the paths of the files in a directory (not recursive), sorted by name
+vector<string> getDirFiles(const string& dirName);
+
+// case-insensitive match against a pattern containing '*' and '?' wildcards
+bool wildcardMatch(const string& str, const string& pattern);
+
 string toLowerCase(string str);
 
 string trimSpaces(string s);
 
 int getBspTextureSize(BSPMIPTEX* bspTexture);
 
+// 64-bit hash of raw bytes (MurmurHash64A). Only use this for lookups within one process.
+uint64 hashData(const void* data, int len, uint64 seed=0);
+
+// Calls func(start, end) for chunks of the range [0, count) on all CPU cores, and waits for them to finish.
+// Chunks finish in any order, so func should only write to the outputs for its own range.
+void parallelFor(int count, int chunkSize, const function<void(int, int)>& func);
+
 float clamp(float val, float min, float max);
 
 vec3 parseVector(string s);
@@ -110,7 +135,7 @@ vector<int> getSortedPlanarVertOrder(vector<vec3>& verts);
 
 vector<vec3> getSortedPlanarVerts(vector<vec3>& verts);
 
-bool pointInsidePolygon(vector<vec2>& poly, vec2 p);
+bool pointInsidePolygon(const vector<vec2>& poly, vec2 p);
 
 enum class FIXUPPATH_SLASH
 {